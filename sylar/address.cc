@@ -9,18 +9,26 @@
   */
 
 #include "address.h"
+#include "config.h"
+#include "dns.h"
 #include "log.h"
+#include <algorithm>
 #include <sstream>
 #include <netdb.h>
 #include <ifaddrs.h>
 #include <stddef.h>
 
 #include "endian.h"
+#include "offload.h"
 
 namespace sylar {
 
     static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+    // 内置的DNS解析器没有得到结果时，是否再用getaddrinfo解析；名字不存在时只对点数少于ndots的短名字回退
+    static sylar::ConfigVar<bool>::ptr g_dns_fallback_getaddrinfo =
+            sylar::Config::Lookup<bool>("dns.fallback_getaddrinfo", true, "fallback to getaddrinfo when dns resolver fails");
+
     template <class T>
     static T CreateMask(uint32_t bits) {
         return (1 << (sizeof(T) * 8 - bits)) - 1;
@@ -102,7 +110,45 @@ namespace sylar {
         if (node.empty()) {
             node = host;
         }
-        int error = getaddrinfo(node.c_str(), service, &hints, &results);
+
+        // 端口是数字时由DnsResolver解析，带缓存，在IO协程中只挂起当前协程；服务名还是交给getaddrinfo
+        int port = 0;
+        bool numeric_service = true;
+        if (service && *service) {
+            char *end = nullptr;
+            long v = strtol(service, &end, 10);
+            numeric_service = *end == '\0' && v >= 0 && v <= 65535;
+            port = (int)v;
+        }
+        if (numeric_service && (family == AF_INET || family == AF_INET6 || family == AF_UNSPEC)) {
+            std::vector<IPAddress::ptr> addrs;
+            int rt = DnsMgr::GetInstance()->resolve(node, family, addrs);
+            if (rt == 0) {
+                for (auto &i : addrs) {
+                    i->setPort(port);
+                    result.push_back(i);
+                }
+                return true;
+            }
+            SYLAR_LOG_DEBUG(g_logger) << "Address::Lookup resolve(" << host << ", " << family
+                                      << ") err=" << rt << " errstr=" << gai_strerror(rt);
+            if (!g_dns_fallback_getaddrinfo->getValue()) {
+                return false;
+            }
+            // 解析器只认hosts文件和DNS；点数少于ndots的短名字还可能由nsswitch中的其他来源提供，
+            // 交给getaddrinfo再试一次，其余名字不存在就是不存在
+            if (rt == EAI_NONAME && (node.empty() || node.back() == '.'
+                    || (uint32_t)std::count(node.begin(), node.end(), '.')
+                       >= DnsMgr::GetInstance()->getNdots())) {
+                return false;
+            }
+        }
+
+        // getaddrinfo会阻塞，在调度器的协程中交给卸载线程池执行，只挂起当前协程
+        int error = 0;
+        OffloadMgr::GetInstance()->run([&]() {
+            error = getaddrinfo(node.c_str(), service, &hints, &results);
+        });
         if (error) {
             SYLAR_LOG_DEBUG(g_logger) << "Address::Lookup getaddress(" << host << ", "
                                       << family << ", " << type << ") err=" << error << " errstr="
@@ -0,0 +1,144 @@
+/**
+  ********************************************************
+  * @file        : cancel.cc
+  * @author      : zgys
+  * @brief       : 协程的截止时间和取消上下文
+  * @attention   : None
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#include "cancel.h"
+#include "fiber.h"
+#include "util.h"
+#include <algorithm>
+#include <errno.h>
+#include <vector>
+
+namespace sylar {
+
+    static FiberLocal<CancelContext::ptr> s_current;
+
+    CancelContext::CancelContext(uint64_t deadline)
+        : m_deadline(deadline) {
+    }
+
+    CancelContext::ptr CancelContext::Create(uint64_t timeout_ms, const ptr& parent) {
+        uint64_t deadline = ~0ull;
+        if(timeout_ms != ~0ull) {
+            deadline = GetCurrentMS() + timeout_ms;
+        }
+        if(parent) {
+            deadline = std::min(deadline, parent->m_deadline);
+        }
+        ptr ctx(new CancelContext(deadline));
+        if(parent) {
+            std::weak_ptr<CancelContext> weak(ctx);
+            uint64_t id = parent->addCallback([weak](int error) {
+                ptr child = weak.lock();
+                if(child) {
+                    child->cancel(error);
+                }
+            });
+            if(id) {
+                ctx->m_parent         = parent;
+                ctx->m_parentCallback = id;
+            } else {
+                ctx->m_error = parent->getError();
+            }
+        }
+        return ctx;
+    }
+
+    CancelContext::~CancelContext() {
+        ptr parent = m_parent.lock();
+        if(parent) {
+            parent->removeCallback(m_parentCallback);
+        }
+    }
+
+    void CancelContext::cancel(int error) {
+        std::map<uint64_t, Callback> callbacks;
+        {
+            MutexType::Lock lock(m_mutex);
+            int expected = 0;
+            if(!m_error.compare_exchange_strong(expected, error)) {
+                return;
+            }
+            callbacks.swap(m_callbacks);
+        }
+        // 回调会唤醒挂起的协程，协程恢复后要删除自己的回调，不能持锁执行
+        for(auto& i : callbacks) {
+            i.second(error);
+        }
+    }
+
+    int CancelContext::getError() const {
+        int error = m_error.load(std::memory_order_acquire);
+        if(error) {
+            return error;
+        }
+        if(m_deadline != ~0ull && GetCurrentMS() >= m_deadline) {
+            return ETIMEDOUT;
+        }
+        return 0;
+    }
+
+    uint64_t CancelContext::getRemainingMs() const {
+        if(m_deadline == ~0ull) {
+            return ~0ull;
+        }
+        uint64_t now = GetCurrentMS();
+        return now >= m_deadline ? 0 : m_deadline - now;
+    }
+
+    uint64_t CancelContext::addCallback(Callback cb) {
+        MutexType::Lock lock(m_mutex);
+        if(m_error) {
+            return 0;
+        }
+        uint64_t id = ++m_nextId;
+        m_callbacks.emplace(id, std::move(cb));
+        return id;
+    }
+
+    void CancelContext::removeCallback(uint64_t id) {
+        Callback cb;
+        {
+            MutexType::Lock lock(m_mutex);
+            auto it = m_callbacks.find(id);
+            if(it == m_callbacks.end()) {
+                return;
+            }
+            // 回调捕获的对象在锁外析构
+            cb.swap(it->second);
+            m_callbacks.erase(it);
+        }
+    }
+
+    CancelContext::ptr CancelContext::GetThis() {
+        ptr* p = s_current.get();
+        return p ? *p : nullptr;
+    }
+
+    CancelContext* CancelContext::GetThisPtr() {
+        ptr* p = s_current.get();
+        return p ? p->get() : nullptr;
+    }
+
+    void CancelContext::SetThis(const ptr& ctx) {
+        if(ctx) {
+            s_current.set(ctx);
+        } else {
+            s_current.reset();
+        }
+    }
+
+    CancelContext::Scope::Scope(const ptr& ctx)
+        : m_old(GetThis()) {
+        SetThis(ctx);
+    }
+
+    CancelContext::Scope::~Scope() {
+        SetThis(m_old);
+    }
+}
@@ -0,0 +1,127 @@
+/**
+  ********************************************************
+  * @file        : cancel.h
+  * @author      : zgys
+  * @brief       : 协程的截止时间和取消上下文
+  * @attention   : hook的socket IO、connect和sleep系列函数按当前协程的上下文提前返回
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#ifndef __SYLAR_CANCEL_H__
+#define __SYLAR_CANCEL_H__
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <errno.h>
+#include <stdint.h>
+#include "mutex.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+    /**
+     * @brief 截止时间和取消上下文
+     * @details 给一次请求一个覆盖多次读写、连接和sleep的总时间预算，并能在客户端放弃时中途取消。
+     *          通过Scope设置为当前协程的上下文后，hook的阻塞调用在上下文取消后立即返回-1，errno为
+     *          ECANCELED(主动取消)或ETIMEDOUT(截止时间已到)；等待的时间不超过剩余的预算；
+     *          挂起等待期间被取消时，通过IOManager::cancelEvent唤醒挂起的协程。
+     *          子上下文的截止时间不晚于父上下文，父上下文取消时子上下文一起取消
+     */
+    class CancelContext : Noncopyable {
+    public:
+        typedef std::shared_ptr<CancelContext> ptr;
+        typedef Mutex MutexType;
+        /// 取消回调，参数为取消的原因
+        typedef std::function<void(int error)> Callback;
+
+        /**
+         * @brief 创建上下文
+         * @param[in] timeout_ms 从现在开始的时间预算(毫秒)，~0ull为不限
+         * @param[in] parent 父上下文
+         */
+        static ptr Create(uint64_t timeout_ms = ~0ull, const ptr& parent = nullptr);
+
+        ~CancelContext();
+
+        /**
+         * @brief 取消，执行全部回调，重复取消不起作用
+         * @param[in] error 取消的原因，之后的阻塞调用以它为errno
+         */
+        void cancel(int error = ECANCELED);
+
+        /**
+         * @brief 取消的原因，没有取消也没有到截止时间返回0，到了截止时间返回ETIMEDOUT
+         */
+        int getError() const;
+
+        /**
+         * @brief 是否已取消或已到截止时间
+         */
+        bool isCancelled() const { return getError() != 0; }
+
+        /**
+         * @brief 截止时间(毫秒)，~0ull为不限
+         */
+        uint64_t getDeadline() const { return m_deadline; }
+
+        /**
+         * @brief 到截止时间还剩的毫秒数，~0ull为不限，已过截止时间返回0
+         */
+        uint64_t getRemainingMs() const;
+
+        /**
+         * @brief 登记取消时执行的回调，挂起等待前登记，恢复后删除
+         * @details 回调在调用cancel的线程上执行，不持有本对象的锁
+         * @return 回调的id；已经取消时不登记，返回0
+         */
+        uint64_t addCallback(Callback cb);
+
+        /**
+         * @brief 删除回调，已经执行过的回调忽略
+         */
+        void removeCallback(uint64_t id);
+
+        /**
+         * @brief 当前协程的上下文，没有设置返回nullptr
+         */
+        static ptr GetThis();
+
+        /**
+         * @brief 当前协程的上下文的裸指针，不增加引用计数，hook的IO路径使用
+         */
+        static CancelContext* GetThisPtr();
+
+        /**
+         * @brief 设置当前协程的上下文，nullptr为清除
+         * @details 保存在协程局部存储中，协程迁移线程后仍然有效，协程结束时释放
+         */
+        static void SetThis(const ptr& ctx);
+
+        /**
+         * @brief 在作用域内把上下文设置为当前协程的上下文，离开时恢复原来的
+         */
+        class Scope : Noncopyable {
+        public:
+            explicit Scope(const ptr& ctx);
+            ~Scope();
+        private:
+            ptr m_old;
+        };
+
+    private:
+        explicit CancelContext(uint64_t deadline);
+
+    private:
+        mutable MutexType               m_mutex;
+        uint64_t                        m_deadline;          // 截止时间(毫秒)
+        std::atomic<int>                m_error{0};          // 取消的原因，0为没有取消
+        uint64_t                        m_nextId = 0;
+        std::map<uint64_t, Callback>    m_callbacks;         // 取消时执行的回调
+        std::weak_ptr<CancelContext>    m_parent;
+        uint64_t                        m_parentCallback = 0; // 在父上下文上登记的回调id
+    };
+}
+
+#endif //__SYLAR_CANCEL_H__
@@ -0,0 +1,169 @@
+/**
+  ********************************************************
+  * @file        : channel.cc
+  * @author      : zgys
+  * @brief       : 协程间的有界通道
+  * @attention   : None
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#include "channel.h"
+#include "iomanager.h"
+#include "log.h"
+#include "macro.h"
+#include <algorithm>
+
+namespace sylar {
+
+    void ChannelBase::close() {
+        std::vector<FiberWaiter> wake;
+        {
+            Spinlock::Lock lock(m_mutex);
+            if (m_closed) {
+                return;
+            }
+            m_closed = true;
+            // 缓冲区非空时不会有接收者在等待，所以这里唤醒的接收者都拿不到值
+            for (auto* q : {&m_recvq, &m_sendq}) {
+                for (auto& e : *q) {
+                    if (Claim(e)) {
+                        *e.ok = false;
+                        wake.push_back(e.ctx->waiter);
+                    }
+                }
+                q->clear();
+            }
+        }
+        for (auto& w : wake) {
+            w.wake();
+        }
+    }
+
+    bool ChannelBase::isClosed() {
+        Spinlock::Lock lock(m_mutex);
+        return m_closed;
+    }
+
+    void ChannelBase::removeLocked(WaitCtx* ctx) {
+        auto pred = [ctx](const WaitEntry& e) { return e.ctx.get() == ctx; };
+        m_sendq.erase(std::remove_if(m_sendq.begin(), m_sendq.end(), pred), m_sendq.end());
+        m_recvq.erase(std::remove_if(m_recvq.begin(), m_recvq.end(), pred), m_recvq.end());
+    }
+
+    /**
+     * @brief 按地址顺序锁住select涉及的全部通道，同一个通道只锁一次，避免两个select互相等锁
+     */
+    static void LockAll(std::vector<Spinlock*>& locks) {
+        std::sort(locks.begin(), locks.end());
+        locks.erase(std::unique(locks.begin(), locks.end()), locks.end());
+        for (auto l : locks) {
+            l->lock();
+        }
+    }
+
+    static void UnlockAll(std::vector<Spinlock*>& locks) {
+        for (auto it = locks.rbegin(); it != locks.rend(); ++it) {
+            (*it)->unlock();
+        }
+    }
+
+    int ChannelBase::Wait(ChannelCase* cases, size_t n, uint64_t timeout_ms) {
+        static thread_local uint32_t s_rotate = 0;
+        SYLAR_ASSERT(n > 0);
+        // 单个分支是普通的send/recv，不需要分配锁数组
+        std::vector<Spinlock*> locks;
+        if (n == 1) {
+            cases[0].chan->m_mutex.lock();
+        } else {
+            locks.reserve(n);
+            for (size_t i = 0; i < n; ++i) {
+                locks.push_back(&cases[i].chan->m_mutex);
+            }
+            LockAll(locks);
+        }
+        auto unlock = [&]() {
+            if (n == 1) {
+                cases[0].chan->m_mutex.unlock();
+            } else {
+                UnlockAll(locks);
+            }
+        };
+
+        size_t start = n == 1 ? 0 : s_rotate++ % n;
+        for (size_t k = 0; k < n; ++k) {
+            size_t i = (start + k) % n;
+            ChannelCase& c = cases[i];
+            FiberWaiter wake;
+            bool done = c.send ? c.chan->trySendLocked(c.data, c.ok, wake)
+                               : c.chan->tryRecvLocked(c.data, c.ok, wake);
+            if (done) {
+                unlock();
+                if (wake.fiber) {
+                    wake.wake();
+                }
+                return i;
+            }
+        }
+        if (timeout_ms == 0) {
+            unlock();
+            return -1;
+        }
+
+        // 在所有通道上登记后挂起，第一个完成收发、关闭通道或超时的一方负责唤醒
+        std::shared_ptr<WaitCtx> ctx = std::make_shared<WaitCtx>();
+        ctx->waiter = FiberWaiter::Current();
+        // 共享栈上的协程挂起期间，对端读写的是堆上的中转对象
+        bool boxed = ctx->waiter.fiber->isSharedStack();
+        std::vector<void*> boxes;
+        if (boxed) {
+            ctx->oks.reset(new bool[n]());
+            boxes.resize(n);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            ChannelCase& c = cases[i];
+            WaitEntry e = {ctx, (int)i, c.data, &c.ok};
+            if (boxed) {
+                boxes[i] = c.chan->boxLocked(c.data);
+                e.data   = boxes[i];
+                e.ok     = &ctx->oks[i];
+            }
+            (c.send ? c.chan->m_sendq : c.chan->m_recvq).push_back(e);
+        }
+        unlock();
+
+        Timer::ptr timer;
+        if (timeout_ms != ~0ull) {
+            IOManager* iom = IOManager::GetThis();
+            SYLAR_ASSERT2(iom, "channel timeout needs an IOManager");
+            timer = iom->addTimer(timeout_ms, [ctx](){
+                int expected = WAITING;
+                if (ctx->state.compare_exchange_strong(expected, TIMEOUT, std::memory_order_acq_rel)) {
+                    FiberWaiter waiter = ctx->waiter;
+                    waiter.wake();
+                }
+            });
+        }
+        Fiber::GetThis()->yield();
+        if (timer) {
+            timer->cancel();
+        }
+
+        int index = ctx->state.load(std::memory_order_acquire);
+        SYLAR_ASSERT(index != WAITING);
+        // 完成的分支的条目已被对端取走，其余通道上作废的条目在这里清掉
+        for (size_t i = 0; i < n; ++i) {
+            if ((int)i == index) {
+                continue;
+            }
+            Spinlock::Lock lock(cases[i].chan->m_mutex);
+            cases[i].chan->removeLocked(ctx.get());
+        }
+        // 条目都已移除或被对端用完，中转对象不会再被访问
+        for (size_t i = 0; i < boxes.size(); ++i) {
+            cases[i].chan->unbox(boxes[i], cases[i].data);
+            cases[i].ok = ctx->oks[i];
+        }
+        ctx->waiter.fiber.reset();
+        return index >= 0 ? index : -1;
+    }
+}
@@ -0,0 +1,374 @@
+/**
+  ********************************************************
+  * @file        : channel.h
+  * @author      : zgys
+  * @brief       : 协程间的有界通道
+  * @attention   : 阻塞的发送/接收只挂起当前协程，必须在调度器中运行的协程里调用；超时依赖IOManager的定时器
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#ifndef __SYLAR_CHANNEL_H__
+#define __SYLAR_CHANNEL_H__
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include "fiber_sync.h"
+#include "mutex.h"
+#include "noncopyable.h"
+
+namespace sylar {
+
+    class ChannelBase;
+
+    /**
+     * @brief select中的一个分支
+     */
+    struct ChannelCase {
+        ChannelBase* chan = nullptr;    // 通道
+        bool         send = false;      // true为发送，false为接收
+        void*        data = nullptr;    // 发送时指向要发送的值，接收时指向接收的位置
+        bool         ok = false;        // 完成后是否成功，通道已关闭为false
+    };
+
+    /**
+     * @brief 通道的公共部分：锁、关闭状态、挂起的发送者和接收者队列，以及select的等待逻辑
+     * @details 等待者在每个通道的队列中登记一个条目，多个条目共享同一个等待上下文，
+     *          谁先把上下文的状态从WAITING改成自己的分支号谁就完成这次收发并唤醒协程，其余条目作废
+     */
+    class ChannelBase : Noncopyable {
+    friend class Select;
+    public:
+        virtual ~ChannelBase() {}
+
+        /**
+         * @brief 关闭通道，唤醒所有挂起的发送者和接收者
+         * @details 关闭后发送都失败；接收先取完缓冲区中剩余的值，之后失败
+         */
+        void close();
+
+        /**
+         * @brief 是否已关闭
+         */
+        bool isClosed();
+
+    protected:
+        static const int WAITING = -1;
+        static const int TIMEOUT = -2;
+
+        /**
+         * @brief 一次阻塞的收发或select共享的等待上下文
+         */
+        struct WaitCtx {
+            std::atomic<int>        state{WAITING};    // WAITING、TIMEOUT或完成的分支号
+            FiberWaiter             waiter;            // 等待的协程
+            std::unique_ptr<bool[]> oks;               // 共享栈协程各分支的完成结果，代替栈上的ChannelCase::ok
+        };
+
+        /**
+         * @brief 挂在通道队列中的等待条目
+         */
+        struct WaitEntry {
+            std::shared_ptr<WaitCtx> ctx;
+            int                      index;     // 在select中的分支号
+            void*                    data;      // 同ChannelCase::data
+            bool*                    ok;        // 同ChannelCase::ok
+        };
+
+        /**
+         * @brief 抢占等待条目，成功后由调用者完成收发并唤醒协程
+         */
+        static bool Claim(WaitEntry& e) {
+            int expected = WAITING;
+            return e.ctx->state.compare_exchange_strong(expected, e.index, std::memory_order_acq_rel);
+        }
+
+        /**
+         * @brief 在一组分支上等待，直到某个分支完成或超时
+         * @param[in] timeout_ms 超时时间，0表示不等待，~0ull表示一直等待
+         * @return 完成的分支号，超时或不等待时没有分支就绪返回-1
+         */
+        static int Wait(ChannelCase* cases, size_t n, uint64_t timeout_ms);
+
+        /**
+         * @brief 持锁尝试发送，不挂起
+         * @param[in] in 要发送的值，成功时被移走
+         * @param[out] ok 通道已关闭为false
+         * @param[out] wake 需要在解锁后唤醒的协程
+         * @return 是否完成(包括因通道关闭而失败)
+         */
+        virtual bool trySendLocked(void* in, bool& ok, FiberWaiter& wake) = 0;
+
+        /**
+         * @brief 持锁尝试接收，不挂起，参数同trySendLocked
+         */
+        virtual bool tryRecvLocked(void* out, bool& ok, FiberWaiter& wake) = 0;
+
+        /**
+         * @brief 把data指向的值移到堆上的中转对象中
+         * @details 共享栈上的协程挂起后栈内容可能被换出，对端不能直接读写它栈上的值，挂起期间改为读写中转对象
+         */
+        virtual void* boxLocked(void* data) = 0;
+
+        /**
+         * @brief 把中转对象中的值移回data并释放中转对象
+         */
+        virtual void unbox(void* box, void* data) = 0;
+
+        /**
+         * @brief 移除属于ctx的等待条目
+         */
+        void removeLocked(WaitCtx* ctx);
+
+    protected:
+        Spinlock              m_mutex;          // 保护通道的全部状态
+        bool                  m_closed = false; // 是否已关闭
+        std::deque<WaitEntry> m_sendq;          // 挂起的发送者
+        std::deque<WaitEntry> m_recvq;          // 挂起的接收者
+    };
+
+    /**
+     * @brief 协程间的通道
+     * @details 容量大于0时是带缓冲的通道，值保存在构造时一次分配好的环形缓冲区中，收发只移动值，不分配内存；
+     *          容量为0时是无缓冲通道，发送者挂起直到接收者把值直接从发送者那里取走。
+     *          缓冲区满/空时发送者/接收者挂起当前协程，对端到来时直接交接并通过调度器唤醒
+     */
+    template<class T>
+    class Channel : public ChannelBase {
+    public:
+        typedef std::shared_ptr<Channel> ptr;
+
+        /**
+         * @brief 构造函数
+         * @param[in] capacity 缓冲区容量，0为无缓冲通道
+         */
+        explicit Channel(size_t capacity = 0)
+            : m_capacity(capacity) {
+            if (m_capacity) {
+                m_ring = static_cast<T*>(::operator new(sizeof(T) * m_capacity));
+            }
+        }
+
+        ~Channel() {
+            while (m_size) {
+                m_ring[m_head].~T();
+                m_head = (m_head + 1) % m_capacity;
+                --m_size;
+            }
+            ::operator delete(m_ring);
+        }
+
+        /**
+         * @brief 发送，缓冲区满且没有接收者时挂起当前协程
+         * @param[in] value 要发送的值，成功时被移走
+         * @param[in] timeout_ms 超时时间，~0ull表示一直等待
+         * @return 成功返回true，超时或通道已关闭返回false，两者用isClosed区分
+         * @attention 不通过errno报告原因：协程挂起后可能换了线程，调用者缓存的errno地址已经失效
+         */
+        bool send(T& value, uint64_t timeout_ms = ~0ull) {
+            return waitOne(true, &value, timeout_ms);
+        }
+
+        bool send(T&& value, uint64_t timeout_ms = ~0ull) {
+            return waitOne(true, &value, timeout_ms);
+        }
+
+        /**
+         * @brief 接收，缓冲区空且没有发送者时挂起当前协程
+         * @param[out] value 接收到的值
+         * @param[in] timeout_ms 超时时间，~0ull表示一直等待
+         * @return 成功返回true，超时或通道已关闭且缓冲区为空返回false
+         */
+        bool recv(T& value, uint64_t timeout_ms = ~0ull) {
+            return waitOne(false, &value, timeout_ms);
+        }
+
+        /**
+         * @brief 不挂起的发送，缓冲区满或通道已关闭时返回false
+         */
+        bool trySend(T& value) {
+            return waitOne(true, &value, 0);
+        }
+
+        /**
+         * @brief 不挂起的接收，没有值可取时返回false
+         */
+        bool tryRecv(T& value) {
+            return waitOne(false, &value, 0);
+        }
+
+        /**
+         * @brief 缓冲区容量
+         */
+        size_t capacity() const { return m_capacity; }
+
+        /**
+         * @brief 缓冲区中的值的个数
+         */
+        size_t size() {
+            Spinlock::Lock lock(m_mutex);
+            return m_size;
+        }
+
+    protected:
+        bool trySendLocked(void* in, bool& ok, FiberWaiter& wake) override {
+            T& value = *static_cast<T*>(in);
+            if (m_closed) {
+                ok = false;
+                return true;
+            }
+            // 有挂起的接收者时缓冲区一定为空，直接交给接收者
+            while (!m_recvq.empty()) {
+                WaitEntry e = std::move(m_recvq.front());
+                m_recvq.pop_front();
+                if (Claim(e)) {
+                    *static_cast<T*>(e.data) = std::move(value);
+                    *e.ok = true;
+                    wake = e.ctx->waiter;
+                    ok = true;
+                    return true;
+                }
+            }
+            if (m_size < m_capacity) {
+                push(value);
+                ok = true;
+                return true;
+            }
+            return false;
+        }
+
+        bool tryRecvLocked(void* out, bool& ok, FiberWaiter& wake) override {
+            T& value = *static_cast<T*>(out);
+            if (m_size) {
+                value = std::move(m_ring[m_head]);
+                m_ring[m_head].~T();
+                m_head = (m_head + 1) % m_capacity;
+                --m_size;
+                // 空出一个位置，挂起的发送者可以把值放进来
+                while (!m_sendq.empty()) {
+                    WaitEntry e = std::move(m_sendq.front());
+                    m_sendq.pop_front();
+                    if (Claim(e)) {
+                        push(*static_cast<T*>(e.data));
+                        *e.ok = true;
+                        wake = e.ctx->waiter;
+                        break;
+                    }
+                }
+                ok = true;
+                return true;
+            }
+            // 无缓冲或缓冲区为空，直接从挂起的发送者那里取
+            while (!m_sendq.empty()) {
+                WaitEntry e = std::move(m_sendq.front());
+                m_sendq.pop_front();
+                if (Claim(e)) {
+                    value = std::move(*static_cast<T*>(e.data));
+                    *e.ok = true;
+                    wake = e.ctx->waiter;
+                    ok = true;
+                    return true;
+                }
+            }
+            if (m_closed) {
+                ok = false;
+                return true;
+            }
+            return false;
+        }
+
+        void* boxLocked(void* data) override {
+            return new T(std::move(*static_cast<T*>(data)));
+        }
+
+        void unbox(void* box, void* data) override {
+            T* value = static_cast<T*>(box);
+            *static_cast<T*>(data) = std::move(*value);
+            delete value;
+        }
+
+    private:
+        void push(T& value) {
+            new (&m_ring[(m_head + m_size) % m_capacity]) T(std::move(value));
+            ++m_size;
+        }
+
+        bool waitOne(bool send, void* data, uint64_t timeout_ms) {
+            ChannelCase c;
+            c.chan = this;
+            c.send = send;
+            c.data = data;
+            return Wait(&c, 1, timeout_ms) >= 0 && c.ok;
+        }
+
+    private:
+        size_t m_capacity;          // 缓冲区容量
+        T*     m_ring = nullptr;    // 环形缓冲区
+        size_t m_head = 0;          // 队首位置
+        size_t m_size = 0;          // 缓冲区中值的个数
+    };
+
+    /**
+     * @brief 同时等待多个通道上的收发，完成其中最先就绪的一个
+     * @details 多个分支同时就绪时从轮转的起点开始选择，避免总是偏向第一个分支
+     */
+    class Select : Noncopyable {
+    public:
+        /**
+         * @brief 添加接收分支
+         */
+        template<class T>
+        Select& recv(Channel<T>& chan, T& value) {
+            addCase(&chan, false, &value);
+            return *this;
+        }
+
+        /**
+         * @brief 添加发送分支，该分支完成时value被移走
+         */
+        template<class T>
+        Select& send(Channel<T>& chan, T& value) {
+            addCase(&chan, true, &value);
+            return *this;
+        }
+
+        /**
+         * @brief 等待，直到某个分支完成
+         * @param[in] timeout_ms 超时时间，~0ull表示一直等待
+         * @return 完成的分支号(按添加顺序从0开始)，超时返回-1
+         */
+        int wait(uint64_t timeout_ms = ~0ull) {
+            return ChannelBase::Wait(m_cases.data(), m_cases.size(), timeout_ms);
+        }
+
+        /**
+         * @brief 不挂起，没有分支就绪时返回-1
+         */
+        int tryWait() {
+            return wait(0);
+        }
+
+        /**
+         * @brief 分支完成后是否成功，通道已关闭为false
+         */
+        bool ok(int index) const { return m_cases[index].ok; }
+
+    private:
+        void addCase(ChannelBase* chan, bool send, void* data) {
+            ChannelCase c;
+            c.chan = chan;
+            c.send = send;
+            c.data = data;
+            m_cases.push_back(c);
+        }
+
+    private:
+        std::vector<ChannelCase> m_cases;
+    };
+}
+
+#endif //SYLAR_CHANNEL_H
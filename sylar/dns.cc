@@ -0,0 +1,727 @@
+/**
+  ********************************************************
+  * @file        : dns.cc
+  * @author      : zgys
+  * @brief       : 协程化的DNS解析器
+  * @attention   : None
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#include "dns.h"
+#include "config.h"
+#include "fiber.h"
+#include "hook.h"
+#include "iomanager.h"
+#include "log.h"
+#include "scheduler.h"
+#include "util.h"
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace sylar {
+
+    static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    // nameserver和查询选项所在的文件，nameserver除了标准写法还可以写成ip:port或[ipv6]:port
+    static ConfigVar<std::string>::ptr g_dns_resolv_conf =
+            Config::Lookup<std::string>("dns.resolv_conf", "/etc/resolv.conf", "dns resolv.conf path");
+    // 优先于DNS查询的静态名字表
+    static ConfigVar<std::string>::ptr g_dns_hosts =
+            Config::Lookup<std::string>("dns.hosts", "/etc/hosts", "dns hosts file path");
+    // 缓存的记录数上限，平均分到各个分片
+    static ConfigVar<uint32_t>::ptr g_dns_cache_size =
+            Config::Lookup<uint32_t>("dns.cache_size", 4096, "dns cache capacity");
+    // 应答中TTL的下限(秒)，为0时TTL为0的应答不缓存
+    static ConfigVar<uint32_t>::ptr g_dns_min_ttl =
+            Config::Lookup<uint32_t>("dns.min_ttl", 0, "dns cache min ttl in seconds");
+    // 应答中TTL的上限(秒)
+    static ConfigVar<uint32_t>::ptr g_dns_max_ttl =
+            Config::Lookup<uint32_t>("dns.max_ttl", 3600, "dns cache max ttl in seconds");
+    // 名字不存在或没有该类型记录的结果缓存的时间(秒)
+    static ConfigVar<uint32_t>::ptr g_dns_negative_ttl =
+            Config::Lookup<uint32_t>("dns.negative_ttl", 30, "dns negative cache ttl in seconds");
+
+    static const uint16_t QTYPE_A      = 1;
+    static const uint16_t QTYPE_AAAA   = 28;
+    static const uint16_t QCLASS_IN    = 1;
+    static const uint16_t RCODE_NXDOMAIN = 3;
+    static const size_t   UDP_BUFFER_SIZE = 4096;
+
+    struct _DnsIniter {
+        _DnsIniter() {
+            // 回调在配置的新值生效之前执行，变化的一项用新值
+            g_dns_resolv_conf->addListener([](const std::string& old_value, const std::string& new_value) {
+                DnsMgr::GetInstance()->reload(new_value, g_dns_hosts->getValue());
+            });
+            g_dns_hosts->addListener([](const std::string& old_value, const std::string& new_value) {
+                DnsMgr::GetInstance()->reload(g_dns_resolv_conf->getValue(), new_value);
+            });
+        }
+    };
+
+    static _DnsIniter s_dns_initer;
+
+    /**
+     * @brief 当前是否可以挂起，即运行在调度器的协程中
+     */
+    static bool CanSuspend() {
+        return Scheduler::GetThis() && Fiber::GetThisPtr() != Scheduler::GetMainFiber();
+    }
+
+    /**
+     * @brief 数字地址转成网络序的原始地址
+     */
+    static bool ParseNumeric(const std::string& host, std::string& raw) {
+        in_addr v4;
+        if(inet_pton(AF_INET, host.c_str(), &v4) == 1) {
+            raw.assign((const char*)&v4, sizeof(v4));
+            return true;
+        }
+        in6_addr v6;
+        if(inet_pton(AF_INET6, host.c_str(), &v6) == 1) {
+            raw.assign((const char*)&v6, sizeof(v6));
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief 由网络序的原始地址创建IPAddress
+     */
+    static IPAddress::ptr CreateRaw(const std::string& raw, uint16_t port) {
+        if(raw.size() == sizeof(in_addr)) {
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port   = htons(port);
+            memcpy(&addr.sin_addr, raw.data(), raw.size());
+            return std::make_shared<IPv4Address>(addr);
+        }
+        sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port   = htons(port);
+        memcpy(&addr.sin6_addr, raw.data(), raw.size());
+        return std::make_shared<IPv6Address>(addr);
+    }
+
+    /**
+     * @brief 解析nameserver，支持ip、ip:port、[ipv6]:port
+     */
+    static Address::ptr ParseServer(const std::string& str) {
+        std::string host = str;
+        int port = 53;
+        if(!str.empty() && str[0] == '[') {
+            size_t pos = str.find(']');
+            if(pos == std::string::npos) {
+                return nullptr;
+            }
+            host = str.substr(1, pos - 1);
+            if(pos + 1 < str.size()) {
+                if(str[pos + 1] != ':') {
+                    return nullptr;
+                }
+                port = atoi(str.c_str() + pos + 2);
+            }
+        } else if(std::count(str.begin(), str.end(), ':') == 1) {
+            size_t pos = str.find(':');
+            host = str.substr(0, pos);
+            port = atoi(str.c_str() + pos + 1);
+        }
+        std::string raw;
+        if(port <= 0 || port > 65535 || !ParseNumeric(host, raw)) {
+            return nullptr;
+        }
+        return CreateRaw(raw, port);
+    }
+
+    static std::string CacheKey(const std::string& name, uint16_t qtype) {
+        return std::to_string(qtype) + ":" + name;
+    }
+
+    static uint16_t Read16(const uint8_t* p) {
+        return (uint16_t)(p[0] << 8 | p[1]);
+    }
+
+    static uint32_t Read32(const uint8_t* p) {
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
+
+    static void Append16(std::string& out, uint16_t v) {
+        out.push_back((char)(v >> 8));
+        out.push_back((char)(v & 0xff));
+    }
+
+    /**
+     * @brief 生成查询请求，id先填0，发送前再填
+     * @return 名字不合法时返回false
+     */
+    static bool BuildQuery(const std::string& name, uint16_t qtype, std::string& out) {
+        out.clear();
+        Append16(out, 0);           // id
+        Append16(out, 0x0100);      // RD，请服务器递归查询
+        Append16(out, 1);           // QDCOUNT
+        Append16(out, 0);           // ANCOUNT
+        Append16(out, 0);           // NSCOUNT
+        Append16(out, 0);           // ARCOUNT
+        size_t begin = 0;
+        while(begin < name.size()) {
+            size_t end = name.find('.', begin);
+            if(end == std::string::npos) {
+                end = name.size();
+            }
+            size_t len = end - begin;
+            if(len == 0 || len > 63) {
+                return false;
+            }
+            out.push_back((char)len);
+            out.append(name, begin, len);
+            begin = end + 1;
+        }
+        out.push_back(0);
+        if(out.size() - 12 > 255) {
+            return false;
+        }
+        Append16(out, qtype);
+        Append16(out, QCLASS_IN);
+        return true;
+    }
+
+    /**
+     * @brief 跳过报文中的一个名字，名字可能以压缩指针结尾
+     */
+    static bool SkipName(const uint8_t* p, size_t n, size_t& pos) {
+        while(pos < n) {
+            uint8_t len = p[pos];
+            if((len & 0xc0) == 0xc0) {
+                pos += 2;
+                return pos <= n;
+            }
+            if(len == 0) {
+                ++pos;
+                return true;
+            }
+            pos += 1 + len;
+        }
+        return false;
+    }
+
+    /**
+     * @brief 解析应答，取出answer段中与查询类型相同的地址
+     * @param[out] rcode 应答码
+     * @param[out] truncated 应答是否被截断，截断时不解析记录
+     * @param[out] ttl 取出的记录中最小的TTL
+     * @return 报文格式不对时返回false
+     */
+    static bool ParseResponse(const std::string& response, uint16_t qtype, int& rcode, bool& truncated,
+                              std::vector<std::string>& addrs, uint32_t& ttl) {
+        const uint8_t* p = (const uint8_t*)response.data();
+        size_t n = response.size();
+        if(n < 12) {
+            return false;
+        }
+        uint16_t flags = Read16(p + 2);
+        if(!(flags & 0x8000)) {
+            return false;
+        }
+        rcode     = flags & 0x0f;
+        truncated = flags & 0x0200;
+        if(truncated) {
+            return true;
+        }
+        uint16_t qdcount = Read16(p + 4);
+        uint16_t ancount = Read16(p + 6);
+        size_t pos = 12;
+        for(uint16_t i = 0; i < qdcount; ++i) {
+            if(!SkipName(p, n, pos) || pos + 4 > n) {
+                return false;
+            }
+            pos += 4;
+        }
+        size_t addr_len = qtype == QTYPE_A ? sizeof(in_addr) : sizeof(in6_addr);
+        ttl = ~0u;
+        // CNAME等其他记录直接跳过，递归服务器会把别名指向的地址一起放在answer段中
+        for(uint16_t i = 0; i < ancount; ++i) {
+            if(!SkipName(p, n, pos) || pos + 10 > n) {
+                return false;
+            }
+            uint16_t type   = Read16(p + pos);
+            uint16_t cls    = Read16(p + pos + 2);
+            uint32_t rttl   = Read32(p + pos + 4);
+            uint16_t rdlen  = Read16(p + pos + 8);
+            pos += 10;
+            if(pos + rdlen > n) {
+                return false;
+            }
+            if(type == qtype && cls == QCLASS_IN && rdlen == addr_len) {
+                addrs.emplace_back((const char*)p + pos, rdlen);
+                ttl = std::min(ttl, rttl);
+            }
+            pos += rdlen;
+        }
+        if(addrs.empty()) {
+            ttl = 0;
+        }
+        return true;
+    }
+
+    /**
+     * @brief 设置socket的收发超时，开启hook时由IOManager的定时器实现
+     */
+    static void SetTimeout(int fd, uint64_t ms) {
+        timeval tv;
+        tv.tv_sec  = ms / 1000;
+        tv.tv_usec = ms % 1000 * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    /**
+     * @brief 通过UDP交换一次报文，忽略id对不上的报文
+     * @details 协程挂起后可能换了线程，hook开关是线程局部的，每次调用前都重新设置
+     */
+    static bool ExchangeUdp(int fd, bool hook, const Address::ptr& server, const std::string& request,
+                            uint64_t timeout_ms, std::string& response) {
+        // connect之后ICMP端口不可达会作为错误返回，也不会收到其他地址发来的报文
+        if(connect(fd, server->getAddr(), server->getAddrLen()) != 0) {
+            return false;
+        }
+        set_hook_enable(hook);
+        SetTimeout(fd, timeout_ms);
+        if(send(fd, request.data(), request.size(), 0) != (ssize_t)request.size()) {
+            return false;
+        }
+        uint64_t deadline = GetCurrentMS() + timeout_ms;
+        while(true) {
+            uint64_t now = GetCurrentMS();
+            if(now >= deadline) {
+                return false;
+            }
+            set_hook_enable(hook);
+            SetTimeout(fd, deadline - now);
+            response.resize(UDP_BUFFER_SIZE);
+            ssize_t rt = recv(fd, &response[0], response.size(), 0);
+            if(rt < 0) {
+                return false;
+            }
+            response.resize(rt);
+            if(rt >= 2 && memcmp(response.data(), request.data(), 2) == 0) {
+                return true;
+            }
+        }
+    }
+
+    static bool WriteAll(int fd, bool hook, const char* data, size_t len) {
+        while(len > 0) {
+            set_hook_enable(hook);
+            ssize_t rt = send(fd, data, len, 0);
+            if(rt <= 0) {
+                return false;
+            }
+            data += rt;
+            len  -= rt;
+        }
+        return true;
+    }
+
+    static bool ReadAll(int fd, bool hook, char* data, size_t len) {
+        while(len > 0) {
+            set_hook_enable(hook);
+            ssize_t rt = recv(fd, data, len, 0);
+            if(rt <= 0) {
+                return false;
+            }
+            data += rt;
+            len  -= rt;
+        }
+        return true;
+    }
+
+    /**
+     * @brief 通过TCP交换一次报文，每个报文前有两字节的长度
+     */
+    static bool ExchangeTcp(int fd, bool hook, const Address::ptr& server, const std::string& request,
+                            uint64_t timeout_ms, std::string& response) {
+        if(connect_with_timeout(fd, server->getAddr(), server->getAddrLen(), timeout_ms) != 0) {
+            return false;
+        }
+        set_hook_enable(hook);
+        SetTimeout(fd, timeout_ms);
+        std::string msg;
+        Append16(msg, request.size());
+        msg.append(request);
+        if(!WriteAll(fd, hook, msg.data(), msg.size())) {
+            return false;
+        }
+        uint8_t len[2];
+        if(!ReadAll(fd, hook, (char*)len, sizeof(len))) {
+            return false;
+        }
+        response.resize(Read16(len));
+        if(!ReadAll(fd, hook, &response[0], response.size())) {
+            return false;
+        }
+        return response.size() >= 2 && memcmp(response.data(), request.data(), 2) == 0;
+    }
+
+    DnsResolver::DnsResolver() {
+        reload();
+    }
+
+    std::shared_ptr<DnsResolver::Conf> DnsResolver::getConf() {
+        RWMutex::ReadLock lock(m_confMutex);
+        return m_conf;
+    }
+
+    size_t DnsResolver::getNameServerCount() {
+        return getConf()->servers.size();
+    }
+
+    uint32_t DnsResolver::getNdots() {
+        return getConf()->ndots;
+    }
+
+    void DnsResolver::reload() {
+        reload(g_dns_resolv_conf->getValue(), g_dns_hosts->getValue());
+    }
+
+    void DnsResolver::reload(const std::string& resolv_conf, const std::string& hosts_path) {
+        std::shared_ptr<Conf> conf = std::make_shared<Conf>();
+        // 构造函数也会走到这里，DnsMgr的静态初始化期间协程不能挂起：同线程上的其他协程会在初始化锁上
+        // 阻塞整个线程，普通文件的读取被交给卸载线程池的话就再也恢复不了。两个小文件直接阻塞读取
+        bool old_hook = is_hook_enable();
+        set_hook_enable(false);
+        std::ifstream resolv(resolv_conf);
+        std::string line;
+        while(std::getline(resolv, line)) {
+            std::istringstream ss(line.substr(0, line.find_first_of("#;")));
+            std::string key;
+            ss >> key;
+            if(key == "nameserver") {
+                std::string value;
+                ss >> value;
+                Address::ptr server = ParseServer(value);
+                if(server) {
+                    conf->servers.push_back(server);
+                } else {
+                    SYLAR_LOG_WARN(g_logger) << "DnsResolver invalid nameserver: " << value;
+                }
+            } else if(key == "search" || key == "domain") {
+                // 和libc一样，后出现的search/domain覆盖前面的
+                conf->search.clear();
+                std::string domain;
+                while(ss >> domain) {
+                    domain = ToLower(domain);
+                    while(!domain.empty() && domain.back() == '.') {
+                        domain.pop_back();
+                    }
+                    if(!domain.empty()) {
+                        conf->search.push_back(domain);
+                    }
+                }
+            } else if(key == "options") {
+                std::string opt;
+                while(ss >> opt) {
+                    if(opt.compare(0, 8, "timeout:") == 0) {
+                        int v = atoi(opt.c_str() + 8);
+                        conf->timeout = std::max(std::min(v, 30), 1) * 1000;
+                    } else if(opt.compare(0, 9, "attempts:") == 0) {
+                        int v = atoi(opt.c_str() + 9);
+                        conf->attempts = std::max(std::min(v, 5), 1);
+                    } else if(opt.compare(0, 6, "ndots:") == 0) {
+                        int v = atoi(opt.c_str() + 6);
+                        conf->ndots = std::max(std::min(v, 15), 0);
+                    }
+                }
+            }
+        }
+
+        std::ifstream hosts(hosts_path);
+        while(std::getline(hosts, line)) {
+            std::istringstream ss(line.substr(0, line.find('#')));
+            std::string addr;
+            std::string raw;
+            if(!(ss >> addr) || !ParseNumeric(addr, raw)) {
+                continue;
+            }
+            uint16_t qtype = raw.size() == sizeof(in_addr) ? QTYPE_A : QTYPE_AAAA;
+            std::string name;
+            while(ss >> name) {
+                conf->hosts[CacheKey(ToLower(name), qtype)].push_back(raw);
+            }
+        }
+        resolv.close();
+        hosts.close();
+        set_hook_enable(old_hook);
+        SYLAR_LOG_DEBUG(g_logger) << "DnsResolver reload nameservers=" << conf->servers.size()
+                                  << " search=" << conf->search.size() << " ndots=" << conf->ndots
+                                  << " hosts=" << conf->hosts.size();
+
+        {
+            RWMutex::WriteLock lock(m_confMutex);
+            m_conf.swap(conf);
+        }
+        clearCache();
+    }
+
+    void DnsResolver::clearCache() {
+        for(auto& shard : m_shards) {
+            MutexType::Lock lock(shard.mutex);
+            shard.cache.clear();
+        }
+    }
+
+    int DnsResolver::resolve(const std::string& host, int family, std::vector<IPAddress::ptr>& result) {
+        if(family != AF_INET && family != AF_INET6 && family != AF_UNSPEC) {
+            return EAI_FAMILY;
+        }
+        std::string raw;
+        if(ParseNumeric(host, raw)) {
+            if(family != AF_UNSPEC && (raw.size() == sizeof(in_addr)) != (family == AF_INET)) {
+                return EAI_NONAME;
+            }
+            result.push_back(CreateRaw(raw, 0));
+            return 0;
+        }
+
+        std::string name = ToLower(host);
+        bool absolute = !name.empty() && name.back() == '.';
+        if(absolute) {
+            name.pop_back();
+        }
+        if(name.empty()) {
+            return EAI_NONAME;
+        }
+        std::vector<uint16_t> qtypes;
+        if(family != AF_INET6) {
+            qtypes.push_back(QTYPE_A);
+        }
+        if(family != AF_INET) {
+            qtypes.push_back(QTYPE_AAAA);
+        }
+
+        // hosts文件中有请求的类型的地址时不再查询DNS
+        std::shared_ptr<Conf> conf = getConf();
+        size_t old_size = result.size();
+        for(auto qtype : qtypes) {
+            auto it = conf->hosts.find(CacheKey(name, qtype));
+            if(it != conf->hosts.end()) {
+                for(auto& i : it->second) {
+                    result.push_back(CreateRaw(i, 0));
+                }
+            }
+        }
+        if(result.size() > old_size) {
+            return 0;
+        }
+
+        // 搜索列表：点数不少于ndots的名字先查原名，否则先补全搜索域；以点结尾的名字只查原名
+        std::vector<std::string> names;
+        if(absolute || conf->search.empty()) {
+            names.push_back(name);
+        } else {
+            bool as_is_first = (uint32_t)std::count(name.begin(), name.end(), '.') >= conf->ndots;
+            if(as_is_first) {
+                names.push_back(name);
+            }
+            for(auto& domain : conf->search) {
+                names.push_back(name + "." + domain);
+            }
+            if(!as_is_first) {
+                names.push_back(name);
+            }
+        }
+        int error = 0;
+        for(auto& i : names) {
+            int rt = resolveName(i, qtypes, result);
+            if(rt == 0) {
+                return 0;
+            }
+            if(rt != EAI_NONAME) {
+                error = rt;
+            }
+        }
+        return error ? error : EAI_NONAME;
+    }
+
+    int DnsResolver::resolveName(const std::string& name, const std::vector<uint16_t>& qtypes,
+                                 std::vector<IPAddress::ptr>& result) {
+        bool found = false;
+        int error = 0;
+        for(auto qtype : qtypes) {
+            std::vector<std::string> addrs;
+            int rt = lookup(name, qtype, addrs);
+            if(rt == 0) {
+                found = true;
+                for(auto& i : addrs) {
+                    result.push_back(CreateRaw(i, 0));
+                }
+            } else if(rt != EAI_NONAME) {
+                error = rt;
+            }
+        }
+        if(found) {
+            return 0;
+        }
+        return error ? error : EAI_NONAME;
+    }
+
+    int DnsResolver::lookup(const std::string& name, uint16_t qtype, std::vector<std::string>& addrs) {
+        std::string key = CacheKey(name, qtype);
+        Shard& shard = m_shards[std::hash<std::string>()(key) % SHARDS];
+        std::shared_ptr<Inflight> inflight;
+        {
+            MutexType::Lock lock(shard.mutex);
+            auto it = shard.cache.find(key);
+            if(it != shard.cache.end()) {
+                if(it->second.expire > GetCurrentMS()) {
+                    ++m_cacheHits;
+                    addrs = it->second.addrs;
+                    return it->second.rc;
+                }
+                shard.cache.erase(it);
+            }
+            // 只有协程能等别人的查询，线程直接自己查询
+            if(CanSuspend()) {
+                auto fit = shard.inflight.find(key);
+                if(fit != shard.inflight.end()) {
+                    std::shared_ptr<Inflight> other = fit->second;
+                    other->waiters.push_back(FiberWaiter::Current());
+                    // 发出查询的协程可能属于另一个调度器，唤醒之前本调度器不能停止
+                    other->waiters.back().scheduler->addExternalWaiter();
+                    ++m_coalesced;
+                    lock.unlock();
+                    Fiber::GetThis()->yield();
+                    addrs = other->addrs;
+                    return other->rc;
+                }
+                inflight = std::make_shared<Inflight>();
+                shard.inflight[key] = inflight;
+            }
+        }
+
+        uint32_t ttl = 0;
+        int rt = query(getConf(), name, qtype, addrs, ttl);
+        if(rt == 0) {
+            ttl = std::min(std::max(ttl, g_dns_min_ttl->getValue()), g_dns_max_ttl->getValue());
+        } else if(rt == EAI_NONAME) {
+            ttl = g_dns_negative_ttl->getValue();
+        } else {
+            ttl = 0;
+        }
+
+        std::deque<FiberWaiter> waiters;
+        {
+            MutexType::Lock lock(shard.mutex);
+            if(ttl > 0) {
+                size_t capacity = std::max<size_t>(g_dns_cache_size->getValue() / SHARDS, 1);
+                if(shard.cache.size() >= capacity) {
+                    uint64_t now = GetCurrentMS();
+                    for(auto it = shard.cache.begin(); it != shard.cache.end();) {
+                        if(it->second.expire <= now) {
+                            it = shard.cache.erase(it);
+                        } else {
+                            ++it;
+                        }
+                    }
+                    if(shard.cache.size() >= capacity) {
+                        shard.cache.erase(shard.cache.begin());
+                    }
+                }
+                CacheEntry& entry = shard.cache[key];
+                entry.rc     = rt;
+                entry.addrs  = addrs;
+                entry.expire = GetCurrentMS() + ttl * 1000ull;
+            }
+            if(inflight) {
+                // 结果写完之后再唤醒，等待的协程恢复后直接读取
+                inflight->rc    = rt;
+                inflight->addrs = addrs;
+                waiters.swap(inflight->waiters);
+                shard.inflight.erase(key);
+            }
+        }
+        for(auto& i : waiters) {
+            Scheduler* scheduler = i.scheduler;
+            i.wake();
+            scheduler->removeExternalWaiter();
+        }
+        return rt;
+    }
+
+    int DnsResolver::query(const std::shared_ptr<Conf>& conf, const std::string& name, uint16_t qtype,
+                           std::vector<std::string>& addrs, uint32_t& ttl) {
+        if(conf->servers.empty()) {
+            return EAI_FAIL;
+        }
+        std::string request;
+        if(!BuildQuery(name, qtype, request)) {
+            return EAI_NONAME;
+        }
+        static thread_local std::mt19937 s_rng(std::random_device{}());
+        for(uint32_t attempt = 0; attempt < conf->attempts; ++attempt) {
+            for(auto& server : conf->servers) {
+                uint16_t id = s_rng();
+                request[0] = (char)(id >> 8);
+                request[1] = (char)(id & 0xff);
+
+                std::string response;
+                int rcode = 0;
+                bool truncated = false;
+                addrs.clear();
+                if(!exchange(server, request, false, conf->timeout, response)
+                        || !ParseResponse(response, qtype, rcode, truncated, addrs, ttl)) {
+                    continue;
+                }
+                // 应答超过了UDP报文的长度，用TCP重新查询
+                if(truncated && (!exchange(server, request, true, conf->timeout, response)
+                        || !ParseResponse(response, qtype, rcode, truncated, addrs, ttl) || truncated)) {
+                    continue;
+                }
+                if(rcode == RCODE_NXDOMAIN) {
+                    addrs.clear();
+                    return EAI_NONAME;
+                }
+                if(rcode != 0) {
+                    // SERVFAIL、REFUSED等换下一个服务器
+                    SYLAR_LOG_DEBUG(g_logger) << "DnsResolver " << name << " server=" << *server
+                                              << " rcode=" << rcode;
+                    addrs.clear();
+                    continue;
+                }
+                return addrs.empty() ? EAI_NONAME : 0;
+            }
+        }
+        SYLAR_LOG_DEBUG(g_logger) << "DnsResolver " << name << " qtype=" << qtype << " no answer";
+        addrs.clear();
+        return EAI_AGAIN;
+    }
+
+    bool DnsResolver::exchange(const Address::ptr& server, const std::string& request, bool tcp,
+                               uint64_t timeout_ms, std::string& response) {
+        ++m_queries;
+        // IO协程中打开hook，收发只挂起当前协程；其他情况下直接阻塞，超时由内核实现
+        bool old_hook = is_hook_enable();
+        bool hook = CanSuspend() && IOManager::GetThis();
+        set_hook_enable(hook);
+        int fd = socket(server->getFamily(), tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+        if(fd < 0) {
+            set_hook_enable(old_hook);
+            return false;
+        }
+        bool ok = tcp ? ExchangeTcp(fd, hook, server, request, timeout_ms, response)
+                      : ExchangeUdp(fd, hook, server, request, timeout_ms, response);
+        set_hook_enable(hook);
+        close(fd);
+        set_hook_enable(old_hook);
+        return ok;
+    }
+}
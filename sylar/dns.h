@@ -0,0 +1,184 @@
+/**
+  ********************************************************
+  * @file        : dns.h
+  * @author      : zgys
+  * @brief       : 协程化的DNS解析器
+  * @attention   : 在IO协程中查询只挂起当前协程，其他情况下阻塞当前线程直到超时
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#ifndef __SYLAR_DNS_H__
+#define __SYLAR_DNS_H__
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include "address.h"
+#include "fiber_sync.h"
+#include "mutex.h"
+#include "noncopyable.h"
+#include "singleton.h"
+
+namespace sylar {
+
+    /**
+     * @brief DNS解析器
+     * @details 按/etc/resolv.conf中的nameserver直接用UDP发送DNS查询，应答被截断时改用TCP重新查询，
+     *          socket调用都经过hook，查询期间只挂起当前协程。名字先查/etc/hosts，数字地址直接转换。
+     *          不以点结尾的名字按search/domain和ndots选项依次补全搜索域查询，与libc的规则相同。
+     *          结果按应答中最小的TTL缓存，域名不存在也缓存一段时间；缓存分成多个分片各自加锁。
+     *          同一个名字同时有多个协程查询时只发一次请求，其他协程等在这次查询上
+     */
+    class DnsResolver : Noncopyable {
+    public:
+        typedef std::shared_ptr<DnsResolver> ptr;
+        typedef Mutex MutexType;
+
+        /**
+         * @brief 构造函数，读取dns.resolv_conf和dns.hosts配置的文件
+         */
+        DnsResolver();
+
+        /**
+         * @brief 解析名字
+         * @param[in] host 域名或数字地址，不带端口
+         * @param[in] family AF_INET只查A记录，AF_INET6只查AAAA记录，AF_UNSPEC两种都查，IPv4地址在前
+         * @param[out] result 追加解析出的地址，端口为0
+         * @return 0成功；EAI_NONAME名字不存在或没有该类型的地址；
+         *         EAI_AGAIN服务器都没有应答或应答出错；EAI_FAIL没有配置nameserver；EAI_FAMILY协议族不支持
+         */
+        int resolve(const std::string& host, int family, std::vector<IPAddress::ptr>& result);
+
+        /**
+         * @brief 重新读取dns.resolv_conf和dns.hosts配置的文件，并清空缓存
+         */
+        void reload();
+
+        /**
+         * @brief 读取指定的resolv.conf和hosts文件，并清空缓存
+         */
+        void reload(const std::string& resolv_conf, const std::string& hosts);
+
+        /**
+         * @brief 清空缓存
+         */
+        void clearCache();
+
+        /**
+         * @brief 配置的nameserver数
+         */
+        size_t getNameServerCount();
+
+        /**
+         * @brief resolv.conf中的ndots选项，默认为1
+         */
+        uint32_t getNdots();
+
+        /**
+         * @brief 发出的查询数，每次UDP或TCP请求计一次
+         */
+        uint64_t getQueries() const { return m_queries; }
+
+        /**
+         * @brief 命中缓存的次数
+         */
+        uint64_t getCacheHits() const { return m_cacheHits; }
+
+        /**
+         * @brief 等在其他协程的同名查询上，没有自己发出请求的次数
+         */
+        uint64_t getCoalesced() const { return m_coalesced; }
+
+    private:
+        /**
+         * @brief resolv.conf和hosts文件的内容，重新读取时整体替换
+         */
+        struct Conf {
+            std::vector<Address::ptr> servers;          // nameserver地址
+            uint64_t timeout = 5000;                    // 单次请求的超时时间(毫秒)
+            uint32_t attempts = 2;                      // 所有nameserver轮流尝试的轮数
+            uint32_t ndots = 1;                         // 名字中的点少于它时先按搜索列表补全再查原名
+            std::vector<std::string> search;            // search/domain给出的搜索列表，小写
+            // hosts文件中的记录，key为小写的名字+查询类型，value为网络序的原始地址
+            std::unordered_map<std::string, std::vector<std::string> > hosts;
+        };
+
+        /**
+         * @brief 缓存的结果
+         */
+        struct CacheEntry {
+            int rc = 0;                                 // resolve的返回值
+            std::vector<std::string> addrs;             // 网络序的原始地址，4或16字节
+            uint64_t expire = 0;                        // 过期时间(毫秒)
+        };
+
+        /**
+         * @brief 进行中的查询，同名的其他协程等在这里
+         */
+        struct Inflight {
+            std::deque<FiberWaiter> waiters;
+            int rc = 0;
+            std::vector<std::string> addrs;
+        };
+
+        /**
+         * @brief 缓存分片
+         */
+        struct Shard {
+            MutexType mutex;
+            std::unordered_map<std::string, CacheEntry> cache;
+            std::unordered_map<std::string, std::shared_ptr<Inflight> > inflight;
+        };
+
+        static const size_t SHARDS = 16;
+
+        /**
+         * @brief 查询一个完整的名字的各种记录
+         * @return 同resolve，有一种记录查到就算成功
+         */
+        int resolveName(const std::string& name, const std::vector<uint16_t>& qtypes,
+                        std::vector<IPAddress::ptr>& result);
+
+        /**
+         * @brief 查一种记录，先查缓存，再等同名的查询或自己查询
+         * @param[in] name 小写的域名
+         * @param[in] qtype 1为A记录，28为AAAA记录
+         */
+        int lookup(const std::string& name, uint16_t qtype, std::vector<std::string>& addrs);
+
+        /**
+         * @brief 依次向各个nameserver查询
+         * @param[out] ttl 结果可以缓存的时间(秒)
+         */
+        int query(const std::shared_ptr<Conf>& conf, const std::string& name, uint16_t qtype,
+                  std::vector<std::string>& addrs, uint32_t& ttl);
+
+        /**
+         * @brief 向一个nameserver发送请求并收取应答
+         * @return 成功返回true，超时或出错返回false
+         */
+        bool exchange(const Address::ptr& server, const std::string& request, bool tcp,
+                      uint64_t timeout_ms, std::string& response);
+
+        std::shared_ptr<Conf> getConf();
+
+    private:
+        RWMutex                     m_confMutex;
+        std::shared_ptr<Conf>       m_conf;
+        Shard                       m_shards[SHARDS];
+        std::atomic<uint64_t>       m_queries{0};
+        std::atomic<uint64_t>       m_cacheHits{0};
+        std::atomic<uint64_t>       m_coalesced{0};
+    };
+
+    /**
+     * @brief 进程内共用的DNS解析器，Address::Lookup使用它
+     */
+    typedef Singleton<DnsResolver> DnsMgr;
+}
+
+#endif //__SYLAR_DNS_H__
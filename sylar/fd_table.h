@@ -0,0 +1,111 @@
+/**
+  ********************************************************
+  * @file        : fd_table.h
+  * @author      : zgys
+  * @brief       : 按fd索引的两级分块表
+  * @attention   : 只增不减，块一旦发布就不会移动或释放，直到表析构
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#ifndef __SYLAR_FD_TABLE_H__
+#define __SYLAR_FD_TABLE_H__
+
+#include <atomic>
+#include <stddef.h>
+#include "noncopyable.h"
+
+namespace sylar {
+
+    /**
+     * @brief 按fd索引的两级分块表
+     * @details 第一级是构造时一次分配好的块指针数组，第二级是按需分配的定长块。
+     *          查找只有一次原子load，无锁且wait-free；扩容只是CAS发布一个新块，
+     *          已有的槽位地址永远不变，扩容期间读者不会被阻塞，也不需要拷贝旧数据
+     * @tparam T 槽位类型，需可默认构造
+     * @tparam ChunkBits 每块容纳 2^ChunkBits 个fd
+     * @tparam MaxChunks 第一级数组长度，可索引的fd上限为 MaxChunks << ChunkBits
+     */
+    template<class T, size_t ChunkBits = 8, size_t MaxChunks = 16384>
+    class FdTable : Noncopyable {
+    public:
+        static const size_t CHUNK_SIZE = (size_t)1 << ChunkBits;
+
+        FdTable()
+            : m_chunks(new std::atomic<Chunk*>[MaxChunks]) {
+            for (size_t i = 0; i < MaxChunks; ++i) {
+                m_chunks[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~FdTable() {
+            for (size_t i = 0; i < MaxChunks; ++i) {
+                delete m_chunks[i].load(std::memory_order_relaxed);
+            }
+            delete[] m_chunks;
+        }
+
+        /**
+         * @brief 可索引的fd上限
+         */
+        static size_t capacity() { return MaxChunks << ChunkBits; }
+
+        /**
+         * @brief 查找fd对应的槽位
+         * @return fd所在的块还未分配或fd越界时返回nullptr
+         */
+        T* find(int fd) const {
+            if (fd < 0 || (size_t)fd >= capacity()) {
+                return nullptr;
+            }
+            Chunk* chunk = m_chunks[(size_t)fd >> ChunkBits].load(std::memory_order_acquire);
+            return chunk ? &chunk->slots[fd & (CHUNK_SIZE - 1)] : nullptr;
+        }
+
+        /**
+         * @brief 查找fd对应的槽位，所在块不存在时分配
+         * @param[in] init 新块发布前对块内每个槽位调用一次init(slot, fd)
+         * @return fd越界时返回nullptr
+         */
+        template<class Init>
+        T* get(int fd, Init init) {
+            T* slot = find(fd);
+            if (slot || fd < 0 || (size_t)fd >= capacity()) {
+                return slot;
+            }
+            size_t index = (size_t)fd >> ChunkBits;
+            Chunk* chunk = new Chunk;
+            for (size_t i = 0; i < CHUNK_SIZE; ++i) {
+                init(chunk->slots[i], (int)((index << ChunkBits) + i));
+            }
+            Chunk* expected = nullptr;
+            // 多个线程同时扩容同一个块时只有一个能发布成功，其余的丢弃自己分配的块
+            if (!m_chunks[index].compare_exchange_strong(expected, chunk,
+                                                         std::memory_order_acq_rel,
+                                                         std::memory_order_acquire)) {
+                delete chunk;
+                chunk = expected;
+            }
+            return &chunk->slots[fd & (CHUNK_SIZE - 1)];
+        }
+
+        /**
+         * @brief 查找fd对应的槽位，所在块不存在时分配，槽位保持默认构造
+         */
+        T* get(int fd) {
+            return get(fd, [](T&, int) {});
+        }
+
+    private:
+        struct Chunk {
+            T slots[CHUNK_SIZE];
+        };
+
+        /// 第一级块指针数组，单独分配，避免把整张表放进持有者对象里
+        std::atomic<Chunk*>* m_chunks;
+    };
+
+    template<class T, size_t ChunkBits, size_t MaxChunks>
+    const size_t FdTable<T, ChunkBits, MaxChunks>::CHUNK_SIZE;
+}
+
+#endif //SYLAR_FD_TABLE_H
@@ -3,7 +3,7 @@
   * @file        : fdmanager.cc
   * @author      : zgys
   * @brief       : None
-  * @attention   : 只管理socket fd，记录fd是否为socket，用户是否设置非阻塞，系统是否设置非阻塞，send/recv超时时间
+  * @attention   : 管理socket fd和hook层读写过的其他fd，记录fd是否为socket、是否为普通文件，用户是否设置非阻塞，系统是否设置非阻塞，send/recv超时时间
   *                提供FdManager单例和get/del方法，用于创建/获取/删除fd
   * @date        : 23-2-24
   ********************************************************
@@ -20,6 +20,7 @@ namespace sylar {
     FdCtx::FdCtx(int fd)
             :m_isInit(false)
             ,m_isSocket(false)
+            ,m_isRegular(false)
             ,m_sysNonblock(false)
             ,m_userNonblock(false)
             ,m_isClosed(false)
@@ -43,9 +44,11 @@ namespace sylar {
         if(-1 == fstat(m_fd, &fd_stat)) {
             m_isInit = false;
             m_isSocket = false;
+            m_isRegular = false;
         } else {
             m_isInit = true;
             m_isSocket = S_ISSOCK(fd_stat.st_mode);
+            m_isRegular = S_ISREG(fd_stat.st_mode);
         }
 
         if(m_isSocket) {
@@ -80,40 +83,40 @@ namespace sylar {
     }
 
     FdManager::FdManager() {
-        m_datas.resize(64);
     }
 
     FdCtx::ptr FdManager::get(int fd, bool auto_create) {
         if(fd == -1) {
             return nullptr;
         }
-        RWMutexType::ReadLock lock(m_mutex);
-        if((int)m_datas.size() <= fd) {
-            if(auto_create == false) {
-                return nullptr;
-            }
-        } else {
-            if(m_datas[fd] || !auto_create) {
-                return m_datas[fd];
-            }
+        Slot* slot = auto_create ? m_datas.get(fd) : m_datas.find(fd);
+        if(!slot) {
+            return nullptr;
+        }
+        MutexType::Lock lock(slot->mutex);
+        if(slot->ctx || !auto_create) {
+            return slot->ctx;
         }
         lock.unlock();
 
-        RWMutexType::WriteLock lock2(m_mutex);
+        // FdCtx构造时会调用fstat/fcntl，不放在自旋锁里
         FdCtx::ptr ctx(new FdCtx(fd));
-        if(fd >= (int)m_datas.size()) {
-            m_datas.resize(fd * 1.5);
+        lock.lock();
+        if(!slot->ctx) {
+            slot->ctx = ctx;
         }
-        m_datas[fd] = ctx;
-        return ctx;
+        return slot->ctx;
     }
 
     void FdManager::del(int fd) {
-        RWMutexType::WriteLock lock(m_mutex);
-        if((int)m_datas.size() <= fd) {
+        Slot* slot = m_datas.find(fd);
+        if(!slot) {
             return;
         }
-        m_datas[fd].reset();
+        FdCtx::ptr ctx;
+        MutexType::Lock lock(slot->mutex);
+        // 在锁外释放，FdCtx的析构不占用自旋锁
+        ctx.swap(slot->ctx);
     }
 
-}
\ No newline at end of file
+}
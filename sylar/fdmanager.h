@@ -14,6 +14,7 @@
 #include <vector>
 #include "thread.h"
 #include "singleton.h"
+#include "fd_table.h"
 
 namespace sylar {
 
@@ -44,6 +45,11 @@ namespace sylar {
          */
         bool isSocket() const { return m_isSocket;}
 
+        /**
+         * @brief 是否普通文件，hook层据此决定是否把读写交给卸载线程池
+         */
+        bool isRegular() const { return m_isRegular;}
+
         /**
          * @brief 是否已关闭
          */
@@ -94,6 +100,8 @@ namespace sylar {
         bool m_isInit: 1;
         /// 是否socket
         bool m_isSocket: 1;
+        /// 是否普通文件
+        bool m_isRegular: 1;
         /// 是否hook非阻塞
         bool m_sysNonblock: 1;
         /// 是否用户主动设置非阻塞
@@ -113,7 +121,7 @@ namespace sylar {
  */
     class FdManager {
     public:
-        typedef RWMutex RWMutexType;
+        typedef Spinlock MutexType;
         /**
          * @brief 无参构造函数
          */
@@ -133,10 +141,16 @@ namespace sylar {
          */
         void del(int fd);
     private:
-        /// 读写锁
-        RWMutexType m_mutex;
-        /// 文件句柄集合
-        std::vector<FdCtx::ptr> m_datas;
+        /**
+         * @brief 每个fd一个槽位，自旋锁只保护本槽位的智能指针
+         */
+        struct Slot {
+            MutexType  mutex;
+            FdCtx::ptr ctx;
+        };
+
+        /// 文件句柄集合，按fd分块增长，查找不加全局锁
+        FdTable<Slot> m_datas;
     };
 
 /// 文件句柄单例
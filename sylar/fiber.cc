@@ -6,7 +6,11 @@
 #include "macro.h"
 #include "log.h"
 #include "scheduler.h"
+#include "util.h"
 #include <atomic>
+#include <deque>
+#include <sys/mman.h>
+#include <unistd.h>
 
 namespace sylar {
 
@@ -16,31 +20,568 @@ namespace sylar {
     static std::atomic<uint64_t> s_fiber_id {0};
     /// 全局静态变量，用于统计当前的协程数
     static std::atomic<uint64_t> s_fiber_count {0};
+    /// 全局静态变量，已分配的协程局部存储槽位数
+    static std::atomic<uint32_t> s_local_slots {0};
 
     /// 线程局部变量，当前线程正在运行的协程
     static thread_local Fiber* t_fiber = nullptr;
     /// 线程局部变量，当前线程的主协程，切换到这个协程，就相当于切换到了主线程中运行，智能指针形式
     static thread_local Fiber::ptr t_threadFiber = nullptr;
+    /// 线程局部变量，当前线程协程切换的记录位置
+    static thread_local Fiber::SwitchTrace* t_switch_trace = nullptr;
 
     // 协程栈大小，可通过配置文件获取，默认128k
     static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
             Config::Lookup<uint32_t>("fiber.stack_size", 128 * 1024, "fiber stack size");
 
+    // 协程栈分配器，malloc: 直接在堆上分配  pool: 每线程缓存的mmap栈，栈底带PROT_NONE保护页
+    static ConfigVar<std::string>::ptr g_fiber_stack_allocator =
+            Config::Lookup<std::string>("fiber.stack_allocator", "malloc", "fiber stack allocator, malloc or pool");
+
+    // pool分配器每个线程最多缓存的栈数量
+    static ConfigVar<uint32_t>::ptr g_fiber_stack_pool_size =
+            Config::Lookup<uint32_t>("fiber.stack_pool_size", 64, "fiber stack pool size per thread");
+
+    /**
+     * @brief 协程栈分配器接口
+     */
+    class StackAllocator {
+    public:
+        virtual ~StackAllocator() {}
+        virtual void* alloc(size_t size) = 0;
+        virtual void dealloc(void* vp, size_t size) = 0;
+    };
+
     /**
      * @brief malloc栈内存分配器，实际协程栈在堆上
      */
-    class MallocStackAllocator {
+    class MallocStackAllocator : public StackAllocator {
     public:
-        static void* Alloc(size_t size) {
+        void* alloc(size_t size) override {
             return malloc(size);
         }
 
-        static void Dealloc(void* vp, size_t size) {
+        void dealloc(void* vp, size_t size) override {
             return free(vp);
         }
     };
 
-    using StackAllocator = MallocStackAllocator;
+    /**
+     * @brief 每线程缓存的mmap栈分配器
+     * @details 每个栈在低地址多映射一页并设置为PROT_NONE，栈溢出时直接触发SIGSEGV，而不是悄悄踩坏堆内存。
+     *          释放的栈缓存在当前线程的空闲列表中，短生命周期的协程可以直接复用，不再走mmap/munmap
+     */
+    class PoolStackAllocator : public StackAllocator {
+    public:
+        void* alloc(size_t size) override {
+            StackPool* pool = GetPool();
+            if(pool) {
+                // 从后往前找，最近释放的栈更可能还在cache里
+                for(size_t i = pool->stacks.size(); i > 0; --i) {
+                    if(pool->stacks[i - 1].second == size) {
+                        void* vp = pool->stacks[i - 1].first;
+                        pool->stacks.erase(pool->stacks.begin() + (i - 1));
+                        return vp;
+                    }
+                }
+            }
+
+            return Map(size);
+        }
+
+        void dealloc(void* vp, size_t size) override {
+            StackPool* pool = GetPool();
+            if(pool && pool->stacks.size() < s_pool_size) {
+                pool->stacks.push_back(std::make_pair(vp, size));
+                return;
+            }
+            Unmap(vp, size);
+        }
+
+        static void SetPoolSize(uint32_t v) { s_pool_size = v; }
+
+        /**
+         * @brief 映射一个带保护页的栈，返回保护页之上的可用地址
+         */
+        static void* Map(size_t size) {
+            size_t page = PageSize();
+            size_t len = RoundUp(size) + page;
+            void* base = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if(base == MAP_FAILED) {
+                SYLAR_LOG_ERROR(g_logger) << "mmap fiber stack fail, len=" << len
+                                          << " errno=" << errno << " " << strerror(errno);
+                throw std::bad_alloc();
+            }
+            // 栈从高地址向低地址增长，保护页放在最低处
+            if(mprotect(base, page, PROT_NONE)) {
+                SYLAR_LOG_ERROR(g_logger) << "mprotect fiber stack guard page fail, errno="
+                                          << errno << " " << strerror(errno);
+            }
+            // 绑核的调度线程创建的协程，栈固定在本节点上，协程被别的节点上的线程执行时也不会把页分配到远端
+            if(CpuUtil::IsPinned()) {
+                CpuUtil::BindLocal((char*)base + page, len - page);
+            }
+            return (char*)base + page;
+        }
+
+        static void Unmap(void* vp, size_t size) {
+            size_t page = PageSize();
+            munmap((char*)vp - page, RoundUp(size) + page);
+        }
+
+    private:
+        struct StackPool {
+            std::vector<std::pair<void*, size_t> > stacks;   // 空闲的栈和它的大小
+
+            ~StackPool() {
+                for(auto& i : stacks) {
+                    Unmap(i.first, i.second);
+                }
+            }
+        };
+
+        /**
+         * @brief 当前线程的栈缓存，线程退出后返回nullptr，之后释放的栈直接munmap
+         */
+        static StackPool* GetPool() {
+            static thread_local bool t_exited = false;
+            static thread_local std::unique_ptr<StackPool> t_pool;
+            if(SYLAR_UNLIKELY(!t_pool)) {
+                if(t_exited) {
+                    return nullptr;
+                }
+                // 线程局部变量按构造的逆序析构，借助一个guard在线程退出时把缓存的栈还给系统
+                struct Guard {
+                    ~Guard() {
+                        t_pool.reset();
+                        t_exited = true;
+                    }
+                };
+                static thread_local Guard t_guard;
+                (void)t_guard;
+                t_pool.reset(new StackPool);
+            }
+            return t_pool.get();
+        }
+
+        static size_t PageSize() {
+            static size_t s_page = sysconf(_SC_PAGESIZE);
+            return s_page;
+        }
+
+        static size_t RoundUp(size_t size) {
+            size_t page = PageSize();
+            return (size + page - 1) / page * page;
+        }
+
+    private:
+        static uint32_t s_pool_size;
+    };
+
+    uint32_t PoolStackAllocator::s_pool_size = 64;
+
+    static MallocStackAllocator s_malloc_allocator;
+    static PoolStackAllocator   s_pool_allocator;
+    static StackAllocator*      s_stack_allocator = &s_malloc_allocator;
+
+    static StackAllocator* GetStackAllocatorByName(const std::string& name) {
+        if(name == "pool") {
+            return &s_pool_allocator;
+        }
+        if(name != "malloc") {
+            SYLAR_LOG_ERROR(g_logger) << "unknown fiber.stack_allocator=" << name << ", use malloc";
+        }
+        return &s_malloc_allocator;
+    }
+
+    struct _StackAllocatorIniter {
+        _StackAllocatorIniter() {
+            s_stack_allocator = GetStackAllocatorByName(g_fiber_stack_allocator->getValue());
+            PoolStackAllocator::SetPoolSize(g_fiber_stack_pool_size->getValue());
+
+            g_fiber_stack_allocator->addListener([](const std::string& old_value, const std::string& new_value) {
+                SYLAR_LOG_INFO(g_logger) << "fiber stack allocator changed from "
+                                         << old_value << " to " << new_value;
+                s_stack_allocator = GetStackAllocatorByName(new_value);
+            });
+            g_fiber_stack_pool_size->addListener([](const uint32_t& old_value, const uint32_t& new_value) {
+                PoolStackAllocator::SetPoolSize(new_value);
+            });
+        }
+    };
+
+    static _StackAllocatorIniter s_stack_allocator_initer;
+
+    // 共享栈模式：参与调度的协程在所在线程的几个大栈上运行，栈被别的协程占用时才把用到的部分拷贝出去，
+    // 挂起的协程只占用与实际栈深度相当的内存，适合大量空闲连接
+    static ConfigVar<bool>::ptr g_fiber_shared_stack =
+            Config::Lookup<bool>("fiber.shared_stack", false, "fiber runs on per-thread shared stacks");
+
+    // 每个共享栈的大小，线程第一次使用共享栈时读取
+    static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_size =
+            Config::Lookup<uint32_t>("fiber.shared_stack_size", 1024 * 1024, "fiber shared stack size");
+
+    // 每个线程的共享栈个数，个数越多，切换时需要拷贝栈的概率越低
+    static ConfigVar<uint32_t>::ptr g_fiber_shared_stack_count =
+            Config::Lookup<uint32_t>("fiber.shared_stack_count", 4, "fiber shared stack count per thread");
+
+    static bool s_use_shared_stack = false;
+
+    /**
+     * @brief 一个共享栈
+     */
+    struct SharedStack {
+        char*  base = nullptr;          // 栈的低地址
+        size_t size = 0;                // 栈大小
+        Fiber* occupant = nullptr;      // 栈上现在是哪个协程的内容
+        bool   pinned = false;          // 占用者挂起期间栈上的对象仍在被访问，不能换出
+    };
+
+    /**
+     * @brief 一个线程的全部共享栈
+     */
+    struct SharedStackSet {
+        std::deque<SharedStack> stacks; // deque追加时不移动已有元素，协程持有的指针保持有效
+        size_t   size  = 0;             // 每个栈的大小
+        size_t   next  = 0;             // 没有空闲的栈时，按轮转选下一个
+        uint64_t bound = 0;             // 绑定到本线程、还没有结束的协程数
+
+        SharedStackSet() {
+            size = std::max<uint32_t>(g_fiber_shared_stack_size->getValue(), 16 * 1024);
+            size_t count = std::max<uint32_t>(g_fiber_shared_stack_count->getValue(), 1);
+            for(size_t i = 0; i < count; ++i) {
+                add();
+            }
+        }
+
+        ~SharedStackSet() {
+            if(bound) {
+                SYLAR_LOG_ERROR(g_logger) << "thread exit with " << bound << " fibers on its shared stacks";
+            }
+            for(auto& i : stacks) {
+                PoolStackAllocator::Unmap(i.base, i.size);
+            }
+        }
+
+        SharedStack* add() {
+            stacks.emplace_back();
+            SharedStack* s = &stacks.back();
+            s->base = (char*)PoolStackAllocator::Map(size);
+            s->size = size;
+            return s;
+        }
+
+        /**
+         * @brief 选一个栈：优先空闲的，其次按轮转选一个没有固定的，全都固定时再映射一个
+         */
+        SharedStack* pick() {
+            size_t n = stacks.size();
+            size_t victim = n;
+            for(size_t i = 0; i < n; ++i) {
+                size_t idx = (next + i) % n;
+                if(!stacks[idx].occupant) {
+                    return &stacks[idx];
+                }
+                if(victim == n && !stacks[idx].pinned) {
+                    victim = idx;
+                }
+            }
+            if(victim == n) {
+                return add();
+            }
+            next = victim + 1;
+            return &stacks[victim];
+        }
+    };
+
+    static thread_local std::unique_ptr<SharedStackSet> t_shared_stacks;
+
+    static SharedStackSet* GetSharedStacks() {
+        if(SYLAR_UNLIKELY(!t_shared_stacks)) {
+            t_shared_stacks.reset(new SharedStackSet);
+        }
+        return t_shared_stacks.get();
+    }
+
+    struct _SharedStackIniter {
+        _SharedStackIniter() {
+            s_use_shared_stack = g_fiber_shared_stack->getValue();
+            g_fiber_shared_stack->addListener([](const bool& old_value, const bool& new_value) {
+                if(new_value && !Fiber::HasSharedStack()) {
+                    SYLAR_LOG_ERROR(g_logger) << "fiber.shared_stack is not supported on this platform";
+                }
+                s_use_shared_stack = new_value;
+            });
+        }
+    };
+
+    static _SharedStackIniter s_shared_stack_initer;
+
+    // 协程上下文切换方式，ucontext: makecontext/swapcontext  asm: 只保存callee-saved寄存器的汇编实现
+    static ConfigVar<std::string>::ptr g_fiber_context =
+            Config::Lookup<std::string>("fiber.context", "ucontext", "fiber context switch, ucontext or asm");
+
+/**
+ * 汇编上下文切换 sylar_swap_context(void** from_sp, void* to_sp)
+ * 把callee-saved寄存器压入当前栈，栈顶保存到*from_sp，然后切换到to_sp并恢复寄存器，ret到目标协程。
+ * 与swapcontext相比不保存信号掩码，省掉了每次切换的rt_sigprocmask系统调用
+ */
+#if defined(__x86_64__)
+#define SYLAR_ASM_CONTEXT 1
+    // 栈布局(低->高)：mxcsr/x87控制字, r15, r14, r13, r12, rbx, rbp, 返回地址
+    static const size_t ASM_CONTEXT_SIZE = 8 * 8;
+    asm(R"(
+        .text
+        .globl sylar_swap_context
+        .type sylar_swap_context,@function
+        .align 16
+    sylar_swap_context:
+        pushq %rbp
+        pushq %rbx
+        pushq %r12
+        pushq %r13
+        pushq %r14
+        pushq %r15
+        subq $8, %rsp
+        stmxcsr (%rsp)
+        fnstcw 4(%rsp)
+        movq %rsp, (%rdi)
+        movq %rsi, %rsp
+        ldmxcsr (%rsp)
+        fldcw 4(%rsp)
+        addq $8, %rsp
+        popq %r15
+        popq %r14
+        popq %r13
+        popq %r12
+        popq %rbx
+        popq %rbp
+        ret
+        .size sylar_swap_context,.-sylar_swap_context
+    )");
+#elif defined(__aarch64__)
+#define SYLAR_ASM_CONTEXT 1
+    // 栈布局(低->高)：d8-d15, x19-x28, x29(fp), x30(lr)
+    static const size_t ASM_CONTEXT_SIZE = 20 * 8;
+    asm(R"(
+        .text
+        .globl sylar_swap_context
+        .type sylar_swap_context,%function
+        .align 4
+    sylar_swap_context:
+        sub sp, sp, #160
+        stp d8, d9, [sp, #0]
+        stp d10, d11, [sp, #16]
+        stp d12, d13, [sp, #32]
+        stp d14, d15, [sp, #48]
+        stp x19, x20, [sp, #64]
+        stp x21, x22, [sp, #80]
+        stp x23, x24, [sp, #96]
+        stp x25, x26, [sp, #112]
+        stp x27, x28, [sp, #128]
+        stp x29, x30, [sp, #144]
+        mov x9, sp
+        str x9, [x0]
+        mov sp, x1
+        ldp d8, d9, [sp, #0]
+        ldp d10, d11, [sp, #16]
+        ldp d12, d13, [sp, #32]
+        ldp d14, d15, [sp, #48]
+        ldp x19, x20, [sp, #64]
+        ldp x21, x22, [sp, #80]
+        ldp x23, x24, [sp, #96]
+        ldp x25, x26, [sp, #112]
+        ldp x27, x28, [sp, #128]
+        ldp x29, x30, [sp, #144]
+        add sp, sp, #160
+        ret
+        .size sylar_swap_context,.-sylar_swap_context
+    )");
+#endif
+
+#ifdef SYLAR_ASM_CONTEXT
+    extern "C" void sylar_swap_context(void** from_sp, void* to_sp);
+#endif
+
+    static bool s_use_asm_context = false;
+
+    static bool UseAsmContext(const std::string& name) {
+        if(name == "asm") {
+            if(Fiber::HasAsmContext()) {
+                return true;
+            }
+            SYLAR_LOG_ERROR(g_logger) << "fiber.context=asm is not supported on this platform, use ucontext";
+        } else if(name != "ucontext") {
+            SYLAR_LOG_ERROR(g_logger) << "unknown fiber.context=" << name << ", use ucontext";
+        }
+        return false;
+    }
+
+    struct _FiberContextIniter {
+        _FiberContextIniter() {
+            s_use_asm_context = UseAsmContext(g_fiber_context->getValue());
+            g_fiber_context->addListener([](const std::string& old_value, const std::string& new_value) {
+                SYLAR_LOG_INFO(g_logger) << "fiber context changed from "
+                                         << old_value << " to " << new_value;
+                s_use_asm_context = UseAsmContext(new_value);
+            });
+        }
+    };
+
+    static _FiberContextIniter s_fiber_context_initer;
+
+    bool Fiber::HasAsmContext() {
+#ifdef SYLAR_ASM_CONTEXT
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool Fiber::HasSharedStack() {
+#if defined(__x86_64__) || defined(__aarch64__)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    uint64_t Fiber::SharedStackFibers() {
+        return t_shared_stacks ? t_shared_stacks->bound : 0;
+    }
+
+    void* Fiber::savedStackPointer() {
+#ifdef SYLAR_ASM_CONTEXT
+        if(m_asmContext) {
+            return m_sp;
+        }
+#endif
+#if defined(__x86_64__)
+        return (void*)m_ctx.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+        return (void*)m_ctx.uc_mcontext.sp;
+#else
+        SYLAR_ASSERT2(false, "shared stack is not supported on this platform");
+        return nullptr;
+#endif
+    }
+
+    void Fiber::saveStack() {
+        char* top = (char*)m_stack + m_stacksize;
+        char* sp  = (char*)savedStackPointer();
+        SYLAR_ASSERT(sp > (char*)m_stack && sp <= top);
+        size_t used = top - sp;
+        // 保存区按实际用量分配，用量降到很低时缩小，挂起的协程只占用它真正用到的那部分
+        if(used > m_savedCap || used < m_savedCap / 4) {
+            free(m_saved);
+            m_savedCap = (used + 255) & ~(size_t)255;
+            m_saved = (char*)malloc(m_savedCap);
+            if(!m_saved) {
+                throw std::bad_alloc();
+            }
+        }
+        memcpy(m_saved, sp, used);
+        m_savedSize = used;
+    }
+
+    void Fiber::switchInShared() {
+        SharedStackSet* set = GetSharedStacks();
+        if(!m_shared) {
+            // 第一次运行，绑定到当前线程的一个共享栈上，从栈顶开始运行
+            m_shared      = set->pick();
+            m_boundThread = sylar::GetThreadId();
+            ++set->bound;
+            if(m_shared->occupant) {
+                m_shared->occupant->saveStack();
+            }
+            m_shared->occupant = this;
+            m_stack     = m_shared->base;
+            m_stacksize = m_shared->size;
+            initContext();
+            return;
+        }
+        SYLAR_ASSERT2(m_boundThread == sylar::GetThreadId(), "shared stack fiber resumed on another thread");
+        if(m_shared->occupant == this) {
+            // 切出之后栈没有被别人用过，内容原样还在
+            return;
+        }
+        if(m_shared->occupant) {
+            m_shared->occupant->saveStack();
+        }
+        m_shared->occupant = this;
+        memcpy((char*)m_stack + m_stacksize - m_savedSize, m_saved, m_savedSize);
+    }
+
+    void Fiber::releaseShared() {
+        if(m_shared) {
+            if(m_shared->occupant == this) {
+                m_shared->occupant = nullptr;
+                m_shared->pinned   = false;
+            }
+            --GetSharedStacks()->bound;
+            m_shared      = nullptr;
+            m_boundThread = -1;
+            m_stack       = nullptr;
+            m_stacksize   = 0;
+        }
+        free(m_saved);
+        m_saved     = nullptr;
+        m_savedSize = 0;
+        m_savedCap  = 0;
+    }
+
+    void Fiber::setStackPinned(bool v) {
+        if(m_shared) {
+            SYLAR_ASSERT(m_shared->occupant == this);
+            m_shared->pinned = v;
+        }
+    }
+
+    void Fiber::initContext() {
+#ifdef SYLAR_ASM_CONTEXT
+        if(m_asmContext) {
+            // 伪造一个刚被sylar_swap_context切出的栈帧，第一次切入时ret到MainFunc
+            uintptr_t top = ((uintptr_t)m_stack + m_stacksize) & ~(uintptr_t)15;
+            void** frame;
+#if defined(__x86_64__)
+            // ret之后rsp需满足 rsp % 16 == 8，与普通函数调用时的入口状态一致，最高处再放一个假的返回地址
+            frame = (void**)(top - ASM_CONTEXT_SIZE - 8);
+            memset(frame, 0, ASM_CONTEXT_SIZE + 8);
+            uint32_t* ctrl = (uint32_t*)frame;
+            ctrl[0] = 0x1F80;                   // mxcsr默认值
+            ctrl[1] = 0x037F;                   // x87控制字默认值
+            frame[7] = (void*)&Fiber::MainFunc;
+#else
+            frame = (void**)(top - ASM_CONTEXT_SIZE);
+            memset(frame, 0, ASM_CONTEXT_SIZE);
+            frame[19] = (void*)&Fiber::MainFunc; // x30(lr)
+#endif
+            m_sp = frame;
+            return;
+        }
+#endif
+        if(getcontext(&m_ctx)) {            // 获取上下文，放入成员m_ctx中
+            SYLAR_ASSERT2(false, "getcontext");
+        }
+        m_ctx.uc_link          = nullptr;
+        m_ctx.uc_stack.ss_sp   = m_stack;
+        m_ctx.uc_stack.ss_size = m_stacksize;
+
+        makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    }
+
+    void Fiber::SwapContext(Fiber* from, Fiber* to, bool use_asm) {
+#ifdef SYLAR_ASM_CONTEXT
+        if(use_asm) {
+            sylar_swap_context(&from->m_sp, to->m_sp);
+            return;
+        }
+#endif
+        if(swapcontext(&from->m_ctx, &to->m_ctx)) {
+            SYLAR_ASSERT2(false, "swapcontext");
+        }
+    }
 
     Fiber::Fiber() { // 主协程
         SetThis(this);
@@ -55,23 +596,23 @@ namespace sylar {
         SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber main id = " << m_id;
     }
 
-    Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler)
+    Fiber::Fiber(Task cb, size_t stacksize, bool run_in_scheduler, bool shared_stack)
     :m_id(s_fiber_id++),                        // 私有构造时s_fiber_id已经加一
-     m_cb(cb),
+     m_cb(std::move(cb)),
      m_runInSchedule(run_in_scheduler){         // 子协程，需要回到函数和栈空间（栈空间实际从堆中分配）
         ++s_fiber_count;                        // 协程数增加
-                                                // 在堆中分配协程栈空间
-        m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
-        m_stack = StackAllocator::Alloc(m_stacksize);
+        m_asmContext = s_use_asm_context;      // 切换方式在创建时确定，resume/yield都用同一种
 
-        if(getcontext(&m_ctx)) {            // 获取上下文，放入成员m_ctx中
-            SYLAR_ASSERT2(false, "getcontext");
+        // 共享栈要在调度协程的栈上拷贝，只有由调度协程resume的协程可以使用；
+        // 栈在第一次resume时才绑定，上下文也推迟到那时初始化
+        m_sharedStack = shared_stack && run_in_scheduler && s_use_shared_stack && HasSharedStack();
+        if(!m_sharedStack) {
+                                                // 在堆中分配协程栈空间
+            m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
+            m_allocator = s_stack_allocator;   // 记录分配器，切换配置后已有的栈仍由原分配器释放
+            m_stack = m_allocator->alloc(m_stacksize);
+            initContext();
         }
-        m_ctx.uc_link          = nullptr;
-        m_ctx.uc_stack.ss_sp   = m_stack;
-        m_ctx.uc_stack.ss_size = m_stacksize;
-
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);
         SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber() id = " << m_id;
     }
 
@@ -80,9 +621,15 @@ namespace sylar {
 //                                  << " total=" << s_fiber_count;
 
         --s_fiber_count;
-        if(m_stack) {                           // 有栈，说明是子协程，需要确保子协程一定是结束状态
+        // 还没运行就被释放的协程，或者主协程，局部存储在这里销毁
+        clearLocals();
+        if(m_sharedStack) {                     // 共享栈协程，结束时已经在resume中解除了绑定
+            SYLAR_ASSERT(m_state == TERM || m_state == READY);
+            SYLAR_ASSERT2(!m_shared, "shared stack fiber destroyed while suspended");
+            free(m_saved);
+        } else if(m_stack) {                    // 有栈，说明是子协程，需要确保子协程一定是结束状态
             SYLAR_ASSERT(m_state == TERM);
-            StackAllocator::Dealloc(m_stack, m_stacksize);
+            m_allocator->dealloc(m_stack, m_stacksize);
             SYLAR_LOG_DEBUG(g_logger) << "Dealloc stack, id = " << m_id;
         } else {                                // 无栈，说明是主协程
             SYLAR_ASSERT(!m_cb);                // 主协程不应该有回调
@@ -99,21 +646,52 @@ namespace sylar {
     }
 
     // 为了简化状态管理，强制只有TERM状态的协程才可以重置，但其实刚创建好但没执行过的协程也应该允许重置的
-    void Fiber::reset(std::function<void()>cb){
-        SYLAR_ASSERT(m_stack);                  // 子协程才能重置状态
+    void Fiber::reset(Task cb){
+        SYLAR_ASSERT(m_stack || m_sharedStack); // 子协程才能重置状态
         SYLAR_ASSERT(m_state == TERM);
 
-        m_cb = cb;
-        if(getcontext(&m_ctx)){
-            SYLAR_ASSERT2(false,"getcontext");
+        m_cb = std::move(cb);
+        clearLocals();
+        if(!m_sharedStack) {                    // 共享栈协程下次resume时重新绑定栈
+            initContext();
         }
+        m_state = READY;
+    }
 
-        m_ctx.uc_link          = nullptr;
-        m_ctx.uc_stack.ss_sp   = m_stack;
-        m_ctx.uc_stack.ss_size = m_stacksize;
+    void Fiber::setLocal(uint32_t slot, void* value, void (*destroy)(void*)) {
+        if(slot >= m_locals.size()) {
+            if(!value) {
+                return;
+            }
+            m_locals.resize(slot + 1);
+        }
+        // 先换上新值再销毁旧值，旧值的析构函数里再访问这个槽位也是安全的
+        LocalSlot old = m_locals[slot];
+        m_locals[slot].value   = value;
+        m_locals[slot].destroy = destroy;
+        if(old.value) {
+            old.destroy(old.value);
+        }
+    }
 
-        makecontext(&m_ctx, &MainFunc, 0);
-        m_state = READY;
+    void Fiber::clearLocals() {
+        // 析构函数里可能又设置了别的槽位，循环到全部清空为止；只清值不释放数组，复用的协程不必重新分配
+        bool again = true;
+        while(again) {
+            again = false;
+            for(size_t i = 0; i < m_locals.size(); ++i) {
+                LocalSlot old = m_locals[i];
+                if(old.value) {
+                    m_locals[i] = LocalSlot();
+                    old.destroy(old.value);
+                    again = true;
+                }
+            }
+        }
+    }
+
+    uint32_t Fiber::AllocLocalSlot() {
+        return s_local_slots++;
     }
 
     //让出
@@ -121,36 +699,45 @@ namespace sylar {
         /// 协程运行完之后会自动yield一次，用于回到主协程，此时状态已为结束状态
         SYLAR_ASSERT(m_state == RUNNING || m_state == TERM)
         SetThis(t_threadFiber.get());
-        if (m_state != TERM) {
-            m_state = READY;
+        if (t_switch_trace) {
+            t_switch_trace->fiberId.store(0, std::memory_order_relaxed);
+            t_switch_trace->seq.store(t_switch_trace->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
         }
+        // 状态保持RUNNING，直到切换完成回到resume()中才改为READY，
+        // 否则协程在切出之前把自己交给其他线程调度时，其他线程可能在上下文保存完之前就resume它
 
         // 如果协程参与调度器调度，那么应该和调度器的主协程进行swap，而不是线程主协程
         if (m_runInSchedule) {
-            if (swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx)) {
-                SYLAR_ASSERT2(false, "swapcontext");
-            }
+            SwapContext(this, Scheduler::GetMainFiber(), m_asmContext);
         }else {
-            if (swapcontext(&m_ctx, &t_threadFiber->m_ctx)) {
-                SYLAR_ASSERT2(false, "swapcontext");
-            }
+            SwapContext(this, t_threadFiber.get(), m_asmContext);
         }
     }
     //唤醒
     void Fiber::resume() {
         SYLAR_ASSERT(m_state != RUNNING && m_state != TERM);
+        if(m_sharedStack) {
+            // 此时运行在调度协程自己的栈上，可以放心改写共享栈
+            switchInShared();
+        }
         SetThis(this);                        // 保存当前协程
         m_state = RUNNING;
+        if(t_switch_trace) {
+            t_switch_trace->fiberId.store(m_id, std::memory_order_relaxed);
+            t_switch_trace->seq.store(t_switch_trace->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
 
         // 如果协程参与调度器调度，那么应该和调度器的主协程进行swap，而不是线程主协程
         if(m_runInSchedule) {
-            if(swapcontext(&(Scheduler::GetMainFiber()->m_ctx),&m_ctx)) {
-                SYLAR_ASSERT2(false, "swapcontext");
-            }
+            SwapContext(Scheduler::GetMainFiber(), this, m_asmContext);
         } else {
-            if(swapcontext(&t_threadFiber->m_ctx, &m_ctx)) {
-                SYLAR_ASSERT2(false, "swapcontext");
-            }
+            SwapContext(t_threadFiber.get(), this, m_asmContext);
+        }
+        // 协程已经yield回来，上下文保存完毕，此时才允许其他线程再次resume它
+        if(m_state == RUNNING) {
+            m_state = READY;
+        } else if(m_sharedStack) {
+            releaseShared();
         }
     }
 
@@ -171,6 +758,18 @@ namespace sylar {
         return t_fiber->shared_from_this();           // 返回主协程的智能指针
     }
 
+    Fiber* Fiber::GetThisPtr() {
+        if(SYLAR_LIKELY(t_fiber)) {
+            return t_fiber;
+        }
+        GetThis();
+        return t_fiber;
+    }
+
+    void Fiber::SetSwitchTrace(SwitchTrace* trace) {
+        t_switch_trace = trace;
+    }
+
     //总协程数
     uint64_t Fiber::TotalFibers() {
         return s_fiber_count;
@@ -184,6 +783,7 @@ namespace sylar {
 
         cur->m_cb();
         cur->m_cb    = nullptr;         //使用functional包装的回调，如果bind一些参数，会使引用计数加一，应当指向nullptr
+        cur->clearLocals();             // 局部存储随协程结束销毁，析构函数仍在本协程中执行
         cur->m_state = TERM;
 
 //     } catch (std::exception& e) {
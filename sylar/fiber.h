@@ -7,11 +7,19 @@
 
 #include <memory>
 #include <functional>
+#include <atomic>
+#include <vector>
+#include <utility>
 #include <ucontext.h>
 #include "thread.h"
+#include "task.h"
+#include "noncopyable.h"
 
 namespace sylar {
 
+class StackAllocator;
+struct SharedStack;
+
 class Fiber : public std::enable_shared_from_this<Fiber> {
 public:
     typedef std::shared_ptr<Fiber> ptr;
@@ -37,19 +45,64 @@ public:
      * @param[in] cb 协程入口函数
      * @param[in] stacksize 栈大小
      * @param[in] run_in_scheduler 本协程是否参与调度器调度，默认为true
+     * @param[in] shared_stack 开启fiber.shared_stack时是否在共享栈上运行，只对参与调度器调度的协程生效；
+     *            切换频繁、常驻的协程(如调度器的idle协程)传false，使用独立的栈
      */
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool run_in_scheduler = true);
+    Fiber(Task cb, size_t stacksize = 0, bool run_in_scheduler = true, bool shared_stack = true);
     ~Fiber();
 
     //重置协程的函数，重置协程状态和入口函数，复用栈空间，不重新创建栈
-    void reset(std::function<void()>cb);
+    void reset(Task cb);
     //让出
     void yield();
     //唤醒
     void resume();
 
+    /**
+     * @brief 线程上协程切换的记录
+     * @details 看门狗据此判断线程是否被某个协程长时间占住：切换次数长时间不变且正在运行某个协程
+     */
+    struct SwitchTrace {
+        std::atomic<uint64_t> seq{0};       // 切换次数
+        std::atomic<uint64_t> fiberId{0};   // 正在运行的协程id，0表示已切回调度协程
+    };
+
     State getState() { return m_state; }
     uint64_t getId() const { return m_id; }
+
+    /**
+     * @brief 是否在共享栈上运行
+     * @attention 共享栈协程挂起期间，它的栈内容可能已被换出到保存区，原地址上是别的协程的栈。
+     *            因此不能把它栈上对象的地址交给其他协程或内核在它挂起期间读写，跨协程传递的数据要放在堆上
+     */
+    bool isSharedStack() const { return m_sharedStack; }
+
+    /**
+     * @brief 共享栈协程绑定的线程id，第一次运行时绑定，结束后解除；其余协程为-1
+     * @details 栈上的内容只能恢复到原来的地址，也就是绑定线程的那个共享栈上，调度器据此把它投递回该线程
+     */
+    int getBoundThread() const { return m_boundThread; }
+
+    /**
+     * @brief 固定或解除固定本协程所在的共享栈，只能在本协程运行时调用，独立栈的协程什么也不做
+     * @details 固定期间本协程挂起时栈内容留在原处，其他协程改用别的共享栈，
+     *          用于把栈上对象的地址交给其他线程、挂起等待它处理完的场合，恢复运行后解除固定
+     */
+    void setStackPinned(bool v);
+
+    /**
+     * @brief 取协程局部存储中slot槽位的值，未设置返回nullptr
+     */
+    void* getLocal(uint32_t slot) const {
+        return slot < m_locals.size() ? m_locals[slot].value : nullptr;
+    }
+
+    /**
+     * @brief 设置slot槽位的值，原有的值用它自己的destroy销毁
+     * @param[in] value 值，nullptr表示清除
+     * @param[in] destroy 协程结束或重置时销毁value的函数
+     */
+    void setLocal(uint32_t slot, void* value, void (*destroy)(void*));
 public:
     //设置当前正在运行的协程，即设置线程局部变量t_fiber的值
     static void SetThis(Fiber* f);
@@ -69,14 +122,129 @@ public:
     static void MainFunc();
     //获取当前协程id
     static uint64_t GetFiberId();
+    //当前平台是否支持汇编实现的上下文切换
+    static bool HasAsmContext();
+    //当前平台是否支持共享栈模式，需要能取到切出时保存的栈顶
+    static bool HasSharedStack();
+    /**
+     * @brief 绑定在当前线程共享栈上、还没有结束的协程数
+     * @details 不为0时线程不能退出，否则这些协程再也无法恢复
+     */
+    static uint64_t SharedStackFibers();
+    /**
+     * @brief 返回当前线程正在执行的协程的裸指针，不增加引用计数
+     * @details 同GetThis()，线程还没有协程时先创建主协程
+     */
+    static Fiber* GetThisPtr();
+    /**
+     * @brief 分配一个协程局部存储的槽位，进程内槽位号只增不减
+     */
+    static uint32_t AllocLocalSlot();
+    /**
+     * @brief 设置当前线程协程切换的记录位置，nullptr为不记录
+     * @details 调度线程进入调度循环时设置，resume/yield各做一次relaxed写
+     */
+    static void SetSwitchTrace(SwitchTrace* trace);
+private:
+    //销毁全部协程局部存储，协程结束、重置和析构时调用
+    void clearLocals();
+    //按协程创建时选定的上下文切换方式初始化入口上下文
+    void initContext();
+    //从当前协程切换到to协程，from为当前协程
+    static void SwapContext(Fiber* from, Fiber* to, bool use_asm);
+    //共享栈模式下切入之前，绑定共享栈或把本协程保存的栈内容拷回共享栈
+    void switchInShared();
+    //把本协程在共享栈上用到的部分拷贝到自己的保存区，腾出共享栈给别的协程
+    void saveStack();
+    //协程结束后解除与共享栈的绑定，释放保存区
+    void releaseShared();
+    //切出时保存的栈顶
+    void* savedStackPointer();
 private:
     uint64_t              m_id = 0;                   // 协程id
     uint32_t              m_stacksize = 0;            // 协程栈大小
-    State                 m_state = READY;            // 协程状态
-    ucontext_t            m_ctx;                      // 协程上下文
+    std::atomic<State>    m_state{READY};             // 协程状态，调度线程会跨线程读取
+    ucontext_t            m_ctx;                      // 协程上下文(ucontext方式)
+    void*                 m_sp = nullptr;             // 协程上下文(汇编方式)，保存切出时的栈顶
+    bool                  m_asmContext = false;       // 是否使用汇编实现的上下文切换
     void*                 m_stack = nullptr;          // 协程栈地址
-    std::function<void()> m_cb;                       // 协程回到函数入口
+    StackAllocator*       m_allocator = nullptr;      // 分配协程栈的分配器，释放时必须用同一个
+    Task                  m_cb;                       // 协程回到函数入口
     bool                  m_runInSchedule;            // 是否由协程d
+    bool                  m_sharedStack = false;      // 是否在共享栈上运行
+    SharedStack*          m_shared = nullptr;         // 绑定的共享栈，运行期间m_stack指向它
+    int                   m_boundThread = -1;         // 绑定的线程id
+    char*                 m_saved = nullptr;          // 被别的协程占用共享栈时，栈内容的保存区
+    uint32_t              m_savedSize = 0;            // 保存区中的字节数
+    uint32_t              m_savedCap = 0;             // 保存区容量
+
+    /**
+     * @brief 协程局部存储的一个槽位
+     */
+    struct LocalSlot {
+        void* value = nullptr;
+        void (*destroy)(void*) = nullptr;
+    };
+    std::vector<LocalSlot> m_locals;                  // 协程局部存储，按槽位号下标访问
+};
+
+/**
+ * @brief 协程局部变量
+ * @details 每个协程各有一份，协程在调度线程间迁移后取到的仍是自己的那份，线程局部变量做不到这一点。
+ *          构造时分配固定的槽位号，存取只是按下标访问当前协程的数组，不查表。
+ *          值在协程结束(TERM)时销毁，调度器复用协程执行下一个任务时不会看到上一个任务留下的值。
+ *          在协程外访问的是线程主协程的那份，线程退出时销毁
+ * @attention 通常定义为全局或静态变量；对象析构后槽位不回收，已存入的值仍会在协程结束时正常销毁
+ */
+template<class T>
+class FiberLocal : Noncopyable {
+public:
+    FiberLocal()
+        : m_slot(Fiber::AllocLocalSlot()) {
+    }
+
+    /**
+     * @brief 当前协程的值，未设置返回nullptr
+     */
+    T* get() const {
+        return static_cast<T*>(Fiber::GetThisPtr()->getLocal(m_slot));
+    }
+
+    /**
+     * @brief 设置当前协程的值
+     */
+    T& set(T value) {
+        T* p = new T(std::move(value));
+        Fiber::GetThisPtr()->setLocal(m_slot, p, &Destroy);
+        return *p;
+    }
+
+    /**
+     * @brief 销毁当前协程的值
+     */
+    void reset() {
+        Fiber::GetThisPtr()->setLocal(m_slot, nullptr, nullptr);
+    }
+
+    /**
+     * @brief 当前协程的值，未设置时先默认构造一个
+     */
+    T& operator*() {
+        T* p = get();
+        return p ? *p : set(T());
+    }
+
+    T* operator->() {
+        return &**this;
+    }
+
+private:
+    static void Destroy(void* p) {
+        delete static_cast<T*>(p);
+    }
+
+private:
+    uint32_t m_slot;
 };
 
 }
@@ -0,0 +1,277 @@
+/**
+  ********************************************************
+  * @file        : fiber_sync.cc
+  * @author      : zgys
+  * @brief       : 协程同步原语
+  * @attention   : None
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#include "fiber_sync.h"
+#include "scheduler.h"
+#include "log.h"
+
+namespace sylar {
+
+    FiberWaiter FiberWaiter::Current() {
+        FiberWaiter waiter;
+        waiter.scheduler = Scheduler::GetThis();
+        SYLAR_ASSERT2(waiter.scheduler, "fiber sync primitives must wait inside a scheduler");
+        waiter.fiber = Fiber::GetThis();
+        return waiter;
+    }
+
+    void FiberWaiter::wake() {
+        scheduler->schedule(fiber);
+        fiber.reset();
+    }
+
+    /**
+     * @brief 把自己加入等待队列后挂起，被唤醒时等待的资源已经转交给本协程
+     * @details 唤醒者可能在本协程真正切出之前就把它加入调度，调度器会跳过仍处于RUNNING状态的协程
+     */
+    static void SuspendOn(std::deque<FiberWaiter>& waiters, Spinlock::Lock& lock) {
+        waiters.push_back(FiberWaiter::Current());
+        lock.unlock();
+        Fiber::GetThis()->yield();
+    }
+
+    void FiberMutex::lockSlow() {
+        bool woken = false;
+        while (true) {
+            Spinlock::Lock lock(m_waitMutex);
+            uint32_t s = m_state.load(std::memory_order_relaxed);
+            if (!(s & LOCKED)) {
+                // 锁空闲就直接抢，被唤醒的协程和新来的协程公平竞争，避免每次解锁都要切换协程的锁护航
+                uint32_t next = woken ? ((s | LOCKED) & ~WOKEN) : (s | LOCKED);
+                if (m_state.compare_exchange_weak(s, next, std::memory_order_acquire)) {
+                    return;
+                }
+                continue;
+            }
+            uint32_t next = woken ? ((s | WAITERS) & ~WOKEN) : (s | WAITERS);
+            if (next != s && !m_state.compare_exchange_weak(s, next, std::memory_order_relaxed)) {
+                continue;
+            }
+            // 被唤醒后又没抢到的协程排回队首，保持先来先得
+            if (woken) {
+                m_waiters.push_front(FiberWaiter::Current());
+            } else {
+                m_waiters.push_back(FiberWaiter::Current());
+            }
+            lock.unlock();
+            Fiber::GetThis()->yield();
+            woken = true;
+        }
+    }
+
+    void FiberMutex::unlockSlow() {
+        FiberWaiter waiter;
+        bool wake = false;
+        {
+            Spinlock::Lock lock(m_waitMutex);
+            while (true) {
+                uint32_t s = m_state.load(std::memory_order_relaxed);
+                uint32_t next = s & ~LOCKED;
+                // 已经有一个被唤醒还没运行的协程时不再唤醒，它运行后会去抢锁
+                wake = !(s & WOKEN) && !m_waiters.empty();
+                if (wake) {
+                    next |= WOKEN;
+                    if (m_waiters.size() == 1) {
+                        next &= ~WAITERS;
+                    }
+                }
+                if (m_state.compare_exchange_weak(s, next, std::memory_order_release)) {
+                    break;
+                }
+            }
+            if (wake) {
+                waiter = m_waiters.front();
+                m_waiters.pop_front();
+            }
+        }
+        if (wake) {
+            waiter.wake();
+        }
+    }
+
+    void FiberRWMutex::lockSlow(bool writer) {
+        bool woken = false;
+        while (true) {
+            Spinlock::Lock lock(m_waitMutex);
+            uint32_t s = m_state.load(std::memory_order_relaxed);
+            if (writer) {
+                if ((s & ~WAITERS) == 0) {
+                    if (m_state.compare_exchange_weak(s, s | WRITER, std::memory_order_acquire)) {
+                        return;
+                    }
+                    continue;
+                }
+            } else if (!(s & WRITER) && m_writers.empty()) {
+                // 没有写者持有或等待时读者可以直接进入
+                if (m_state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) {
+                    return;
+                }
+                continue;
+            }
+            if (!(s & WAITERS) && !m_state.compare_exchange_weak(s, s | WAITERS, std::memory_order_relaxed)) {
+                continue;
+            }
+            std::deque<FiberWaiter>& waiters = writer ? m_writers : m_readers;
+            if (woken) {
+                waiters.push_front(FiberWaiter::Current());
+            } else {
+                waiters.push_back(FiberWaiter::Current());
+            }
+            lock.unlock();
+            Fiber::GetThis()->yield();
+            woken = true;
+        }
+    }
+
+    void FiberRWMutex::unlockSlow() {
+        std::vector<FiberWaiter> wake;
+        {
+            Spinlock::Lock lock(m_waitMutex);
+            uint32_t next = 0;
+            while (true) {
+                uint32_t s = m_state.load(std::memory_order_relaxed);
+                next = (s & WRITER) ? (s & ~WRITER) : s - 1;
+                if (m_state.compare_exchange_weak(s, next, std::memory_order_release)) {
+                    break;
+                }
+            }
+            // 锁完全空闲时唤醒等待者重新抢锁：写者优先，只唤醒一个；没有写者则唤醒全部读者
+            if ((next & ~WAITERS) == 0 && (next & WAITERS)) {
+                if (!m_writers.empty()) {
+                    wake.push_back(m_writers.front());
+                    m_writers.pop_front();
+                } else {
+                    wake.assign(m_readers.begin(), m_readers.end());
+                    m_readers.clear();
+                }
+                if (m_readers.empty() && m_writers.empty()) {
+                    m_state.fetch_and(~WAITERS, std::memory_order_relaxed);
+                }
+            }
+        }
+        for (auto& w : wake) {
+            w.wake();
+        }
+    }
+
+    bool FiberSemaphore::tryWait() {
+        uint32_t s = m_state.load(std::memory_order_relaxed);
+        while ((s & ~WAITERS) != 0) {
+            if (m_state.compare_exchange_weak(s, s - 1, std::memory_order_acquire)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void FiberSemaphore::waitSlow() {
+        Spinlock::Lock lock(m_waitMutex);
+        while (true) {
+            uint32_t s = m_state.load(std::memory_order_relaxed);
+            if ((s & ~WAITERS) != 0) {
+                // notify时有等待者会直接交接，所以有计数时一定没有等待者
+                if (m_state.compare_exchange_weak(s, s - 1, std::memory_order_acquire)) {
+                    return;
+                }
+                continue;
+            }
+            if (!(s & WAITERS) && !m_state.compare_exchange_weak(s, s | WAITERS, std::memory_order_relaxed)) {
+                continue;
+            }
+            break;
+        }
+        SuspendOn(m_waiters, lock);
+    }
+
+    void FiberSemaphore::notifySlow() {
+        FiberWaiter waiter;
+        {
+            Spinlock::Lock lock(m_waitMutex);
+            while (true) {
+                uint32_t s = m_state.load(std::memory_order_relaxed);
+                if (!(s & WAITERS)) {
+                    if (m_state.compare_exchange_weak(s, s + 1, std::memory_order_release)) {
+                        return;
+                    }
+                    continue;
+                }
+                waiter = m_waiters.front();
+                m_waiters.pop_front();
+                // 计数直接交给被唤醒的协程，计数保持为0
+                if (m_waiters.empty()) {
+                    m_state.store(0, std::memory_order_release);
+                }
+                break;
+            }
+        }
+        waiter.wake();
+    }
+
+    void FiberCondition::wait(FiberMutex& mutex) {
+        {
+            Spinlock::Lock lock(m_waitMutex);
+            m_waiters.push_back(FiberWaiter::Current());
+        }
+        // 先入队再解锁，解锁之后的notify一定能看到本协程
+        mutex.unlock();
+        Fiber::GetThis()->yield();
+        mutex.lock();
+    }
+
+    void FiberCondition::notifyOne() {
+        FiberWaiter waiter;
+        {
+            Spinlock::Lock lock(m_waitMutex);
+            if (m_waiters.empty()) {
+                return;
+            }
+            waiter = m_waiters.front();
+            m_waiters.pop_front();
+        }
+        waiter.wake();
+    }
+
+    void FiberCondition::notifyAll() {
+        std::deque<FiberWaiter> waiters;
+        {
+            Spinlock::Lock lock(m_waitMutex);
+            waiters.swap(m_waiters);
+        }
+        for (auto& w : waiters) {
+            w.wake();
+        }
+    }
+
+    void WaitGroup::add(int64_t n) {
+        std::deque<FiberWaiter> waiters;
+        {
+            Spinlock::Lock lock(m_waitMutex);
+            int64_t count = m_count.load(std::memory_order_relaxed) + n;
+            SYLAR_ASSERT2(count >= 0, "WaitGroup count < 0");
+            m_count.store(count, std::memory_order_relaxed);
+            if (count == 0) {
+                waiters.swap(m_waiters);
+            }
+        }
+        for (auto& w : waiters) {
+            w.wake();
+        }
+    }
+
+    void WaitGroup::wait() {
+        {
+            Spinlock::Lock lock(m_waitMutex);
+            if (m_count.load(std::memory_order_relaxed) == 0) {
+                return;
+            }
+            m_waiters.push_back(FiberWaiter::Current());
+        }
+        Fiber::GetThis()->yield();
+    }
+}
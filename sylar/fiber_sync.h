@@ -0,0 +1,306 @@
+/**
+  ********************************************************
+  * @file        : fiber_sync.h
+  * @author      : zgys
+  * @brief       : 协程同步原语
+  * @attention   : 只能在调度器中运行的协程里等待，等待时只挂起当前协程，不阻塞线程
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#ifndef __SYLAR_FIBER_SYNC_H__
+#define __SYLAR_FIBER_SYNC_H__
+
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <stdint.h>
+#include "fiber.h"
+#include "mutex.h"
+#include "noncopyable.h"
+#include "macro.h"
+
+namespace sylar {
+
+    class Scheduler;
+
+    /**
+     * @brief 等待中的协程和唤醒它的调度器
+     */
+    struct FiberWaiter {
+        Scheduler* scheduler = nullptr;
+        Fiber::ptr fiber;
+
+        /**
+         * @brief 记录当前协程和当前调度器
+         */
+        static FiberWaiter Current();
+
+        /**
+         * @brief 通过调度器把协程重新加入调度
+         */
+        void wake();
+    };
+
+    /**
+     * @brief 协程互斥锁
+     * @details 状态字包括已上锁、有协程在等待、已唤醒一个等待者三个标志位。无竞争时加锁/解锁各只是一次CAS；
+     *          有竞争时等待的协程挂起到等待队列中，解锁时通过Scheduler::schedule唤醒队首的协程重新抢锁，
+     *          同一时刻最多只有一个被唤醒还未抢锁的协程
+     */
+    class FiberMutex : Noncopyable {
+    public:
+        /// 局部锁
+        typedef ScopedLockImpl<FiberMutex> Lock;
+
+        /**
+         * @brief 加锁，锁被占用时挂起当前协程
+         */
+        void lock() {
+            uint32_t expected = 0;
+            if (SYLAR_LIKELY(m_state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire))) {
+                return;
+            }
+            lockSlow();
+        }
+
+        /**
+         * @brief 尝试加锁，不等待
+         */
+        bool tryLock() {
+            uint32_t expected = 0;
+            return m_state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire);
+        }
+
+        /**
+         * @brief 解锁，有等待者时唤醒等待最久的协程
+         */
+        void unlock() {
+            uint32_t expected = LOCKED;
+            if (SYLAR_LIKELY(m_state.compare_exchange_strong(expected, 0, std::memory_order_release))) {
+                return;
+            }
+            unlockSlow();
+        }
+
+    private:
+        void lockSlow();
+        void unlockSlow();
+
+    private:
+        static const uint32_t LOCKED  = 1;
+        static const uint32_t WAITERS = 2;
+        static const uint32_t WOKEN   = 4;
+
+        /// 锁状态 LOCKED | WAITERS | WOKEN
+        std::atomic<uint32_t>   m_state{0};
+        /// 保护等待队列
+        Spinlock                m_waitMutex;
+        /// 等待加锁的协程
+        std::deque<FiberWaiter> m_waiters;
+    };
+
+    /**
+     * @brief 协程读写锁
+     * @details 状态字低位是持有读锁的协程数，另有写锁位和等待位。无竞争时加锁/解锁只是一次CAS；
+     *          写锁优先，有写者在等待时新来的读者也要等待，避免写者饿死。
+     *          锁完全释放时优先唤醒一个写者，没有写者等待时唤醒全部读者，被唤醒的协程重新抢锁
+     */
+    class FiberRWMutex : Noncopyable {
+    public:
+        /// 局部读锁
+        typedef ReadScopedLockImpl<FiberRWMutex> ReadLock;
+        /// 局部写锁
+        typedef WriteScopedLockImpl<FiberRWMutex> WriteLock;
+
+        /**
+         * @brief 加读锁
+         */
+        void rdlock() {
+            uint32_t s = m_state.load(std::memory_order_relaxed);
+            if (SYLAR_LIKELY(!(s & (WRITER | WAITERS))
+                             && m_state.compare_exchange_strong(s, s + 1, std::memory_order_acquire))) {
+                return;
+            }
+            lockSlow(false);
+        }
+
+        /**
+         * @brief 加写锁
+         */
+        void wrlock() {
+            uint32_t expected = 0;
+            if (SYLAR_LIKELY(m_state.compare_exchange_strong(expected, WRITER, std::memory_order_acquire))) {
+                return;
+            }
+            lockSlow(true);
+        }
+
+        /**
+         * @brief 解锁，读锁写锁都用这个接口
+         */
+        void unlock() {
+            uint32_t s = m_state.load(std::memory_order_relaxed);
+            if (SYLAR_LIKELY(!(s & WAITERS))) {
+                uint32_t next = (s & WRITER) ? 0 : s - 1;
+                if (m_state.compare_exchange_strong(s, next, std::memory_order_release)) {
+                    return;
+                }
+            }
+            unlockSlow();
+        }
+
+    private:
+        void lockSlow(bool writer);
+        void unlockSlow();
+
+    private:
+        static const uint32_t WRITER  = 1u << 30;
+        static const uint32_t WAITERS = 1u << 31;
+
+        /// 读者数 | WRITER | WAITERS
+        std::atomic<uint32_t>   m_state{0};
+        /// 保护等待队列
+        Spinlock                m_waitMutex;
+        /// 等待读锁的协程
+        std::deque<FiberWaiter> m_readers;
+        /// 等待写锁的协程
+        std::deque<FiberWaiter> m_writers;
+    };
+
+    /**
+     * @brief 协程信号量
+     * @details 状态字低位是可用的计数，最高位表示有协程在等待。无竞争时wait/notify各只是一次CAS；
+     *          notify时有等待者则直接把这个计数交给等待最久的协程
+     */
+    class FiberSemaphore : Noncopyable {
+    public:
+        /**
+         * @brief 构造函数
+         * @param[in] count 初始计数
+         */
+        explicit FiberSemaphore(uint32_t count = 0)
+            : m_state(count) {
+        }
+
+        /**
+         * @brief 获取信号量，计数为0时挂起当前协程
+         */
+        void wait() {
+            uint32_t s = m_state.load(std::memory_order_relaxed);
+            if (SYLAR_LIKELY(s != 0 && !(s & WAITERS)
+                             && m_state.compare_exchange_strong(s, s - 1, std::memory_order_acquire))) {
+                return;
+            }
+            waitSlow();
+        }
+
+        /**
+         * @brief 尝试获取信号量，不等待
+         */
+        bool tryWait();
+
+        /**
+         * @brief 释放信号量
+         */
+        void notify() {
+            uint32_t s = m_state.load(std::memory_order_relaxed);
+            if (SYLAR_LIKELY(!(s & WAITERS)
+                             && m_state.compare_exchange_strong(s, s + 1, std::memory_order_release))) {
+                return;
+            }
+            notifySlow();
+        }
+
+        /**
+         * @brief 当前可用的计数
+         */
+        uint32_t getCount() const { return m_state.load(std::memory_order_relaxed) & ~WAITERS; }
+
+    private:
+        void waitSlow();
+        void notifySlow();
+
+    private:
+        static const uint32_t WAITERS = 1u << 31;
+
+        /// 计数 | WAITERS
+        std::atomic<uint32_t>   m_state;
+        /// 保护等待队列
+        Spinlock                m_waitMutex;
+        /// 等待的协程
+        std::deque<FiberWaiter> m_waiters;
+    };
+
+    /**
+     * @brief 协程条件变量，配合FiberMutex使用
+     */
+    class FiberCondition : Noncopyable {
+    public:
+        /**
+         * @brief 释放mutex并挂起当前协程，被唤醒后重新加锁再返回
+         * @param[in] mutex 调用者已持有的锁
+         * @attention 和pthread条件变量一样可能被其他协程抢先改变条件，调用者应在循环中检查条件
+         */
+        void wait(FiberMutex& mutex);
+
+        /**
+         * @brief 唤醒一个等待的协程
+         */
+        void notifyOne();
+
+        /**
+         * @brief 唤醒全部等待的协程
+         */
+        void notifyAll();
+
+    private:
+        /// 保护等待队列
+        Spinlock                m_waitMutex;
+        /// 等待的协程
+        std::deque<FiberWaiter> m_waiters;
+    };
+
+    /**
+     * @brief 协程等待组
+     * @details 计数由add增加、done减少，wait挂起当前协程直到计数归零；用于父协程等待一批子协程结束。
+     *          计数在等待队列的锁内修改，归零时由最后一个done的协程直接唤醒等待者，
+     *          等待者返回后即可销毁WaitGroup，done在解锁之后不会再访问它
+     */
+    class WaitGroup : Noncopyable {
+    public:
+        explicit WaitGroup(int64_t count = 0)
+            : m_count(count) {}
+
+        /**
+         * @brief 增加计数，n可以为负数；计数归零时唤醒全部等待者
+         * @attention 计数小于0时断言失败
+         */
+        void add(int64_t n = 1);
+
+        /**
+         * @brief 计数减一
+         */
+        void done() { add(-1); }
+
+        /**
+         * @brief 挂起当前协程直到计数归零，计数已经为0时直接返回
+         * @attention 只能在调度器的协程中调用
+         */
+        void wait();
+
+        /**
+         * @brief 返回当前计数
+         */
+        int64_t getCount() const { return m_count.load(std::memory_order_relaxed); }
+
+    private:
+        /// 保护计数的修改和等待队列
+        Spinlock                m_waitMutex;
+        /// 未完成的数量
+        std::atomic<int64_t>    m_count;
+        /// 等待的协程
+        std::deque<FiberWaiter> m_waiters;
+    };
+}
+
+#endif //SYLAR_FIBER_SYNC_H
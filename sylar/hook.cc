@@ -10,13 +10,19 @@
 
 #include "hook.h"
 #include <dlfcn.h>
+#include <linux/io_uring.h>
+#include <sys/stat.h>
 
+#include "cancel.h"
 #include "config.h"
 #include "log.h"
 #include "fiber.h"
 #include "iomanager.h"
 #include "fdmanager.h"
 #include "macro.h"
+#include "offload.h"
+#include <algorithm>
+#include <atomic>
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 namespace sylar {
@@ -24,6 +30,10 @@ namespace sylar {
     static sylar::ConfigVar<int>::ptr g_tcp_connect_timeout =
             sylar::Config::Lookup("tcp.connect.timeout", 5000, "tcp connect timeout");
 
+    // hook开启时，普通文件的读写和fsync交给卸载线程池执行，只挂起当前协程
+    static sylar::ConfigVar<bool>::ptr g_offload_file_io =
+            sylar::Config::Lookup("offload.file_io", true, "offload hooked regular file io to the offload pool");
+
     // 实现的hook是线程级的，所以需要线程局部变量来保存
     //1：静态局部变量首先是静态变量，所以全局共享，其他线程是共享的
     //2：静态局部变量在第一次调用该函数的时候被初始化，然后其他线程调用该函数的时候直接操作该变量。
@@ -44,6 +54,10 @@ namespace sylar {
     XX(recvmsg) \
     XX(write) \
     XX(writev) \
+    XX(pread) \
+    XX(pwrite) \
+    XX(fsync) \
+    XX(fdatasync) \
     XX(send) \
     XX(sendto) \
     XX(sendmsg) \
@@ -64,11 +78,16 @@ namespace sylar {
     }
 
     static uint64_t s_connect_timeout = -1;
+    static bool s_offload_file_io = true;
 
     struct _HookIniter {
         _HookIniter() {
             hook_init();
             s_connect_timeout = g_tcp_connect_timeout->getValue();
+            s_offload_file_io = g_offload_file_io->getValue();
+            g_offload_file_io->addListener([](const bool &old_value, const bool &new_value) {
+                s_offload_file_io = new_value;
+            });
 
             g_tcp_connect_timeout->addListener([](const int &old_value, const int &new_value) {
                 SYLAR_LOG_INFO(g_logger) << "tcp connect timeout changed from "
@@ -92,9 +111,114 @@ namespace sylar {
 }
 
 struct timer_info {
-    int cancelled = 0;
+    // 超时定时器和取消上下文都可能唤醒等待的协程，先到的那个的原因生效
+    std::atomic<int> cancelled{0};
+
+    /**
+     * @brief 记录唤醒的原因
+     * @details 唤醒者不管是不是第一个都要调用cancelEvent：先到的那个可能落在两次等待之间，
+     *          当时没有注册事件，cancelEvent没有作用
+     * @return 是否是第一个
+     */
+    bool cancel(int error) {
+        int expected = 0;
+        return cancelled.compare_exchange_strong(expected, error);
+    }
 };
 
+/**
+ * @brief 在当前协程的取消上下文上登记：取消时记下原因并通过cancelEvent唤醒等在fd上的协程
+ * @details 在addEvent成功之后、挂起之前登记，上下文已经取消时直接唤醒，挂起后马上恢复。
+ *          cancel在锁外执行回调，上一次等待的回调可能在协程已经恢复之后才执行，所以只要上下文取消了
+ *          就要cancelEvent，不能只看自己是不是第一个设置原因的
+ * @return 回调的id，恢复后用它删除回调；没有上下文或已经取消返回0
+ */
+static uint64_t watch_cancel(sylar::CancelContext *cctx, const std::shared_ptr<timer_info> &tinfo,
+                             sylar::IOManager *iom, int fd, uint32_t event) {
+    if (!cctx) {
+        return 0;
+    }
+    std::weak_ptr<timer_info> winfo(tinfo);
+    uint64_t id = cctx->addCallback([winfo, iom, fd, event](int error) {
+        auto t = winfo.lock();
+        if (t) {
+            t->cancel(error);
+            iom->cancelEvent(fd, (sylar::IOManager::Event) (event));
+        }
+    });
+    if (!id) {
+        tinfo->cancel(cctx->getError());
+        iom->cancelEvent(fd, (sylar::IOManager::Event) (event));
+    }
+    return id;
+}
+
+/**
+ * @brief 是否把fd上的阻塞调用交给卸载线程池
+ * @details 普通文件总是"就绪"的，epoll不接受它们，读写会在调度线程上一直阻塞到磁盘IO完成。
+ *          标准输入输出除外：stdio的缓冲区只有线程级的递归锁，协程在刷缓冲区的途中挂起时，
+ *          同一线程上的其他协程可以进入这个写了一半的缓冲区
+ * @param[in] regular_only 是否只对普通文件卸载，fsync这类对任何fd都会阻塞的调用传false
+ * @param[out] file regular_only时返回fd的FdCtx，卸载线程执行前用它核对fd还是普通文件
+ */
+static bool should_offload(int fd, bool regular_only = true, sylar::FdCtx::ptr *file = nullptr) {
+    if (!sylar::t_hook_enable || !sylar::s_offload_file_io || fd <= STDERR_FILENO
+            || !sylar::OffloadPool::CanOffload()) {
+        return false;
+    }
+    if (!regular_only) {
+        return true;
+    }
+    sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
+    if (!ctx) {
+        // open不经过hook，普通文件第一次读写时才创建FdCtx，之后不再fstat；
+        // 管道、eventfd这类fd不创建，它们经过未hook的close关闭后不会留下过期的FdCtx
+        struct stat st;
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            return false;
+        }
+        ctx = sylar::FdMgr::GetInstance()->get(fd, true);
+    }
+    if (!ctx || ctx->isClose() || !ctx->isRegular()) {
+        return false;
+    }
+    if (file) {
+        *file = ctx;
+    }
+    return true;
+}
+
+/**
+ * @brief 在卸载线程池中执行原函数，协程挂起等待，返回值和errno与直接调用相同
+ * @details 普通文件可能经过未hook的close关闭(fclose、ifstream)，FdCtx留了下来，同号fd又被管道或socket复用。
+ *          给出file时卸载线程先fstat核对，fd已经不是普通文件就不在池中执行，免得把卸载线程阻塞在管道上；
+ *          过期的FdCtx删掉，这一次回到调用者线程直接执行
+ */
+template<typename OriginFun, typename... Args>
+static ssize_t do_offload(int fd, const sylar::FdCtx::ptr &file, OriginFun fun, Args &&... args) {
+    ssize_t n = -1;
+    int err = 0;
+    bool stale = false;
+    auto call = std::bind(fun, fd, std::forward<Args>(args)...);
+    sylar::OffloadMgr::GetInstance()->run([fd, &file, &call, &n, &err, &stale]() {
+        struct stat st;
+        if (file && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))) {
+            stale = true;
+            return;
+        }
+        n = call();
+        err = errno;
+    });
+    if (stale) {
+        if (sylar::FdMgr::GetInstance()->get(fd) == file) {
+            sylar::FdMgr::GetInstance()->del(fd);
+        }
+        return call();
+    }
+    errno = err;
+    return n;
+}
+
 template<typename OriginFun, typename... Args> // 可变参数的args
 static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
                      uint32_t event, int timeout_so, Args &&... args) {
@@ -103,7 +227,11 @@ static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
     }
 
     sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
-    if (!ctx) { // 不存在，把认为它不是socket，返回函数原型
+    sylar::FdCtx::ptr file;
+    if (!ctx) { // 不存在，把认为它不是socket，普通文件交给卸载线程池，其余返回函数原型
+        if (should_offload(fd, true, &file)) {
+            return do_offload(fd, file, fun, std::forward<Args>(args)...);
+        }
         return fun(fd, std::forward<Args>(args)...);
     }
 
@@ -112,10 +240,24 @@ static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
         return -1;
     }
 
+    if (!ctx->isSocket() && should_offload(fd, true, &file)) {
+        return do_offload(fd, file, fun, std::forward<Args>(args)...);
+    }
+
     if (!ctx->isSocket() || ctx->getUserNonblock()) { // 是socker，而且已经设置为非阻塞io
         return fun(fd, std::forward<Args>(args)...); //用forward把参数展开
     }
 
+    // 当前协程的取消上下文已经取消时不再做IO，客户端已经放弃了
+    sylar::CancelContext *cctx = sylar::CancelContext::GetThisPtr();
+    if (cctx) {
+        int error = cctx->getError();
+        if (error) {
+            errno = error;
+            return -1;
+        }
+    }
+
     // 下面就是hook要做的内容
     uint64_t to = ctx->getTimeout(timeout_so); // 获取超时的时间
     std::shared_ptr<timer_info> tinfo(new timer_info); // 设置一个超时的条件
@@ -130,19 +272,38 @@ static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
         sylar::Timer::ptr timer;
         std::weak_ptr<timer_info> winfo(tinfo);
 
-        if (to != (uint64_t) -1) { // 说明有超时时间
-            timer = iom->addConditionTimer(to, [winfo, fd, iom, event]() { // 等待它 to 的时间， 如果没来的化，就触发回调
+        // 上一次等待的定时器或取消回调可能在协程被IO唤醒之后才执行，原因已经记下，不再等待
+        if (tinfo->cancelled) {
+            errno = tinfo->cancelled;
+            return -1;
+        }
+        uint64_t wait_to = to;
+        if (cctx) { // 等待时间不超过上下文剩余的时间预算，每次重试重新计算
+            int error = cctx->getError();
+            if (error) {
+                errno = error;
+                return -1;
+            }
+            wait_to = std::min(to, cctx->getRemainingMs());
+        }
+        if (wait_to != (uint64_t) -1) { // 说明有超时时间
+            timer = iom->addConditionTimer(wait_to, [winfo, fd, iom, event]() { // 等待它 wait_to 的时间， 如果没来的化，就触发回调
                 auto t = winfo.lock(); // 拿出这个条件，唤醒一下
-                if (!t || t->cancelled) { // 如果有这个条件，并且这个条件没有设错误，直接返回
+                if (!t) { // 条件已经不在了，直接返回
                     return;
                 }
-                t->cancelled = ETIMEDOUT; // 否则设置错误，并取消事件
+                t->cancel(ETIMEDOUT); // 设置错误，并取消事件
                 iom->cancelEvent(fd, (sylar::IOManager::Event) (event));
             }, winfo);
         }
 
         int rt = iom->addEvent(fd, (sylar::IOManager::Event) (event)); // 添加一个当前协程的事件
-        if (SYLAR_UNLIKELY(rt)) { // 如果添加失败，则取消定时器
+        if (rt == 1) { // 持久注册模式下fd在上次等待之后已经就绪过，不用挂起直接重试
+            if (timer) {
+                timer->cancel();
+            }
+            goto retry;
+        } else if (SYLAR_UNLIKELY(rt)) { // 如果添加失败，则取消定时器
             SYLAR_LOG_ERROR(g_logger) << hook_fun_name << " addEvent("
                                       << fd << ", " << event << ")";
             if (timer) { // 如果有定时器，就把定时器取消掉
@@ -150,11 +311,18 @@ static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
             }
             return -1;
         } else { // 成功了则让出执行权
+            uint64_t cancel_id = watch_cancel(cctx, tinfo, iom, fd, event);
+            if (tinfo->cancelled) { // 定时器或取消回调在addEvent之前执行，cancelEvent落空了，自己取消
+                iom->cancelEvent(fd, (sylar::IOManager::Event) (event));
+            }
             sylar::Fiber::GetThis()->yield();
             if (timer) { // timer不为nullptr，说明有超时时间，挂起后任务应该被执行了
                 timer->cancel();
             }
-            if (tinfo->cancelled) { // 超时
+            if (cancel_id) {
+                cctx->removeCallback(cancel_id);
+            }
+            if (tinfo->cancelled) { // 超时或被取消
                 errno = tinfo->cancelled;
                 return -1;
             }
@@ -165,6 +333,91 @@ static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name,
     return n;
 }
 
+/**
+ * @brief 通过io_uring执行IO，直接提交真正的读写操作，完成后带着结果恢复协程，省掉EAGAIN+epoll_ctl+重试
+ * @details 只接管do_io会挂起协程的情况(hook开启、未关闭的socket、用户没有设置非阻塞)，
+ *          其余情况、IOManager没有开启io_uring以及提交队列满时返回false，由调用者走原来的do_io。
+ *          共享栈上的协程也不走io_uring：内核在协程挂起期间访问栈上的缓冲区和请求，而那时栈上可能是别的协程。
+ *          设置了取消上下文的协程同样交给do_io，取消时要能通过cancelEvent唤醒
+ * @param[in] prep 填充sqe
+ * @param[out] result 与原函数相同的返回值，出错时设置errno
+ * @return 是否由io_uring处理了
+ */
+template<typename Prep>
+static bool do_uring_io(int fd, int timeout_so, Prep prep, ssize_t &result) {
+    if (!sylar::t_hook_enable) {
+        return false;
+    }
+    sylar::IOManager *iom = sylar::IOManager::GetThis();
+    if (!iom || !iom->hasIoUring() || sylar::Fiber::GetThisPtr()->isSharedStack()
+            || sylar::CancelContext::GetThisPtr()) {
+        return false;
+    }
+    sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
+    if (!ctx || ctx->isClose() || !ctx->isSocket() || ctx->getUserNonblock()) {
+        return false;
+    }
+
+    int rt = 0;
+    if (!iom->submitIo(prep, rt, ctx->getTimeout(timeout_so))) {
+        return false; // 提交队列满，这次走epoll
+    }
+    if (rt < 0) {
+        // 等待期间fd被close，取消的操作按do_io的行为返回EBADF
+        errno = (rt == -ECANCELED && ctx->isClose()) ? EBADF : -rt;
+        result = -1;
+    } else {
+        result = rt;
+    }
+    return true;
+}
+
+/**
+ * @brief 挂起当前协程ms毫秒
+ * @details 当前协程有取消上下文时，睡眠不超过剩余的时间预算，上下文取消时提前唤醒；
+ *          定时器和取消回调谁先到谁唤醒协程，只唤醒一次
+ * @param[out] left 提前返回时剩余没睡的毫秒数
+ * @return 0睡满了；否则为上下文取消的原因
+ */
+static int do_sleep(uint64_t ms, uint64_t *left = nullptr) {
+    sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();   // 取出当前的协程
+    sylar::IOManager *iom = sylar::IOManager::GetThis(); // 取出当前的iomanager
+    sylar::CancelContext *cctx = sylar::CancelContext::GetThisPtr();
+    if (!cctx) {
+        iom->addTimer(ms, std::bind((void (sylar::Scheduler::*)
+                (sylar::Fiber::ptr, int thread)) &sylar::IOManager::schedule, iom, fiber, -1));
+        fiber->yield();
+        return 0;
+    }
+
+    uint64_t start = sylar::GetCurrentMS();
+    int error = cctx->getError();
+    if (!error) {
+        auto woken = std::make_shared<std::atomic<bool> >(false);
+        auto wake = [woken, iom, fiber]() {
+            bool expected = false;
+            if (woken->compare_exchange_strong(expected, true)) {
+                iom->schedule(fiber);
+            }
+        };
+        sylar::Timer::ptr timer = iom->addTimer(std::min(ms, cctx->getRemainingMs()), wake);
+        uint64_t id = cctx->addCallback([wake](int) { wake(); });
+        if (!id) {
+            wake();
+        }
+        fiber->yield();
+        timer->cancel();
+        if (id) {
+            cctx->removeCallback(id);
+        }
+        error = cctx->getError();
+    }
+    if (error && left) {
+        uint64_t used = sylar::GetCurrentMS() - start;
+        *left = used < ms ? ms - used : 0;
+    }
+    return error;
+}
 
 extern "C" {
 #define XX(name) name ## _fun name ## _f = nullptr;
@@ -176,11 +429,11 @@ unsigned int sleep(unsigned int seconds) {
         return sleep_f(seconds);
     }
 
-    sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();   // 取出当前的协程
-    sylar::IOManager* iom = sylar::IOManager::GetThis(); // 取出当前的iomanager
-    iom->addTimer(seconds * 1000, std::bind((void (sylar::Scheduler::*)
-            (sylar::Fiber::ptr, int thread))& sylar::IOManager::schedule, iom, fiber, -1));
-    sylar::Fiber::GetThis()->yield();
+    // 被取消上下文提前唤醒时和被信号打断一样，返回没睡的秒数
+    uint64_t left = 0;
+    if (do_sleep(seconds * 1000ull, &left)) {
+        return (left + 999) / 1000;
+    }
     return 0;
 }
 
@@ -188,11 +441,11 @@ int usleep(useconds_t usec) {
     if (!sylar::t_hook_enable) {
         return usleep_f(usec);
     }
-    sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
-    sylar::IOManager *iom = sylar::IOManager::GetThis();
-    iom->addTimer(usec / 1000, std::bind((void (sylar::Scheduler::*)
-            (sylar::Fiber::ptr, int thread)) &sylar::IOManager::schedule, iom, fiber, -1));
-    sylar::Fiber::GetThis()->yield();
+    int error = do_sleep(usec / 1000);
+    if (error) {
+        errno = error;
+        return -1;
+    }
     return 0;
 }
 
@@ -202,11 +455,16 @@ int nanosleep(const struct timespec *req, struct timespec *rem) {
     }
 
     int timeout_ms = req->tv_sec * 1000 + req->tv_nsec / 1000 / 1000;
-    sylar::Fiber::ptr fiber = sylar::Fiber::GetThis();
-    sylar::IOManager *iom = sylar::IOManager::GetThis();
-    iom->addTimer(timeout_ms, std::bind((void (sylar::Scheduler::*)
-            (sylar::Fiber::ptr, int thread)) &sylar::IOManager::schedule, iom, fiber, -1));
-    sylar::Fiber::GetThis()->yield();
+    uint64_t left = 0;
+    int error = do_sleep(timeout_ms, &left);
+    if (error) {
+        if (rem) {
+            rem->tv_sec  = left / 1000;
+            rem->tv_nsec = left % 1000 * 1000 * 1000;
+        }
+        errno = error;
+        return -1;
+    }
     return 0;
 }
 
@@ -218,6 +476,8 @@ int socket(int domain, int type, int protocol) {
     if (fd == -1) {
         return fd;
     }
+    // fd没有经过hook关闭时(如fclose)会留下旧的FdCtx，新建的fd要重新初始化
+    sylar::FdMgr::GetInstance()->del(fd);
     sylar::FdMgr::GetInstance()->get(fd, true);
     return fd;
 }
@@ -240,6 +500,34 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
         return connect_f(fd, addr, addrlen);
     }
 
+    sylar::CancelContext *cctx = sylar::CancelContext::GetThisPtr();
+    if (cctx) { // 已经取消就不再连接，连接等待的时间不超过剩余的时间预算
+        int error = cctx->getError();
+        if (error) {
+            errno = error;
+            return -1;
+        }
+        timeout_ms = std::min(timeout_ms, cctx->getRemainingMs());
+    }
+
+    sylar::IOManager *iom = sylar::IOManager::GetThis();
+    if (iom && iom->hasIoUring() && !sylar::Fiber::GetThisPtr()->isSharedStack() && !cctx) {
+        // 由io_uring完成整个连接过程，结果直接是connect的返回值；提交队列满时走下面的epoll
+        int rt = 0;
+        if (iom->submitIo([fd, addr, addrlen](io_uring_sqe *sqe) {
+            sqe->opcode = IORING_OP_CONNECT;
+            sqe->fd     = fd;
+            sqe->addr   = (uint64_t) (uintptr_t) addr;
+            sqe->off    = addrlen;
+        }, rt, timeout_ms)) {
+            if (rt < 0) {
+                errno = -rt;
+                return -1;
+            }
+            return 0;
+        }
+    }
+
     int n = connect_f(fd, addr, addrlen);
     if (n == 0) {
         return 0;
@@ -247,7 +535,6 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
         return n;
     }
 
-    sylar::IOManager *iom = sylar::IOManager::GetThis();
     sylar::Timer::ptr timer;
     std::shared_ptr<timer_info> tinfo(new timer_info);
     std::weak_ptr<timer_info> winfo(tinfo);
@@ -255,20 +542,32 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
     if (timeout_ms != (uint64_t) -1) {
         timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom]() {
             auto t = winfo.lock();
-            if (!t || t->cancelled) {
+            if (!t) {
                 return;
             }
-            t->cancelled = ETIMEDOUT;
+            t->cancel(ETIMEDOUT);
             iom->cancelEvent(fd, sylar::IOManager::WRITE);
         }, winfo);
     }
 
     int rt = iom->addEvent(fd, sylar::IOManager::WRITE);
-    if (rt == 0) {
+    if (rt == 1) {
+        // 持久注册模式下已经可写，连接已有结果
+        if (timer) {
+            timer->cancel();
+        }
+    } else if (rt == 0) {
+        uint64_t cancel_id = watch_cancel(cctx, tinfo, iom, fd, sylar::IOManager::WRITE);
+        if (tinfo->cancelled) { // 同do_io，唤醒者在addEvent之前执行
+            iom->cancelEvent(fd, sylar::IOManager::WRITE);
+        }
         sylar::Fiber::GetThis()->yield();
         if (timer) {
             timer->cancel();
         }
+        if (cancel_id) {
+            cctx->removeCallback(cancel_id);
+        }
         if (tinfo->cancelled) {
             errno = tinfo->cancelled;
             return -1;
@@ -298,22 +597,67 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 }
 
 int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
-    int fd = do_io(s, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    ssize_t n = 0;
+    int fd = 0;
+    if (do_uring_io(s, SO_RCVTIMEO, [s, addr, addrlen](io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd     = s;
+        sqe->addr   = (uint64_t) (uintptr_t) addr;
+        sqe->addr2  = (uint64_t) (uintptr_t) addrlen;
+    }, n)) {
+        fd = n;
+    } else {
+        fd = do_io(s, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    }
     if (fd >= 0) {
+        // 同socket，丢掉没有经过hook关闭留下的旧FdCtx；hook关闭的线程保持原样，不改变它的阻塞模式
+        if (sylar::t_hook_enable) {
+            sylar::FdMgr::GetInstance()->del(fd);
+        }
         sylar::FdMgr::GetInstance()->get(fd, true);
     }
     return fd;
 }
 
 ssize_t read(int fd, void *buf, size_t count) {
+    ssize_t n = 0;
+    if (do_uring_io(fd, SO_RCVTIMEO, [fd, buf, count](io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd     = fd;
+        sqe->addr   = (uint64_t) (uintptr_t) buf;
+        sqe->len    = count;
+        sqe->off    = (uint64_t) -1;
+    }, n)) {
+        return n;
+    }
     return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, buf, count);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
+    ssize_t n = 0;
+    if (do_uring_io(fd, SO_RCVTIMEO, [fd, iov, iovcnt](io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd     = fd;
+        sqe->addr   = (uint64_t) (uintptr_t) iov;
+        sqe->len    = iovcnt;
+        sqe->off    = (uint64_t) -1;
+    }, n)) {
+        return n;
+    }
     return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
+    ssize_t n = 0;
+    if (do_uring_io(sockfd, SO_RCVTIMEO, [sockfd, buf, len, flags](io_uring_sqe *sqe) {
+        sqe->opcode    = IORING_OP_RECV;
+        sqe->fd        = sockfd;
+        sqe->addr      = (uint64_t) (uintptr_t) buf;
+        sqe->len       = len;
+        sqe->msg_flags = flags;
+    }, n)) {
+        return n;
+    }
     return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
 }
 
@@ -323,18 +667,88 @@ ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
+    ssize_t n = 0;
+    if (do_uring_io(sockfd, SO_RCVTIMEO, [sockfd, msg, flags](io_uring_sqe *sqe) {
+        sqe->opcode    = IORING_OP_RECVMSG;
+        sqe->fd        = sockfd;
+        sqe->addr      = (uint64_t) (uintptr_t) msg;
+        sqe->len       = 1;
+        sqe->msg_flags = flags;
+    }, n)) {
+        return n;
+    }
     return do_io(sockfd, recvmsg_f, "recvmsg", sylar::IOManager::READ, SO_RCVTIMEO, msg, flags);
 }
 
 ssize_t write(int fd, const void *buf, size_t count) {
+    ssize_t n = 0;
+    if (do_uring_io(fd, SO_SNDTIMEO, [fd, buf, count](io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd     = fd;
+        sqe->addr   = (uint64_t) (uintptr_t) buf;
+        sqe->len    = count;
+        sqe->off    = (uint64_t) -1;
+    }, n)) {
+        return n;
+    }
     return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count);
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    ssize_t n = 0;
+    if (do_uring_io(fd, SO_SNDTIMEO, [fd, iov, iovcnt](io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd     = fd;
+        sqe->addr   = (uint64_t) (uintptr_t) iov;
+        sqe->len    = iovcnt;
+        sqe->off    = (uint64_t) -1;
+    }, n)) {
+        return n;
+    }
     return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
 }
 
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+    sylar::FdCtx::ptr file;
+    if (should_offload(fd, true, &file)) {
+        return do_offload(fd, file, pread_f, buf, count, offset);
+    }
+    return pread_f(fd, buf, count, offset);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+    sylar::FdCtx::ptr file;
+    if (should_offload(fd, true, &file)) {
+        return do_offload(fd, file, pwrite_f, buf, count, offset);
+    }
+    return pwrite_f(fd, buf, count, offset);
+}
+
+int fsync(int fd) {
+    if (should_offload(fd, false)) {
+        return do_offload(fd, nullptr, fsync_f);
+    }
+    return fsync_f(fd);
+}
+
+int fdatasync(int fd) {
+    if (should_offload(fd, false)) {
+        return do_offload(fd, nullptr, fdatasync_f);
+    }
+    return fdatasync_f(fd);
+}
+
 ssize_t send(int s, const void *msg, size_t len, int flags) {
+    ssize_t n = 0;
+    if (do_uring_io(s, SO_SNDTIMEO, [s, msg, len, flags](io_uring_sqe *sqe) {
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->fd        = s;
+        sqe->addr      = (uint64_t) (uintptr_t) msg;
+        sqe->len       = len;
+        sqe->msg_flags = flags;
+    }, n)) {
+        return n;
+    }
     return do_io(s, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
 }
 
@@ -343,6 +757,16 @@ ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct socka
 }
 
 ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
+    ssize_t n = 0;
+    if (do_uring_io(s, SO_SNDTIMEO, [s, msg, flags](io_uring_sqe *sqe) {
+        sqe->opcode    = IORING_OP_SENDMSG;
+        sqe->fd        = s;
+        sqe->addr      = (uint64_t) (uintptr_t) msg;
+        sqe->len       = 1;
+        sqe->msg_flags = flags;
+    }, n)) {
+        return n;
+    }
     return do_io(s, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
 }
 
@@ -356,6 +780,7 @@ int close(int fd) {
         auto iom = sylar::IOManager::GetThis();
         if (iom) {
             iom->cancelAll(fd);
+            iom->cancelIo(fd);
         }
         sylar::FdMgr::GetInstance()->del(fd);
     }
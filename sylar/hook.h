@@ -77,6 +77,18 @@ extern write_fun write_f;
 typedef ssize_t (*writev_fun)(int fd, const struct iovec *iov, int iovcnt);
 extern writev_fun writev_f;
 
+typedef ssize_t (*pread_fun)(int fd, void *buf, size_t count, off_t offset);
+extern pread_fun pread_f;
+
+typedef ssize_t (*pwrite_fun)(int fd, const void *buf, size_t count, off_t offset);
+extern pwrite_fun pwrite_f;
+
+typedef int (*fsync_fun)(int fd);
+extern fsync_fun fsync_f;
+
+typedef int (*fdatasync_fun)(int fd);
+extern fdatasync_fun fdatasync_f;
+
 typedef ssize_t (*send_fun)(int s, const void *msg, size_t len, int flags);
 extern send_fun send_f;
 
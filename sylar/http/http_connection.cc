@@ -7,6 +7,7 @@
 
 #include "http_connection.h"
 #include "http_parser.h"
+#include "../cancel.h"
 #include "../log.h"
 
 namespace sylar {
@@ -23,6 +24,22 @@ std::string HttpResult::toString() const {
     return ss.str();
 }
 
+/**
+ * @brief 请求因为取消上下文中止时的结果，上下文没有取消返回nullptr
+ */
+static HttpResult::ptr CancelledResult(CancelContext::ptr ctx, const std::string& host) {
+    int error = ctx->getError();
+    if(!error) {
+        return nullptr;
+    }
+    if(error == ETIMEDOUT) {
+        return std::make_shared<HttpResult>((int)HttpResult::Error::TIMEOUT
+                , nullptr, "request deadline exceeded: " + host);
+    }
+    return std::make_shared<HttpResult>((int)HttpResult::Error::CANCELLED
+            , nullptr, "request cancelled: " + host);
+}
+
 HttpConnection::HttpConnection(Socket::ptr sock, bool owner)
     :SocketStream(sock, owner) {
 }
@@ -230,8 +247,20 @@ HttpResult::ptr HttpConnection::DoRequest(HttpMethod method
 HttpResult::ptr HttpConnection::DoRequest(HttpRequest::ptr req
                             , Uri::ptr uri
                             , uint64_t timeout_ms) {
+    // 解析、连接、发送、接收共用timeout_ms的时间预算，调用者的取消上下文取消时请求一起中止
+    CancelContext::ptr cctx = CancelContext::Create(timeout_ms, CancelContext::GetThis());
+    CancelContext::Scope scope(cctx);
+    HttpResult::ptr cancelled = CancelledResult(cctx, uri->getHost());
+    if(cancelled) {
+        return cancelled;
+    }
+
     Address::ptr addr = uri->createAddress();
     if(!addr) {
+        cancelled = CancelledResult(cctx, uri->getHost());
+        if(cancelled) {
+            return cancelled;
+        }
         return std::make_shared<HttpResult>((int)HttpResult::Error::INVALID_HOST
                 , nullptr, "invalid host: " + uri->getHost());
     }
@@ -243,12 +272,22 @@ HttpResult::ptr HttpConnection::DoRequest(HttpRequest::ptr req
                         + " errstr=" + std::string(strerror(errno)));
     }
     if(!sock->connect(addr)) {
+        cancelled = CancelledResult(cctx, addr->toString());
+        if(cancelled) {
+            return cancelled;
+        }
         return std::make_shared<HttpResult>((int)HttpResult::Error::CONNECT_FAIL
                 , nullptr, "connect fail: " + addr->toString());
     }
     sock->setRecvTimeout(timeout_ms);
     HttpConnection::ptr conn = std::make_shared<HttpConnection>(sock);
     int rt = conn->sendRequest(req);
+    if(rt <= 0) {
+        cancelled = CancelledResult(cctx, addr->toString());
+        if(cancelled) {
+            return cancelled;
+        }
+    }
     if(rt == 0) {
         return std::make_shared<HttpResult>((int)HttpResult::Error::SEND_CLOSE_BY_PEER
                 , nullptr, "send request closed by peer: " + addr->toString());
@@ -260,6 +299,10 @@ HttpResult::ptr HttpConnection::DoRequest(HttpRequest::ptr req
     }
     auto rsp = conn->recvResponse();
     if(!rsp) {
+        cancelled = CancelledResult(cctx, addr->toString());
+        if(cancelled) {
+            return cancelled;
+        }
         return std::make_shared<HttpResult>((int)HttpResult::Error::TIMEOUT
                     , nullptr, "recv response timeout: " + addr->toString()
                     + " timeout_ms:" + std::to_string(timeout_ms));
@@ -436,6 +479,14 @@ HttpResult::ptr HttpConnectionPool::doRequest(HttpMethod method
 
 HttpResult::ptr HttpConnectionPool::doRequest(HttpRequest::ptr req
                                         , uint64_t timeout_ms) {
+    // 同HttpConnection::DoRequest，发送和接收共用timeout_ms的时间预算
+    CancelContext::ptr cctx = CancelContext::Create(timeout_ms, CancelContext::GetThis());
+    CancelContext::Scope scope(cctx);
+    HttpResult::ptr cancelled = CancelledResult(cctx, m_host);
+    if(cancelled) {
+        return cancelled;
+    }
+
     auto conn = getConnection();
     if(!conn) {
         return std::make_shared<HttpResult>((int)HttpResult::Error::POOL_GET_CONNECTION
@@ -448,6 +499,14 @@ HttpResult::ptr HttpConnectionPool::doRequest(HttpRequest::ptr req
     }
     sock->setRecvTimeout(timeout_ms);
     int rt = conn->sendRequest(req);
+    if(rt <= 0) {
+        cancelled = CancelledResult(cctx, m_host);
+        if(cancelled) {
+            // 请求只发了一部分，连接不能再放回池中复用
+            sock->close();
+            return cancelled;
+        }
+    }
     if(rt == 0) {
         return std::make_shared<HttpResult>((int)HttpResult::Error::SEND_CLOSE_BY_PEER
                 , nullptr, "send request closed by peer: " + sock->getRemoteAddress()->toString());
@@ -459,6 +518,11 @@ HttpResult::ptr HttpConnectionPool::doRequest(HttpRequest::ptr req
     }
     auto rsp = conn->recvResponse();
     if(!rsp) {
+        cancelled = CancelledResult(cctx, m_host);
+        if(cancelled) {
+            sock->close();
+            return cancelled;
+        }
         return std::make_shared<HttpResult>((int)HttpResult::Error::TIMEOUT
                     , nullptr, "recv response timeout: " + sock->getRemoteAddress()->toString()
                     + " timeout_ms:" + std::to_string(timeout_ms));
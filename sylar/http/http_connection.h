@@ -50,6 +50,8 @@ struct HttpResult {
         POOL_GET_CONNECTION = 8,
         /// 无效的连接
         POOL_INVALID_CONNECTION = 9,
+        /// 调用者的取消上下文已取消
+        CANCELLED = 10,
     };
 
     /**
@@ -0,0 +1,206 @@
+/**
+  ********************************************************
+  * @file        : io_uring.cc
+  * @author      : zgys
+  * @brief       : io_uring的轻量封装
+  * @attention   : None
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#include "io_uring.h"
+#include "log.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+namespace sylar {
+    static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    static int io_uring_setup(uint32_t entries, io_uring_params* p) {
+        return (int)syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    static int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+        return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    static int io_uring_register(int fd, uint32_t opcode, void* arg, uint32_t nr_args) {
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    }
+
+    IoUring::IoUring(uint32_t entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = io_uring_setup(entries, &params);
+        if (fd < 0) {
+            SYLAR_LOG_INFO(g_logger) << "io_uring_setup(" << entries << ") errno=" << errno
+                                     << " errstr=" << strerror(errno);
+            return;
+        }
+        m_fd = fd;
+
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+        }
+
+        m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_sqRing == MAP_FAILED) {
+            m_sqRing = nullptr;
+            SYLAR_LOG_ERROR(g_logger) << "io_uring mmap sq ring errno=" << errno;
+            release();
+            return;
+        }
+        if (single_mmap) {
+            m_cqRing = m_sqRing;
+        } else {
+            m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if (m_cqRing == MAP_FAILED) {
+                m_cqRing = nullptr;
+                SYLAR_LOG_ERROR(g_logger) << "io_uring mmap cq ring errno=" << errno;
+                release();
+                return;
+            }
+        }
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring mmap sqes errno=" << errno;
+            release();
+            return;
+        }
+        m_sqes = (io_uring_sqe*)sqes;
+
+        char* sq = (char*)m_sqRing;
+        m_sqHead    = (uint32_t*)(sq + params.sq_off.head);
+        m_sqTail    = (uint32_t*)(sq + params.sq_off.tail);
+        m_sqMask    = (uint32_t*)(sq + params.sq_off.ring_mask);
+        m_sqEntries = (uint32_t*)(sq + params.sq_off.ring_entries);
+        m_sqArray   = (uint32_t*)(sq + params.sq_off.array);
+        m_sqeHead = m_sqeTail = *m_sqTail;
+
+        char* cq = (char*)m_cqRing;
+        m_cqHead = (uint32_t*)(cq + params.cq_off.head);
+        m_cqTail = (uint32_t*)(cq + params.cq_off.tail);
+        m_cqMask = (uint32_t*)(cq + params.cq_off.ring_mask);
+        m_cqes   = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        if (!probe()) {
+            // 内核太旧，缺少需要的操作，视为不可用，由调用者回退到epoll
+            SYLAR_LOG_INFO(g_logger) << "io_uring probe failed, required opcodes not supported";
+            release();
+        }
+    }
+
+    IoUring::~IoUring() {
+        release();
+    }
+
+    void IoUring::release() {
+        if (m_sqes) {
+            munmap(m_sqes, m_sqesSize);
+            m_sqes = nullptr;
+        }
+        if (m_cqRing && m_cqRing != m_sqRing) {
+            munmap(m_cqRing, m_cqRingSize);
+        }
+        m_cqRing = nullptr;
+        if (m_sqRing) {
+            munmap(m_sqRing, m_sqRingSize);
+            m_sqRing = nullptr;
+        }
+        if (m_fd >= 0) {
+            close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+    bool IoUring::probe() {
+        static const uint32_t PROBE_OPS = 256;
+        size_t len = sizeof(io_uring_probe) + PROBE_OPS * sizeof(io_uring_probe_op);
+        std::unique_ptr<char[]> buf(new char[len]);
+        memset(buf.get(), 0, len);
+        io_uring_probe* p = (io_uring_probe*)buf.get();
+        if (io_uring_register(m_fd, IORING_REGISTER_PROBE, p, PROBE_OPS) < 0) {
+            return false;
+        }
+        const int ops[] = {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READV, IORING_OP_WRITEV,
+                           IORING_OP_RECV, IORING_OP_SEND, IORING_OP_RECVMSG, IORING_OP_SENDMSG,
+                           IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_LINK_TIMEOUT,
+                           IORING_OP_ASYNC_CANCEL};
+        for (int op : ops) {
+            if (op > p->last_op || !(p->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                return false;
+            }
+        }
+
+        // IOManager::cancelIo按fd取消(IORING_ASYNC_CANCEL_FD，5.19加入)，只检查操作码的话5.6~5.18的内核也能通过，
+        // 但取消会以-EINVAL失败，fd被close时挂起的recv/accept不会被唤醒。这里用本身的句柄实际提交一次
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+        sqe->fd           = m_fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        if (submit() != 1) {
+            return false;
+        }
+        int rt;
+        do {
+            rt = io_uring_enter(m_fd, 0, 1, IORING_ENTER_GETEVENTS);
+        } while (rt < 0 && errno == EINTR);
+        if (rt < 0) {
+            return false;
+        }
+        int res = 0;
+        reap([&res](io_uring_cqe* cqe) {
+            res = cqe->res;
+        });
+        if (res == -EINVAL) {
+            SYLAR_LOG_INFO(g_logger) << "io_uring IORING_ASYNC_CANCEL_FD not supported";
+            return false;
+        }
+        return true;
+    }
+
+    io_uring_sqe* IoUring::getSqe() {
+        uint32_t head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        if (m_sqeTail - head >= *m_sqEntries) {
+            return nullptr;
+        }
+        io_uring_sqe* sqe = &m_sqes[m_sqeTail & *m_sqMask];
+        memset(sqe, 0, sizeof(*sqe));
+        ++m_sqeTail;
+        return sqe;
+    }
+
+    int IoUring::submit() {
+        // 把新填好的sqe按顺序放入提交队列的索引数组，再发布tail
+        uint32_t tail = *m_sqTail;
+        uint32_t mask = *m_sqMask;
+        while (m_sqeHead != m_sqeTail) {
+            m_sqArray[tail & mask] = m_sqeHead & mask;
+            ++tail;
+            ++m_sqeHead;
+        }
+        __atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+
+        // 上次没被内核取走的sqe也一起提交
+        uint32_t to_submit = tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+        if (!to_submit) {
+            return 0;
+        }
+
+        int rt;
+        do {
+            rt = io_uring_enter(m_fd, to_submit, 0, 0);
+        } while (rt < 0 && errno == EINTR);
+        return rt < 0 ? -errno : rt;
+    }
+}
@@ -0,0 +1,140 @@
+/**
+  ********************************************************
+  * @file        : io_uring.h
+  * @author      : zgys
+  * @brief       : io_uring的轻量封装
+  * @attention   : 直接使用io_uring_setup/io_uring_enter/io_uring_register系统调用，不依赖liburing
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#ifndef __SYLAR_IO_URING_H__
+#define __SYLAR_IO_URING_H__
+
+#include <memory>
+#include <stdint.h>
+#include "noncopyable.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace sylar {
+
+    /**
+     * @brief io_uring实例
+     * @details 负责映射提交队列(SQ)和完成队列(CQ)，提供取sqe、批量提交、遍历cqe的接口。
+     *          本身不是线程安全的，由调用者加锁
+     */
+    class IoUring : Noncopyable {
+    public:
+        typedef std::shared_ptr<IoUring> ptr;
+
+        /**
+         * @brief 构造函数
+         * @param[in] entries 提交队列的长度，内核会向上取整为2的幂
+         * @attention 创建失败时isValid()返回false(内核不支持或被seccomp禁止)
+         */
+        explicit IoUring(uint32_t entries);
+
+        /**
+         * @brief 析构函数，解除映射并关闭句柄
+         */
+        ~IoUring();
+
+        /**
+         * @brief 是否创建成功，并且支持IOManager用到的全部操作
+         */
+        bool isValid() const { return m_fd >= 0; }
+
+        /**
+         * @brief io_uring的句柄，有完成事件时可读，可以注册到epoll中
+         */
+        int getFd() const { return m_fd; }
+
+        /**
+         * @brief 取一个空闲的sqe，已清零
+         * @return 提交队列满时返回nullptr，需先submit
+         */
+        io_uring_sqe* getSqe();
+
+        /**
+         * @brief 已经填好但还没有提交给内核的sqe数量
+         */
+        uint32_t getPendingSubmit() const { return m_sqeTail - m_sqeHead; }
+
+        /**
+         * @brief 提交队列中还能再取的sqe数量
+         */
+        uint32_t getFreeSqes() const {
+            return *m_sqEntries - (m_sqeTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE));
+        }
+
+        /**
+         * @brief 把所有已填好的sqe一次性提交给内核
+         * @return 提交的数量，失败返回-errno
+         */
+        int submit();
+
+        /**
+         * @brief 遍历并消费所有已完成的cqe
+         * @param[in] cb 对每个cqe调用一次
+         * @return 消费的cqe数量
+         */
+        template<class Callback>
+        uint32_t reap(Callback cb) {
+            uint32_t head = *m_cqHead;
+            uint32_t tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+            uint32_t count = 0;
+            while (head != tail) {
+                cb(&m_cqes[head & *m_cqMask]);
+                ++head;
+                ++count;
+            }
+            if (count) {
+                __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+            }
+            return count;
+        }
+
+        /**
+         * @brief 完成队列中是否有未消费的cqe
+         */
+        bool hasCompletion() const {
+            return *m_cqHead != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        }
+
+    private:
+        /**
+         * @brief 检查内核是否支持IOManager用到的操作，以及按fd取消
+         */
+        bool probe();
+
+        /**
+         * @brief 解除映射并关闭句柄
+         */
+        void release();
+
+    private:
+        int           m_fd = -1;              // io_uring句柄
+        void*         m_sqRing = nullptr;     // 提交队列映射
+        size_t        m_sqRingSize = 0;
+        void*         m_cqRing = nullptr;     // 完成队列映射，SINGLE_MMAP时与m_sqRing相同
+        size_t        m_cqRingSize = 0;
+        io_uring_sqe* m_sqes = nullptr;       // sqe数组映射
+        size_t        m_sqesSize = 0;
+
+        uint32_t*     m_sqHead = nullptr;
+        uint32_t*     m_sqTail = nullptr;
+        uint32_t*     m_sqMask = nullptr;
+        uint32_t*     m_sqEntries = nullptr;
+        uint32_t*     m_sqArray = nullptr;
+        uint32_t      m_sqeHead = 0;          // 已提交给内核的位置
+        uint32_t      m_sqeTail = 0;          // 已填好的位置
+
+        uint32_t*     m_cqHead = nullptr;
+        uint32_t*     m_cqTail = nullptr;
+        uint32_t*     m_cqMask = nullptr;
+        io_uring_cqe* m_cqes = nullptr;
+    };
+}
+
+#endif //SYLAR_IO_URING_H
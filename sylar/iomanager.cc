@@ -10,7 +10,10 @@
 #include "iomanager.h"
 #include "macro.h"
 #include "log.h"
+#include "config.h"
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string>
@@ -19,6 +22,62 @@
 namespace sylar {
     static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+    // 是否每个调度线程使用独立的epoll，fd注册在哪个线程上，事件触发后就回到哪个线程执行
+    static ConfigVar<bool>::ptr g_iomanager_reactor_per_thread =
+            Config::Lookup<bool>("iomanager.reactor_per_thread", false, "iomanager one epoll per worker thread");
+
+    // 是否持久注册fd(EPOLLIN|EPOLLOUT|EPOLLET)，就绪状态锁存在FdContext中，省掉每次事件的epoll_ctl
+    static ConfigVar<bool>::ptr g_iomanager_persistent_events =
+            Config::Lookup<bool>("iomanager.persistent_events", false, "iomanager keep fds registered for their lifetime");
+
+    // idle中一轮epoll_wait触发的事件和到期定时器是否收集起来一次投递，整批最多一次加锁和一次tickle
+    static ConfigVar<bool>::ptr g_iomanager_batch_schedule =
+            Config::Lookup<bool>("iomanager.batch_schedule", true, "iomanager publish one epoll batch of wakeups at once");
+
+    // 是否使用io_uring执行hook层的IO操作，内核不支持时自动回退到epoll
+    static ConfigVar<bool>::ptr g_iomanager_io_uring =
+            Config::Lookup<bool>("iomanager.io_uring", false, "iomanager use io_uring for hooked io");
+
+    // io_uring提交队列长度
+    static ConfigVar<uint32_t>::ptr g_iomanager_io_uring_entries =
+            Config::Lookup<uint32_t>("iomanager.io_uring_entries", 256, "iomanager io_uring queue entries");
+
+    // 积累多少个sqe后不等idle立即提交
+    static ConfigVar<uint32_t>::ptr g_iomanager_io_uring_batch =
+            Config::Lookup<uint32_t>("iomanager.io_uring_batch", 32, "iomanager io_uring submit batch size");
+
+    // idle线程阻塞在epoll_wait之前最多忙轮询多少微秒，0为关闭；实际时长按近期命中率自适应
+    static ConfigVar<uint32_t>::ptr g_iomanager_busy_poll_us =
+            Config::Lookup<uint32_t>("iomanager.busy_poll_us", 0, "iomanager idle busy poll budget in microseconds");
+
+    /**
+     * @brief 忙等循环中的CPU提示，降低功耗并让出超线程的执行资源
+     */
+    static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield" ::: "memory");
+#endif
+    }
+
+    /**
+     * @brief 一个通过io_uring执行的IO操作，位于发起协程的栈上，协程挂起期间有效
+     */
+    struct UringOp {
+        Fiber::ptr fiber;              // 发起操作的协程
+        int        res = 0;            // 操作结果
+        int        refs = 1;           // 还未收到的cqe数，带超时时操作本身和超时各有一个
+        bool       timedOut = false;   // 是否因超时被取消
+    };
+
+    /// 超时sqe的user_data在UringOp地址上打的标记
+    static const uint64_t URING_TIMEOUT_TAG = 1;
+
+    /// 当前线程认领的Reactor及其所属的IOManager，仅每线程epoll模式使用
+    static thread_local IOManager* t_reactor_owner = nullptr;
+    static thread_local void* t_reactor = nullptr;
+
     enum EpollCtlOp {
     };
 
@@ -67,57 +126,118 @@ namespace sylar {
     }
 
     IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
-            : Scheduler(threads, use_caller, name) {
+            : Scheduler(threads, use_caller, name),
+              m_reactorPerThread(g_iomanager_reactor_per_thread->getValue()),
+              m_persistentEvents(g_iomanager_persistent_events->getValue()),
+              m_batchSchedule(g_iomanager_batch_schedule->getValue()),
+              m_busyPollUs(g_iomanager_busy_poll_us->getValue()) {
+        if (m_reactorPerThread) {
+            // 每个调度线程(包括use_caller的caller线程)一个epoll，线程第一次进入idle或注册事件时认领；
+            // 注册在某个epoll上的fd离不开认领它的线程，线程数固定
+            disableElastic();
+            m_epfd = -1;
+            m_reactors.resize(threads);
+            for (auto& reactor : m_reactors) {
+                reactor = new Reactor;
+                reactor->epfd = epoll_create(5000);
+                SYLAR_ASSERT(reactor->epfd > 0);
+                reactor->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                SYLAR_ASSERT(reactor->eventFd > 0);
+
+                epoll_event event;
+                memset(&event, 0, sizeof(epoll_event));
+                event.events = EPOLLIN | EPOLLET;
+                event.data.fd = reactor->eventFd;
+                int rt = epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->eventFd, &event);
+                SYLAR_ASSERT(!rt);
+            }
+            initIoUring();
+            start();
+            return;
+        }
+
         m_epfd = epoll_create(5000);
         SYLAR_ASSERT(m_epfd > 0);
 
-        int rt = pipe(m_tickleFds);
-        SYLAR_ASSERT(!rt);
+        // eventfd是一个计数器，多次写入只需一次读取，比pipe少一个句柄且不会写满
+        m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        SYLAR_ASSERT(m_tickleFd > 0);
 
-        // 关注pipe读句柄的可读事件，用于tickle协程
+        // 关注eventfd的可读事件，用于tickle协程
         epoll_event event;
         memset(&event, 0, sizeof(epoll_event));
         // LT模式：对于读事件 EPOLLIN，只要socket上有未读完的数据，EPOLLIN 就会一直触发；对于写事件 EPOLLOUT，只要socket可写，EPOLLOUT 就会一直触发
         // ET模式：对于读事件 EPOLLIN，只有socket上的数据从无到有，EPOLLIN 才会触发；对于写事件 EPOLLOUT，只有在socket写缓冲区从不可写变为可写，EPOLLOUT 才会触发
         event.events = EPOLLIN | EPOLLET;
-        event.data.fd = m_tickleFds[0]; // 读
+        event.data.fd = m_tickleFd;
 
-        // 非阻塞方式，配合边缘触发
-        rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
+        int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
         SYLAR_ASSERT(!rt);
 
-        rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-        SYLAR_ASSERT(!rt);
-
-        contextResize(32);
+        initIoUring();
 
         start();    // 父类中的启动，当IOManager创建好了就默认启动
     }
 
     IOManager::~IOManager() {
         stop();
-        close(m_epfd);
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
-
-        for (size_t i = 0; i < m_fdContexts.size(); ++i) {
-            if (m_fdContexts[i]) {
-                delete m_fdContexts[i];
+        m_uring.reset();
+        if (m_reactorPerThread) {
+            for (auto reactor : m_reactors) {
+                close(reactor->epfd);
+                close(reactor->eventFd);
+                delete reactor;
             }
+            if (t_reactor_owner == this) {
+                t_reactor_owner = nullptr;
+                t_reactor = nullptr;
+            }
+        } else {
+            close(m_epfd);
+            close(m_tickleFd);
         }
     }
 
-    void IOManager::contextResize(size_t size) {
-        m_fdContexts.resize(size);
-
-        for(size_t i = 0; i < m_fdContexts.size(); i++) {
-            if(!m_fdContexts[i]) {
-                m_fdContexts[i] = new FdContext;
-                m_fdContexts[i]->fd = i;
+    void IOManager::initIoUring() {
+        if (!g_iomanager_io_uring->getValue()) {
+            return;
+        }
+        IoUring::ptr uring(new IoUring(g_iomanager_io_uring_entries->getValue()));
+        if (!uring->isValid()) {
+            SYLAR_LOG_WARN(g_logger) << "io_uring not available, fallback to epoll";
+            return;
+        }
+        m_uring = uring;
+        m_uringBatch = std::max(1u, g_iomanager_io_uring_batch->getValue());
+
+        // io_uring有完成事件时句柄可读，注册到每个epoll上，哪个线程先醒来就由哪个线程收割
+        std::vector<int> epfds;
+        if (m_reactorPerThread) {
+            for (auto reactor : m_reactors) {
+                epfds.push_back(reactor->epfd);
             }
+        } else {
+            epfds.push_back(m_epfd);
+        }
+        for (int epfd : epfds) {
+            epoll_event event;
+            memset(&event, 0, sizeof(epoll_event));
+            event.events = EPOLLIN | EPOLLET;
+            event.data.fd = m_uring->getFd();
+            int rt = epoll_ctl(epfd, EPOLL_CTL_ADD, m_uring->getFd(), &event);
+            SYLAR_ASSERT(!rt);
         }
     }
 
+    IOManager::FdContext* IOManager::getFdContext(int fd, bool auto_create) {
+        if (!auto_create) {
+            return m_fdContexts.find(fd);
+        }
+        return m_fdContexts.get(fd, [](FdContext& fd_ctx, int i) {
+            fd_ctx.fd = i;
+        });
+    }
+
     IOManager::FdContext::EventContext& IOManager::FdContext::getEventContext(IOManager::Event event) {
         switch (event) {
             case IOManager::READ:
@@ -134,9 +254,10 @@ namespace sylar {
         event_ctx.scheduler = nullptr;
         event_ctx.fiber.reset();       // 智能指针放弃引用,不再指向那个对象
         event_ctx.cb        = nullptr;
+        event_ctx.thread    = -1;
     }
 
-    void IOManager::FdContext::triggerEvent(IOManager::Event event) {
+    void IOManager::FdContext::triggerEvent(IOManager::Event event, std::vector<ScheduleTask>* batch, Scheduler* owner) {
         // 待触发的事件必须已被注册过
         SYLAR_ASSERT(events & event);
         /**
@@ -146,27 +267,28 @@ namespace sylar {
         events = (Event)(events & ~event);
         // 调度对应的协程
         EventContext& ctx = getEventContext(event);
-        if (ctx.cb) {
-            ctx.scheduler->schedule(ctx.cb);
+        // 回调和协程都移交给调度器，不复制
+        if (batch && ctx.scheduler == owner) {
+            if (ctx.cb) {
+                batch->emplace_back(std::move(ctx.cb), ctx.thread);
+            } else {
+                batch->emplace_back(std::move(ctx.fiber), ctx.thread);
+            }
+        } else if (ctx.cb) {
+            ctx.scheduler->schedule(std::move(ctx.cb), ctx.thread);
         } else {
-           ctx.scheduler->schedule(ctx.fiber);
+           ctx.scheduler->schedule(std::move(ctx.fiber), ctx.thread);
         }
         resetEventContext(ctx);
         return;
     }
 
-    int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
+    int IOManager::addEvent(int fd, Event event, Task cb) {
         // 找到fd对应的FdContext，如果不存在，那就分配一个
-        FdContext* fd_ctx = nullptr;
-        RWMutexType::ReadLock lock(m_mutex);
-        if((int)m_fdContexts.size() > fd) {    // 说明fd存在
-            fd_ctx = m_fdContexts[fd];
-            lock.unlock();
-        } else {
-            lock.unlock();
-            RWMutexType::WriteLock lock2(m_mutex);
-            contextResize(fd * 1.5); // 1.5倍扩容
-            fd_ctx = m_fdContexts[fd];
+        FdContext* fd_ctx = getFdContext(fd, true);
+        if (SYLAR_UNLIKELY(!fd_ctx)) {
+            SYLAR_LOG_ERROR(g_logger) << "addEvent fd=" << fd << " out of range";
+            return -1;
         }
         // 运行到此处，此fd对应的上下文由fd_ctx指向
         // 同一个fd不允许重复添加相同的事件
@@ -178,6 +300,10 @@ namespace sylar {
             SYLAR_ASSERT(!(fd_ctx->events & event));
         }
 
+        if (m_persistentEvents) {
+            return addEventPersistent(fd_ctx, event, cb);
+        }
+
         // 不是同一个fd，得看这个事件是新增还是修改
         // 将新的事件加入epoll_wait，使用epoll_event的私有指针存储FdContext的位置
         int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD; // 如果此fd的上下文的事件为空，说明没添加过事件，不为空，说明是修改事件
@@ -185,9 +311,14 @@ namespace sylar {
         epevent.events = EPOLLET | fd_ctx->events | event;   // epoll事件，包括边沿触发，旧事件，新事件
         epevent.data.ptr = fd_ctx;         // FdContext
 
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        // 每线程epoll模式下，新注册的fd放到当前线程的epoll上，已注册的fd继续使用原来的epoll
+        if (m_reactorPerThread && !fd_ctx->events) {
+            fd_ctx->reactor = selectReactor();
+        }
+        int epfd = getEpfd(fd_ctx);
+        int rt = epoll_ctl(epfd, op, fd, &epevent);
         if (rt) {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
                                       << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
                                       << rt << " (" << errno << ") (" << strerror(errno) << ") fd_ctx->events="
                                       << (EPOLL_EVENTS)fd_ctx->events;
@@ -202,31 +333,85 @@ namespace sylar {
         FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);     // 获取事件上下文
         SYLAR_ASSERT(!event_ctx.scheduler && !event_ctx.fiber && !event_ctx.cb); // 有一个不为空断言
 
+        setEventContext(fd_ctx, event_ctx, cb);
+        return 0;
+    }
+
+    void IOManager::setEventContext(FdContext* fd_ctx, FdContext::EventContext& event_ctx, Task& cb) {
         // 赋值scheduler和回调函数，如果回调函数为空，则把当前协程当成回调执行体
         event_ctx.scheduler = Scheduler::GetThis();
+        if (fd_ctx->reactor && event_ctx.scheduler == this) {
+            // 事件触发后回到fd所在的线程执行，保持连接和线程的亲和性
+            event_ctx.thread = fd_ctx->reactor->threadId;
+        }
         if (cb) {  // 传入的是回调函数
-            event_ctx.cb.swap(cb);
+            event_ctx.cb = std::move(cb);
         } else {   // 使用当前协程
             event_ctx.fiber = Fiber::GetThis();
             SYLAR_ASSERT2(event_ctx.fiber->getState() == Fiber::RUNNING, "state=" << event_ctx.fiber->getState());
         }
+    }
+
+    int IOManager::addEventPersistent(FdContext* fd_ctx, Event event, Task& cb) {
+        // 已经就绪过且还没人消费，不用等待，消费掉锁存的就绪状态
+        if (fd_ctx->ready & event) {
+            fd_ctx->ready = (Event)(fd_ctx->ready & ~event);
+            if (cb) {
+                Scheduler::GetThis()->schedule(std::move(cb));
+                return 0;
+            }
+            return 1;
+        }
+
+        // 第一次添加事件时注册读写两个方向，之后整个生命周期都不再调用epoll_ctl
+        if (!fd_ctx->registered) {
+            if (m_reactorPerThread) {
+                fd_ctx->reactor = selectReactor();
+            }
+            epoll_event epevent;
+            epevent.events   = EPOLLET | EPOLLIN | EPOLLOUT;
+            epevent.data.ptr = fd_ctx;
+            int epfd = getEpfd(fd_ctx);
+            int rt = epoll_ctl(epfd, EPOLL_CTL_ADD, fd_ctx->fd, &epevent);
+            if (rt) {
+                SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
+                                          << (EpollCtlOp)EPOLL_CTL_ADD << ", " << fd_ctx->fd << ", "
+                                          << (EPOLL_EVENTS)epevent.events << "):"
+                                          << rt << " (" << errno << ") (" << strerror(errno) << ")";
+                return -1;
+            }
+            fd_ctx->registered = true;
+            fd_ctx->ready = NONE;
+        }
+
+        ++m_pendingEventCount;
+        fd_ctx->events = (Event)(fd_ctx->events | event);
+        FdContext::EventContext& event_ctx = fd_ctx->getEventContext(event);
+        SYLAR_ASSERT(!event_ctx.scheduler && !event_ctx.fiber && !event_ctx.cb);
+        setEventContext(fd_ctx, event_ctx, cb);
         return 0;
     }
 
     bool IOManager::delEvent(int fd, Event event) {
         // 找到fd对应的FdContext
-        RWMutexType::ReadLock lock(m_mutex);
-        if((int)m_fdContexts.size() <= fd) { // 说明没有这个fd的上下文
+        FdContext* fd_ctx = getFdContext(fd, false);
+        if (!fd_ctx) {
             return false;
         }
-        FdContext* fd_ctx = m_fdContexts[fd];
-        lock.unlock();
 
         FdContext::MutexType::Lock lock2(fd_ctx->mutex);
         if(SYLAR_UNLIKELY(!(fd_ctx->events & event))) { // 如果这个fd并没有添加这个事件
             return false;
         }
 
+        if(m_persistentEvents) {
+            // fd保持注册，只需要清除等待者
+            fd_ctx->events = (Event)(fd_ctx->events & ~event);
+            --m_pendingEventCount;
+            fd_ctx->resetEventContext(fd_ctx->getEventContext(event));
+            return true;
+        }
+
         // 清除指定的事件，表示不关心这个事件了，如果清除之后结果为0，则从epoll_wait中删除该文件描述符
         //与运算+取反运算 0x00000n00 & ~0x00000100 把n设为0。 下要删除的位置为1
         Event new_events = (Event)(fd_ctx->events & ~event);
@@ -235,9 +420,10 @@ namespace sylar {
         epevent.events   = EPOLLET | new_events;
         epevent.data.ptr = fd_ctx;
 
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+        int epfd = getEpfd(fd_ctx);
+        int rt = epoll_ctl(epfd, op, fd, &epevent);
         if(rt) {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
                                       << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
                                       << rt << " (" << errno << ") (" << strerror(rt) << ")";
             return false;
@@ -253,18 +439,22 @@ namespace sylar {
 
     bool IOManager::cancelEvent(int fd, Event event) {
         // 找到fd对应的FdContext
-        RWMutexType::ReadLock lock(m_mutex);
-        if((int)m_fdContexts.size() <= fd) {
+        FdContext* fd_ctx = getFdContext(fd, false);
+        if (!fd_ctx) {
             return false;
         }
-        FdContext* fd_ctx = m_fdContexts[fd];
-        lock.unlock();
 
         FdContext::MutexType::Lock lock2(fd_ctx->mutex);
         if(SYLAR_UNLIKELY(!(fd_ctx->events & event))) {
             return false;
         }
 
+        if(m_persistentEvents) {
+            fd_ctx->triggerEvent(event);
+            --m_pendingEventCount;
+            return true;
+        }
+
         //删除事件
         Event new_events = (Event)(fd_ctx->events & ~event);
         int op           = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
@@ -272,9 +462,10 @@ namespace sylar {
         epevent.events   = EPOLLET | new_events;
         epevent.data.ptr = fd_ctx;
 
-        int rt = epoll_ctl(m_epfd, op, fd, & epevent);
+        int epfd = getEpfd(fd_ctx);
+        int rt = epoll_ctl(epfd, op, fd, &epevent);
         if(rt) {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
                                       << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
                                       << rt << " (" << errno << ") (" << strerror(errno) << ")";
             return false;
@@ -289,15 +480,20 @@ namespace sylar {
 
     bool IOManager::cancelAll(int fd) {
         // 找到fd对应的FdContext
-        RWMutexType::ReadLock lock(m_mutex);
-        if((int)m_fdContexts.size() <= fd) {
+        FdContext* fd_ctx = getFdContext(fd, false);
+        if (!fd_ctx) {
             return false;
         }
-        FdContext* fd_ctx = m_fdContexts[fd];
-        lock.unlock();
 
         FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-        if(!(fd_ctx->events)) {
+        if(m_persistentEvents) {
+            // 持久注册模式下cancelAll是fd生命周期的结束(close)，从epoll中删除并清空锁存状态
+            if(!fd_ctx->registered) {
+                return false;
+            }
+            fd_ctx->registered = false;
+            fd_ctx->ready = NONE;
+        } else if(!(fd_ctx->events)) {
             return false;
         }
 
@@ -307,9 +503,10 @@ namespace sylar {
         epevent.events   = 0;
         epevent.data.ptr = fd_ctx;
 
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if(rt) {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+        int epfd = getEpfd(fd_ctx);
+        int rt = epoll_ctl(epfd, op, fd, &epevent);
+        if(rt && !m_persistentEvents) {
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
                                       << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
                                       << rt << " (" << errno << ") (" << strerror(errno) << ")";
             return false;
@@ -329,6 +526,116 @@ namespace sylar {
         return true;
     }
 
+    bool IOManager::submitIo(const std::function<void(io_uring_sqe*)>& prep, int& result, uint64_t timeout_ms) {
+        SYLAR_ASSERT(m_uring);
+        UringOp op;
+        op.fiber = Fiber::GetThis();
+        __kernel_timespec ts;
+        bool has_timeout = (timeout_ms != ~0ull);
+        {
+            Spinlock::Lock lock(m_uringMutex);
+            // 带超时的操作需要连续两个sqe，中间不能被提交打断，否则链接关系会挂到别的sqe上
+            uint32_t need = has_timeout ? 2 : 1;
+            if (m_uring->getFreeSqes() < need) {
+                flushIoNoLock();
+                if (m_uring->getFreeSqes() < need) {
+                    return false;
+                }
+            }
+            io_uring_sqe* sqe = m_uring->getSqe();
+            prep(sqe);
+            sqe->user_data = (uint64_t)(uintptr_t)&op;
+            if (has_timeout) {
+                ts.tv_sec  = timeout_ms / 1000;
+                ts.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
+                sqe->flags |= IOSQE_IO_LINK;
+                io_uring_sqe* tsqe = m_uring->getSqe();
+                tsqe->opcode    = IORING_OP_LINK_TIMEOUT;
+                tsqe->addr      = (uint64_t)(uintptr_t)&ts;
+                tsqe->len       = 1;
+                tsqe->user_data = (uint64_t)(uintptr_t)&op | URING_TIMEOUT_TAG;
+                op.refs = 2;
+            }
+            ++m_pendingEventCount;
+            ++m_pendingIo;
+            if (m_uring->getPendingSubmit() >= m_uringBatch) {
+                flushIoNoLock();
+            }
+        }
+
+        // 操作完成后由reapIo重新调度回来，此时op中的结果已经写好
+        Fiber::GetThis()->yield();
+        if (op.timedOut && op.res == -ECANCELED) {
+            result = -ETIMEDOUT;
+        } else {
+            result = op.res;
+        }
+        return true;
+    }
+
+    void IOManager::cancelIo(int fd) {
+        if (!m_uring || m_pendingIo == 0) {
+            return;
+        }
+        Spinlock::Lock lock(m_uringMutex);
+        if (m_uring->getFreeSqes() < 1) {
+            flushIoNoLock();
+        }
+        io_uring_sqe* sqe = m_uring->getSqe();
+        if (!sqe) {
+            SYLAR_LOG_ERROR(g_logger) << "cancelIo(" << fd << ") io_uring submission queue full";
+            return;
+        }
+        sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+        sqe->fd           = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data    = 0;
+        // 取消要立即生效，不等批量提交
+        flushIoNoLock();
+    }
+
+    void IOManager::flushIoNoLock() {
+        if (!m_uring->getPendingSubmit()) {
+            return;
+        }
+        int rt = m_uring->submit();
+        if (rt < 0) {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring submit error: " << rt << " (" << strerror(-rt) << ")";
+        }
+    }
+
+    size_t IOManager::reapIo() {
+        std::vector<Fiber::ptr> fibers;
+        {
+            Spinlock::Lock lock(m_uringMutex);
+            m_uring->reap([&fibers](io_uring_cqe* cqe) {
+                uint64_t data = cqe->user_data;
+                if (!data) {
+                    // cancelIo提交的取消请求，不关心结果
+                    return;
+                }
+                UringOp* op = (UringOp*)(uintptr_t)(data & ~URING_TIMEOUT_TAG);
+                if (data & URING_TIMEOUT_TAG) {
+                    if (cqe->res == -ETIME) {
+                        op->timedOut = true;
+                    }
+                } else {
+                    op->res = cqe->res;
+                }
+                if (--op->refs == 0) {
+                    fibers.push_back(std::move(op->fiber));
+                }
+            });
+        }
+        // 先加入调度再减计数，避免stopping()在两者之间误判为可以停止
+        for (auto& fiber : fibers) {
+            schedule(fiber);
+            --m_pendingIo;
+            --m_pendingEventCount;
+        }
+        return fibers.size();
+    }
+
     IOManager *IOManager::GetThis() {
         return dynamic_cast<IOManager *>(Scheduler::GetThis());
     }
@@ -341,10 +648,98 @@ namespace sylar {
     void IOManager::tickle() {
         SYLAR_LOG_DEBUG(g_logger) << "IOManager tickle";
         if(!hasIdleThreads()) {
+            ++m_ticklesSuppressed;
             return;
         }
-        int rt = write(m_tickleFds[1], "T", 1);
-        SYLAR_ASSERT(rt == 1);
+        if(m_reactorPerThread) {
+            // 和idle中标记可唤醒之后的检查配对，任务已经入队时两边至少有一边能看到对方
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // 只唤醒一个空闲线程，从轮询位置开始找，避免总是唤醒同一个；停止时唤醒全部
+            bool all = isStopping();
+            size_t n = m_reactors.size();
+            size_t start = m_reactorNext++;
+            for(size_t i = 0; i < n; ++i) {
+                Reactor* reactor = m_reactors[(start + i) % n];
+                if(all) {
+                    wakeReactor(reactor);
+                    continue;
+                }
+                bool expected = true;
+                if(reactor->idle.compare_exchange_strong(expected, false)) {
+                    wakeReactor(reactor);
+                    return;
+                }
+            }
+            if(!all) {
+                // 空闲的线程都已经被唤醒过了
+                ++m_ticklesSuppressed;
+            }
+            return;
+        }
+
+        // 在途的唤醒数达到空闲线程数时，再写eventfd也不会多唤醒线程，直接合并掉；停止时必须唤醒全部线程
+        if(!isStopping()) {
+            size_t pending = m_pendingTickles;
+            do {
+                if(pending >= getIdleThreadCount()) {
+                    ++m_ticklesSuppressed;
+                    return;
+                }
+            } while(!m_pendingTickles.compare_exchange_weak(pending, pending + 1));
+        } else {
+            ++m_pendingTickles;
+        }
+        uint64_t one = 1;
+        int rt = write(m_tickleFd, &one, sizeof(one));
+        SYLAR_ASSERT(rt == sizeof(one));
+        ++m_ticklesSent;
+    }
+
+    void IOManager::tickleThread(int thread) {
+        if(!m_reactorPerThread) {
+            tickle();
+            return;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        for(auto reactor : m_reactors) {
+            if(reactor->threadId == thread) {
+                if(reactor->idle.exchange(false)) {
+                    wakeReactor(reactor);
+                }
+                return;
+            }
+        }
+        // 目标线程还没有认领Reactor，退化为唤醒任意空闲线程
+        tickle();
+    }
+
+    void IOManager::wakeReactor(Reactor* reactor) {
+        uint64_t one = 1;
+        int rt = write(reactor->eventFd, &one, sizeof(one));
+        SYLAR_ASSERT(rt == sizeof(one));
+        ++m_ticklesSent;
+    }
+
+    IOManager::Reactor* IOManager::getThreadReactor() {
+        if(Scheduler::GetThis() != this) {
+            return nullptr;
+        }
+        if(t_reactor_owner != this) {
+            size_t idx = m_reactorSeq++;
+            SYLAR_ASSERT(idx < m_reactors.size());
+            t_reactor_owner = this;
+            t_reactor = m_reactors[idx];
+            m_reactors[idx]->threadId = sylar::GetThreadId();
+        }
+        return (Reactor*)t_reactor;
+    }
+
+    IOManager::Reactor* IOManager::selectReactor() {
+        Reactor* reactor = getThreadReactor();
+        if(!reactor) {
+            reactor = m_reactors[m_reactorNext++ % m_reactors.size()];
+        }
+        return reactor;
     }
 
     bool IOManager::stopping() {
@@ -367,23 +762,39 @@ namespace sylar {
     void IOManager::idle() {
         SYLAR_LOG_DEBUG(g_logger) << "IOManager idle";
 
+        // 每线程epoll模式下只等待本线程的epoll，非该模式下所有线程共享m_epfd
+        Reactor* reactor = m_reactorPerThread ? getThreadReactor() : nullptr;
+        int epfd      = reactor ? reactor->epfd : m_epfd;
+        int tickle_fd = reactor ? reactor->eventFd : m_tickleFd;
+        int uring_fd  = m_uring ? m_uring->getFd() : -1;
+
         // 一次epoll_wait最多检测256个就绪事件，如果就绪事件超过了这个数，那么会在下轮epoll_wati继续处理
         const uint64_t MAX_EVENTS = 256;
         epoll_event* events = new epoll_event[MAX_EVENTS]();
         std::shared_ptr<epoll_event> shared_events(events, [](epoll_event* ptr){
             delete[] ptr;
         });
+        // 到期定时器的回调，跨轮复用容量
+        std::vector<Task> cbs;
+        // 本轮唤醒的任务，批量投递模式下收集起来一次发布，跨轮复用容量
+        std::vector<ScheduleTask> ready;
+        std::vector<ScheduleTask>* batch = m_batchSchedule ? &ready : nullptr;
+        // 本线程忙轮询的近期命中率，定点数，BUSY_POLL_ONE为100%
+        uint32_t poll_rate = BUSY_POLL_ONE;
+        // 本线程的运行计数，idle总是在Scheduler::run中被切入，不会为空
+        ThreadCounters* counters = GetThreadCounters();
 
         while (true) {
             // 获取下一个定时器的超时时间，顺便判断调度器是否停止
             uint64_t next_timeout = 0;
-            if( SYLAR_UNLIKELY(stopping(next_timeout))) {
+            if( SYLAR_UNLIKELY(stopping(next_timeout) || isRetiring())) {
                 SYLAR_LOG_DEBUG(g_logger) << "name=" << getName() << "idle stopping exit";
                 break;
             }
 
             // 阻塞在epoll_wait上，等待事件发生或定时器超时
             int rt = 0;
+            bool polled = false;
             do{
                 // 默认超时时间5秒，如果下一个定时器的超时时间大于5秒，仍以5秒来计算超时，避免定时器超时时间太大时，epoll_wait一直阻塞
                 static const int MAX_TIMEOUT = 5000;
@@ -393,33 +804,88 @@ namespace sylar {
                     next_timeout = MAX_TIMEOUT;
                 }
                 // rt 返回事件个数
-                rt = epoll_wait(m_epfd, events, MAX_EVENTS, (int)next_timeout);
+                if(m_uring) {
+                    // 本轮调度中各协程积累的IO操作一次性提交；已有完成事件时不阻塞
+                    {
+                        Spinlock::Lock lock(m_uringMutex);
+                        flushIoNoLock();
+                    }
+                    if(reapIo() > 0) {
+                        next_timeout = 0;
+                    }
+                }
+                if(reactor) {
+                    reactor->idle = true;
+                }
+                if(m_busyPollUs && next_timeout > 0 && !polled) {
+                    // 低延迟模式：先自旋一小段时间，期间来的任务和IO事件不用经过一次睡眠唤醒
+                    polled = true;
+                    rt = busyPoll(epfd, events, MAX_EVENTS, next_timeout, poll_rate);
+                    if(rt >= 0) {
+                        if(reactor) {
+                            reactor->idle = false;
+                        }
+                        break;
+                    }
+                }
+                if(reactor && next_timeout > 0) {
+                    // 标记为可唤醒之后再查一遍队列：在这之前投递的任务看到本线程不可唤醒，tickle被合并掉了，
+                    // 在这之后投递的任务一定能看到标记并写eventfd
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if(hasRunnableTasks()) {
+                        next_timeout = 0;
+                    }
+                }
+                rt = epoll_wait(epfd, events, MAX_EVENTS, (int)next_timeout);
+                if(reactor) {
+                    reactor->idle = false;
+                }
                 if(rt < 0 && errno == EINTR) {
                     continue;
                 } else {
                     break;
                 }
             } while(true);
+            if(counters) {
+                // 忙轮询等到结果也算一次等待，轮询中间的空转不计
+                Count(counters->epollWaits);
+                if(rt > 0) {
+                    Count(counters->epollEvents, rt);
+                }
+            }
 
             // 收集所有已超时的定时器，执行回调函数
-            std::vector<std::function<void()> > cbs;
             listExpiredCb(cbs);
             if(!cbs.empty()) {
-                for(const auto& cb : cbs) {
-                    schedule(cb);
+                if(counters) {
+                    Count(counters->timerExpired, cbs.size());
+                }
+                for(auto& cb : cbs) {
+                    if(batch) {
+                        batch->emplace_back(std::move(cb), -1);
+                    } else {
+                        schedule(std::move(cb));
+                    }
                 }
                 cbs.clear();
             }
 
             // 遍历所有发生的事件，根据epoll_event的私有指针找到对应的FdContext，进行事件处理
+            // 触发的事件数在任务发布之后再从m_pendingEventCount中减去，其他线程不会在任务可见之前判断为可以停止
+            size_t fired = 0;
             for (int i = 0; i < rt; ++i) {
                 epoll_event& event = events[i];
-                if (event.data.fd == m_tickleFds[0]) {
-                    // ticklefd[0]用于通知协程调度，这时只需要把管道里的内容读完即可
-                    uint8_t dummy[256];
-                    while (read(m_tickleFds[0], dummy, sizeof(dummy)) > 0){};
-                        continue;
-
+                if (event.data.fd == tickle_fd) {
+                    // eventfd用于通知协程调度，一次read就取走全部计数并清零
+                    uint64_t count = 0;
+                    if (read(tickle_fd, &count, sizeof(count)) == sizeof(count) && !reactor) {
+                        m_pendingTickles -= count;
+                    }
+                    continue;
+                }
+                if (event.data.fd == uring_fd) {
+                    reapIo();
+                    continue;
                 }
 
                 FdContext* fd_ctx = (FdContext* )event.data.ptr;
@@ -430,7 +896,8 @@ namespace sylar {
                  * 出现这两种事件，应该同时触发fd的读和写事件，否则有可能出现注册的事件永远执行不到的情况
                  */
                 if (event.events & (EPOLLERR | EPOLLHUP)) {
-                    event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+                    // 持久注册模式下没有等待者也要锁存，下一次addEvent才能立即返回
+                    event.events |= (EPOLLIN | EPOLLOUT) & (m_persistentEvents ? (EPOLLIN | EPOLLOUT) : fd_ctx->events);
                 }
                 int real_events = NONE;
                 if (event.events & EPOLLIN) {
@@ -440,6 +907,21 @@ namespace sylar {
                     real_events |= WRITE;
                 }
 
+                if (m_persistentEvents) {
+                    // fd一直保持注册，有等待者就唤醒，没有就把就绪状态锁存下来，不调用epoll_ctl
+                    int wake = fd_ctx->events & real_events;
+                    fd_ctx->ready = (Event)(fd_ctx->ready | (real_events & ~wake));
+                    if (wake & READ) {
+                        fd_ctx->triggerEvent(READ, batch, this);
+                        ++fired;
+                    }
+                    if (wake & WRITE) {
+                        fd_ctx->triggerEvent(WRITE, batch, this);
+                        ++fired;
+                    }
+                    continue;
+                }
+
                 if ((fd_ctx->events & real_events) == NONE) {
                     continue;
                 }
@@ -449,9 +931,9 @@ namespace sylar {
                 int op          = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
                 event.events    = EPOLLET | left_events;
 
-                int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
+                int rt2 = epoll_ctl(epfd, op, fd_ctx->fd, &event);
                 if (rt2) {
-                    SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+                    SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << epfd << ", "
                                               << (EpollCtlOp)op << ", " << fd_ctx->fd << ", " << (EPOLL_EVENTS)event.events << "):"
                                               << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
                     continue;
@@ -459,15 +941,21 @@ namespace sylar {
 
                 // 处理已经发生的事件，也就是让调度器调度指定的函数或协程
                 if (real_events & READ) {
-                    fd_ctx->triggerEvent(READ);
-                    --m_pendingEventCount;
+                    fd_ctx->triggerEvent(READ, batch, this);
+                    ++fired;
                 }
                 if (real_events & WRITE) {
-                    fd_ctx->triggerEvent(WRITE);
-                    --m_pendingEventCount;
+                    fd_ctx->triggerEvent(WRITE, batch, this);
+                    ++fired;
                 }
             } // end for
 
+            // 本轮的定时器回调和被唤醒的协程一次发布
+            scheduleBatch(ready);
+            if(fired) {
+                m_pendingEventCount -= fired;
+            }
+
             /**
              * 一旦处理完所有的事件，idle协程yield，这样可以让调度协程(Scheduler::run)重新检查是否有新任务要调度
              * 上面triggerEvent实际也只是把对应的fiber重新加入调度，要执行的话还要等idle协程退出
@@ -480,6 +968,46 @@ namespace sylar {
         } // end while(true)
     }
 
+    int IOManager::busyPoll(int epfd, epoll_event* events, int maxevents, uint64_t timeout_ms, uint32_t& rate) {
+        // 自旋时长按命中率缩放，保留1/8的下限，长时间空闲后仍能重新发现流量
+        uint64_t budget = std::max<uint64_t>(m_busyPollUs / 8, (uint64_t)m_busyPollUs * rate / BUSY_POLL_ONE);
+        budget = std::min(budget, timeout_ms * 1000);
+        uint64_t deadline = sylar::GetCurrentUS() + budget;
+        int rt = -1;
+        do {
+            if(hasPendingTasks()) {
+                rt = 0;
+                break;
+            }
+            int n = epoll_wait(epfd, events, maxevents, 0);
+            if(n > 0) {
+                rt = n;
+                break;
+            }
+            CpuRelax();
+        } while(sylar::GetCurrentUS() < deadline);
+
+        // 命中率按1/8的权重做指数滑动平均
+        if(rt >= 0) {
+            rate += (BUSY_POLL_ONE - rate) >> 3;
+            ++m_busyPollHits;
+        } else {
+            rate -= rate >> 3;
+            ++m_busyPollMisses;
+        }
+        return rt;
+    }
+
+    SchedulerStats IOManager::getStats() {
+        SchedulerStats stats = Scheduler::getStats();
+        stats.pendingEvents     = m_pendingEventCount;
+        stats.ticklesSent       = m_ticklesSent;
+        stats.ticklesSuppressed = m_ticklesSuppressed;
+        stats.busyPollHits      = m_busyPollHits;
+        stats.busyPollMisses    = m_busyPollMisses;
+        return stats;
+    }
+
     void IOManager::onTimerInsertedAtFront() {
         tickle();
     }
@@ -12,6 +12,10 @@
 
 #include "scheduler.h"
 #include "timer.h"
+#include "io_uring.h"
+#include "fd_table.h"
+
+struct epoll_event;
 
 namespace sylar {
     class IOManager : public Scheduler, public TimerManager {
@@ -29,12 +33,14 @@ namespace sylar {
         };
 
     private:
+        struct Reactor;
+
         /**
          * @brief socket fd 上下文类
          * @details 每个socket fd都对应一个FdContext，包括fd的值，fd上的事件，以及fd的读写事件上下文中
          */
         struct FdContext {
-            typedef Mutex MutexType;
+            typedef Spinlock MutexType;
             /**
              * @brief 事件上下文类
              * @details fd的每个事件都有一个事件上下文，保存这个事件的回调函数以及执行回调函数的调度器
@@ -43,7 +49,8 @@ namespace sylar {
             struct EventContext {
                 Scheduler*            scheduler = nullptr;  // 执行事件回调的调度器
                 Fiber::ptr            fiber;                // 事件协程
-                std::function<void()> cb;                   // 事件的回调函数
+                Task                  cb;                   // 事件的回调函数
+                int                   thread = -1;          // 执行事件回调的线程id，-1表示任意线程
             };
 
             /**
@@ -63,14 +70,31 @@ namespace sylar {
              * @brief 触发事件
              * @details 根据事件类型调用对应上下文结构中的调度器去调度回调协程或回调函数
              * @param[in] event 事件类型
+             * @param[out] batch 不为空且事件属于owner时，任务放入batch由调用者统一投递，否则立即调度
+             * @param[in] owner batch所属的调度器
              */
-            void triggerEvent(Event event);
+            void triggerEvent(Event event, std::vector<ScheduleTask>* batch = nullptr, Scheduler* owner = nullptr);
 
             EventContext read;                 // 读事件上下文
             EventContext write;                // 写事件上下文
             int          fd = 0;               // 事件关联的句柄
             Event        events = NONE;        // 该fd添加了哪些事件的回调函数
-            MutexType    mutex;                // 互斥锁
+            MutexType    mutex;                // 自旋锁，临界区只是改几个字段或一次epoll_ctl
+            Reactor*     reactor = nullptr;    // fd注册在哪个线程的epoll上(每线程epoll模式)，为空表示还未注册
+            Event        ready = NONE;         // 持久注册模式下已就绪但还没有等待者的事件
+            bool         registered = false;   // 持久注册模式下fd是否已注册到epoll
+        };
+
+        /**
+         * @brief 每个调度线程独占的epoll实例(每线程epoll模式)
+         * @details 线程在自己的epoll上注册和等待fd事件，事件触发后协程回到注册它的线程执行；
+         *          其他线程通过写eventfd唤醒它
+         */
+        struct Reactor {
+            int               epfd = -1;            // 本线程的epoll句柄
+            int               eventFd = -1;         // 用于唤醒本线程的eventfd
+            std::atomic<int>  threadId = {-1};      // 所属调度线程id，-1表示还未有线程认领
+            std::atomic<bool> idle = {false};       // 是否阻塞在epoll_wait上且还未被唤醒
         };
 
     public:
@@ -92,9 +116,11 @@ namespace sylar {
          * @param fd 句柄
          * @param event 事件
          * @param cb 事件回调函数，如果为空，则默认把当前协程作为回调执行体
-         * @return 1 success  0 retry  -1 error
+         * @details 持久注册模式下，如果fd上已经锁存了该事件的就绪状态，则不再等待：
+         *          传入了cb时立即调度cb并返回0，未传入cb时返回1，调用者不需要yield，直接重试IO即可
+         * @return 0 success  1 already ready(持久注册模式)  -1 error
          */
-        int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+        int addEvent(int fd, Event event, Task cb = nullptr);
 
         /**
          * @brief 删除事件
@@ -125,13 +151,84 @@ namespace sylar {
          */
         static IOManager* GetThis();
 
+        /**
+         * @brief 是否开启了每线程epoll模式
+         */
+        bool isReactorPerThread() const { return m_reactorPerThread; }
+
+        /**
+         * @brief 是否开启了持久注册模式
+         * @details fd第一次添加事件时以EPOLLIN|EPOLLOUT|EPOLLET注册，直到cancelAll(close)才删除，
+         *          之后的添加/删除/触发事件都不再调用epoll_ctl，没有等待者时的就绪状态锁存在FdContext中
+         */
+        bool isPersistentEvents() const { return m_persistentEvents; }
+
+        /**
+         * @brief idle是否把一轮epoll_wait的事件和到期定时器收集起来批量投递
+         */
+        bool isBatchSchedule() const { return m_batchSchedule; }
+
+        /**
+         * @brief 是否使用io_uring执行IO操作
+         * @details 配置了iomanager.io_uring且内核支持时为true，否则hook层回退到epoll
+         */
+        bool hasIoUring() const { return (bool)m_uring; }
+
+        /**
+         * @brief 通过io_uring执行一个IO操作，挂起当前协程直到操作完成
+         * @details sqe不会立即提交，而是在本线程进入idle或积累到iomanager.io_uring_batch个时一次性提交，
+         *          这样同一轮调度中各个协程发起的IO合并为一次io_uring_enter
+         * @param[in] prep 填充sqe的操作码、fd、缓冲区等，user_data由IOManager设置
+         * @param[out] result 操作的结果，出错时为-errno，超时为-ETIMEDOUT
+         * @param[in] timeout_ms 超时时间(毫秒)，~0ull表示不超时
+         * @return 是否提交了；提交队列满且刷新后仍然没有空闲的sqe时返回false，协程没有挂起，由调用者回退到epoll
+         */
+        bool submitIo(const std::function<void(io_uring_sqe*)>& prep, int& result, uint64_t timeout_ms = ~0ull);
+
+        /**
+         * @brief 取消fd上所有还未完成的io_uring操作，被取消的操作返回-ECANCELED
+         */
+        void cancelIo(int fd);
+
+        /**
+         * @brief 实际发出唤醒(写eventfd)的tickle次数
+         */
+        uint64_t getTicklesSent() const { return m_ticklesSent; }
+
+        /**
+         * @brief 因为没有空闲线程或已有足够的唤醒在途而省掉的tickle次数
+         */
+        uint64_t getTicklesSuppressed() const { return m_ticklesSuppressed; }
+
+        /**
+         * @brief 忙轮询期间等到了任务或IO事件的次数
+         */
+        uint64_t getBusyPollHits() const { return m_busyPollHits; }
+
+        /**
+         * @brief 忙轮询自旋到期仍一无所获、转入阻塞等待的次数
+         */
+        uint64_t getBusyPollMisses() const { return m_busyPollMisses; }
+
+        /**
+         * @brief 在调度器统计的基础上补充IO事件、tickle和忙轮询的计数
+         */
+        SchedulerStats getStats() override;
+
     protected:
        /**
         * @brief 通知调度器有任务要调度
-        * @details 写pipe让idle协程从epoll_wait退出，待idle协程yield之后Scheduler::run就可以调度其他任务
+        * @details 写eventfd让idle协程从epoll_wait退出，待idle协程yield之后Scheduler::run就可以调度其他任务。
+        *          已发出还未被消费的唤醒数不少于空闲线程数时不再写eventfd，并发的tickle合并为一次系统调用
         */
         void tickle() override;
 
+        /**
+         * @brief 通知指定线程有任务要调度
+         * @details 每线程epoll模式下只唤醒目标线程，否则同tickle
+         */
+        void tickleThread(int thread) override;
+
         /**
          * @brief 判断是否可以停止
          * @details 判断条件是Scheduler::stopping()外加IOManager的m_pendingEventCount为0，
@@ -160,17 +257,93 @@ namespace sylar {
         void onTimerInsertedAtFront() override;
 
         /**
-         * @brief 重置socket句柄上下文的容器大小
-         * @param size 容量大小
+         * @brief 获取fd对应的上下文，无锁
+         * @param[in] fd 句柄
+         * @param[in] auto_create 所在块不存在时是否分配
+         * @return 不存在或fd越界时返回nullptr
+         */
+        FdContext* getFdContext(int fd, bool auto_create);
+
+        /**
+         * @brief 获取当前线程的Reactor，当前线程是本调度器的调度线程且还未认领时认领一个
+         * @return 不是本调度器的调度线程返回nullptr
+         */
+        Reactor* getThreadReactor();
+
+        /**
+         * @brief 为还未注册的fd选择一个Reactor，调度线程用自己的，其他线程轮询分配
+         */
+        Reactor* selectReactor();
+
+        /**
+         * @brief 写eventfd唤醒指定Reactor
+         */
+        void wakeReactor(Reactor* reactor);
+
+        /**
+         * @brief 设置事件上下文的调度器、回调函数或协程
+         */
+        void setEventContext(FdContext* fd_ctx, FdContext::EventContext& event_ctx, Task& cb);
+
+        /**
+         * @brief 持久注册模式下的添加事件，需持有fd_ctx->mutex
+         */
+        int addEventPersistent(FdContext* fd_ctx, Event event, Task& cb);
+
+        /**
+         * @brief idle阻塞之前的忙轮询(iomanager.busy_poll_us)
+         * @details 自旋期间反复检查注入队列和本地队列，并以0超时调用epoll_wait。
+         *          自旋时长为配置值乘以本线程近期的命中率，命中率按每次轮询的结果做滑动平均
+         * @param[in] timeout_ms 距下一个定时器的时间，自旋不会超过它
+         * @param[in, out] rate 本线程的命中率，BUSY_POLL_ONE为100%
+         * @return 等到的IO事件数，等到了任务返回0，自旋到期返回-1
+         */
+        int busyPoll(int epfd, epoll_event* events, int maxevents, uint64_t timeout_ms, uint32_t& rate);
+
+        /**
+         * @brief 按配置创建io_uring并把它的句柄注册到epoll中，失败时保持epoll模式
+         */
+        void initIoUring();
+
+        /**
+         * @brief 把已填好的sqe提交给内核，需持有m_uringMutex
+         */
+        void flushIoNoLock();
+
+        /**
+         * @brief 收割io_uring的完成事件，重新调度等待的协程
+         * @return 重新调度的协程数
          */
-        void contextResize(size_t size);
+        size_t reapIo();
+
+        /**
+         * @brief fd当前所在的epoll句柄
+         */
+        int getEpfd(FdContext* fd_ctx) const { return fd_ctx->reactor ? fd_ctx->reactor->epfd : m_epfd; }
 
     private:
         int                     m_epfd = 0;                      // epoll的句柄
-        int                     m_tickleFds[2];                  // pipe的句柄，fd[0]读端，fd[1]写端
+        int                     m_tickleFd = -1;                // 用于tickle的eventfd
+        std::atomic<size_t>     m_pendingTickles = {0};         // 已写入eventfd还未被idle协程读走的唤醒数
+        std::atomic<uint64_t>   m_ticklesSent = {0};            // 实际写eventfd的tickle次数
+        std::atomic<uint64_t>   m_ticklesSuppressed = {0};      // 被合并或无需唤醒而省掉的tickle次数
         std::atomic<size_t>     m_pendingEventCount = {0};     // 等待执行的IO事件数
-        RWMutexType             m_mutex;                        // 读写锁
-        std::vector<FdContext*> m_fdContexts;                   // socket事件上下文的容器
+        FdTable<FdContext>      m_fdContexts;                   // socket事件上下文的表，按fd分块增长
+        bool                    m_reactorPerThread = false;     // 是否每个调度线程一个epoll
+        bool                    m_persistentEvents = false;     // 是否持久注册fd，去掉每次事件的epoll_ctl
+        bool                    m_batchSchedule = true;         // 是否批量投递一轮事件循环唤醒的任务
+        uint32_t                m_busyPollUs = 0;               // idle阻塞前最多忙轮询的微秒数，0为关闭
+        std::atomic<uint64_t>   m_busyPollHits = {0};           // 忙轮询命中次数
+        std::atomic<uint64_t>   m_busyPollMisses = {0};         // 忙轮询落空次数
+        std::vector<Reactor*>   m_reactors;                     // 每个调度线程的epoll实例(每线程epoll模式)
+        std::atomic<size_t>     m_reactorSeq = {0};             // 调度线程认领Reactor的序号
+        std::atomic<size_t>     m_reactorNext = {0};            // 轮询分配Reactor的序号
+        IoUring::ptr            m_uring;                        // io_uring实例，未开启或内核不支持时为空
+        Spinlock                m_uringMutex;                   // 保护m_uring的提交队列和完成队列
+        uint32_t                m_uringBatch = 32;              // 积累多少个sqe后立即提交
+        std::atomic<size_t>     m_pendingIo = {0};              // 已提交还未完成的io_uring操作数
+
+        static const uint32_t   BUSY_POLL_ONE = 1024;           // 忙轮询命中率的定点数1
     };
 
 
@@ -5,6 +5,7 @@
 #include <time.h>
 #include <string.h>
 #include "config.h"
+#include "hook.h"
 #include "util.h"
 
 
@@ -362,16 +363,23 @@ namespace sylar {
 
     void FileLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
         if (level >= m_level) {
+            // 普通文件的写在hook开启时会卸载到线程池并挂起协程，持锁挂起会让同一线程上写日志的其他协程卡在锁上，
+            // 日志直接在当前线程写
+            bool hook = is_hook_enable();
+            set_hook_enable(false);
             uint64_t now = event->getTime();
             if (now >= (m_lastTime + 3)) {
                 reopen();
                 m_lastTime = now;
             }
-            MutexType::Lock lock(m_mutex);
-            //if(!(m_filestream << m_formatter->format(logger, level, event))) {
-            if (!m_formatter->format(m_filestream, logger, level, event)) {
-                std::cout << "error" << std::endl;
+            {
+                MutexType::Lock lock(m_mutex);
+                //if(!(m_filestream << m_formatter->format(logger, level, event))) {
+                if (!m_formatter->format(m_filestream, logger, level, event)) {
+                    std::cout << "error" << std::endl;
+                }
             }
+            set_hook_enable(hook);
         }
     }
 
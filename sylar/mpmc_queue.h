@@ -0,0 +1,144 @@
+/**
+  ********************************************************
+  * @file        : mpmc_queue.h
+  * @author      : zgys
+  * @brief       : 有界无锁多生产者多消费者队列
+  * @attention   : 基于Dmitry Vyukov的bounded MPMC queue，容量向上取整为2的幂
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#ifndef __SYLAR_MPMC_QUEUE_H__
+#define __SYLAR_MPMC_QUEUE_H__
+
+#include <atomic>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+#include "noncopyable.h"
+
+namespace sylar {
+
+    /**
+     * @brief 有界无锁MPMC环形队列
+     * @details 每个槽位带一个序号，生产者/消费者通过CAS抢占位置后只操作自己的槽位，
+     *          槽位在构造时一次性分配，入队出队都不再分配内存。队列满时tryPush返回false，由调用者走溢出路径
+     */
+    template<class T>
+    class MPMCQueue : Noncopyable {
+    public:
+        /**
+         * @brief 构造函数
+         * @param[in] capacity 队列容量，会向上取整为2的幂，最小为2
+         */
+        explicit MPMCQueue(size_t capacity) {
+            size_t size = 2;
+            while (size < capacity) {
+                size <<= 1;
+            }
+            m_mask   = size - 1;
+            m_buffer = new Cell[size];
+            for (size_t i = 0; i < size; ++i) {
+                m_buffer[i].sequence.store(i, std::memory_order_relaxed);
+            }
+            m_enqueuePos.store(0, std::memory_order_relaxed);
+            m_dequeuePos.store(0, std::memory_order_relaxed);
+        }
+
+        ~MPMCQueue() {
+            delete[] m_buffer;
+        }
+
+        /**
+         * @brief 入队，成功时v的内容被移动到队列中
+         * @return 队列已满返回false
+         */
+        bool tryPush(T& v) {
+            Cell* cell;
+            size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+            while (true) {
+                cell = &m_buffer[pos & m_mask];
+                size_t seq = cell->sequence.load(std::memory_order_acquire);
+                intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+                if (dif == 0) {          // 槽位空闲，抢占位置
+                    if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (dif < 0) {    // 槽位还没被消费，队列满
+                    return false;
+                } else {                 // 被其他生产者抢先，重新读取位置
+                    pos = m_enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+            cell->data = std::move(v);
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * @brief 出队
+         * @param[out] v 出队的元素
+         * @return 队列为空返回false
+         */
+        bool tryPop(T& v) {
+            Cell* cell;
+            size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+            while (true) {
+                cell = &m_buffer[pos & m_mask];
+                size_t seq = cell->sequence.load(std::memory_order_acquire);
+                intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+                if (dif == 0) {          // 槽位已写入，抢占位置
+                    if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (dif < 0) {    // 槽位还没写入，队列空
+                    return false;
+                } else {
+                    pos = m_dequeuePos.load(std::memory_order_relaxed);
+                }
+            }
+            v = std::move(cell->data);
+            cell->data = T();            // 释放槽位中持有的资源(如智能指针)
+            cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * @brief 队列中的元素个数(包括正在入队的)，并发下只是近似值
+         */
+        size_t size() const {
+            // 先读消费者位置再读生产者位置，保证enq >= deq
+            size_t deq = m_dequeuePos.load(std::memory_order_acquire);
+            size_t enq = m_enqueuePos.load(std::memory_order_acquire);
+            return enq > deq ? enq - deq : 0;
+        }
+
+        /**
+         * @brief 是否为空，正在入队的元素也视为非空
+         */
+        bool empty() const { return size() == 0; }
+
+        /**
+         * @brief 队列容量
+         */
+        size_t capacity() const { return m_mask + 1; }
+
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T                   data;
+        };
+
+        static const size_t CACHELINE_SIZE = 64;
+
+        char                m_pad0[CACHELINE_SIZE];
+        Cell*               m_buffer = nullptr;                            // 槽位数组
+        size_t              m_mask = 0;                                    // 容量-1，用于取模
+        char                m_pad1[CACHELINE_SIZE];
+        std::atomic<size_t> m_enqueuePos;                                  // 生产者位置
+        char                m_pad2[CACHELINE_SIZE - sizeof(size_t)];
+        std::atomic<size_t> m_dequeuePos;                                  // 消费者位置
+        char                m_pad3[CACHELINE_SIZE - sizeof(size_t)];
+    };
+}
+
+#endif //SYLAR_MPMC_QUEUE_H
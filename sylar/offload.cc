@@ -0,0 +1,126 @@
+/**
+  ********************************************************
+  * @file        : offload.cc
+  * @author      : zgys
+  * @brief       : 阻塞调用的卸载线程池
+  * @attention   : None
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#include "offload.h"
+#include "config.h"
+#include "fiber.h"
+#include "log.h"
+#include "macro.h"
+#include "scheduler.h"
+#include <algorithm>
+
+namespace sylar {
+
+    static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    // 卸载线程池的线程数，同时进行的阻塞调用超过这个数时排队
+    static ConfigVar<uint32_t>::ptr g_offload_threads =
+            Config::Lookup<uint32_t>("offload.threads", 4, "offload thread pool size");
+
+    OffloadPool::OffloadPool(size_t threads, const std::string& name) {
+        if(!threads) {
+            threads = std::max<uint32_t>(g_offload_threads->getValue(), 1);
+        }
+        m_threads.reserve(threads);
+        for(size_t i = 0; i < threads; ++i) {
+            m_threads.push_back(Thread::ptr(new Thread(std::bind(&OffloadPool::worker, this),
+                                                       name + "_" + std::to_string(i))));
+        }
+    }
+
+    OffloadPool::~OffloadPool() {
+        stop();
+    }
+
+    bool OffloadPool::CanOffload() {
+        return Scheduler::GetThis() && Fiber::GetThisPtr() != Scheduler::GetMainFiber();
+    }
+
+    void OffloadPool::run(Task fn) {
+        std::shared_ptr<Job> job;
+        if(CanOffload()) {
+            MutexType::Lock lock(m_mutex);
+            if(!m_stopping) {
+                job = std::make_shared<Job>();
+                job->fn     = std::move(fn);
+                job->waiter = FiberWaiter::Current();
+                // 池中的线程唤醒本协程之前，调度器不能停止
+                job->waiter.scheduler->addExternalWaiter();
+                m_jobs.push_back(job);
+                ++m_pending;
+            }
+        }
+        if(!job) {
+            fn();
+            return;
+        }
+
+        Fiber* cur = Fiber::GetThisPtr();
+        // 挂起期间池中的线程会访问本协程栈上的参数，共享栈不能被换出
+        cur->setStackPinned(true);
+        m_sem.notify();
+        cur->yield();
+        cur->setStackPinned(false);
+        if(job->error) {
+            std::rethrow_exception(job->error);
+        }
+    }
+
+    void OffloadPool::stop() {
+        std::vector<Thread::ptr> threads;
+        {
+            MutexType::Lock lock(m_mutex);
+            if(m_stopping) {
+                return;
+            }
+            m_stopping = true;
+            for(size_t i = 0; i < m_threads.size(); ++i) {
+                m_jobs.push_back(nullptr);
+            }
+            threads = m_threads;
+        }
+        for(size_t i = 0; i < threads.size(); ++i) {
+            m_sem.notify();
+        }
+        for(auto& i : threads) {
+            i->join();
+        }
+    }
+
+    void OffloadPool::worker() {
+        while(true) {
+            m_sem.wait();
+            std::shared_ptr<Job> job;
+            {
+                MutexType::Lock lock(m_mutex);
+                SYLAR_ASSERT(!m_jobs.empty());
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            if(!job) {
+                break;
+            }
+            --m_pending;
+            try {
+                job->fn();
+            } catch (...) {
+                job->error = std::current_exception();
+            }
+            job->fn = nullptr;
+            ++m_completed;
+            // 结果写完之后再唤醒，协程恢复后直接读取
+            FiberWaiter waiter = std::move(job->waiter);
+            Scheduler* scheduler = waiter.scheduler;
+            job.reset();
+            waiter.wake();
+            scheduler->removeExternalWaiter();
+        }
+        SYLAR_LOG_DEBUG(g_logger) << "offload worker exit";
+    }
+}
@@ -0,0 +1,130 @@
+/**
+  ********************************************************
+  * @file        : offload.h
+  * @author      : zgys
+  * @brief       : 阻塞调用的卸载线程池
+  * @attention   : 只有在调度器的协程中调用时才会卸载，其余情况在当前线程直接执行
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#ifndef __SYLAR_OFFLOAD_H__
+#define __SYLAR_OFFLOAD_H__
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <stdint.h>
+#include "fiber_sync.h"
+#include "mutex.h"
+#include "noncopyable.h"
+#include "singleton.h"
+#include "task.h"
+#include "thread.h"
+
+namespace sylar {
+
+    /**
+     * @brief 卸载线程池
+     * @details 有些调用无法用epoll变成非阻塞的：getaddrinfo、普通文件的读写、fsync等，
+     *          直接在调度线程上调用会把整个线程上的协程都卡住。协程把这类调用提交给线程池后挂起，
+     *          池中的线程执行完后通过FiberWaiter把协程放回它原来的调度器。
+     *          共享栈模式下，等待期间协程的栈被固定在原处，调用可以直接使用调用者栈上的参数和缓冲区
+     */
+    class OffloadPool : Noncopyable {
+    public:
+        typedef std::shared_ptr<OffloadPool> ptr;
+        typedef Mutex MutexType;
+
+        /**
+         * @brief 构造函数，立即创建线程
+         * @param[in] threads 线程数，为0时使用offload.threads配置
+         * @param[in] name 线程名前缀
+         */
+        explicit OffloadPool(size_t threads = 0, const std::string& name = "offload");
+
+        /**
+         * @brief 析构函数，执行完已提交的调用后回收线程
+         */
+        ~OffloadPool();
+
+        /**
+         * @brief 在线程池中执行fn，当前协程挂起直到fn返回
+         * @details 不在调度器的协程中(包括调度协程自己)或线程池已停止时，直接在当前线程执行fn。
+         *          fn中抛出的异常在调用者协程中重新抛出；fn设置的errno不会带回，需要的话由fn自己记录
+         */
+        void run(Task fn);
+
+        /**
+         * @brief 同run，返回fn的结果
+         */
+        template<class F, class R = typename std::result_of<F&()>::type>
+        typename std::enable_if<!std::is_void<R>::value, R>::type
+        call(F f) {
+            std::unique_ptr<R> result;
+            run([&f, &result]() {
+                result.reset(new R(f()));
+            });
+            return std::move(*result);
+        }
+
+        /**
+         * @brief 停止线程池，已提交的调用执行完后线程退出，之后的调用都直接在调用者线程执行
+         */
+        void stop();
+
+        /**
+         * @brief 线程数
+         */
+        size_t getThreadCount() const { return m_threads.size(); }
+
+        /**
+         * @brief 已提交还没有开始执行的调用数
+         */
+        uint64_t getPending() const { return m_pending; }
+
+        /**
+         * @brief 已在线程池中执行完的调用数
+         */
+        uint64_t getCompleted() const { return m_completed; }
+
+        /**
+         * @brief 当前是否可以卸载，即运行在调度器的协程中
+         */
+        static bool CanOffload();
+
+    private:
+        /**
+         * @brief 一次卸载的调用
+         */
+        struct Job {
+            Task               fn;          // 要执行的调用
+            FiberWaiter        waiter;      // 挂起的调用者，执行完后通过它回到原来的调度器
+            std::exception_ptr error;       // fn抛出的异常
+        };
+
+        /**
+         * @brief 线程池中的线程取出调用并执行
+         */
+        void worker();
+
+    private:
+        MutexType                         m_mutex;
+        Semaphore                         m_sem;             // 每提交一个调用或停止时的每个线程notify一次
+        std::deque<std::shared_ptr<Job> > m_jobs;            // 等待执行的调用，停止时放入空指针
+        std::vector<Thread::ptr>          m_threads;
+        bool                              m_stopping = false;
+        std::atomic<uint64_t>             m_pending{0};
+        std::atomic<uint64_t>             m_completed{0};
+    };
+
+    /**
+     * @brief 进程内共用的卸载线程池，hook的文件IO和Address::Lookup使用它
+     */
+    typedef Singleton<OffloadPool> OffloadMgr;
+}
+
+#endif //__SYLAR_OFFLOAD_H__
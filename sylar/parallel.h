@@ -0,0 +1,131 @@
+/**
+  ********************************************************
+  * @file        : parallel.h
+  * @author      : zgys
+  * @brief       : 在调度器上并发执行一批子协程并等待结果
+  * @attention   : 只能在调度器的协程中调用；调用返回前一定等全部子协程结束
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#ifndef __SYLAR_PARALLEL_H__
+#define __SYLAR_PARALLEL_H__
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include <stddef.h>
+#include "fiber_sync.h"
+#include "macro.h"
+#include "scheduler.h"
+#include "task.h"
+
+namespace sylar {
+
+    /**
+     * @brief 把[begin, end)按grain切成若干段，每段在一个子协程中依次执行f(i)
+     * @details 除第一段外的子协程通过批量schedule一次投递到当前调度器，第一段由调用者协程自己执行，
+     *          然后在WaitGroup上挂起，最后一个结束的子协程直接唤醒调用者。
+     *          子协程的异常被捕获，全部结束后按段的顺序重新抛出第一个
+     * @param[in] begin 开始下标
+     * @param[in] end 结束下标(不含)
+     * @param[in] f 对每个下标调用一次，签名为void(size_t)
+     * @param[in] grain 每个子协程处理的下标数，为0时按1处理
+     */
+    template<class F>
+    void parallel_for(size_t begin, size_t end, F f, size_t grain = 1) {
+        if(begin >= end) {
+            return;
+        }
+        Scheduler* sc = Scheduler::GetThis();
+        SYLAR_ASSERT2(sc, "parallel_for must run inside a scheduler");
+        grain = std::max<size_t>(grain, 1);
+        size_t chunks = (end - begin + grain - 1) / grain;
+
+        // 子协程共用的状态放在堆上而不是调用者的栈上：共享栈模式下调用者挂起后，它的栈内容会被换出
+        struct State {
+            State(size_t b, size_t e, size_t g, size_t chunks, F&& fn)
+                : begin(b), end(e), grain(g), wg(chunks - 1), errors(chunks), f(std::move(fn)) {
+            }
+
+            void run(size_t chunk) {
+                size_t lo = begin + chunk * grain;
+                size_t hi = std::min(end, lo + grain);
+                try {
+                    for(size_t i = lo; i < hi; ++i) {
+                        f(i);
+                    }
+                } catch (...) {
+                    errors[chunk] = std::current_exception();
+                }
+            }
+
+            size_t begin;
+            size_t end;
+            size_t grain;
+            WaitGroup wg;
+            std::vector<std::exception_ptr> errors;
+            F f;
+        };
+        std::shared_ptr<State> state = std::make_shared<State>(begin, end, grain, chunks, std::move(f));
+
+        std::vector<Task> children;
+        children.reserve(chunks - 1);
+        for(size_t chunk = 1; chunk < chunks; ++chunk) {
+            children.emplace_back([state, chunk]() {
+                state->run(chunk);
+                state->wg.done();
+            });
+        }
+        sc->schedule(children.begin(), children.end());
+
+        state->run(0);
+        state->wg.wait();
+        for(auto& e : state->errors) {
+            if(e) {
+                std::rethrow_exception(e);
+            }
+        }
+    }
+
+    /**
+     * @brief 并发执行fns中的每个函数，返回按顺序排列的结果
+     * @details 每个子协程把结果直接写入自己的槽位，不经过队列转交，全部结束后再移入返回值；异常规则同parallel_for
+     * @attention 结果类型需要可默认构造和移动赋值
+     */
+    template<class F, class R = typename std::result_of<F&()>::type>
+    typename std::enable_if<!std::is_void<R>::value, std::vector<R> >::type
+    when_all(std::vector<F>& fns) {
+        // 每个结果单独占一个对象：std::vector<bool>按位存放，不同线程上的子协程直接写它会互相覆盖
+        struct Slot {
+            R value;
+        };
+        // 子协程只引用堆上的数据，见parallel_for
+        std::shared_ptr<std::vector<Slot> > slots = std::make_shared<std::vector<Slot> >(fns.size());
+        F* fs = fns.data();
+        parallel_for(0, fns.size(), [fs, slots](size_t i) {
+            (*slots)[i].value = fs[i]();
+        });
+        std::vector<R> results;
+        results.reserve(slots->size());
+        for(auto& s : *slots) {
+            results.push_back(std::move(s.value));
+        }
+        return results;
+    }
+
+    /**
+     * @brief 并发执行fns中的每个函数并等待全部结束，用于没有返回值的函数
+     */
+    template<class F, class R = typename std::result_of<F&()>::type>
+    typename std::enable_if<std::is_void<R>::value>::type
+    when_all(std::vector<F>& fns) {
+        F* fs = fns.data();
+        parallel_for(0, fns.size(), [fs](size_t i) {
+            fs[i]();
+        });
+    }
+}
+
+#endif //SYLAR_PARALLEL_H
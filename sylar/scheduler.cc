@@ -5,21 +5,121 @@
 #include "scheduler.h"
 #include "macro.h"
 #include "hook.h"
+#include "config.h"
+#include "util.h"
+#include "watchdog.h"
+#include <algorithm>
+#include <map>
+#include <unistd.h>
 
 namespace sylar {
 
     static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+    // 是否使用每线程本地队列+工作窃取的调度模式，默认使用全局任务队列
+    static ConfigVar<bool>::ptr g_scheduler_work_stealing =
+            Config::Lookup<bool>("scheduler.work_stealing", false, "scheduler per-thread queues with work stealing");
+
+    // 无锁注入队列的容量，超出的任务溢出到加锁的任务链表
+    static ConfigVar<uint32_t>::ptr g_scheduler_inject_queue_size =
+            Config::Lookup<uint32_t>("scheduler.inject_queue_size", 1024, "scheduler lock-free inject queue size");
+
+    // 调度线程绑核方式 none: 不绑定  list: 依次绑定到scheduler.affinity_cpus中的CPU
+    // core: 依次绑定到每个物理核  numa: 依次分配到scheduler.affinity_nodes中的节点，绑定到整个节点
+    static ConfigVar<std::string>::ptr g_scheduler_affinity =
+            Config::Lookup<std::string>("scheduler.affinity", "none", "scheduler thread affinity none|list|core|numa");
+
+    // list模式使用的CPU列表，格式同/sys/devices/system/cpu/online，如"0-3,8"
+    static ConfigVar<std::string>::ptr g_scheduler_affinity_cpus =
+            Config::Lookup<std::string>("scheduler.affinity_cpus", "", "scheduler affinity cpu list");
+
+    // numa模式使用的节点列表，为空表示全部有CPU的节点
+    static ConfigVar<std::string>::ptr g_scheduler_affinity_nodes =
+            Config::Lookup<std::string>("scheduler.affinity_nodes", "", "scheduler affinity numa node list");
+
+    // Scheduler::Checkpoint的时间片长度
+    static ConfigVar<uint32_t>::ptr g_scheduler_time_slice_ms =
+            Config::Lookup<uint32_t>("scheduler.time_slice_ms", 10, "time slice of Scheduler::Checkpoint in ms");
+
+    // 是否按负载自动增减工作线程，构造时的线程数不小于上限时作为上限
+    static ConfigVar<bool>::ptr g_scheduler_elastic =
+            Config::Lookup<bool>("scheduler.elastic", false, "scheduler grows and shrinks threads by load");
+
+    // 弹性模式的线程数下限和上限，都包括use_caller的caller线程；上限为0表示取构造时的线程数
+    static ConfigVar<uint32_t>::ptr g_scheduler_elastic_min_threads =
+            Config::Lookup<uint32_t>("scheduler.elastic_min_threads", 1, "elastic scheduler min threads");
+    static ConfigVar<uint32_t>::ptr g_scheduler_elastic_max_threads =
+            Config::Lookup<uint32_t>("scheduler.elastic_max_threads", 0, "elastic scheduler max threads, 0 for constructor threads");
+
+    // 控制线程的采样间隔
+    static ConfigVar<uint32_t>::ptr g_scheduler_elastic_interval_ms =
+            Config::Lookup<uint32_t>("scheduler.elastic_interval_ms", 100, "elastic scheduler sample interval in ms");
+
+    // 排队延迟连续elastic_grow_samples次超过目标时增加一个线程
+    static ConfigVar<uint32_t>::ptr g_scheduler_elastic_latency_us =
+            Config::Lookup<uint32_t>("scheduler.elastic_latency_us", 2000, "elastic scheduler target queue latency in us");
+    static ConfigVar<uint32_t>::ptr g_scheduler_elastic_grow_samples =
+            Config::Lookup<uint32_t>("scheduler.elastic_grow_samples", 2, "elastic scheduler samples over latency before grow");
+
+    // 工作线程的空闲时间占比(百分比)连续elastic_shrink_samples次不低于它时退出一个线程
+    static ConfigVar<uint32_t>::ptr g_scheduler_elastic_idle_percent =
+            Config::Lookup<uint32_t>("scheduler.elastic_idle_percent", 80, "elastic scheduler idle percent to shrink");
+    static ConfigVar<uint32_t>::ptr g_scheduler_elastic_shrink_samples =
+            Config::Lookup<uint32_t>("scheduler.elastic_shrink_samples", 50, "elastic scheduler idle samples before shrink");
+
+    /// 检查点每次都要用，缓存下来避免读配置加锁
+    static uint32_t s_time_slice_ms = 10;
+
+    struct _SchedulerConfigIniter {
+        _SchedulerConfigIniter() {
+            s_time_slice_ms = g_scheduler_time_slice_ms->getValue();
+            g_scheduler_time_slice_ms->addListener([](const uint32_t& old_value, const uint32_t& new_value) {
+                s_time_slice_ms = new_value;
+            });
+        }
+    };
+
+    static _SchedulerConfigIniter s_scheduler_config_initer;
+
     /// 当前线程的调度器，同一个调度器下的所有线程共享同一个实例
     static thread_local Scheduler* t_scheduler = nullptr;
     /// 当前线程的调度协程，每个线程都独有一份
     static thread_local Fiber* t_scheduler_fiber = nullptr;
+    /// 当前调度线程的本地任务队列，仅工作窃取模式使用
+    static thread_local void* t_local_queue = nullptr;
+    /// 当前调度线程的运行计数
+    static thread_local void* t_counters = nullptr;
+    /// 检查点看到的协程切换次数，变化了说明进入了新的时间片
+    static thread_local uint64_t t_slice_seq = ~0ull;
+    /// 当前时间片的起点
+    static thread_local uint64_t t_slice_begin = 0;
+    /// 当前线程认领了退出请求，离开调度循环后退出
+    static thread_local bool t_retiring = false;
 
     Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name)
             : m_name(name),
-              m_useCaller(use_caller) {
+              m_useCaller(use_caller),
+              m_workStealing(g_scheduler_work_stealing->getValue()),
+              m_elastic(g_scheduler_elastic->getValue()),
+              m_injectQueue(g_scheduler_inject_queue_size->getValue()) {
         SYLAR_ASSERT(threads > 0);
 
+        // 工作线程数的上下限，上限决定了预先分配的槽位和本地队列数，运行中不再变化
+        size_t caller = use_caller ? 1 : 0;
+        size_t max_threads = g_scheduler_elastic_max_threads->getValue();
+        size_t min_threads = g_scheduler_elastic_min_threads->getValue();
+        m_maxThreads = std::max(threads - caller, max_threads > caller ? max_threads - caller : 0);
+        // 至少留一个工作线程，use_caller的caller线程只在stop时才执行任务
+        m_minThreads = std::min(std::max<size_t>(min_threads > caller ? min_threads - caller : 0, 1), m_maxThreads);
+
+        if (m_workStealing) {
+            // 每个调度线程(包括use_caller的caller线程)一个本地队列，按上限分配，退出的线程交还的队列由新线程认领
+            m_queues.resize(m_maxThreads + caller);
+            for (auto& q : m_queues) {
+                q = new LocalQueue;
+            }
+        }
+
         // 是否把创建协程调度器的线程放到协程调度器管理的线程池中
         // 如果不放入，那这个线程专职协程调度
         // 如果放入， 那就要把协程调度器封装到这个线程的一个协程中，称之为主协程或协程调度器协程
@@ -47,13 +147,20 @@ namespace sylar {
             m_rootThread = -1;
         }
         m_threadCount = threads;
+        WatchdogMgr::GetInstance()->add(this);
     }
 
     Scheduler::~Scheduler() {
         SYLAR_LOG_DEBUG(g_logger) << "Scheduler::~Scheduler()";
         SYLAR_ASSERT(m_stopping);
+        // 先从看门狗注销，之后看门狗不会再访问本调度器的线程计数
+        WatchdogMgr::GetInstance()->del(this);
         if(GetThis() == this) {      // 如果当前实例就是调度器协程
             t_scheduler = nullptr;   // 当前线程的调度器置空
+            t_local_queue = nullptr;
+        }
+        for (auto q : m_queues) {
+            delete q;
         }
     }
 
@@ -65,6 +172,135 @@ namespace sylar {
         return t_scheduler_fiber;
     }
 
+    Scheduler::ThreadCounters* Scheduler::GetThreadCounters() {
+        return static_cast<ThreadCounters*>(t_counters);
+    }
+
+    bool Scheduler::Checkpoint() {
+        ThreadCounters* counters = GetThreadCounters();
+        // 只在调度器调度的协程中生效，调度协程和线程主协程不能yield
+        if(!counters || !counters->trace.fiberId.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        uint64_t seq = counters->trace.seq.load(std::memory_order_relaxed);
+        uint64_t now = sylar::GetCurrentMS();
+        if(seq != t_slice_seq) {
+            t_slice_seq   = seq;
+            t_slice_begin = now;
+            return false;
+        }
+        if(now - t_slice_begin < s_time_slice_ms) {
+            return false;
+        }
+        // 重新排队再让出，排在已经等待的任务后面
+        GetThis()->schedule(Fiber::GetThis());
+        Fiber::GetThis()->yield();
+        return true;
+    }
+
+    SchedulerStats Scheduler::getStats() {
+        SchedulerStats stats;
+        stats.name          = m_name;
+        stats.threads       = getThreadCount();
+        stats.activeThreads = m_activeThreadCount;
+        stats.idleThreads   = m_idleThreadCount;
+        stats.queueDepth    = m_injectQueue.size() + m_localTaskCount;
+        stats.queueLatencyUs = m_probeLatencyUs;
+        stats.threadsAdded   = m_threadsAdded;
+        stats.threadsRetired = m_threadsRetired;
+        std::vector<std::shared_ptr<ThreadCounters> > counters;
+        SchedulerStats::Thread retired;
+        {
+            // 计数列表和退出线程的累计一起取，线程退出时的合并不会被算两次或漏掉
+            MutexType::Lock lock(m_mutex);
+            stats.queueDepth += m_tasks.size();
+            counters = m_counters;
+            retired  = m_retiredTotals;
+        }
+
+        uint64_t now = sylar::GetCurrentUS();
+        auto add = [&stats](const SchedulerStats::Thread& t) {
+            stats.tasks        += t.tasks;
+            stats.switches     += t.switches;
+            stats.steals       += t.steals;
+            stats.idleUs       += t.idleUs;
+            stats.busyUs       += t.busyUs;
+            stats.epollWaits   += t.epollWaits;
+            stats.epollEvents  += t.epollEvents;
+            stats.timerExpired += t.timerExpired;
+        };
+        add(retired);
+        for (auto& c : counters) {
+            SchedulerStats::Thread t;
+            ReadCounters(*c, now, t);
+            for (auto q : m_queues) {
+                if (q->threadId == t.id) {
+                    LocalQueue::MutexType::Lock lock(q->mutex);
+                    t.queueDepth = q->tasks.size() + q->pinned.size();
+                    break;
+                }
+            }
+            add(t);
+            stats.perThread.push_back(t);
+        }
+        return stats;
+    }
+
+    void Scheduler::ReadCounters(const ThreadCounters& c, uint64_t now, SchedulerStats::Thread& t) {
+        t.id           = c.threadId;
+        t.tasks        = c.tasks.load(std::memory_order_relaxed);
+        t.switches     = c.switches.load(std::memory_order_relaxed);
+        t.steals       = c.steals.load(std::memory_order_relaxed);
+        t.epollWaits   = c.epollWaits.load(std::memory_order_relaxed);
+        t.epollEvents  = c.epollEvents.load(std::memory_order_relaxed);
+        t.timerExpired = c.timerExpired.load(std::memory_order_relaxed);
+        // 正在idle中的这一段也算上
+        uint64_t since = c.idleSince.load(std::memory_order_relaxed);
+        t.idleUs       = c.idleUs.load(std::memory_order_relaxed) + (since && now > since ? now - since : 0);
+        uint64_t end   = c.endUs.load(std::memory_order_relaxed);
+        uint64_t total = (end ? end : now) - c.startUs;
+        t.busyUs       = total > t.idleUs ? total - t.idleUs : 0;
+    }
+
+    std::string SchedulerStats::toString() const {
+        std::stringstream ss;
+        ss << "scheduler=" << name
+           << " threads=" << threads
+           << " active=" << activeThreads
+           << " idle=" << idleThreads
+           << " queue=" << queueDepth
+           << " tasks=" << tasks
+           << " switches=" << switches
+           << " steals=" << steals
+           << " idle_us=" << idleUs
+           << " busy_us=" << busyUs
+           << " epoll_waits=" << epollWaits
+           << " events_per_wait=" << eventsPerWait()
+           << " timers=" << timerExpired
+           << " pending_events=" << pendingEvents
+           << " tickles=" << ticklesSent
+           << " tickles_suppressed=" << ticklesSuppressed
+           << " poll_hits=" << busyPollHits
+           << " poll_misses=" << busyPollMisses
+           << " queue_latency_us=" << queueLatencyUs
+           << " threads_added=" << threadsAdded
+           << " threads_retired=" << threadsRetired;
+        for (auto& t : perThread) {
+            ss << std::endl
+               << "  thread=" << t.id
+               << " queue=" << t.queueDepth
+               << " tasks=" << t.tasks
+               << " switches=" << t.switches
+               << " steals=" << t.steals
+               << " idle_us=" << t.idleUs
+               << " busy_us=" << t.busyUs
+               << " epoll_waits=" << t.epollWaits
+               << " epoll_events=" << t.epollEvents
+               << " timers=" << t.timerExpired;
+        }
+        return ss.str();
+    }
+
     void Scheduler::start() {
         SYLAR_LOG_DEBUG(g_logger) << "start";
         MutexType::Lock lock(m_mutex);
@@ -75,17 +311,297 @@ namespace sylar {
 
         SYLAR_ASSERT(m_threads.empty());         // 线程池中如果非空，失败
 
-        m_threads.resize(m_threadCount); // 线程池大小设置为要求数量
-        for(size_t i = 0; i < m_threadCount; i++) {
-            //创建线程加入线程池，线程池中的线程执行的回调函数是调度器的run来调度线程中的协程
-            m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this),
-                                          m_name + "_" + std::to_string(i)));
-            //创建的线程的线程id加入线程id池
-            m_threadIds.push_back(m_threads[i]->getId());
+        planAffinity();
+        // 线程池按上限分配槽位，弹性模式下先启动下限个线程，其余槽位留给运行中增加的线程
+        size_t n = m_elastic ? m_minThreads : m_threadCount.load();
+        m_threads.resize(m_maxThreads);
+        m_threadCount = 0;
+        for(size_t i = 0; i < n; i++) {
+            spawnThreadNoLock(i);
+        }
+        if(m_elastic) {
+            m_elasticRunning = true;
+            m_elasticThread.reset(new Thread(std::bind(&Scheduler::elasticRun, this), m_name + "_elastic"));
         }
         lock.unlock();
     }
 
+    void Scheduler::spawnThreadNoLock(size_t slot) {
+        //创建线程加入线程池，线程池中的线程执行的回调函数是调度器的run来调度线程中的协程
+        std::vector<int> cpus = slot < m_threadCpus.size() ? m_threadCpus[slot] : std::vector<int>();
+        m_threads[slot].reset(new Thread([this, cpus]() {
+                                             bindThread(cpus);
+                                             run();
+                                         },
+                                         m_name + "_" + std::to_string(slot)));
+        //创建的线程的线程id加入线程id池
+        m_threadIds.push_back(m_threads[slot]->getId());
+        ++m_threadCount;
+    }
+
+    void Scheduler::disableElastic() {
+        MutexType::Lock lock(m_mutex);
+        SYLAR_ASSERT(m_threads.empty());
+        m_elastic    = false;
+        m_maxThreads = m_threadCount;
+        m_minThreads = m_threadCount;
+    }
+
+    bool Scheduler::addThread() {
+        reapRetired();
+        MutexType::Lock lock(m_mutex);
+        if(m_stopping || m_threadCount >= m_maxThreads) {
+            return false;
+        }
+        auto it = std::find(m_threads.begin(), m_threads.end(), nullptr);
+        if(it == m_threads.end()) {
+            // 还没有start，或者退出的线程还没有交出槽位
+            return false;
+        }
+        spawnThreadNoLock(it - m_threads.begin());
+        ++m_threadsAdded;
+        return true;
+    }
+
+    bool Scheduler::retireThread() {
+        {
+            MutexType::Lock lock(m_mutex);
+            if(m_stopping || m_threads.empty() || m_threadCount <= m_minThreads + m_retireRequests) {
+                return false;
+            }
+            ++m_retireRequests;
+        }
+        // 唤醒一个空闲线程来认领；没有空闲线程时由下一个进入idle的线程认领
+        tickle();
+        return true;
+    }
+
+    bool Scheduler::isRetiring() const {
+        return t_retiring && t_scheduler == this;
+    }
+
+    bool Scheduler::tryRetire() {
+        int self = sylar::GetThreadId();
+        if(self == m_rootThread || m_stopping) {
+            return false;
+        }
+        if(Fiber::SharedStackFibers()) {
+            // 有挂起的协程的栈内容在本线程的共享栈上，只能由本线程恢复
+            return false;
+        }
+        if(m_workStealing) {
+            // 还有只能由本线程执行的任务，先把它们执行完
+            LocalQueue* queue = (LocalQueue*)t_local_queue;
+            LocalQueue::MutexType::Lock lock(queue->mutex);
+            if(!queue->pinned.empty()) {
+                return false;
+            }
+        }
+        MutexType::Lock lock(m_mutex);
+        if(m_stopping || m_retireRequests == 0) {
+            return false;
+        }
+        --m_retireRequests;
+        --m_threadCount;
+        // 从线程id池中去掉之后，新投递的指定本线程的任务会改为任意线程执行
+        m_threadIds.erase(std::remove(m_threadIds.begin(), m_threadIds.end(), self), m_threadIds.end());
+        for(auto& thread : m_threads) {
+            if(thread && thread->getId() == self) {
+                m_retired.push_back(thread);
+                thread.reset();
+                break;
+            }
+        }
+        ++m_threadsRetired;
+        return true;
+    }
+
+    void Scheduler::retireSelf() {
+        int self = sylar::GetThreadId();
+        std::list<ScheduleTask> orphans;
+        if(m_workStealing) {
+            // 交还本地队列，之后它可以被新线程认领；投递到这里的任务在锁内会再确认一次所属线程
+            LocalQueue* queue = (LocalQueue*)t_local_queue;
+            t_local_queue = nullptr;
+            LocalQueue::MutexType::Lock lock(queue->mutex);
+            for(auto& task : queue->pinned) {
+                orphans.push_back(std::move(task));
+            }
+            for(auto& task : queue->tasks) {
+                orphans.push_back(std::move(task));
+            }
+            queue->pinned.clear();
+            queue->tasks.clear();
+            queue->threadId = -1;
+        }
+        size_t n = orphans.size();
+        {
+            MutexType::Lock lock(m_mutex);
+            for(auto& task : m_tasks) {
+                if(task.thread == self) {
+                    task.thread = -1;
+                }
+            }
+            for(auto& task : orphans) {
+                task.thread = -1;
+            }
+            m_tasks.splice(m_tasks.end(), orphans);
+        }
+        // 先放入全局队列再减少计数，stopping()不会看到任务凭空消失
+        m_localTaskCount -= n;
+        tickle();
+        SYLAR_LOG_INFO(g_logger) << m_name << " thread " << self << " retired, handed over " << n << " tasks";
+    }
+
+    void Scheduler::rehomeNoLock(ScheduleTask& task) {
+        if(task.thread != -1 && std::find(m_threadIds.begin(), m_threadIds.end(), task.thread) == m_threadIds.end()) {
+            task.thread = -1;
+        }
+    }
+
+    void Scheduler::reapRetired() {
+        std::vector<Thread::ptr> retired;
+        {
+            MutexType::Lock lock(m_mutex);
+            retired.swap(m_retired);
+        }
+        for(auto& thread : retired) {
+            thread->join();
+        }
+    }
+
+    void Scheduler::elasticRun() {
+        // 每个线程上次采样时的累计空闲时间和采样时间，只比较两次都还在运行的线程
+        std::map<std::shared_ptr<ThreadCounters>, std::pair<uint64_t, uint64_t> > last;
+        uint32_t over_latency = 0;
+        uint32_t mostly_idle = 0;
+        while(m_elasticRunning) {
+            // 分段睡眠，stop时不用等满一个采样间隔
+            uint64_t interval_us = std::max(g_scheduler_elastic_interval_ms->getValue(), 1u) * 1000ull;
+            for(uint64_t slept = 0; slept < interval_us && m_elasticRunning; slept += 10000) {
+                usleep(std::min<uint64_t>(interval_us - slept, 10000));
+            }
+            if(!m_elasticRunning) {
+                break;
+            }
+            reapRetired();
+
+            // 排队延迟：投递一个探测任务，记录它从投递到开始执行的时间；上一个还没执行时，它已经等待的时间就是延迟的下界
+            uint64_t now = sylar::GetCurrentUS();
+            uint64_t sent = m_probeSentUs;
+            uint64_t latency = 0;
+            if(sent) {
+                latency = std::max(now - sent, m_probeLatencyUs.load());
+            } else {
+                latency = m_probeLatencyUs;
+                m_probeSentUs = now;
+                schedule([this, now]() {
+                    m_probeLatencyUs = sylar::GetCurrentUS() - now;
+                    m_probeSentUs = 0;
+                });
+            }
+
+            // 空闲比例：还在运行的线程在这个间隔内的空闲时间之和除以经过的时间之和
+            std::vector<std::shared_ptr<ThreadCounters> > counters;
+            {
+                MutexType::Lock lock(m_mutex);
+                counters = m_counters;
+            }
+            std::map<std::shared_ptr<ThreadCounters>, std::pair<uint64_t, uint64_t> > current;
+            uint64_t idle_us = 0;
+            uint64_t wall_us = 0;
+            for(auto& c : counters) {
+                if(c->endUs || c->threadId == m_rootThread) {
+                    continue;
+                }
+                uint64_t since = c->idleSince.load(std::memory_order_relaxed);
+                uint64_t idle  = c->idleUs.load(std::memory_order_relaxed) + (since && now > since ? now - since : 0);
+                auto it = last.find(c);
+                if(it != last.end() && now > it->second.second) {
+                    idle_us += idle > it->second.first ? idle - it->second.first : 0;
+                    wall_us += now - it->second.second;
+                }
+                current[c] = std::make_pair(idle, now);
+            }
+            last.swap(current);
+            uint64_t idle_percent = wall_us ? std::min<uint64_t>(idle_us * 100 / wall_us, 100) : 0;
+
+            // 增加要连续几次超过延迟目标，减少要连续更多次空闲，避免负载抖动时线程数来回变化
+            bool slow = latency > g_scheduler_elastic_latency_us->getValue();
+            over_latency = slow ? over_latency + 1 : 0;
+            mostly_idle  = (!slow && wall_us && idle_percent >= g_scheduler_elastic_idle_percent->getValue())
+                           ? mostly_idle + 1 : 0;
+            if(over_latency >= std::max(g_scheduler_elastic_grow_samples->getValue(), 1u)) {
+                over_latency = 0;
+                mostly_idle  = 0;
+                if(addThread()) {
+                    SYLAR_LOG_INFO(g_logger) << m_name << " grow to " << getThreadCount()
+                                             << " threads, queue latency " << latency << "us";
+                }
+            } else if(mostly_idle >= std::max(g_scheduler_elastic_shrink_samples->getValue(), 1u)) {
+                over_latency = 0;
+                mostly_idle  = 0;
+                if(retireThread()) {
+                    SYLAR_LOG_INFO(g_logger) << m_name << " shrink from " << getThreadCount()
+                                             << " threads, idle " << idle_percent << "%";
+                }
+            }
+        }
+    }
+
+    void Scheduler::planAffinity() {
+        m_threadCpus.clear();
+        const std::string& mode = g_scheduler_affinity->getValue();
+        if(mode == "none" || mode.empty()) {
+            return;
+        }
+
+        // 每个候选集合轮流分给一个线程
+        std::vector<std::vector<int> > sets;
+        if(mode == "list") {
+            for(int cpu : CpuUtil::ParseCpuList(g_scheduler_affinity_cpus->getValue())) {
+                sets.push_back({cpu});
+            }
+        } else if(mode == "core") {
+            for(int cpu : CpuUtil::GetPhysicalCores()) {
+                sets.push_back({cpu});
+            }
+        } else if(mode == "numa") {
+            std::vector<int> nodes = CpuUtil::ParseCpuList(g_scheduler_affinity_nodes->getValue());
+            if(nodes.empty()) {
+                nodes = CpuUtil::GetNumaNodes();
+            }
+            for(int node : nodes) {
+                std::vector<int> cpus = CpuUtil::GetNodeCpus(node);
+                if(!cpus.empty()) {
+                    sets.push_back(cpus);
+                }
+            }
+        } else {
+            SYLAR_LOG_ERROR(g_logger) << "unknown scheduler.affinity=" << mode;
+            return;
+        }
+        if(sets.empty()) {
+            SYLAR_LOG_ERROR(g_logger) << "scheduler.affinity=" << mode << " no cpu available";
+            return;
+        }
+        for(size_t i = 0; i < m_maxThreads; ++i) {
+            m_threadCpus.push_back(sets[i % sets.size()]);
+        }
+    }
+
+    void Scheduler::bindThread(const std::vector<int>& cpus) {
+        if(cpus.empty()) {
+            return;
+        }
+        if(!CpuUtil::SetAffinity(cpus)) {
+            SYLAR_LOG_ERROR(g_logger) << "bind thread " << sylar::GetThreadId() << " cpu fail errno=" << errno;
+            return;
+        }
+        // 绑核之后线程自己分配的内存(协程栈、epoll_event缓冲、本地队列节点等)都落在本节点
+        CpuUtil::SetLocalAlloc();
+    }
+
     void Scheduler::stop() {
         SYLAR_LOG_INFO(g_logger) << this << " stop";
         if(stopping()) {
@@ -100,6 +616,17 @@ namespace sylar {
             SYLAR_ASSERT(GetThis() != this);
         }
 
+        // 先停掉弹性伸缩的控制线程，之后线程数不再变化
+        m_elasticRunning = false;
+        Thread::ptr elastic;
+        {
+            MutexType::Lock lock(m_mutex);
+            elastic.swap(m_elasticThread);
+        }
+        if (elastic) {
+            elastic->join();
+        }
+
         // 通知所有线程的协程调度器，有任务的，将任务队列中的任务执行完
         for(size_t i = 0; i < m_threadCount; i++) {
             tickle();
@@ -121,10 +648,14 @@ namespace sylar {
         {
             MutexType::Lock lock(m_mutex);
             thrs.swap(m_threads);
+            thrs.insert(thrs.end(), m_retired.begin(), m_retired.end());
+            m_retired.clear();
         }
-        // 线程池中的线程以join的方式结束
+        // 线程池中的线程以join的方式结束，空槽位跳过
         for (auto &i : thrs) {
-            i->join();
+            if (i) {
+                i->join();
+            }
         }
     }
 
@@ -134,12 +665,13 @@ namespace sylar {
 
     bool Scheduler::stopping() {
         MutexType::Lock lock(m_mutex);
-        return m_stopping && m_tasks.empty() && m_activeThreadCount == 0;
+        return m_stopping && m_tasks.empty() && m_injectQueue.empty()
+               && m_localTaskCount == 0 && m_activeThreadCount == 0 && m_externalWaiters == 0;
     }
 
     void Scheduler::idle() {
         SYLAR_LOG_DEBUG(g_logger) << "idle";
-        while (!stopping()) {
+        while (!stopping() && !isRetiring()) {
             sylar::Fiber::GetThis()->yield();
         }
     }
@@ -148,6 +680,320 @@ namespace sylar {
         t_scheduler = this;
     }
 
+    bool Scheduler::scheduleLocal(ScheduleTask& task) {
+        if(!task.fiber && !task.cb) {
+            return false;
+        }
+
+        LocalQueue* target = nullptr;
+        bool pinned = false;
+        if(task.thread != -1) {
+            // 指定了执行线程，找到该线程认领的本地队列
+            for(auto q : m_queues) {
+                if(q->threadId == task.thread) {
+                    target = q;
+                    pinned = true;
+                    break;
+                }
+            }
+        } else if(t_scheduler == this && t_local_queue) {
+            // 调度线程自己投递的任务放入自己的本地队列，其他线程空闲时会来窃取
+            target = (LocalQueue*)t_local_queue;
+        }
+
+        if(!target) {
+            // 非调度线程投递，或者目标线程还没有开始运行，放入全局队列
+            return scheduleInject(task) || hasIdleThreads();
+        }
+
+        {
+            LocalQueue::MutexType::Lock lock(target->mutex);
+            if(pinned && target->threadId != task.thread) {
+                // 目标线程刚刚退出并交还了本地队列，改走全局队列
+                lock.unlock();
+                return scheduleInject(task) || hasIdleThreads();
+            }
+            if(pinned) {
+                target->pinned.push_back(std::move(task));
+            } else {
+                target->tasks.push_back(std::move(task));
+            }
+            ++m_localTaskCount;
+        }
+        return hasIdleThreads();
+    }
+
+    bool Scheduler::scheduleInject(ScheduleTask& task) {
+        if(!task.fiber && !task.cb) {
+            return false;
+        }
+        if(task.thread == -1) {
+            bool need_tickle = m_injectQueue.empty();
+            if(m_injectQueue.tryPush(task)) {
+                return need_tickle;
+            }
+        }
+        // 溢出路径：注入队列满了，或者任务指定了线程(不能被任意线程取走)
+        MutexType::Lock lock(m_mutex);
+        rehomeNoLock(task);
+        bool need_tickle = m_tasks.empty();
+        m_tasks.push_back(std::move(task));
+        return need_tickle;
+    }
+
+    void Scheduler::scheduleBatch(std::vector<ScheduleTask>& tasks) {
+        if(tasks.empty()) {
+            return;
+        }
+        int self = sylar::GetThreadId();
+        bool need_tickle = false;
+        std::vector<int> tickle_threads;      // 指定了其他线程的任务的目标线程，很少出现，用到时才分配
+
+        LocalQueue* local = (m_workStealing && t_scheduler == this) ? (LocalQueue*)t_local_queue : nullptr;
+        if(local) {
+            // 不指定线程和指定本线程的任务一次放入本地队列，其余的留给下面的逐个投递
+            size_t n = 0;
+            {
+                LocalQueue::MutexType::Lock lock(local->mutex);
+                for(auto& task : tasks) {
+                    if(!task.fiber && !task.cb) {
+                        continue;
+                    }
+                    if(task.thread == -1) {
+                        local->tasks.push_back(std::move(task));
+                    } else if(task.thread == self) {
+                        local->pinned.push_back(std::move(task));
+                    } else {
+                        continue;
+                    }
+                    task.reset();
+                    ++n;
+                }
+                m_localTaskCount += n;
+            }
+            need_tickle = n && hasIdleThreads();
+        }
+
+        std::list<ScheduleTask> overflow;
+        bool inject_empty = m_injectQueue.empty();
+        bool injected = false;
+        for(auto& task : tasks) {
+            if(!task.fiber && !task.cb) {
+                continue;
+            }
+            if(task.thread != -1 && task.thread != self
+                    && std::find(tickle_threads.begin(), tickle_threads.end(), task.thread) == tickle_threads.end()) {
+                tickle_threads.push_back(task.thread);
+            }
+            if(m_workStealing && task.thread != -1) {
+                // 指定了其他线程，放入目标线程的pinned队列
+                scheduleLocal(task);
+                continue;
+            }
+            if(task.thread == -1 && m_injectQueue.tryPush(task)) {
+                injected = true;
+                continue;
+            }
+            overflow.push_back(std::move(task));
+        }
+        tasks.clear();
+
+        if(injected) {
+            need_tickle = need_tickle || inject_empty || (m_workStealing && hasIdleThreads());
+        }
+        if(!overflow.empty()) {
+            MutexType::Lock lock(m_mutex);
+            if(!tickle_threads.empty()) {
+                for(auto& task : overflow) {
+                    rehomeNoLock(task);
+                }
+            }
+            need_tickle = need_tickle || m_tasks.empty();
+            m_tasks.splice(m_tasks.end(), overflow);
+        }
+
+        if(need_tickle) {
+            tickle();
+        }
+        for(int thread : tickle_threads) {
+            tickleThread(thread);
+        }
+    }
+
+    bool Scheduler::takeTaskInject(ScheduleTask& task) {
+        if(m_injectQueue.empty()) {
+            return false;
+        }
+        // 先增加活跃线程数再出队，保证stopping()不会在任务出队后、执行前误判为可以停止
+        ++m_activeThreadCount;
+        while(m_injectQueue.tryPop(task)) {
+            if(task.fiber && task.fiber->getState() == Fiber::RUNNING) {
+                // 协程在yield之前就把自己加入了调度，还没切出去，放到链表中由加锁遍历的逻辑稍后处理
+                MutexType::Lock lock(m_mutex);
+                m_tasks.push_back(std::move(task));
+                task.reset();
+                continue;
+            }
+            return true;
+        }
+        --m_activeThreadCount;
+        return false;
+    }
+
+    bool Scheduler::takeTaskNoLock(ScheduleTask& task, bool& tickle_me) {
+        auto it = m_tasks.begin();
+        while(it != m_tasks.end()) {
+            if(it->thread != -1 && it->thread != sylar::GetThreadId()) {
+                ++it;
+                tickle_me = true;
+                continue;
+            }
+            if(it->fiber && it->fiber->getState() == Fiber::RUNNING) {
+                ++it;
+                continue;
+            }
+            task = std::move(*it);
+            it = m_tasks.erase(it);
+            tickle_me |= (it != m_tasks.end());
+            return true;
+        }
+        return false;
+    }
+
+    bool Scheduler::stealTask(LocalQueue* victim, LocalQueue* thief, ScheduleTask& task) {
+        std::vector<ScheduleTask> stolen;
+        {
+            LocalQueue::MutexType::Lock lock(victim->mutex);
+            if(victim->tasks.empty()) {
+                return false;
+            }
+            // 从尾部窃取一半，队列头部的任务留给所属线程，保持它的执行顺序
+            size_t n = (victim->tasks.size() + 1) / 2;
+            auto it = victim->tasks.end();
+            while(n > 0 && it != victim->tasks.begin()) {
+                --it;
+                if(it->fiber && it->fiber->getState() == Fiber::RUNNING) {
+                    continue;
+                }
+                stolen.push_back(std::move(*it));
+                it = victim->tasks.erase(it);
+                --n;
+            }
+        }
+        if(stolen.empty()) {
+            return false;
+        }
+
+        if(ThreadCounters* counters = GetThreadCounters()) {
+            Count(counters->steals, stolen.size());
+        }
+        // stolen中是逆序的，最后一个是最早入队的任务，直接执行它，其余放入自己的队列
+        task = std::move(stolen.back());
+        stolen.pop_back();
+        if(!stolen.empty()) {
+            LocalQueue::MutexType::Lock lock(thief->mutex);
+            thief->tasks.insert(thief->tasks.end(), std::make_move_iterator(stolen.rbegin()),
+                                std::make_move_iterator(stolen.rend()));
+        }
+        return true;
+    }
+
+    bool Scheduler::takeTaskLocal(ScheduleTask& task, bool& tickle_me) {
+        LocalQueue* self = (LocalQueue*)t_local_queue;
+        SYLAR_ASSERT(self);
+
+        // 从队列头部取出第一个可执行的任务，协程在yield之前把自己重新加入调度时还处于RUNNING状态，要跳过
+        auto pop_runnable = [&task](std::deque<ScheduleTask>& dq) {
+            for(auto it = dq.begin(); it != dq.end(); ++it) {
+                if(it->fiber && it->fiber->getState() == Fiber::RUNNING) {
+                    continue;
+                }
+                task = std::move(*it);
+                dq.erase(it);
+                return true;
+            }
+            return false;
+        };
+
+        {
+            LocalQueue::MutexType::Lock lock(self->mutex);
+            if(pop_runnable(self->pinned) || pop_runnable(self->tasks)) {
+                // 先增加活跃线程数再减少任务数，保证stopping()不会看到任务和活跃线程同时为0的中间状态
+                ++m_activeThreadCount;
+                --m_localTaskCount;
+                // 自己的队列还有剩余，通知空闲线程过来窃取
+                tickle_me = !self->tasks.empty();
+                return true;
+            }
+        }
+
+        if(takeTaskInject(task)) {
+            tickle_me = true;
+            return true;
+        }
+
+        {
+            MutexType::Lock lock(m_mutex);
+            if(!m_tasks.empty() && takeTaskNoLock(task, tickle_me)) {
+                ++m_activeThreadCount;
+                return true;
+            }
+        }
+
+        if(m_localTaskCount == 0) {
+            return false;
+        }
+
+        // 从下一个线程的队列开始尝试窃取，避免所有空闲线程都盯着同一个队列
+        size_t n = m_queues.size();
+        size_t start = 0;
+        for(size_t i = 0; i < n; ++i) {
+            if(m_queues[i] == self) {
+                start = i;
+                break;
+            }
+        }
+        for(size_t i = 1; i < n; ++i) {
+            LocalQueue* victim = m_queues[(start + i) % n];
+            if(stealTask(victim, self, task)) {
+                ++m_activeThreadCount;
+                --m_localTaskCount;
+                tickle_me = true;
+                return true;
+            }
+            LocalQueue::MutexType::Lock lock(victim->mutex);
+            if(!victim->pinned.empty()) {
+                // 别的线程有只能由它执行的任务，通知一下
+                tickle_me = true;
+            }
+        }
+        return false;
+    }
+
+    bool Scheduler::hasRunnableTasks() {
+        if(!m_injectQueue.empty()) {
+            return true;
+        }
+        if(m_workStealing && m_localTaskCount > 0) {
+            // 自己的队列全部可取，其他线程的队列只有可被窃取的任务算数
+            LocalQueue* self = (LocalQueue*)t_local_queue;
+            for(auto q : m_queues) {
+                LocalQueue::MutexType::Lock lock(q->mutex);
+                if(!q->tasks.empty() || (q == self && !q->pinned.empty())) {
+                    return true;
+                }
+            }
+        }
+        int self = sylar::GetThreadId();
+        MutexType::Lock lock(m_mutex);
+        for(auto& task : m_tasks) {
+            if(task.thread == -1 || task.thread == self) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     void Scheduler::run() {
         SYLAR_LOG_DEBUG(g_logger) << "run";
         set_hook_enable(false);
@@ -156,8 +1002,34 @@ namespace sylar {
         if(sylar::GetThreadId() != m_rootThread) {
             t_scheduler_fiber = Fiber::GetThis().get();  //将线程的调度协程（主协程）保存到 t_scheduler_fiber
         }
-        // 创建一个执行空闲任务的协程
-        Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
+        if(m_workStealing) {
+            // 认领一个空闲的本地队列，认领之后其他线程指定本线程执行的任务可以直接投递进来
+            LocalQueue* queue = nullptr;
+            for(auto q : m_queues) {
+                int expected = -1;
+                if(q->threadId.compare_exchange_strong(expected, sylar::GetThreadId())) {
+                    queue = q;
+                    break;
+                }
+            }
+            SYLAR_ASSERT(queue);
+            t_local_queue = queue;
+        }
+        // 本线程的运行计数，登记到调度器中供getStats汇总
+        std::shared_ptr<ThreadCounters> counters_ptr = std::make_shared<ThreadCounters>();
+        ThreadCounters* counters = counters_ptr.get();
+        counters->threadId = sylar::GetThreadId();
+        counters->startUs  = sylar::GetCurrentUS();
+        counters->pthread  = pthread_self();
+        {
+            MutexType::Lock lock(m_mutex);
+            m_counters.push_back(counters_ptr);
+        }
+        t_counters = counters;
+        Fiber::SetSwitchTrace(&counters->trace);
+
+        // 创建一个执行空闲任务的协程，它切换得最频繁，始终使用独立的栈，不参与共享栈的拷贝
+        Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this), 0, true, false));
         // 创建一个回调任务的协程
         Fiber::ptr cb_fiber;
 
@@ -165,7 +1037,12 @@ namespace sylar {
         while(true) {
             task.reset();             // 清空此任务
             bool tickle_me = true;   // 是否tickle其他线程进行任务调度
-            {
+            if(m_workStealing) {
+                tickle_me = false;
+                takeTaskLocal(task, tickle_me);
+            } else if(takeTaskInject(task)) {
+                // 无锁注入队列中取到了任务
+            } else {
                 MutexType::Lock lock(m_mutex);
                 auto it = m_tasks.begin();
                 // 遍历任务队列中的所有任务
@@ -188,9 +1065,8 @@ namespace sylar {
                     }
 
                     // 当前调度线程找到一个任务，准备开始调度，将其从任务队列中剔除，活动线程数加1
-                    task = *it;                   // 取出任务
-                    m_tasks.erase(it);     // 从任务队列中删除任务
-                    it++;                         // 迭代器继续遍历
+                    task = std::move(*it);        // 取出任务
+                    it = m_tasks.erase(it);       // 从任务队列中删除任务，迭代器指向下一个任务
                     ++m_activeThreadCount;        // 活跃线程数增加
                     break;
                 }
@@ -204,24 +1080,32 @@ namespace sylar {
             }
 
             if(task.fiber) {
+                Count(counters->tasks);
+                Count(counters->switches);
                 // resume协程，resume返回时，协程要么执行完了，要么半路yield了，总之这个任务就算完成了，活跃线程数减一
                 task.fiber->resume();
                 --m_activeThreadCount;
                 task.reset();
             } else if (task.cb) {
+                Count(counters->tasks);
+                Count(counters->switches);
                 if(cb_fiber) { /// 执行cb的协程可以用，调用的是fiber中的reset
-                    cb_fiber->reset(task.cb); // cb_fiber协程复用绑定任务task.cb
+                    cb_fiber->reset(std::move(task.cb)); // cb_fiber协程复用绑定任务task.cb
                 } else {       /// 不可用，cb_fiber协程指向绑定任务task.cb的新协程 调用的是 shared_ptr的reset
                     // reset()包含两个操作。当智能指针中有值的时候，调用reset()会使引用计数减1.
                     // 当调用reset（new xxx())重新赋值时，智能指针首先是生成新对象，
                     // 然后将旧对象的引用计数减1（当然，如果发现引用计数为0时，则析构旧对象），
                     // 然后将新对象的指针交给智能指针保管。
-                    cb_fiber.reset(new Fiber(task.cb));
+                    cb_fiber.reset(new Fiber(std::move(task.cb)));
                 }
                 task.reset();            // 重置(清空)此任务
                 cb_fiber->resume();      // 唤醒，执行cb_fiber
                 m_activeThreadCount--;
-                cb_fiber.reset();        // 引用计数减一
+                // 回调执行完且没有别人持有时留下这个协程，下一个回调复用它和它的栈，不再创建协程；
+                // 半路yield的协程由持有它的一方重新调度，这里放手
+                if(cb_fiber->getState() != Fiber::TERM || cb_fiber.use_count() > 1) {
+                    cb_fiber.reset();    // 引用计数减一
+                }
             } else {
                 // 进到这个分支情况一定是任务队列空了，调度idle协程即可
                 if(idle_fiber->getState() == Fiber::TERM) {
@@ -230,10 +1114,50 @@ namespace sylar {
                     break;
                 }
 
+                if(m_retireRequests > 0 && !t_retiring && tryRetire()) {
+                    // 认领了退出请求，idle协程看到后立即返回，下一轮循环退出
+                    t_retiring = true;
+                }
+                Count(counters->switches);
+                uint64_t idle_begin = sylar::GetCurrentUS();
+                counters->idleSince.store(idle_begin, std::memory_order_relaxed);
                 ++m_idleThreadCount;
                 idle_fiber->resume();
                 --m_idleThreadCount;
+                counters->idleSince.store(0, std::memory_order_relaxed);
+                Count(counters->idleUs, sylar::GetCurrentUS() - idle_begin);
+                if(t_retiring) {
+                    // 已认领退出请求，不再取新任务，剩下的由retireSelf交给其他线程
+                    break;
+                }
+            }
+        }
+        counters->endUs = sylar::GetCurrentUS();
+        {
+            Spinlock::Lock lock(counters->signalMutex);
+            counters->alive = false;
+        }
+        Fiber::SetSwitchTrace(nullptr);
+        t_counters = nullptr;
+        if(t_retiring) {
+            // 弹性退出的线程不再单独保留计数，合并到累计中，线程反复增减时计数列表不会一直变长；
+            // getStats和看门狗手里的副本持有引用，用完才释放
+            SchedulerStats::Thread t;
+            ReadCounters(*counters, sylar::GetCurrentUS(), t);
+            {
+                MutexType::Lock lock(m_mutex);
+                m_retiredTotals.tasks        += t.tasks;
+                m_retiredTotals.switches     += t.switches;
+                m_retiredTotals.steals       += t.steals;
+                m_retiredTotals.idleUs       += t.idleUs;
+                m_retiredTotals.busyUs       += t.busyUs;
+                m_retiredTotals.epollWaits   += t.epollWaits;
+                m_retiredTotals.epollEvents  += t.epollEvents;
+                m_retiredTotals.timerExpired += t.timerExpired;
+                m_counters.erase(std::remove(m_counters.begin(), m_counters.end(), counters_ptr), m_counters.end());
             }
+            retireSelf();
+            t_retiring = false;
         }
         SYLAR_LOG_DEBUG(g_logger) << "Scheduler::run() exit";
     }
@@ -7,13 +7,75 @@
 #define __SYLAR_SCHEDULE_H__
 
 #include <memory>
+#include <string>
 #include <vector>
+#include <list>
+#include <deque>
+#include <atomic>
 #include "fiber.h"
+#include "task.h"
+#include "mpmc_queue.h"
 #include "mutex.h"
 #include "thread.h"
 
 namespace sylar {
+    /**
+     * @brief 调度器运行统计的快照
+     * @details 由Scheduler::getStats汇总各调度线程的计数得到，IO相关的字段只有IOManager会填
+     */
+    struct SchedulerStats {
+        /**
+         * @brief 单个调度线程的统计
+         */
+        struct Thread {
+            int      id = -1;                  // 线程id
+            size_t   queueDepth = 0;           // 本地队列中的任务数(工作窃取模式)
+            uint64_t tasks = 0;                // 执行的任务数
+            uint64_t switches = 0;             // 切入任务协程和idle协程的次数
+            uint64_t steals = 0;               // 从其他线程窃取的任务数
+            uint64_t idleUs = 0;               // 在idle协程中的时间(包括忙轮询)
+            uint64_t busyUs = 0;               // 其余时间，即执行任务和调度的时间
+            uint64_t epollWaits = 0;           // epoll_wait调用次数
+            uint64_t epollEvents = 0;          // epoll_wait返回的事件总数
+            uint64_t timerExpired = 0;         // 处理的到期定时器数
+        };
+
+        std::string name;                      // 调度器名称
+        size_t   threads = 0;                  // 调度线程数
+        size_t   activeThreads = 0;            // 正在执行任务的线程数
+        size_t   idleThreads = 0;              // 在idle协程中的线程数
+        size_t   queueDepth = 0;               // 全部队列中等待执行的任务数
+        uint64_t tasks = 0;                    // 以下为各线程计数之和，包括弹性退出的线程
+        uint64_t switches = 0;
+        uint64_t steals = 0;
+        uint64_t idleUs = 0;
+        uint64_t busyUs = 0;
+        uint64_t epollWaits = 0;
+        uint64_t epollEvents = 0;
+        uint64_t timerExpired = 0;
+        size_t   pendingEvents = 0;            // 已注册还未触发的IO事件数
+        uint64_t ticklesSent = 0;              // 实际发出的唤醒数
+        uint64_t ticklesSuppressed = 0;        // 被合并或无需唤醒而省掉的唤醒数
+        uint64_t busyPollHits = 0;             // 忙轮询命中次数
+        uint64_t busyPollMisses = 0;           // 忙轮询落空次数
+        uint64_t queueLatencyUs = 0;           // 弹性模式下最近一次探测到的排队延迟
+        uint64_t threadsAdded = 0;             // 运行中增加的线程数
+        uint64_t threadsRetired = 0;           // 运行中退出的线程数
+        std::vector<Thread> perThread;         // 每个调度线程的统计，弹性退出的线程不在其中
+
+        /**
+         * @brief 平均每次epoll_wait返回的事件数
+         */
+        double eventsPerWait() const { return epollWaits ? (double)epollEvents / epollWaits : 0; }
+
+        /**
+         * @brief 输出为key=value形式，每个线程一行，便于定期采集
+         */
+        std::string toString() const;
+    };
+
     class Scheduler {
+    friend class Watchdog;
     public:
         typedef std::shared_ptr<Scheduler> ptr;
         typedef Mutex MutexType;
@@ -23,96 +85,302 @@ namespace sylar {
         virtual ~Scheduler();
 
         const std::string &getName() const { return m_name; }
+
+        /**
+         * @brief 汇总各调度线程的计数，得到运行统计
+         * @details 计数由各线程在调度循环中只写自己的一份，这里读取时才加总，不给调度路径增加共享写
+         */
+        virtual SchedulerStats getStats();
+
+        bool isWorkStealing() const { return m_workStealing; }   // 是否开启了工作窃取模式
+        bool isElastic() const { return m_elastic; }             // 是否按负载自动增减线程
+
+        /**
+         * @brief 当前的调度线程数，包括use_caller的caller线程
+         */
+        size_t getThreadCount() const { return m_threadCount + (m_rootFiber ? 1 : 0); }
+
+        /**
+         * @brief 增加一个工作线程
+         * @return 已达到scheduler.elastic_max_threads上限、还没有start或已经stop时返回false
+         */
+        bool addThread();
+
+        /**
+         * @brief 请求一个工作线程退出
+         * @details 由下一个进入idle的工作线程认领，本地队列中的任务和指定它执行的任务转交给其他线程；
+         *          caller线程和还有指定本线程任务的线程不会认领
+         * @return 扣除已经在途的请求后会低于scheduler.elastic_min_threads下限时返回false
+         */
+        bool retireThread();
         static Scheduler* GetThis();        // 返回当前协程调度器
         static Fiber* GetMainFiber();      // 返回当前协程调度器的调度协程
 
+        /**
+         * @brief 协作式检查点，当前协程的时间片用完时让出执行权
+         * @details 长时间占用CPU、不做hook IO的循环中定期调用，避免同一线程上排队的其他协程饿死。
+         *          时间片从协程本次被调度运行后第一次调用检查点开始计算，长度由scheduler.time_slice_ms配置；
+         *          每次调用读一次时钟，循环体很短时可以每隔若干次迭代调用一次
+         * @return 是否让出过执行权，不在调度器的协程中调用时什么也不做，返回false
+         */
+        static bool Checkpoint();
+
         void start();
         void stop();
 
         /**
          * @brief 调度协程
-         * @param[in] fc 协程或函数
+         * @param[in] fc 协程或函数，函数会一路移动到执行它的协程中，小的可调用对象不分配内存
          * @param[in] thread 协程执行的线程id,-1标识任意线程
          */
         template<class FiberOrCb>
         void  schedule(FiberOrCb fc, int thread = -1) {
             bool need_tickle = false;
-            {
-                MutexType::Lock lock(m_mutex);
-                need_tickle = scheduleNoLock(fc, thread);
+            ScheduleTask ft(std::move(fc), thread);
+            thread = ft.thread;                                  // 共享栈协程会被指定回它绑定的线程
+            if(m_workStealing) {
+                need_tickle = scheduleLocal(ft);
+            } else {
+                need_tickle = scheduleInject(ft);
             }
-            
-            if(need_tickle) {
+
+            if(thread != -1) {
+                // 指定了线程的任务只有目标线程能执行，直接通知目标线程
+                tickleThread(thread);
+            } else if(need_tickle) {
                 tickle();
             }
         }
 
         /**
          * @brief 批量调度协程
+         * @details 整批通过scheduleBatch投递，只加一次锁、最多tickle一次；元素中的协程或函数会被移走
          * @param[in] begin 协程数组的开始
          * @param[in] end 协程数组的结束
          */
         template<class InputIterator>
         void schedule(InputIterator begin, InputIterator end) {
-            bool need_tickle = false;
-            {
-                MutexType::Lock lock(m_mutex);
-                while (begin != end) {
-                    need_tickle = scheduleNoLock(&*begin) || need_tickle;
-                }
-            }
-            if(need_tickle) {
-                tickle();
+            std::vector<ScheduleTask> tasks;
+            for (; begin != end; ++begin) {
+                tasks.emplace_back(&*begin, -1);
             }
+            scheduleBatch(tasks);
         }
 
+        /**
+         * @brief 登记一个挂起后由调度器之外的线程唤醒的协程，登记的协程被唤醒之前调度器不会停止
+         * @details 卸载线程池这类唤醒者不在本调度器中，调度器看不到挂起的协程，
+         *          挂起前登记，调用schedule唤醒之后再取消，取消之后唤醒者不能再访问调度器
+         */
+        void addExternalWaiter() { ++m_externalWaiters; }
+
+        /**
+         * @brief 取消addExternalWaiter的登记
+         */
+        void removeExternalWaiter() { --m_externalWaiters; }
+
     protected:
         virtual void tickle();                                   // 通知协程调度器有任务了
+        virtual void tickleThread(int thread) { tickle(); }      // 通知指定线程有任务了，默认同tickle
         virtual bool stopping();                                 // 返回是否可以停止
         virtual void idle();                                     // 协程无任务可调度时执行idle协程
         void run();                                              // 协程调度函数
         void setThis();                                          // 设置当前的协程调度器
         bool hasIdleThreads() { return m_idleThreadCount > 0; }  // 是否有空闲线程
+        size_t getIdleThreadCount() const { return m_idleThreadCount; } // 空闲线程数
+        bool isStopping() const { return m_stopping; }           // 是否已经调用了stop
+        bool isRetiring() const;                                 // 当前线程是否认领了退出请求，idle应尽快返回
+
+        /**
+         * @brief 固定线程数，关闭弹性伸缩和addThread/retireThread
+         * @attention 须在start之前调用，供线程和其他资源一一绑定的子类使用
+         */
+        void disableElastic();
+        /**
+         * @brief 无锁地查看注入队列和本地队列中是否有任务，供idle忙轮询使用
+         * @details 溢出到m_tasks链表和指定线程的任务不在这里检查，它们总会伴随一次tickle
+         */
+        bool hasPendingTasks() const { return !m_injectQueue.empty() || m_localTaskCount > 0; }
+        /**
+         * @brief 查看是否有当前线程可以取走的任务，包括溢出到m_tasks链表和指定本线程的任务
+         * @details 需要加锁，供调度线程进入阻塞等待之前做最后一次检查：线程在Scheduler::run中已经计为空闲、
+         *          但还没有标记为可唤醒时投递的任务，投递方的tickle会被合并掉，只能由这里发现
+         */
+        bool hasRunnableTasks();
+
+        /**
+         * @brief 调度线程的运行计数
+         * @details 每个调度线程一份，只由所属线程用relaxed的读改写更新，没有锁总线的原子指令；
+         *          前后填充避免和其他线程的计数落在同一缓存行
+         */
+        struct ThreadCounters {
+            char                  pad0[64];
+            int                   threadId = -1;
+            uint64_t              startUs = 0;       // 线程进入调度循环的时间
+            std::atomic<uint64_t> endUs{0};          // 线程退出调度循环的时间，0表示还在运行
+            std::atomic<uint64_t> tasks{0};
+            std::atomic<uint64_t> switches{0};
+            std::atomic<uint64_t> steals{0};
+            std::atomic<uint64_t> idleUs{0};
+            std::atomic<uint64_t> idleSince{0};      // 本次进入idle的时间，0表示不在idle中
+            std::atomic<uint64_t> epollWaits{0};
+            std::atomic<uint64_t> epollEvents{0};
+            std::atomic<uint64_t> timerExpired{0};
+
+            // 以下供看门狗使用
+            Fiber::SwitchTrace    trace;                 // 协程切换记录，由Fiber::resume/yield更新
+            pthread_t             pthread;               // 用于向该线程发信号抓取调用栈
+            Spinlock              signalMutex;           // 保证线程退出调度循环后不再给它发信号
+            bool                  alive = true;          // 线程是否还在调度循环中
+            void*                 frames[64];            // 信号处理函数抓到的调用栈地址
+            std::atomic<int>      frameCount{-1};        // 调用栈地址个数，-1表示还没抓到
+            uint64_t              watchSeq = 0;          // 看门狗上次看到的切换次数
+            uint64_t              watchSinceMs = 0;      // 看门狗看到切换次数变化的时间
+            bool                  flagged = false;       // 本次卡住是否已经报告过
+            char                  pad1[64];
+        };
+
+        /**
+         * @brief 单写者计数加n
+         */
+        static void Count(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief 当前调度线程的计数，不在调度循环中返回nullptr
+         */
+        static ThreadCounters* GetThreadCounters();
+
+        struct ScheduleTask;
+
+        /**
+         * @brief 批量投递任务，整批最多tickle一次
+         * @details 供调度线程把一轮事件循环产生的任务一次发布出去：全局队列模式下注入队列放得下的无锁放入，
+         *          其余(注入队列满了或指定了线程的)先在锁外串成链表，再在一次加锁中拼接到m_tasks；
+         *          工作窃取模式下在一次加锁中放入本线程的本地队列。指定了其他线程的任务按目标线程各通知一次
+         * @param[in, out] tasks 要投递的任务，返回时已清空，保留容量供下一轮复用
+         */
+        void scheduleBatch(std::vector<ScheduleTask>& tasks);
 
     private:
         //协程调度启动(无锁)
         template<class FiberOrCb>
         bool scheduleNoLock(FiberOrCb fc, int thread = -1) {
            bool need_tickle = m_tasks.empty();                   // 任务队列是否为空
-            ScheduleTask ft(fc, thread);                         // 创建任务
+            ScheduleTask ft(std::move(fc), thread);              // 创建任务
            if(ft.fiber || ft.cb) {                               // 如果协程和协程的执行函数都存在
-               m_tasks.push_back(ft);                            // 将此任务加入任务队列
+               m_tasks.push_back(std::move(ft));                 // 将此任务加入任务队列
            }
            return need_tickle;                                   // 返回true，通知schedule调度协程有任务，进行调度
         }
 
-    private:
+        struct LocalQueue;
+
+        /**
+         * @brief 投递任务到全局队列
+         * @details 未指定线程的任务优先无锁地放入注入队列m_injectQueue，注入队列满了或指定了线程的任务
+         *          再加锁放入m_tasks链表(溢出路径)
+         * @return 是否需要tickle
+         */
+        bool scheduleInject(ScheduleTask& task);
+
+        /**
+         * @brief 从注入队列中无锁地取一个任务，成功时活跃线程数已加1
+         */
+        bool takeTaskInject(ScheduleTask& task);
+
+        /**
+         * @brief 工作窃取模式下的任务投递
+         * @details 指定了线程的任务直接进入目标线程的pinned队列；调度线程自己投递的任务进入自己的本地队列；
+         *          其余线程投递的任务进入全局队列m_tasks，由空闲的调度线程取走
+         * @return 是否需要tickle
+         */
+        bool scheduleLocal(ScheduleTask& task);
+
+        /**
+         * @brief 工作窃取模式下为当前调度线程取一个任务
+         * @details 依次查找：本线程pinned队列 -> 本线程本地队列 -> 全局队列 -> 窃取其他线程的本地队列
+         * @param[out] task 取到的任务
+         * @param[out] tickle_me 是否需要通知其他线程
+         * @return 是否取到任务
+         */
+        bool takeTaskLocal(ScheduleTask& task, bool& tickle_me);
+
+        /**
+         * @brief 从全局队列中取一个可在当前线程执行的任务，需持有m_mutex
+         */
+        bool takeTaskNoLock(ScheduleTask& task, bool& tickle_me);
+
+        /**
+         * @brief 从victim的本地队列尾部窃取一半任务放入thief，返回其中一个
+         */
+        bool stealTask(LocalQueue* victim, LocalQueue* thief, ScheduleTask& task);
+
+        void planAffinity();                                     // 按配置计算每个调度线程绑定的CPU集合
+
+        void spawnThreadNoLock(size_t slot);                     // 在m_threads的slot槽位上创建工作线程，需持有m_mutex
+
+        /**
+         * @brief 调度线程进入idle之前认领一个退出请求，认领后不再出现在m_threadIds中
+         */
+        bool tryRetire();
+
+        /**
+         * @brief 认领了退出请求的线程离开调度循环后，把本地队列和指定本线程的任务交给其他线程
+         */
+        void retireSelf();
+
+        /**
+         * @brief 指定的线程已经退出时改为任意线程执行，需持有m_mutex
+         */
+        void rehomeNoLock(ScheduleTask& task);
+
+        /**
+         * @brief 把一个线程的计数换算成统计，busyUs和idleUs算到now为止
+         */
+        static void ReadCounters(const ThreadCounters& c, uint64_t now, SchedulerStats::Thread& t);
+
+        void reapRetired();                                      // join已经退出调度循环的线程
+        void elasticRun();                                       // 弹性伸缩的控制线程，定期采样排队延迟和空闲比例
+
+        static void bindThread(const std::vector<int>& cpus);    // 在调度线程内绑定CPU并设置本节点内存分配
+
+    protected:
         // 调度任务： 协程/函数/线程组  主要由两种任务
         // 一种是已经有回调的协程fiber， 放入任务队列中，调度器调度后执行
         // 一种是回调函数cb， 放入任务队列，调度后创建一个执行它的协程执行
+        // 任务只能移动，从schedule到队列再到执行协程，回调都不会被复制
         struct ScheduleTask {
             Fiber::ptr fiber;                                   // 协程
-            std::function<void()> cb;                           // 协程执行函数
+            Task       cb;                                      // 协程执行函数
             int thread;                                         // 指定此线程id去执行任务，未指定为 -1
 
             ScheduleTask(Fiber::ptr f, int thr)                 // 传入协程智能指针，指定线程号的构造函数
-                    : fiber(f),
-                      thread(thr) {
+                    : fiber(std::move(f)),
+                      thread(BoundThread(fiber.get(), thr)) {
             }
 
             ScheduleTask(Fiber::ptr *f, int thr)               // 传入协程智能指针的指针，指定线程号的构造函数
-                    : thread(thr) {
+                    : thread(-1) {
                 fiber.swap(*f);                                //  不会使fiber的引用增多
+                thread = BoundThread(fiber.get(), thr);
             }
 
-            ScheduleTask(std::function<void()> f, int thr)    // 传入协执行函数，指定线程号的构造函数
-                    : cb(f),
+            ScheduleTask(Task f, int thr)                       // 传入协执行函数，指定线程号的构造函数
+                    : cb(std::move(f)),
                       thread(thr) {
             }
 
-            ScheduleTask(std::function<void()>* f, int thr)  // 传入协执行函数的指针，指定线程号的构造函数
-                    : thread(thr) {
-                cb.swap(*f);
+            ScheduleTask(Task* f, int thr)                      // 传入协执行函数的指针，指定线程号的构造函数
+                    : cb(std::move(*f)),
+                      thread(thr) {
+            }
+
+            ScheduleTask(std::function<void()>* f, int thr)  // 传入std::function的指针，移走其中的函数
+                    : cb(std::move(*f)),
+                      thread(thr) {
+                *f = nullptr;
             }
 
             ScheduleTask()                                   // stl 使用的无参构造
@@ -120,11 +388,36 @@ namespace sylar {
 
             }
 
+            ScheduleTask(ScheduleTask&&) = default;
+            ScheduleTask& operator=(ScheduleTask&&) = default;
+
             void reset() {
                 fiber = nullptr;
                 cb = nullptr;
                 thread = -1;
             }
+
+            /**
+             * @brief 未指定线程时，已经绑定了共享栈的协程只能回到绑定的线程上执行
+             */
+            static int BoundThread(Fiber* f, int thr) {
+                return (thr == -1 && f) ? f->getBoundThread() : thr;
+            }
+        };
+
+    private:
+        /**
+         * @brief 调度线程的本地任务队列(工作窃取模式)
+         * @details tasks 可以被其他线程窃取，pinned 中是指定了本线程执行的任务，只能由本线程取出，
+         *          这样指定线程的任务不会在每次遍历时被其他线程反复跳过
+         */
+        struct LocalQueue {
+            typedef Spinlock MutexType;
+
+            MutexType                mutex;           // 队列锁，只有所属线程和窃取者竞争
+            std::deque<ScheduleTask> tasks;           // 可被窃取的任务
+            std::deque<ScheduleTask> pinned;          // 指定本线程执行的任务
+            std::atomic<int>         threadId = {-1}; // 所属调度线程id，-1表示还未有线程认领
         };
 
     private:
@@ -133,13 +426,32 @@ namespace sylar {
         std::vector<Thread::ptr> m_threads;                   // 线程池
         std::vector<int>         m_threadIds;                 // 线程池中线程id的集合
         std::list<ScheduleTask>  m_tasks;                     // 任务队列
-        size_t                   m_threadCount = 0;           // 线程池中线程总数，不包含use_caller的主线程
+        std::atomic<size_t>      m_threadCount = {0};         // 线程池中线程总数，不包含use_caller的主线程
+        size_t                   m_minThreads = 0;            // 工作线程数下限，不包含use_caller的主线程
+        size_t                   m_maxThreads = 0;            // 工作线程数上限，m_threads按它分配槽位
+        std::vector<Thread::ptr> m_retired;                   // 已退出调度循环、还未join的线程
+        std::atomic<size_t>      m_retireRequests = {0};      // 还没有线程认领的退出请求数
         std::atomic<size_t>      m_activeThreadCount = {0};   // 活跃线程数
         std::atomic<size_t>      m_idleThreadCount = {0};     // 空闲线程数
+        std::atomic<size_t>      m_externalWaiters = {0};     // 等待调度器之外的线程唤醒的协程数
         Fiber::ptr               m_rootFiber;                 // 调度器所在协程为主协程
         int                      m_rootThread = 0;            // use_caller为true时，调度器所在线程的id
         bool                     m_useCaller;                 // 是否使用use_caller
         bool                     m_stopping = false;          // 是否正在停止
+        bool                     m_workStealing = false;      // 是否使用工作窃取模式
+        bool                     m_elastic = false;           // 是否按负载自动增减线程
+        Thread::ptr              m_elasticThread;             // 弹性伸缩的控制线程
+        std::atomic<bool>        m_elasticRunning = {false};  // 控制线程是否继续运行
+        std::atomic<uint64_t>    m_probeSentUs = {0};         // 在途的延迟探测任务的投递时间，0表示没有在途的探测
+        std::atomic<uint64_t>    m_probeLatencyUs = {0};      // 最近一次探测任务的排队延迟
+        std::atomic<uint64_t>    m_threadsAdded = {0};        // 运行中增加的线程数
+        std::atomic<uint64_t>    m_threadsRetired = {0};      // 运行中退出的线程数
+        std::vector<LocalQueue*> m_queues;                    // 每个调度线程一个本地队列(工作窃取模式)
+        std::atomic<size_t>      m_localTaskCount = {0};      // 所有本地队列中的任务总数
+        MPMCQueue<ScheduleTask>  m_injectQueue;               // 跨线程投递任务的无锁注入队列，满了之后溢出到m_tasks
+        std::vector<std::vector<int> > m_threadCpus;          // 每个调度线程绑定的CPU集合，为空表示不绑定
+        std::vector<std::shared_ptr<ThreadCounters> > m_counters; // 每个调度线程的计数，弹性退出的线程会被移除
+        SchedulerStats::Thread   m_retiredTotals;             // 弹性退出的线程的计数之和
 
     };
 }
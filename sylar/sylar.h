@@ -14,6 +14,13 @@
 #include "sylar/macro.h"
 #include "sylar/fiber.h"
 #include "sylar/scheduler.h"
+#include "sylar/fiber_sync.h"
+#include "sylar/parallel.h"
+#include "sylar/channel.h"
+#include "sylar/watchdog.h"
+#include "sylar/offload.h"
+#include "sylar/dns.h"
+#include "sylar/cancel.h"
 #include "sylar/iomanager.h"
 #include "sylar/timer.h"
 
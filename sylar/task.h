@@ -0,0 +1,171 @@
+/**
+  ********************************************************
+  * @file        : task.h
+  * @author      : zgys
+  * @brief       : 只能移动、带内联存储的可调用对象
+  * @attention   : 调度器、协程、IO事件和定时器之间传递回调都用它，代替会复制和分配内存的std::function
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#ifndef __SYLAR_TASK_H__
+#define __SYLAR_TASK_H__
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace sylar {
+
+    /**
+     * @brief 只能移动的void()可调用对象
+     * @details 不超过INLINE_SIZE、且移动构造不抛异常的可调用对象(捕获几个指针或shared_ptr的lambda、
+     *          std::function本身)直接放在对象内部，构造、移动、调用都不分配内存；更大的才放到堆上。
+     *          从空的std::function或空函数指针构造得到的是空Task
+     */
+    class Task {
+    public:
+        /// 内联存储的大小，能放下std::function或捕获了shared_ptr和几个指针的lambda
+        static const size_t INLINE_SIZE = 48;
+
+        Task() noexcept {}
+
+        Task(std::nullptr_t) noexcept {}
+
+        template<class F,
+                 class D = typename std::decay<F>::type,
+                 class = typename std::enable_if<!std::is_same<D, Task>::value>::type,
+                 class = decltype(std::declval<D&>()())>
+        Task(F&& f) {
+            if (!IsNull(f)) {
+                init<D>(std::forward<F>(f), Inline<D>());
+            }
+        }
+
+        Task(Task&& o) noexcept {
+            moveFrom(o);
+        }
+
+        Task& operator=(Task&& o) noexcept {
+            if (this != &o) {
+                reset();
+                moveFrom(o);
+            }
+            return *this;
+        }
+
+        Task& operator=(std::nullptr_t) noexcept {
+            reset();
+            return *this;
+        }
+
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+
+        ~Task() {
+            reset();
+        }
+
+        /**
+         * @brief 调用，空Task不能调用
+         */
+        void operator()() {
+            m_ops->invoke(&m_storage);
+        }
+
+        explicit operator bool() const { return m_ops != nullptr; }
+
+        /**
+         * @brief 是否保存在内联存储中(测试用)
+         */
+        bool isInline() const { return m_ops && m_ops->inlined; }
+
+    private:
+        typedef typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type Storage;
+
+        /**
+         * @brief 类型擦除后的操作表，每种可调用对象类型一份静态实例
+         */
+        struct Ops {
+            void (*invoke)(Storage*);
+            void (*move)(Storage* dst, Storage* src);   // 移动构造到dst并销毁src
+            void (*destroy)(Storage*);
+            bool inlined;
+        };
+
+        template<class D>
+        struct Inline : std::integral_constant<bool, sizeof(D) <= INLINE_SIZE
+                                                     && alignof(D) <= alignof(std::max_align_t)
+                                                     && std::is_nothrow_move_constructible<D>::value> {};
+
+        template<class D>
+        struct InlineOps {
+            static D* get(Storage* s) { return reinterpret_cast<D*>(s); }
+            static void invoke(Storage* s) { (*get(s))(); }
+            static void move(Storage* dst, Storage* src) {
+                new (dst) D(std::move(*get(src)));
+                get(src)->~D();
+            }
+            static void destroy(Storage* s) { get(s)->~D(); }
+            static const Ops ops;
+        };
+
+        template<class D>
+        struct HeapOps {
+            static D*& get(Storage* s) { return *reinterpret_cast<D**>(s); }
+            static void invoke(Storage* s) { (*get(s))(); }
+            static void move(Storage* dst, Storage* src) { *reinterpret_cast<D**>(dst) = get(src); }
+            static void destroy(Storage* s) { delete get(s); }
+            static const Ops ops;
+        };
+
+        template<class F>
+        static bool IsNull(const F&) { return false; }
+        template<class F>
+        static bool IsNull(const std::function<F>& f) { return !f; }
+        template<class F>
+        static bool IsNull(F* f) { return f == nullptr; }
+
+        template<class D, class F>
+        void init(F&& f, std::true_type) {
+            new (&m_storage) D(std::forward<F>(f));
+            m_ops = &InlineOps<D>::ops;
+        }
+
+        template<class D, class F>
+        void init(F&& f, std::false_type) {
+            *reinterpret_cast<D**>(&m_storage) = new D(std::forward<F>(f));
+            m_ops = &HeapOps<D>::ops;
+        }
+
+        void moveFrom(Task& o) noexcept {
+            if (o.m_ops) {
+                o.m_ops->move(&m_storage, &o.m_storage);
+                m_ops = o.m_ops;
+                o.m_ops = nullptr;
+            }
+        }
+
+        void reset() noexcept {
+            if (m_ops) {
+                // 先摘下再销毁，可调用对象析构时再给这个Task赋值也是安全的
+                const Ops* ops = m_ops;
+                m_ops = nullptr;
+                ops->destroy(&m_storage);
+            }
+        }
+
+    private:
+        Storage    m_storage;
+        const Ops* m_ops = nullptr;
+    };
+
+    template<class D>
+    const Task::Ops Task::InlineOps<D>::ops = {&InlineOps<D>::invoke, &InlineOps<D>::move, &InlineOps<D>::destroy, true};
+
+    template<class D>
+    const Task::Ops Task::HeapOps<D>::ops = {&HeapOps<D>::invoke, &HeapOps<D>::move, &HeapOps<D>::destroy, false};
+}
+
+#endif //SYLAR_TASK_H
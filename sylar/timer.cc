@@ -10,8 +10,15 @@
 #include "timer.h"
 #include "util.h"
 #include "macro.h"
+#include "config.h"
+#include <algorithm>
 
 namespace sylar {
+
+    // 是否使用分层时间轮管理定时器，添加和取消都是O(1)，适合大量短命定时器(如hook中的IO超时)
+    static ConfigVar<bool>::ptr g_timer_wheel =
+            Config::Lookup<bool>("timer.wheel", false, "use hierarchical timing wheel for timers");
+
     bool Timer::Comparator::operator()(const Timer::ptr& lhs, const Timer::ptr& rhs) const {
         if (!lhs && !rhs) {
             return false;
@@ -22,10 +29,10 @@ namespace sylar {
         if (!rhs) {
             return false;
         }
-        if (lhs->m_next < lhs->m_next) {
+        if (lhs->m_next < rhs->m_next) {
             return true;
         }
-        if (lhs->m_next > lhs->m_next) {
+        if (lhs->m_next > rhs->m_next) {
             return false;
         }
         return lhs.get() < rhs.get();
@@ -44,8 +51,15 @@ namespace sylar {
     bool Timer::cancel() {
         TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
         if(m_cb) {
+            m_cb = nullptr;
+            if(m_manager->m_useWheel) {
+                Timer::ptr self = m_manager->wheelRemove(this);
+                return true;
+            }
             auto it = m_manager->m_timers.find(shared_from_this());
-            m_manager->m_timers.erase(it);
+            if(it != m_manager->m_timers.end()) {
+                m_manager->m_timers.erase(it);
+            }
             return true;
         }
         return false;
@@ -56,6 +70,15 @@ namespace sylar {
         if(!m_cb) {
             return false;
         }
+        if(m_manager->m_useWheel) {
+            Timer::ptr self = m_manager->wheelRemove(this);
+            if(!self) {
+                return false;
+            }
+            m_next = sylar::GetCurrentMS() + m_ms;
+            m_manager->wheelAdd(self);
+            return true;
+        }
         auto it = m_manager->m_timers.find(shared_from_this());
         if(it == m_manager->m_timers.end()) {
             return false;
@@ -75,11 +98,17 @@ namespace sylar {
             return false;
         }
         // 在定时器管理器的定时器队列中找，如果没有这个定时器实例，旧重设失败
-        auto it = m_manager->m_timers.find(shared_from_this());
-        if(it == m_manager->m_timers.end()) {
-            return false;
+        if(m_manager->m_useWheel) {
+            if(!m_manager->wheelRemove(this)) {
+                return false;
+            }
+        } else {
+            auto it = m_manager->m_timers.find(shared_from_this());
+            if(it == m_manager->m_timers.end()) {
+                return false;
+            }
+            m_manager->m_timers.erase(it);
         }
-        m_manager->m_timers.erase(it);
         uint64_t start = 0;
         if(from_now) {
             start = sylar::GetCurrentMS();
@@ -92,11 +121,22 @@ namespace sylar {
         return true;
     }
 
-    TimerManager::TimerManager() {
+    TimerManager::TimerManager()
+            : m_useWheel(g_timer_wheel->getValue()),
+              m_wheelNextHint(~0ull) {
         m_previousTime = sylar::GetCurrentMS();
+        m_wheelTime = m_previousTime;
+        memset(m_wheelRoot, 0, sizeof(m_wheelRoot));
+        memset(m_wheelLevel, 0, sizeof(m_wheelLevel));
     }
 
-    TimerManager::~TimerManager() {}
+    TimerManager::~TimerManager() {
+        if(m_useWheel) {
+            // 时间轮中的定时器持有自身引用，析构时要全部摘下，否则会泄漏
+            std::vector<Timer::ptr> timers;
+            wheelExpire(m_wheelTime, true, timers);
+        }
+    }
 
     Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring) {
         Timer::ptr timer(new Timer(ms, cb, recurring, this));
@@ -106,6 +146,19 @@ namespace sylar {
     }
 
     void TimerManager::addTimer(Timer::ptr timer, RWMutexType::WriteLock& lock) {
+        if(m_useWheel) {
+            wheelAdd(timer);
+            // 比idle协程当前等待的时间点更早，需要唤醒它重新计算epoll_wait的超时时间
+            bool at_front = (timer->m_next < m_wheelNextHint) && !m_tickled;
+            if(at_front) {
+                m_tickled = true;
+            }
+            lock.unlock();
+            if(at_front) {
+                onTimerInsertedAtFront();
+            }
+            return;
+        }
         auto it = m_timers.insert(timer).first;
         bool at_front = (it == m_timers.begin()) && !m_tickled;
         if(at_front) {
@@ -131,7 +184,18 @@ namespace sylar {
 
     uint64_t TimerManager::getNextTimer() {
         RWMutexType::ReadLock lock(m_mutex);
+        // 多个idle线程持读锁同时进来，只写原子变量；读锁排除了写者，它们从同一个时间轮状态算出同一个值
         m_tickled = false;
+        if(m_useWheel) {
+            if(m_wheelCount == 0) {
+                m_wheelNextHint = ~0ull;
+                return ~0ull;
+            }
+            uint64_t next = wheelNextTime();
+            m_wheelNextHint = next;
+            uint64_t now_ms = sylar::GetCurrentMS();
+            return now_ms >= next ? 0 : next - now_ms;
+        }
         if(m_timers.empty()) {
             return ~0ull;     //如果定时器的队列是空的，那就返回一个最大的数， 0取反 ull是unsigned long long
         }
@@ -145,17 +209,40 @@ namespace sylar {
         }
     }
 
-    void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs) {
+    void TimerManager::listExpiredCb(std::vector<Task>& cbs) {
         uint64_t now_ms = sylar::GetCurrentMS();
         std::vector<Timer::ptr> expired;
         {
             RWMutexType::ReadLock lock(m_mutex);
-            if(m_timers.empty()) {
+            if(m_useWheel ? m_wheelCount == 0 : m_timers.empty()) {
                 return;
             }
         }
         RWMutexType::WriteLock lock(m_mutex);
 
+        if(m_useWheel) {
+            if(m_wheelCount == 0) {
+                m_wheelTime = now_ms + 1;
+                return;
+            }
+            bool rollover = SYLAR_UNLIKELY(detectClockRollover(now_ms));
+            // 按槽整体摘下到期的定时器，一次加锁处理一批
+            wheelExpire(now_ms, rollover, expired);
+            cbs.reserve(cbs.size() + expired.size());
+            for(auto& timer : expired) {
+                if(timer->m_recurring) {
+                    cbs.emplace_back(timer->m_cb);
+                    timer->m_next = now_ms + timer->m_ms;
+                    wheelAdd(timer);
+                } else {
+                    // 一次性定时器的回调直接移走，不再复制
+                    cbs.emplace_back(std::move(timer->m_cb));
+                    timer->m_cb = nullptr;
+                }
+            }
+            return;
+        }
+
         if(m_timers.empty()) {
             return;
         }
@@ -181,11 +268,12 @@ namespace sylar {
         cbs.reserve(expired.size());
 
         for(auto& timer : expired) {
-            cbs.push_back(timer->m_cb);
             if(timer->m_recurring) {
+                cbs.emplace_back(timer->m_cb);
                 timer->m_next = now_ms + timer->m_ms;
                 m_timers.insert(timer);
             } else {
+                cbs.emplace_back(std::move(timer->m_cb));
                 timer->m_cb = nullptr;
             }
         }
@@ -202,6 +290,148 @@ namespace sylar {
 
     bool TimerManager::hasTimer() {
         RWMutexType::ReadLock lock(m_mutex);
-        return !m_timers.empty();
+        return m_useWheel ? m_wheelCount > 0 : !m_timers.empty();
+    }
+
+    void TimerManager::wheelAdd(const Timer::ptr& timer) {
+        if(m_wheelCount == 0) {
+            // 时间轮空闲期间没有推进，先对齐到当前时间，否则下次到期处理要逐毫秒走完整个空闲期
+            m_wheelTime = std::max(m_wheelTime, sylar::GetCurrentMS());
+        }
+        uint64_t expires = timer->m_next;
+        uint64_t idx = expires - m_wheelTime;
+        Timer** slot = nullptr;
+        if((int64_t)idx < 0) {
+            // 已经过期，放到下一个要处理的槽位
+            slot = &m_wheelRoot[m_wheelTime & WHEEL_ROOT_MASK];
+        } else if(idx < WHEEL_ROOT_SIZE) {
+            slot = &m_wheelRoot[expires & WHEEL_ROOT_MASK];
+        } else {
+            if(idx > 0xffffffffull) {
+                // 超出时间轮范围，先放在最高层最远的槽位，级联时会按真实时间重新分配
+                expires = m_wheelTime + 0xffffffffull;
+            }
+            size_t level = 0;
+            while(level + 1 < WHEEL_LEVELS
+                  && idx >= (1ull << (WHEEL_ROOT_BITS + (level + 1) * WHEEL_LEVEL_BITS))) {
+                ++level;
+            }
+            size_t shift = WHEEL_ROOT_BITS + level * WHEEL_LEVEL_BITS;
+            slot = &m_wheelLevel[level][(expires >> shift) & WHEEL_LEVEL_MASK];
+        }
+
+        Timer* t = timer.get();
+        t->m_wheelPrev = nullptr;
+        t->m_wheelNext = *slot;
+        if(*slot) {
+            (*slot)->m_wheelPrev = t;
+        }
+        *slot = t;
+        t->m_wheelSlot = slot;
+        if(!t->m_wheelSelf) {
+            t->m_wheelSelf = timer;
+        }
+        ++m_wheelCount;
+    }
+
+    Timer::ptr TimerManager::wheelRemove(Timer* timer) {
+        Timer::ptr self;
+        if(!timer->m_wheelSlot) {
+            return self;
+        }
+        if(timer->m_wheelPrev) {
+            timer->m_wheelPrev->m_wheelNext = timer->m_wheelNext;
+        } else {
+            *timer->m_wheelSlot = timer->m_wheelNext;
+        }
+        if(timer->m_wheelNext) {
+            timer->m_wheelNext->m_wheelPrev = timer->m_wheelPrev;
+        }
+        timer->m_wheelPrev = nullptr;
+        timer->m_wheelNext = nullptr;
+        timer->m_wheelSlot = nullptr;
+        self.swap(timer->m_wheelSelf);
+        --m_wheelCount;
+        return self;
+    }
+
+    void TimerManager::wheelCascade(size_t level, size_t index) {
+        Timer* t = m_wheelLevel[level][index];
+        m_wheelLevel[level][index] = nullptr;
+        while(t) {
+            Timer* next = t->m_wheelNext;
+            Timer::ptr self;
+            self.swap(t->m_wheelSelf);
+            t->m_wheelPrev = nullptr;
+            t->m_wheelNext = nullptr;
+            t->m_wheelSlot = nullptr;
+            --m_wheelCount;
+            wheelAdd(self);
+            t = next;
+        }
+    }
+
+    void TimerManager::wheelExpire(uint64_t now_ms, bool all, std::vector<Timer::ptr>& expired) {
+        auto take_slot = [this, &expired](Timer** slot) {
+            Timer* t = *slot;
+            *slot = nullptr;
+            while(t) {
+                Timer* next = t->m_wheelNext;
+                t->m_wheelPrev = nullptr;
+                t->m_wheelNext = nullptr;
+                t->m_wheelSlot = nullptr;
+                expired.push_back(Timer::ptr());
+                expired.back().swap(t->m_wheelSelf);
+                --m_wheelCount;
+                t = next;
+            }
+        };
+
+        if(all) {
+            for(size_t i = 0; i < WHEEL_ROOT_SIZE; ++i) {
+                take_slot(&m_wheelRoot[i]);
+            }
+            for(size_t l = 0; l < WHEEL_LEVELS; ++l) {
+                for(size_t i = 0; i < WHEEL_LEVEL_SIZE; ++i) {
+                    take_slot(&m_wheelLevel[l][i]);
+                }
+            }
+            m_wheelTime = now_ms + 1;
+            return;
+        }
+
+        while(m_wheelTime <= now_ms) {
+            if(m_wheelCount == 0) {
+                m_wheelTime = now_ms + 1;
+                break;
+            }
+            size_t index = m_wheelTime & WHEEL_ROOT_MASK;
+            if(index == 0) {
+                // 根时间轮转完一圈，从上层依次级联下一段时间的定时器
+                for(size_t l = 0; l < WHEEL_LEVELS; ++l) {
+                    size_t i = (m_wheelTime >> (WHEEL_ROOT_BITS + l * WHEEL_LEVEL_BITS)) & WHEEL_LEVEL_MASK;
+                    wheelCascade(l, i);
+                    if(i != 0) {
+                        break;
+                    }
+                }
+            }
+            take_slot(&m_wheelRoot[index]);
+            ++m_wheelTime;
+        }
+    }
+
+    uint64_t TimerManager::wheelNextTime() {
+        // 在根时间轮中找最近的非空槽位，遇到一圈的边界时需要级联，也要在那个时间点醒来
+        for(size_t i = 0; i < WHEEL_ROOT_SIZE; ++i) {
+            uint64_t tick = m_wheelTime + i;
+            if(m_wheelRoot[tick & WHEEL_ROOT_MASK]) {
+                return tick;
+            }
+            if(i > 0 && (tick & WHEEL_ROOT_MASK) == 0) {
+                return tick;
+            }
+        }
+        return m_wheelTime + WHEEL_ROOT_SIZE;
     }
 }
\ No newline at end of file
@@ -13,7 +13,10 @@
 #include <memory>
 #include <set>
 #include <vector>
+#include <atomic>
+#include <functional>
 #include "mutex.h"
+#include "task.h"
 
 namespace sylar {
 
@@ -59,6 +62,12 @@ namespace sylar {
         std::function<void()> m_cb = nullptr;            // 定时器需要执行的任务
         TimerManager*         m_manager = nullptr;       // timerManager指针
 
+        // 时间轮模式下使用的侵入式双向链表节点
+        Timer::ptr            m_wheelSelf;               // 在时间轮中时持有自身，保证定时器不被释放
+        Timer*                m_wheelPrev = nullptr;     // 槽位链表中的前一个定时器
+        Timer*                m_wheelNext = nullptr;     // 槽位链表中的后一个定时器
+        Timer**               m_wheelSlot = nullptr;     // 所在槽位的链表头，nullptr表示不在时间轮中
+
     private:
         /**
          * @brief 定时器比较仿函数
@@ -111,12 +120,17 @@ namespace sylar {
          * @brief 获取需要执行的定时器的回调函数列表
          * @param[out] cbs 回调函数数组
          */
-        void listExpiredCb(std::vector<std::function<void()> >& cbs);
+        void listExpiredCb(std::vector<Task>& cbs);
 
         /**
          * @brief 是否有定时器
          */
         bool hasTimer();
+
+        /**
+         * @brief 是否使用分层时间轮
+         */
+        bool isTimingWheel() const { return m_useWheel; }
     protected:
         /**
          * @brief 当有新的定时器插入到定时器的首部,执行该函数
@@ -132,11 +146,55 @@ namespace sylar {
          * @brief 检测服务器时间是否被调后了
          */
         bool detectClockRollover(uint64_t now_ms);
+
+        /**
+         * @brief 把定时器挂到时间轮对应的槽位上，O(1)
+         */
+        void wheelAdd(const Timer::ptr& timer);
+
+        /**
+         * @brief 把定时器从时间轮中摘下，O(1)
+         * @return 时间轮持有的定时器引用，调用者持有它直到不再访问该定时器
+         */
+        Timer::ptr wheelRemove(Timer* timer);
+
+        /**
+         * @brief 把高层时间轮的一个槽位中的定时器重新分配到低层
+         */
+        void wheelCascade(size_t level, size_t index);
+
+        /**
+         * @brief 推进时间轮到now_ms，整槽收集到期的定时器
+         * @param[in] all 是否取出全部定时器(时钟回退时使用)
+         */
+        void wheelExpire(uint64_t now_ms, bool all, std::vector<Timer::ptr>& expired);
+
+        /**
+         * @brief 时间轮中下一次需要处理的时间点(绝对时间)，可能早于实际最近的定时器
+         */
+        uint64_t wheelNextTime();
+
     private:
+        /// 根时间轮每槽1ms，共256槽；其上4层每层64槽，每槽跨度是下一层一整圈，共覆盖2^32ms
+        static const size_t WHEEL_ROOT_BITS  = 8;
+        static const size_t WHEEL_ROOT_SIZE  = 1 << WHEEL_ROOT_BITS;
+        static const size_t WHEEL_ROOT_MASK  = WHEEL_ROOT_SIZE - 1;
+        static const size_t WHEEL_LEVEL_BITS = 6;
+        static const size_t WHEEL_LEVEL_SIZE = 1 << WHEEL_LEVEL_BITS;
+        static const size_t WHEEL_LEVEL_MASK = WHEEL_LEVEL_SIZE - 1;
+        static const size_t WHEEL_LEVELS     = 4;
+
         RWMutexType                             m_mutex;
         std::set<Timer::ptr, Timer::Comparator> m_timers;              /// 定时器集合
-        bool                                    m_tickled = false;     /// 是否触发onTimerInsertedAtFront
+        std::atomic<bool>                       m_tickled{false};      /// 是否触发onTimerInsertedAtFront，多个idle线程在读锁下同时清除
         uint64_t                                m_previousTime = 0;    /// 上次执行时间
+
+        bool                                    m_useWheel = false;    /// 是否使用分层时间轮代替std::set
+        uint64_t                                m_wheelTime = 0;       /// 时间轮下一个要处理的时间点(ms)
+        size_t                                  m_wheelCount = 0;      /// 时间轮中的定时器数量
+        std::atomic<uint64_t>                   m_wheelNextHint;       /// 上次计算出的下一次处理时间，用于判断是否需要唤醒；多个idle线程在读锁下同时写入
+        Timer*                                  m_wheelRoot[WHEEL_ROOT_SIZE];
+        Timer*                                  m_wheelLevel[WHEEL_LEVELS][WHEEL_LEVEL_SIZE];
     };
 }
 
@@ -12,9 +12,13 @@
 #include <signal.h> // for kill()
 #include <sys/syscall.h>
 #include <sys/stat.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
 #include <execinfo.h> // for backtrace()
 #include <cxxabi.h>   // for abi::__cxa_demangle()
 #include <algorithm>  // for std::transform()
+#include <fstream>
+#include <set>
 #include "util.h"
 #include "log.h"
 #include "fiber.h"
@@ -70,18 +74,22 @@ void Backtrace(std::vector<std::string> &bt, int size, int skip) {
     void **array = (void **)malloc((sizeof(void *) * size));
     size_t s     = ::backtrace(array, size);
 
-    char **strings = backtrace_symbols(array, s);
+    Backtrace(bt, array, s, skip);
+    free(array);
+}
+
+void Backtrace(std::vector<std::string> &bt, void *const *frames, int size, int skip) {
+    char **strings = backtrace_symbols(frames, size);
     if (strings == NULL) {
         SYLAR_LOG_ERROR(g_logger) << "backtrace_synbols error";
         return;
     }
 
-    for (size_t i = skip; i < s; ++i) {
+    for (int i = skip; i < size; ++i) {
         bt.push_back(demangle(strings[i]));
     }
 
     free(strings);
-    free(array);
 }
 
 std::string BacktraceToString(int size, int skip, const std::string &prefix) {
@@ -556,4 +564,141 @@ std::wstring StringUtil::StringToWString(const std::string& s) {
 }
 
 
+/// 当前线程是否已绑核
+static thread_local bool t_cpu_pinned = false;
+
+/**
+ * @brief 读取sysfs文件的第一行
+ */
+static std::string ReadSysfsLine(const std::string& path) {
+    std::ifstream ifs(path);
+    std::string line;
+    if (ifs) {
+        std::getline(ifs, line);
+    }
+    return line;
+}
+
+std::vector<int> CpuUtil::ParseCpuList(const std::string& str) {
+    std::set<int> cpus;
+    size_t pos = 0;
+    while (pos < str.size()) {
+        size_t end = str.find(',', pos);
+        if (end == std::string::npos) {
+            end = str.size();
+        }
+        std::string item = StringUtil::Trim(str.substr(pos, end - pos));
+        pos = end + 1;
+        if (item.empty()) {
+            continue;
+        }
+        int first = -1;
+        int last = -1;
+        int n = sscanf(item.c_str(), "%d-%d", &first, &last);
+        if (n == 1) {
+            last = first;
+        } else if (n != 2) {
+            continue;
+        }
+        for (int i = first; i >= 0 && i <= last; ++i) {
+            cpus.insert(i);
+        }
+    }
+    return std::vector<int>(cpus.begin(), cpus.end());
+}
+
+std::vector<int> CpuUtil::GetOnlineCpus() {
+    std::vector<int> cpus = ParseCpuList(ReadSysfsLine("/sys/devices/system/cpu/online"));
+    if (cpus.empty()) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long i = 0; i < n; ++i) {
+            cpus.push_back(i);
+        }
+    }
+    return cpus;
+}
+
+std::vector<int> CpuUtil::GetPhysicalCores() {
+    std::vector<int> cores;
+    std::set<std::pair<std::string, std::string> > seen;
+    for (int cpu : GetOnlineCpus()) {
+        std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        auto key = std::make_pair(ReadSysfsLine(dir + "physical_package_id"),
+                                  ReadSysfsLine(dir + "core_id"));
+        if (seen.insert(key).second) {
+            cores.push_back(cpu);
+        }
+    }
+    return cores;
+}
+
+std::vector<int> CpuUtil::GetNumaNodes() {
+    std::vector<int> nodes = ParseCpuList(ReadSysfsLine("/sys/devices/system/node/has_cpu"));
+    if (nodes.empty()) {
+        nodes.push_back(0);
+    }
+    return nodes;
+}
+
+std::vector<int> CpuUtil::GetNodeCpus(int node) {
+    std::vector<int> cpus = ParseCpuList(ReadSysfsLine("/sys/devices/system/node/node"
+                                                       + std::to_string(node) + "/cpulist"));
+    if (cpus.empty() && node == 0) {
+        cpus = GetOnlineCpus();
+    }
+    return cpus;
+}
+
+int CpuUtil::GetCpuNode(int cpu) {
+    for (int node : GetNumaNodes()) {
+        std::vector<int> cpus = GetNodeCpus(node);
+        if (std::binary_search(cpus.begin(), cpus.end(), cpu)) {
+            return node;
+        }
+    }
+    return 0;
+}
+
+bool CpuUtil::SetAffinity(const std::vector<int>& cpus) {
+    if (cpus.empty()) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        return false;
+    }
+    t_cpu_pinned = true;
+    return true;
+}
+
+bool CpuUtil::IsPinned() {
+    return t_cpu_pinned;
+}
+
+bool CpuUtil::SetLocalAlloc() {
+    return syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) == 0;
+}
+
+bool CpuUtil::BindLocal(void* addr, size_t len) {
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+        return false;
+    }
+    const size_t bits = sizeof(unsigned long) * 8;
+    if (node >= bits * 16) {
+        return false;
+    }
+    unsigned long mask[16] = {0};
+    mask[node / bits] = 1UL << (node % bits);
+    return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, bits * 16, 0) == 0;
+}
+
+
 } // namespace sylar
\ No newline at end of file
@@ -54,6 +54,16 @@ void SetThreadName(const std::string &name);
  */
 void Backtrace(std::vector<std::string> &bt, int size = 64, int skip = 1);
 
+/**
+ * @brief 把已经取到的调用栈地址解析为符号
+ * @details 信号处理函数中只能用::backtrace取地址，符号解析要分配内存，放到别的线程中用这个函数做
+ * @param[out] bt 保存调用栈
+ * @param[in] frames 调用栈地址
+ * @param[in] size 地址个数
+ * @param[in] skip 跳过栈顶的层数
+ */
+void Backtrace(std::vector<std::string> &bt, void *const *frames, int size, int skip = 0);
+
 /**
  * @brief 获取当前栈信息的字符串
  * @param[in] size 栈的最大层数
@@ -288,6 +298,66 @@ public:
 
 };
 
+/**
+ * @brief CPU拓扑、线程绑核和NUMA内存策略
+ * @details 拓扑信息读取/sys/devices/system，内存策略直接用set_mempolicy/mbind系统调用，不依赖libnuma
+ */
+class CpuUtil {
+public:
+    /**
+     * @brief 解析内核格式的CPU列表，如"0-3,8,10-11"
+     * @return 升序去重后的CPU编号，格式错误的部分被忽略
+     */
+    static std::vector<int> ParseCpuList(const std::string& str);
+
+    /**
+     * @brief 在线的CPU
+     */
+    static std::vector<int> GetOnlineCpus();
+
+    /**
+     * @brief 每个物理核取编号最小的一个逻辑CPU，超线程的兄弟CPU被去掉
+     */
+    static std::vector<int> GetPhysicalCores();
+
+    /**
+     * @brief 有CPU的NUMA节点，不支持NUMA的系统返回{0}
+     */
+    static std::vector<int> GetNumaNodes();
+
+    /**
+     * @brief NUMA节点上的CPU，不支持NUMA的系统节点0返回全部在线CPU
+     */
+    static std::vector<int> GetNodeCpus(int node);
+
+    /**
+     * @brief CPU所属的NUMA节点，未知时返回0
+     */
+    static int GetCpuNode(int cpu);
+
+    /**
+     * @brief 把当前线程绑定到指定的CPU集合上
+     * @return 集合为空或系统调用失败返回false
+     */
+    static bool SetAffinity(const std::vector<int>& cpus);
+
+    /**
+     * @brief 当前线程是否通过SetAffinity绑定过CPU
+     */
+    static bool IsPinned();
+
+    /**
+     * @brief 当前线程之后缺页分配的内存都优先落在线程正在运行的节点上(MPOL_LOCAL)
+     */
+    static bool SetLocalAlloc();
+
+    /**
+     * @brief 把一段还未访问的内存绑定到当前线程所在的节点上(MPOL_PREFERRED)，
+     *        即使之后由其他节点上的线程首次访问也分配在本节点
+     */
+    static bool BindLocal(void* addr, size_t len);
+};
+
 } // namespace sylar
 
 #endif // __SYLAR_UTIL_H__
@@ -0,0 +1,227 @@
+/**
+  ********************************************************
+  * @file        : watchdog.cc
+  * @author      : zgys
+  * @brief       : 检测长时间占住调度线程的协程
+  * @attention   : None
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#include "watchdog.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+#include <algorithm>
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace sylar {
+
+    static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    // 调度线程多久没有切换协程算作被占住，0为关闭看门狗
+    static ConfigVar<uint32_t>::ptr g_watchdog_threshold_ms =
+            Config::Lookup<uint32_t>("watchdog.threshold_ms", 0, "watchdog stuck threshold in ms, 0 to disable");
+
+    // 报告时是否抓取被占住线程的调用栈，需要向该线程发送SIGURG
+    static ConfigVar<bool>::ptr g_watchdog_backtrace =
+            Config::Lookup<bool>("watchdog.backtrace", true, "watchdog captures backtrace of stuck thread by SIGURG");
+
+    /// 等待被占住线程响应信号的最长时间
+    static const int CAPTURE_WAIT_MS = 50;
+
+    Watchdog::Watchdog() {
+        g_watchdog_threshold_ms->addListener([this](const uint32_t& old_value, const uint32_t& new_value) {
+            if(new_value) {
+                start();
+            }
+        });
+    }
+
+    Watchdog::~Watchdog() {
+        Thread::ptr thread;
+        {
+            MutexType::Lock lock(m_mutex);
+            m_running = false;
+            thread.swap(m_thread);
+        }
+        if(thread) {
+            thread->join();
+        }
+    }
+
+    void Watchdog::add(Scheduler* scheduler) {
+        MutexType::Lock lock(m_mutex);
+        m_schedulers.push_back(scheduler);
+        startNoLock();
+    }
+
+    void Watchdog::del(Scheduler* scheduler) {
+        Thread::ptr thread;
+        {
+            MutexType::Lock lock(m_mutex);
+            auto it = std::find(m_schedulers.begin(), m_schedulers.end(), scheduler);
+            if(it != m_schedulers.end()) {
+                m_schedulers.erase(it);
+            }
+            if(m_schedulers.empty() && m_thread) {
+                m_running = false;
+                thread.swap(m_thread);
+            }
+        }
+        if(thread) {
+            thread->join();
+        }
+    }
+
+    void Watchdog::setCallback(Callback cb) {
+        MutexType::Lock lock(m_mutex);
+        m_callback = std::move(cb);
+    }
+
+    void Watchdog::start() {
+        MutexType::Lock lock(m_mutex);
+        startNoLock();
+    }
+
+    void Watchdog::startNoLock() {
+        if(m_thread || m_schedulers.empty() || !g_watchdog_threshold_ms->getValue()) {
+            return;
+        }
+        if(!m_signalInstalled) {
+            struct sigaction old;
+            if(sigaction(SIGURG, nullptr, &old) == 0
+                    && (old.sa_handler == SIG_DFL || old.sa_handler == SIG_IGN)) {
+                // 先调用一次::backtrace，让它在信号处理函数之外完成libgcc的加载
+                void* frames[1];
+                ::backtrace(frames, 1);
+
+                struct sigaction sa;
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = &Watchdog::OnSignal;
+                sa.sa_flags   = SA_RESTART;
+                sigemptyset(&sa.sa_mask);
+                m_signalInstalled = sigaction(SIGURG, &sa, nullptr) == 0;
+            }
+            if(!m_signalInstalled) {
+                SYLAR_LOG_WARN(g_logger) << "watchdog can not install SIGURG handler, backtrace disabled";
+            }
+        }
+        m_running = true;
+        m_thread.reset(new Thread(std::bind(&Watchdog::run, this), "watchdog"));
+    }
+
+    void Watchdog::run() {
+        while(m_running) {
+            uint64_t threshold = g_watchdog_threshold_ms->getValue();
+            // 检查间隔为阈值的1/4，报告最多比阈值晚这么多
+            uint64_t interval = threshold ? std::max<uint64_t>(threshold / 4, 1) : 100;
+            usleep(interval * 1000);
+            if(!threshold) {
+                continue;
+            }
+
+            bool backtrace = g_watchdog_backtrace->getValue();
+            std::vector<WatchdogEvent> events;
+            Callback cb;
+            {
+                MutexType::Lock lock(m_mutex);
+                backtrace = backtrace && m_signalInstalled;
+                uint64_t now = sylar::GetCurrentMS();
+                for(auto scheduler : m_schedulers) {
+                    check(scheduler, now, threshold, backtrace, events);
+                }
+                cb = m_callback;
+            }
+
+            for(auto& e : events) {
+                ++m_flagged;
+                if(cb) {
+                    cb(e);
+                    continue;
+                }
+                std::stringstream ss;
+                for(auto& i : e.backtrace) {
+                    ss << std::endl << "    " << i;
+                }
+                SYLAR_LOG_WARN(g_logger) << "watchdog: scheduler=" << e.scheduler
+                                         << " thread=" << e.threadId
+                                         << " fiber=" << e.fiberId
+                                         << " stuck " << e.stuckMs << "ms" << ss.str();
+            }
+        }
+    }
+
+    void Watchdog::check(Scheduler* scheduler, uint64_t now_ms, uint64_t threshold_ms, bool backtrace,
+                         std::vector<WatchdogEvent>& events) {
+        std::vector<std::shared_ptr<Scheduler::ThreadCounters> > counters;
+        {
+            Scheduler::MutexType::Lock lock(scheduler->m_mutex);
+            counters = scheduler->m_counters;
+        }
+        for(auto& sp : counters) {
+            Scheduler::ThreadCounters* c = sp.get();
+            uint64_t seq = c->trace.seq.load(std::memory_order_relaxed);
+            if(seq != c->watchSeq || !c->watchSinceMs) {
+                c->watchSeq     = seq;
+                c->watchSinceMs = now_ms;
+                c->flagged      = false;
+                continue;
+            }
+            // 在调度协程中(fiberId为0)或idle中等待IO不算占住，同一次卡住只报告一次
+            uint64_t fiber_id = c->trace.fiberId.load(std::memory_order_relaxed);
+            if(!fiber_id || c->idleSince.load(std::memory_order_relaxed) || c->endUs
+                    || c->flagged || now_ms - c->watchSinceMs < threshold_ms) {
+                continue;
+            }
+            c->flagged = true;
+
+            WatchdogEvent e;
+            e.scheduler = scheduler->getName();
+            e.threadId  = c->threadId;
+            e.fiberId   = fiber_id;
+            e.stuckMs   = now_ms - c->watchSinceMs;
+            if(backtrace) {
+                capture(c, e.backtrace);
+            }
+            events.push_back(std::move(e));
+        }
+    }
+
+    void Watchdog::capture(Scheduler::ThreadCounters* counters, std::vector<std::string>& bt) {
+        counters->frameCount.store(-1, std::memory_order_relaxed);
+        {
+            // 持锁发送，线程退出调度循环前会拿这把锁，保证pthread_t仍然有效
+            Spinlock::Lock lock(counters->signalMutex);
+            if(!counters->alive || pthread_kill(counters->pthread, SIGURG)) {
+                return;
+            }
+        }
+        int n = -1;
+        for(int i = 0; i < CAPTURE_WAIT_MS; ++i) {
+            n = counters->frameCount.load(std::memory_order_acquire);
+            if(n >= 0) {
+                break;
+            }
+            usleep(1000);
+        }
+        // 跳过信号处理函数和信号返回跳板两层
+        if(n > 2) {
+            Backtrace(bt, counters->frames, n, 2);
+        }
+    }
+
+    void Watchdog::OnSignal(int sig) {
+        Scheduler::ThreadCounters* counters = Scheduler::GetThreadCounters();
+        if(!counters) {
+            return;
+        }
+        int saved_errno = errno;
+        int n = ::backtrace(counters->frames, sizeof(counters->frames) / sizeof(counters->frames[0]));
+        counters->frameCount.store(n, std::memory_order_release);
+        errno = saved_errno;
+    }
+}
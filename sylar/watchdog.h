@@ -0,0 +1,110 @@
+/**
+  ********************************************************
+  * @file        : watchdog.h
+  * @author      : zgys
+  * @brief       : 检测长时间占住调度线程的协程
+  * @attention   : 由watchdog.threshold_ms开启，默认关闭；抓取调用栈需要向被占住的线程发送SIGURG
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#ifndef __SYLAR_WATCHDOG_H__
+#define __SYLAR_WATCHDOG_H__
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "mutex.h"
+#include "noncopyable.h"
+#include "scheduler.h"
+#include "singleton.h"
+#include "thread.h"
+
+namespace sylar {
+
+    /**
+     * @brief 一次卡住的报告
+     */
+    struct WatchdogEvent {
+        std::string              scheduler;       // 调度器名称
+        int                      threadId = -1;   // 被占住的调度线程id
+        uint64_t                 fiberId = 0;     // 占住线程的协程id
+        uint64_t                 stuckMs = 0;     // 已经多久没有切换协程
+        std::vector<std::string> backtrace;       // 该线程被发现时的调用栈，没有抓到为空
+    };
+
+    /**
+     * @brief 调度线程看门狗
+     * @details 每个调度线程在Fiber::resume/yield中记录协程切换次数和正在运行的协程，看门狗线程定期检查，
+     *          某个线程的切换次数超过阈值时间没有变化、且正在运行一个任务协程(不在idle中)，就报告一次。
+     *          报告中的调用栈由被占住的线程在SIGURG的处理函数中自己抓取地址，看门狗线程再解析符号。
+     *          调度器在构造时注册，析构时注销
+     */
+    class Watchdog : Noncopyable {
+    public:
+        typedef Mutex MutexType;
+        typedef std::function<void(const WatchdogEvent&)> Callback;
+
+        Watchdog();
+        ~Watchdog();
+
+        /**
+         * @brief 注册调度器，开启时启动看门狗线程
+         */
+        void add(Scheduler* scheduler);
+
+        /**
+         * @brief 注销调度器，返回后看门狗不会再访问它；最后一个调度器注销时停止看门狗线程
+         */
+        void del(Scheduler* scheduler);
+
+        /**
+         * @brief 设置报告的处理函数，在看门狗线程中调用；为空时打印WARN日志
+         */
+        void setCallback(Callback cb);
+
+        /**
+         * @brief 累计报告过的次数
+         */
+        uint64_t getFlagged() const { return m_flagged; }
+
+        /**
+         * @brief 按配置启动看门狗线程，已经在运行或未开启时什么也不做
+         */
+        void start();
+
+    private:
+        void startNoLock();
+        void run();
+
+        /**
+         * @brief 检查一个调度器的全部线程，新发现卡住的线程加入events
+         */
+        void check(Scheduler* scheduler, uint64_t now_ms, uint64_t threshold_ms, bool backtrace,
+                   std::vector<WatchdogEvent>& events);
+
+        /**
+         * @brief 抓取被占住线程的调用栈
+         */
+        void capture(Scheduler::ThreadCounters* counters, std::vector<std::string>& bt);
+
+        /**
+         * @brief SIGURG处理函数，只把当前线程的调用栈地址写进本线程的计数中
+         */
+        static void OnSignal(int sig);
+
+    private:
+        MutexType                m_mutex;
+        std::vector<Scheduler*>  m_schedulers;           // 已注册的调度器
+        Thread::ptr              m_thread;               // 看门狗线程
+        std::atomic<bool>        m_running = {false};    // 看门狗线程是否继续运行
+        bool                     m_signalInstalled = false;  // 是否已经安装了SIGURG处理函数
+        Callback                 m_callback;             // 报告的处理函数
+        std::atomic<uint64_t>    m_flagged = {0};        // 累计报告次数
+    };
+
+    typedef Singleton<Watchdog> WatchdogMgr;
+}
+
+#endif //SYLAR_WATCHDOG_H
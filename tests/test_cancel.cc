@@ -0,0 +1,242 @@
+/**
+  ********************************************************
+  * @file        : test_cancel.cc
+  * @author      : zgys
+  * @brief       : 测试截止时间和取消上下文
+  * @attention   : None
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#include "sylar/sylar.h"
+#include "sylar/cancel.h"
+#include "sylar/fdmanager.h"
+#include "sylar/hook.h"
+#include "sylar/uri.h"
+#include "sylar/http/http_connection.h"
+#include <atomic>
+#include <string>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+/**
+ * @brief 创建一对socket，清掉同号fd可能残留的上下文
+ */
+static void make_pair(int fds[2]) {
+    SYLAR_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    for (int i = 0; i < 2; ++i) {
+        sylar::FdMgr::GetInstance()->del(fds[i]);
+        sylar::FdMgr::GetInstance()->get(fds[i], true);
+    }
+}
+
+static void close_pair(int fds[2]) {
+    for (int i = 0; i < 2; ++i) {
+        close(fds[i]);
+    }
+}
+
+/**
+ * @brief 截止时间覆盖多次调用：sleep用掉一部分预算后，read只等剩下的时间；过期后的调用立即返回
+ */
+void test_deadline() {
+    std::atomic<bool> done = {false};
+    {
+        sylar::IOManager iom(1, false, "cancel_deadline");
+        iom.schedule([&done]{
+            sylar::set_hook_enable(true);
+            int fds[2];
+            make_pair(fds);
+            sylar::CancelContext::Scope scope(sylar::CancelContext::Create(300));
+
+            uint64_t start = sylar::GetCurrentMS();
+            SYLAR_ASSERT(usleep(200 * 1000) == 0);
+            char buf[16];
+            SYLAR_ASSERT(read(fds[0], buf, sizeof(buf)) == -1);
+            SYLAR_ASSERT(errno == ETIMEDOUT);
+            uint64_t used = sylar::GetCurrentMS() - start;
+            SYLAR_LOG_INFO(g_logger) << "deadline read returned after " << used << "ms";
+            SYLAR_ASSERT(used >= 290 && used < 1000);
+
+            // 已经过期，不再挂起
+            start = sylar::GetCurrentMS();
+            SYLAR_ASSERT(write(fds[0], "x", 1) == -1 && errno == ETIMEDOUT);
+            SYLAR_ASSERT(read(fds[0], buf, sizeof(buf)) == -1 && errno == ETIMEDOUT);
+            SYLAR_ASSERT(usleep(100 * 1000) == -1 && errno == ETIMEDOUT);
+            SYLAR_ASSERT(sylar::GetCurrentMS() - start < 50);
+            close_pair(fds);
+            done = true;
+        });
+    }
+    SYLAR_ASSERT(done);
+    SYLAR_LOG_INFO(g_logger) << "cancel deadline ok";
+}
+
+/**
+ * @brief 取消唤醒挂起在read和sleep上的协程，取消可以来自其他协程或调度器外的线程
+ */
+void test_cancel() {
+    std::atomic<int> done = {0};
+    sylar::CancelContext::ptr ctx = sylar::CancelContext::Create();
+    {
+        sylar::IOManager iom(1, false, "cancel_wake");
+        iom.schedule([&done, ctx]{
+            sylar::set_hook_enable(true);
+            int fds[2];
+            make_pair(fds);
+            sylar::CancelContext::Scope scope(ctx);
+            char buf[16];
+            uint64_t start = sylar::GetCurrentMS();
+            SYLAR_ASSERT(read(fds[0], buf, sizeof(buf)) == -1);
+            SYLAR_ASSERT(errno == ECANCELED);
+            SYLAR_ASSERT(sylar::GetCurrentMS() - start < 1000);
+            close_pair(fds);
+            ++done;
+        });
+        iom.schedule([&done, ctx]{
+            sylar::set_hook_enable(true);
+            sylar::CancelContext::Scope scope(sylar::CancelContext::Create(~0ull, ctx));
+            SYLAR_ASSERT(sleep(10) > 0);
+            ++done;
+        });
+        // 不受影响的协程照常完成
+        iom.schedule([&done]{
+            sylar::set_hook_enable(true);
+            SYLAR_ASSERT(usleep(150 * 1000) == 0);
+            ++done;
+        });
+        usleep(100 * 1000);
+        ctx->cancel();
+    }
+    SYLAR_ASSERT(done == 3);
+
+    // 已取消的上下文：新的子上下文直接是取消状态，连接不再发起
+    sylar::CancelContext::ptr child = sylar::CancelContext::Create(1000, ctx);
+    SYLAR_ASSERT(child->getError() == ECANCELED);
+    SYLAR_ASSERT(child->addCallback([](int) {}) == 0);
+    {
+        sylar::IOManager iom(1, false, "cancel_connect");
+        iom.schedule([child]{
+            sylar::set_hook_enable(true);
+            sylar::CancelContext::Scope scope(child);
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family      = AF_INET;
+            addr.sin_port        = htons(1);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            SYLAR_ASSERT(connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1);
+            SYLAR_ASSERT(errno == ECANCELED);
+            close(fd);
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "cancel wake ok";
+}
+
+/**
+ * @brief 取消落在两次等待之间：协程被虚假唤醒后重试又得到EAGAIN，重新注册事件之前上一次等待的取消回调
+ *        已经执行过，这时仍然要被唤醒，不能一直等到有数据
+ */
+void test_between_waits() {
+    static const int ROUNDS = 200;
+    int fds[2];
+    make_pair(fds);
+    {
+        // 虚假唤醒和取消都来自调度器之外的线程，一个调度线程就够了，协程也不会换线程
+        sylar::IOManager iom(1, false, "cancel_race");
+        for (int i = 0; i < ROUNDS; ++i) {
+            sylar::CancelContext::ptr ctx = sylar::CancelContext::Create();
+            std::atomic<bool> waiting = {false};
+            std::atomic<bool> finished = {false};
+            iom.schedule([&fds, &waiting, &finished, ctx]{
+                sylar::set_hook_enable(true);
+                sylar::CancelContext::Scope scope(ctx);
+                char c;
+                waiting = true;
+                SYLAR_ASSERT(read(fds[0], &c, 1) == -1);
+                SYLAR_ASSERT(errno == ECANCELED);
+                finished = true;
+            });
+            while (!waiting) {
+                usleep(100);
+            }
+            // 不停地用cancelEvent制造虚假唤醒，让协程在等待和重试之间来回
+            sylar::Thread waker([&iom, &fds, &finished]{
+                while (!finished) {
+                    iom.cancelEvent(fds[0], sylar::IOManager::READ);
+                }
+            }, "cancel_waker");
+            usleep(i % 10 * 100);
+            ctx->cancel();
+            uint64_t start = sylar::GetCurrentMS();
+            while (!finished) {
+                SYLAR_ASSERT(sylar::GetCurrentMS() - start < 2000);
+                usleep(1000);
+            }
+            waker.join();
+        }
+    }
+    close_pair(fds);
+    SYLAR_LOG_INFO(g_logger) << "cancel between waits ok";
+}
+
+/**
+ * @brief HttpConnection::DoRequest：timeout_ms是整个请求的预算；调用者取消时请求中止
+ */
+void test_http() {
+    // 只监听不应答，连接由内核完成，请求发出后一直等不到响应
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    SYLAR_ASSERT(bind(server, (sockaddr*)&addr, sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    SYLAR_ASSERT(getsockname(server, (sockaddr*)&addr, &len) == 0);
+    SYLAR_ASSERT(listen(server, 16) == 0);
+    std::string url = "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + "/";
+
+    sylar::CancelContext::ptr ctx = sylar::CancelContext::Create();
+    std::atomic<int> done = {0};
+    {
+        sylar::IOManager iom(1, false, "cancel_http");
+        iom.schedule([&done, url]{
+            sylar::set_hook_enable(true);
+            uint64_t start = sylar::GetCurrentMS();
+            auto result = sylar::http::HttpConnection::DoGet(url, 200);
+            uint64_t used = sylar::GetCurrentMS() - start;
+            SYLAR_LOG_INFO(g_logger) << "http timeout " << result->toString() << " used=" << used;
+            SYLAR_ASSERT(result->result == (int)sylar::http::HttpResult::Error::TIMEOUT);
+            SYLAR_ASSERT(used >= 190 && used < 1000);
+            ++done;
+        });
+        iom.schedule([&done, url, ctx]{
+            sylar::set_hook_enable(true);
+            sylar::CancelContext::Scope scope(ctx);
+            uint64_t start = sylar::GetCurrentMS();
+            auto result = sylar::http::HttpConnection::DoGet(url, 10 * 1000);
+            uint64_t used = sylar::GetCurrentMS() - start;
+            SYLAR_LOG_INFO(g_logger) << "http cancel " << result->toString() << " used=" << used;
+            SYLAR_ASSERT(result->result == (int)sylar::http::HttpResult::Error::CANCELLED);
+            SYLAR_ASSERT(used < 1000);
+            ++done;
+        });
+        usleep(100 * 1000);
+        ctx->cancel();
+    }
+    SYLAR_ASSERT(done == 2);
+    close(server);
+    SYLAR_LOG_INFO(g_logger) << "cancel http ok";
+}
+
+int main(int argc, char** argv) {
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::FATAL);
+    test_deadline();
+    test_cancel();
+    test_between_waits();
+    test_http();
+    return 0;
+}
@@ -0,0 +1,321 @@
+/**
+  ********************************************************
+  * @file        : test_channel.cc
+  * @author      : zgys
+  * @brief       : 测试协程通道
+  * @attention   : None
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#include "sylar/sylar.h"
+#include "sylar/channel.h"
+#include <atomic>
+#include <list>
+#include <memory>
+#include <string>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const int THREADS = 4;
+
+/**
+ * @brief 多生产者多消费者，带缓冲和无缓冲两种通道，关闭后消费者退出
+ */
+void test_mpmc(size_t capacity) {
+    static const int PRODUCERS = 4;
+    static const int CONSUMERS = 4;
+    static const int ITEMS = 5000;
+    sylar::Channel<int> chan(capacity);
+    std::atomic<int64_t> sum = {0};
+    std::atomic<int> received = {0};
+    std::atomic<int> producers = {PRODUCERS};
+    {
+        sylar::IOManager iom(THREADS, false, "channel_mpmc");
+        for (int i = 0; i < PRODUCERS; ++i) {
+            iom.schedule([&]{
+                for (int j = 1; j <= ITEMS; ++j) {
+                    SYLAR_ASSERT(chan.send(j));
+                }
+                if (--producers == 0) {
+                    chan.close();
+                }
+            });
+        }
+        for (int i = 0; i < CONSUMERS; ++i) {
+            iom.schedule([&]{
+                int v = 0;
+                while (chan.recv(v)) {
+                    sum += v;
+                    ++received;
+                }
+                SYLAR_ASSERT(chan.isClosed());
+            });
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "channel capacity=" << capacity
+                             << " received=" << received << " sum=" << sum;
+    SYLAR_ASSERT(received == PRODUCERS * ITEMS);
+    SYLAR_ASSERT(sum == (int64_t)PRODUCERS * ITEMS * (ITEMS + 1) / 2);
+}
+
+/**
+ * @brief 只能移动的值经过缓冲区，关闭后剩余的值仍能取出，发送失败
+ */
+void test_move_close() {
+    sylar::Channel<std::unique_ptr<std::string> > chan(4);
+    sylar::IOManager iom(1, false, "channel_close");
+    iom.schedule([&chan]{
+        for (int i = 0; i < 3; ++i) {
+            std::unique_ptr<std::string> p(new std::string(std::to_string(i)));
+            SYLAR_ASSERT(chan.send(std::move(p)));
+        }
+        SYLAR_ASSERT(chan.size() == 3);
+        chan.close();
+        SYLAR_ASSERT(!chan.send(std::unique_ptr<std::string>()));
+        std::unique_ptr<std::string> p;
+        for (int i = 0; i < 3; ++i) {
+            SYLAR_ASSERT(chan.recv(p) && *p == std::to_string(i));
+        }
+        SYLAR_ASSERT(!chan.recv(p));
+    });
+}
+
+/**
+ * @brief 超时：空通道上接收、满通道和无缓冲通道上发送
+ */
+void test_timeout() {
+    sylar::IOManager iom(2, false, "channel_timeout");
+    iom.schedule([]{
+        sylar::Channel<int> buffered(1);
+        sylar::Channel<int> unbuffered;
+        int v = 0;
+        uint64_t begin = sylar::GetCurrentMS();
+        SYLAR_ASSERT(!buffered.recv(v, 50) && !buffered.isClosed());
+        SYLAR_ASSERT(sylar::GetCurrentMS() - begin >= 50);
+        SYLAR_ASSERT(buffered.trySend(v));
+        SYLAR_ASSERT(!buffered.trySend(v));
+        SYLAR_ASSERT(!buffered.send(1, 20));
+        SYLAR_ASSERT(!unbuffered.send(1, 20));
+        SYLAR_ASSERT(!unbuffered.tryRecv(v));
+
+        // 超时返回后发送者的条目已经清掉，后来的接收者不会拿到它
+        sylar::IOManager::GetThis()->schedule([&unbuffered]{
+            SYLAR_ASSERT(unbuffered.send(7));
+        });
+        SYLAR_ASSERT(unbuffered.recv(v, 1000) && v == 7);
+    });
+}
+
+/**
+ * @brief select同时等待接收和发送，超时返回-1
+ */
+void test_select() {
+    static const int ITEMS = 1000;
+    sylar::IOManager iom(THREADS, false, "channel_select");
+    std::shared_ptr<sylar::Channel<int> > a = std::make_shared<sylar::Channel<int> >();
+    std::shared_ptr<sylar::Channel<std::string> > b = std::make_shared<sylar::Channel<std::string> >(2);
+    std::shared_ptr<sylar::Channel<int> > out = std::make_shared<sylar::Channel<int> >();
+    iom.schedule([a]{
+        for (int i = 0; i < ITEMS; ++i) {
+            a->send(i);
+        }
+        a->close();
+    });
+    iom.schedule([b]{
+        for (int i = 0; i < ITEMS; ++i) {
+            b->send(std::to_string(i));
+        }
+        b->close();
+    });
+    iom.schedule([out]{
+        int v = 0;
+        int count = 0;
+        while (out->recv(v)) {
+            ++count;
+        }
+        SYLAR_ASSERT(count == 2 * ITEMS);
+    });
+    iom.schedule([a, b, out]{
+        int from_a = 0;
+        int from_b = 0;
+        bool a_open = true;
+        bool b_open = true;
+        int pending = 0;
+        bool has_pending = false;
+        while (a_open || b_open || has_pending) {
+            int va = 0;
+            std::string vb;
+            int ia = -1, ib = -1, iout = -1;
+            sylar::Select sel;
+            int n = 0;
+            if (a_open && !has_pending) {
+                sel.recv(*a, va);
+                ia = n++;
+            }
+            if (b_open && !has_pending) {
+                sel.recv(*b, vb);
+                ib = n++;
+            }
+            if (has_pending) {
+                sel.send(*out, pending);
+                iout = n++;
+            }
+            int idx = sel.wait(1000);
+            SYLAR_ASSERT(idx >= 0);
+            if (idx == ia) {
+                if (sel.ok(idx)) {
+                    ++from_a;
+                    pending = va;
+                    has_pending = true;
+                } else {
+                    a_open = false;
+                }
+            } else if (idx == ib) {
+                if (sel.ok(idx)) {
+                    SYLAR_ASSERT(vb == std::to_string(from_b));
+                    ++from_b;
+                    pending = from_b;
+                    has_pending = true;
+                } else {
+                    b_open = false;
+                }
+            } else if (idx == iout) {
+                SYLAR_ASSERT(sel.ok(idx));
+                has_pending = false;
+            }
+        }
+        out->close();
+        SYLAR_LOG_INFO(g_logger) << "select from_a=" << from_a << " from_b=" << from_b;
+        SYLAR_ASSERT(from_a == ITEMS && from_b == ITEMS);
+
+        int v = 0;
+        sylar::Channel<int> idle;
+        SYLAR_ASSERT(sylar::Select().recv(idle, v).tryWait() == -1);
+        uint64_t begin = sylar::GetCurrentMS();
+        sylar::Select sel;
+        sel.recv(idle, v).send(idle, v);
+        SYLAR_ASSERT(sel.wait(30) == -1);
+        SYLAR_ASSERT(sylar::GetCurrentMS() - begin >= 30);
+    });
+}
+
+/**
+ * @brief 用std::list加互斥锁实现的通道，作为对比基线
+ * @details 队列满/空时只能让出协程后重试，每个值一次链表节点分配
+ */
+class ListChannel {
+public:
+    explicit ListChannel(size_t capacity)
+        : m_capacity(capacity) {
+    }
+
+    void send(int v) {
+        while (true) {
+            {
+                sylar::Mutex::Lock lock(m_mutex);
+                if (m_list.size() < m_capacity) {
+                    m_list.push_back(v);
+                    return;
+                }
+            }
+            yield();
+        }
+    }
+
+    bool recv(int& v) {
+        while (true) {
+            {
+                sylar::Mutex::Lock lock(m_mutex);
+                if (!m_list.empty()) {
+                    v = m_list.front();
+                    m_list.pop_front();
+                    return true;
+                }
+                if (m_closed) {
+                    return false;
+                }
+            }
+            yield();
+        }
+    }
+
+    void close() {
+        sylar::Mutex::Lock lock(m_mutex);
+        m_closed = true;
+    }
+
+private:
+    static void yield() {
+        sylar::Scheduler::GetThis()->schedule(sylar::Fiber::GetThis());
+        sylar::Fiber::GetThis()->yield();
+    }
+
+private:
+    size_t         m_capacity;
+    bool           m_closed = false;
+    sylar::Mutex   m_mutex;
+    std::list<int> m_list;
+};
+
+/**
+ * @brief 三级流水线，每级一个协程，对比通道和链表队列
+ */
+template<class ChannelType>
+void bench_pipeline(const char* name, size_t capacity) {
+    static const int ITEMS = 200000;
+    ChannelType c1(capacity);
+    ChannelType c2(capacity);
+    int64_t sum = 0;
+    uint64_t begin = sylar::GetCurrentUS();
+    {
+        sylar::IOManager iom(THREADS, false, "bench_channel");
+        iom.schedule([&c1]{
+            for (int i = 0; i < ITEMS; ++i) {
+                c1.send(i);
+            }
+            c1.close();
+        });
+        iom.schedule([&c1, &c2]{
+            int v = 0;
+            while (c1.recv(v)) {
+                c2.send(v * 2);
+            }
+            c2.close();
+        });
+        iom.schedule([&c2, &sum]{
+            int v = 0;
+            while (c2.recv(v)) {
+                sum += v;
+            }
+        });
+    }
+    uint64_t used = sylar::GetCurrentUS() - begin;
+    SYLAR_ASSERT(sum == (int64_t)ITEMS * (ITEMS - 1));
+    SYLAR_LOG_INFO(g_logger) << "pipeline=" << name
+                             << " capacity=" << capacity
+                             << " items=" << ITEMS
+                             << " used=" << used << "us"
+                             << " ns/item=" << used * 1000.0 / ITEMS;
+}
+
+void bench_channel() {
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    bench_pipeline<ListChannel>("list", 128);
+    bench_pipeline<sylar::Channel<int> >("channel", 128);
+    bench_pipeline<sylar::Channel<int> >("channel", 0);
+    SYLAR_LOG_NAME("system")->setLevel(level);
+}
+
+int main(int argc, char** argv) {
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    test_mpmc(16);
+    test_mpmc(0);
+    test_move_close();
+    test_timeout();
+    test_select();
+    SYLAR_LOG_NAME("system")->setLevel(level);
+    bench_channel();
+    return 0;
+}
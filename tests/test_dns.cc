@@ -0,0 +1,419 @@
+/**
+  ********************************************************
+  * @file        : test_dns.cc
+  * @author      : zgys
+  * @brief       : 测试DNS解析器
+  * @attention   : 使用本地的DNS桩服务，不访问外部网络
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#include "sylar/sylar.h"
+#include "sylar/address.h"
+#include "sylar/dns.h"
+#include "sylar/hook.h"
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+/**
+ * @brief 本地的DNS桩服务，UDP和TCP监听同一个端口，按名字返回固定的应答
+ * @details a.test        A 10.0.0.1和10.0.0.2，TTL 60，没有AAAA记录
+ *          slow.test     延迟200毫秒应答A 10.0.0.3
+ *          short.test    A 10.0.0.4，TTL 1
+ *          big.test      UDP应答带TC位，TCP应答A 10.0.0.5
+ *          fail.test     SERVFAIL
+ *          api.svc.test  A 10.0.0.6，用来测试搜索列表
+ *          其他          NXDOMAIN
+ */
+class StubServer {
+public:
+    StubServer() {
+        m_udp = socket(AF_INET, SOCK_DGRAM, 0);
+        m_tcp = socket(AF_INET, SOCK_STREAM, 0);
+        SYLAR_ASSERT(m_udp >= 0 && m_tcp >= 0);
+        int on = 1;
+        setsockopt(m_tcp, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        // 先绑定UDP取得随机端口，TCP绑定同一个端口
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        SYLAR_ASSERT(bind(m_udp, (sockaddr*)&addr, sizeof(addr)) == 0);
+        socklen_t len = sizeof(addr);
+        SYLAR_ASSERT(getsockname(m_udp, (sockaddr*)&addr, &len) == 0);
+        m_port = ntohs(addr.sin_port);
+        SYLAR_ASSERT(bind(m_tcp, (sockaddr*)&addr, sizeof(addr)) == 0);
+        SYLAR_ASSERT(listen(m_tcp, 16) == 0);
+
+        timeval tv = {0, 50 * 1000};
+        setsockopt(m_udp, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(m_tcp, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        m_udpThread.reset(new sylar::Thread(std::bind(&StubServer::serveUdp, this), "dns_stub_udp"));
+        m_tcpThread.reset(new sylar::Thread(std::bind(&StubServer::serveTcp, this), "dns_stub_tcp"));
+    }
+
+    ~StubServer() {
+        m_stop = true;
+        m_udpThread->join();
+        m_tcpThread->join();
+        close(m_udp);
+        close(m_tcp);
+    }
+
+    uint16_t getPort() const { return m_port; }
+
+    /**
+     * @brief 收到的查询数
+     * @param[in] key 名字/类型/传输方式，如a.test/1/udp
+     */
+    int count(const std::string& key) {
+        sylar::Mutex::Lock lock(m_mutex);
+        return m_counts[key];
+    }
+
+private:
+    static void Append16(std::string& out, uint16_t v) {
+        out.push_back((char)(v >> 8));
+        out.push_back((char)(v & 0xff));
+    }
+
+    static void Append32(std::string& out, uint32_t v) {
+        Append16(out, v >> 16);
+        Append16(out, v & 0xffff);
+    }
+
+    /**
+     * @brief 生成应答，answer段中的名字都用指向问题的压缩指针
+     */
+    static std::string Answer(const std::string& request, size_t question_end, int rcode, bool truncated,
+                              const std::vector<std::string>& addrs, uint32_t ttl) {
+        std::string out = request.substr(0, 2);
+        Append16(out, 0x8180 | rcode | (truncated ? 0x0200 : 0));
+        Append16(out, 1);
+        Append16(out, addrs.size());
+        Append16(out, 0);
+        Append16(out, 0);
+        out.append(request, 12, question_end - 12);
+        for (auto& i : addrs) {
+            in_addr a;
+            SYLAR_ASSERT(inet_pton(AF_INET, i.c_str(), &a) == 1);
+            Append16(out, 0xc00c);
+            Append16(out, 1);
+            Append16(out, 1);
+            Append32(out, ttl);
+            Append16(out, 4);
+            out.append((const char*)&a, 4);
+        }
+        return out;
+    }
+
+    std::string handle(const std::string& request, bool tcp) {
+        std::string name;
+        size_t pos = 12;
+        while (pos < request.size() && request[pos]) {
+            if (!name.empty()) {
+                name.push_back('.');
+            }
+            name.append(request, pos + 1, (uint8_t)request[pos]);
+            pos += 1 + (uint8_t)request[pos];
+        }
+        pos += 1;
+        SYLAR_ASSERT(pos + 4 <= request.size());
+        uint16_t qtype = (uint8_t)request[pos] << 8 | (uint8_t)request[pos + 1];
+        size_t question_end = pos + 4;
+        {
+            sylar::Mutex::Lock lock(m_mutex);
+            ++m_counts[name + "/" + std::to_string(qtype) + (tcp ? "/tcp" : "/udp")];
+        }
+
+        std::vector<std::string> addrs;
+        uint32_t ttl = 60;
+        if (name == "fail.test") {
+            return Answer(request, question_end, 2, false, addrs, ttl);
+        }
+        if (name != "a.test" && name != "slow.test" && name != "short.test" && name != "big.test"
+                && name != "api.svc.test") {
+            return Answer(request, question_end, 3, false, addrs, ttl);
+        }
+        if (qtype != 1) {
+            return Answer(request, question_end, 0, false, addrs, ttl);
+        }
+        if (name == "a.test") {
+            addrs = {"10.0.0.1", "10.0.0.2"};
+        } else if (name == "slow.test") {
+            usleep(200 * 1000);
+            addrs = {"10.0.0.3"};
+        } else if (name == "short.test") {
+            addrs = {"10.0.0.4"};
+            ttl = 1;
+        } else if (name == "big.test") {
+            if (!tcp) {
+                return Answer(request, question_end, 0, true, {}, ttl);
+            }
+            addrs = {"10.0.0.5"};
+        } else if (name == "api.svc.test") {
+            addrs = {"10.0.0.6"};
+        }
+        return Answer(request, question_end, 0, false, addrs, ttl);
+    }
+
+    void serveUdp() {
+        while (!m_stop) {
+            char buf[512];
+            sockaddr_in peer;
+            socklen_t len = sizeof(peer);
+            ssize_t rt = recvfrom(m_udp, buf, sizeof(buf), 0, (sockaddr*)&peer, &len);
+            if (rt < 12) {
+                continue;
+            }
+            std::string response = handle(std::string(buf, rt), false);
+            sendto(m_udp, response.data(), response.size(), 0, (sockaddr*)&peer, len);
+        }
+    }
+
+    void serveTcp() {
+        while (!m_stop) {
+            int client = accept(m_tcp, nullptr, nullptr);
+            if (client < 0) {
+                continue;
+            }
+            // accept的hook会为连接创建FdCtx并设为非阻塞，桩服务在普通线程上阻塞读写，要改回阻塞；
+            // 连接还继承了监听socket用来检查退出的短超时
+            fcntl_f(client, F_SETFL, fcntl_f(client, F_GETFL, 0) & ~O_NONBLOCK);
+            timeval tv = {2, 0};
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            uint8_t hdr[2];
+            if (recv(client, hdr, 2, MSG_WAITALL) == 2) {
+                std::string request(hdr[0] << 8 | hdr[1], '\0');
+                if (recv(client, &request[0], request.size(), MSG_WAITALL) == (ssize_t)request.size()) {
+                    std::string response = handle(request, true);
+                    std::string msg;
+                    Append16(msg, response.size());
+                    msg.append(response);
+                    send(client, msg.data(), msg.size(), 0);
+                }
+            }
+            close(client);
+        }
+    }
+
+private:
+    int m_udp;
+    int m_tcp;
+    uint16_t m_port;
+    std::atomic<bool> m_stop = {false};
+    sylar::Mutex m_mutex;
+    std::map<std::string, int> m_counts;
+    sylar::Thread::ptr m_udpThread;
+    sylar::Thread::ptr m_tcpThread;
+};
+
+static std::string g_resolv_conf;
+static std::string g_hosts;
+
+/**
+ * @brief 把解析器指向桩服务和测试用的hosts文件
+ */
+void setup(StubServer& server) {
+    g_resolv_conf = "/tmp/sylar_test_dns_resolv_" + std::to_string(getpid());
+    g_hosts = "/tmp/sylar_test_dns_hosts_" + std::to_string(getpid());
+    std::ofstream(g_resolv_conf) << "# stub\nnameserver 127.0.0.1:" << server.getPort()
+                                 << "\noptions timeout:1 attempts:2\n";
+    std::ofstream(g_hosts) << "10.9.8.7 MyHost.test alias.test # comment\n::1 localhost6.test\n";
+    sylar::Config::Lookup<std::string>("dns.resolv_conf")->setValue(g_resolv_conf);
+    sylar::Config::Lookup<std::string>("dns.hosts")->setValue(g_hosts);
+    SYLAR_ASSERT(sylar::DnsMgr::GetInstance()->getNameServerCount() == 1);
+}
+
+/**
+ * @brief 协程中解析出所有地址并设置端口，再次解析命中缓存；协程外的线程共用同一个缓存
+ */
+void test_basic(StubServer& server) {
+    sylar::DnsResolver* dns = sylar::DnsMgr::GetInstance();
+    uint64_t hits = dns->getCacheHits();
+    {
+        sylar::IOManager iom(1, false, "dns_basic");
+        iom.schedule([]{
+            std::vector<sylar::Address::ptr> addrs;
+            SYLAR_ASSERT(sylar::Address::Lookup(addrs, "a.test:8080"));
+            SYLAR_ASSERT(addrs.size() == 2);
+            SYLAR_ASSERT(addrs[0]->toString() == "10.0.0.1:8080");
+            SYLAR_ASSERT(addrs[1]->toString() == "10.0.0.2:8080");
+
+            // 缓存中的结果不受上一次设置端口的影响
+            addrs.clear();
+            SYLAR_ASSERT(sylar::Address::Lookup(addrs, "A.TEST."));
+            SYLAR_ASSERT(addrs.size() == 2);
+            SYLAR_ASSERT(addrs[0]->toString() == "10.0.0.1:0");
+        });
+    }
+    std::vector<sylar::Address::ptr> addrs;
+    SYLAR_ASSERT(sylar::Address::Lookup(addrs, "a.test:80", AF_UNSPEC));
+    SYLAR_ASSERT(addrs.size() == 2);
+    SYLAR_ASSERT(server.count("a.test/1/udp") == 1);
+    // AF_UNSPEC时还查了一次AAAA，没有记录
+    SYLAR_ASSERT(server.count("a.test/28/udp") == 1);
+    SYLAR_ASSERT(dns->getCacheHits() == hits + 2);
+
+    std::vector<sylar::IPAddress::ptr> ips;
+    SYLAR_ASSERT(dns->resolve("a.test", AF_INET6, ips) == EAI_NONAME);
+    SYLAR_ASSERT(dns->resolve("10.1.2.3", AF_INET, ips) == 0);
+    SYLAR_ASSERT(ips.size() == 1 && ips[0]->toString() == "10.1.2.3:0");
+    SYLAR_LOG_INFO(g_logger) << "dns basic ok queries=" << dns->getQueries();
+}
+
+/**
+ * @brief 多个协程同时解析同一个名字只发出一次查询，等待期间调度线程继续运行其他协程
+ */
+void test_coalesce(StubServer& server) {
+    static const int FIBERS = 20;
+    sylar::DnsResolver* dns = sylar::DnsMgr::GetInstance();
+    uint64_t coalesced = dns->getCoalesced();
+    std::atomic<int> ok = {0};
+    {
+        sylar::IOManager iom(2, false, "dns_coalesce");
+        for (int i = 0; i < FIBERS; ++i) {
+            iom.schedule([&ok]{
+                sylar::IPAddress::ptr addr = sylar::Address::LookupAnyIPAddress("slow.test");
+                if (addr && addr->toString() == "10.0.0.3:0") {
+                    ++ok;
+                }
+            });
+        }
+    }
+    SYLAR_ASSERT(ok == FIBERS);
+    SYLAR_ASSERT(server.count("slow.test/1/udp") == 1);
+    SYLAR_ASSERT(dns->getCoalesced() == coalesced + FIBERS - 1);
+    SYLAR_LOG_INFO(g_logger) << "dns coalesce ok";
+}
+
+/**
+ * @brief TTL过期后重新查询；域名不存在的结果也缓存；SERVFAIL不缓存
+ */
+void test_ttl(StubServer& server) {
+    sylar::DnsResolver* dns = sylar::DnsMgr::GetInstance();
+    std::vector<sylar::IPAddress::ptr> ips;
+    SYLAR_ASSERT(dns->resolve("short.test", AF_INET, ips) == 0);
+    SYLAR_ASSERT(dns->resolve("short.test", AF_INET, ips) == 0);
+    SYLAR_ASSERT(server.count("short.test/1/udp") == 1);
+    usleep(1100 * 1000);
+    SYLAR_ASSERT(dns->resolve("short.test", AF_INET, ips) == 0);
+    SYLAR_ASSERT(server.count("short.test/1/udp") == 2);
+
+    std::vector<sylar::Address::ptr> addrs;
+    SYLAR_ASSERT(!sylar::Address::Lookup(addrs, "none.test:80"));
+    SYLAR_ASSERT(!sylar::Address::Lookup(addrs, "none.test:80"));
+    SYLAR_ASSERT(addrs.empty());
+    SYLAR_ASSERT(server.count("none.test/1/udp") == 1);
+
+    // 每轮尝试都得到SERVFAIL
+    SYLAR_ASSERT(dns->resolve("fail.test", AF_INET, ips) == EAI_AGAIN);
+    SYLAR_ASSERT(server.count("fail.test/1/udp") == 2);
+    SYLAR_ASSERT(dns->resolve("fail.test", AF_INET, ips) == EAI_AGAIN);
+    SYLAR_ASSERT(server.count("fail.test/1/udp") == 4);
+    SYLAR_LOG_INFO(g_logger) << "dns ttl ok";
+}
+
+/**
+ * @brief UDP应答被截断时用TCP重新查询
+ */
+void test_tcp(StubServer& server) {
+    bool ok = false;
+    {
+        sylar::IOManager iom(1, false, "dns_tcp");
+        iom.schedule([&ok]{
+            sylar::IPAddress::ptr addr = sylar::Address::LookupAnyIPAddress("big.test:53");
+            ok = addr && addr->toString() == "10.0.0.5:53";
+        });
+    }
+    SYLAR_ASSERT(ok);
+    SYLAR_ASSERT(server.count("big.test/1/udp") == 1);
+    SYLAR_ASSERT(server.count("big.test/1/tcp") == 1);
+    SYLAR_LOG_INFO(g_logger) << "dns tcp ok";
+}
+
+/**
+ * @brief hosts文件中的名字不查询DNS，名字不区分大小写
+ */
+void test_hosts(StubServer& server) {
+    uint64_t queries = sylar::DnsMgr::GetInstance()->getQueries();
+    std::vector<sylar::Address::ptr> addrs;
+    SYLAR_ASSERT(sylar::Address::Lookup(addrs, "myhost.TEST:1234"));
+    SYLAR_ASSERT(addrs.size() == 1 && addrs[0]->toString() == "10.9.8.7:1234");
+    sylar::Address::ptr addr = sylar::Address::LookupAny("localhost6.test:80", AF_INET6);
+    SYLAR_ASSERT(addr && addr->toString() == "[::1]:80");
+    SYLAR_ASSERT(sylar::DnsMgr::GetInstance()->getQueries() == queries);
+    SYLAR_LOG_INFO(g_logger) << "dns hosts ok";
+}
+
+/**
+ * @brief 搜索列表：点数少于ndots的名字先补全搜索域，否则先查原名；以点结尾的名字不补全；
+ *        补全后仍然不存在的短名字交给getaddrinfo
+ */
+void test_search(StubServer& server) {
+    std::string resolv_conf = g_resolv_conf + "_search";
+    std::ofstream(resolv_conf) << "nameserver 127.0.0.1:" << server.getPort()
+                               << "\ndomain ignored.test\nsearch svc.test. none.test\noptions ndots:2\n";
+    sylar::DnsResolver* dns = sylar::DnsMgr::GetInstance();
+    dns->reload(resolv_conf, g_hosts);
+    SYLAR_ASSERT(dns->getNdots() == 2);
+
+    std::vector<sylar::IPAddress::ptr> ips;
+    SYLAR_ASSERT(dns->resolve("api", AF_INET, ips) == 0);
+    SYLAR_ASSERT(ips.size() == 1 && ips[0]->toString() == "10.0.0.6:0");
+    SYLAR_ASSERT(server.count("api.svc.test/1/udp") == 1);
+    SYLAR_ASSERT(server.count("api/1/udp") == 0);
+    SYLAR_ASSERT(server.count("api.ignored.test/1/udp") == 0);
+
+    // 点数少于ndots，先查补全后的名字，都不存在再查原名
+    ips.clear();
+    SYLAR_ASSERT(dns->resolve("a.test", AF_INET, ips) == 0);
+    SYLAR_ASSERT(ips.size() == 2);
+    SYLAR_ASSERT(server.count("a.test.svc.test/1/udp") == 1);
+    SYLAR_ASSERT(server.count("a.test.none.test/1/udp") == 1);
+
+    // 点数达到ndots，原名查到就不再补全
+    ips.clear();
+    SYLAR_ASSERT(dns->resolve("api.svc.test", AF_INET, ips) == 0);
+    SYLAR_ASSERT(server.count("api.svc.test.svc.test/1/udp") == 0);
+    SYLAR_ASSERT(dns->resolve("api.", AF_INET, ips) == EAI_NONAME);
+    SYLAR_ASSERT(server.count("api/1/udp") == 1);
+
+    // 测试用的hosts文件中没有localhost，短名字回退到getaddrinfo
+    std::vector<sylar::Address::ptr> addrs;
+    SYLAR_ASSERT(sylar::Address::Lookup(addrs, "localhost:80", AF_INET));
+    SYLAR_ASSERT(server.count("localhost.svc.test/1/udp") == 1);
+    SYLAR_ASSERT(!sylar::Address::Lookup(addrs, "none.none.test:80", AF_INET));
+
+    dns->reload(g_resolv_conf, g_hosts);
+    unlink(resolv_conf.c_str());
+    SYLAR_LOG_INFO(g_logger) << "dns search ok";
+}
+
+int main(int argc, char** argv) {
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    {
+        StubServer server;
+        setup(server);
+        test_basic(server);
+        test_coalesce(server);
+        test_ttl(server);
+        test_tcp(server);
+        test_hosts(server);
+        test_search(server);
+    }
+    unlink(g_resolv_conf.c_str());
+    unlink(g_hosts.c_str());
+    return 0;
+}
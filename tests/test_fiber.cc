@@ -9,8 +9,16 @@
   */
 
 #include "sylar/sylar.h"
+#include "sylar/hook.h"
+#include "sylar/fdmanager.h"
 #include <string>
 #include <vector>
+#include <atomic>
+#include <iostream>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
@@ -66,6 +74,388 @@ void test_fiber() {
     SYLAR_LOG_INFO(g_logger) << "test_fiber end";
 }
 
+void empty_fiber() {
+}
+
+/**
+ * @brief 对比malloc和pool两种栈分配器下协程创建/销毁的吞吐
+ */
+void bench_fiber_create() {
+    static const int N = 100000;
+    sylar::Fiber::GetThis();
+
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    auto allocator = sylar::Config::Lookup<std::string>("fiber.stack_allocator");
+    const char* names[] = {"malloc", "pool"};
+    for (auto name : names) {
+        allocator->setValue(name);
+        uint64_t begin = sylar::GetCurrentUS();
+        for (int i = 0; i < N; ++i) {
+            sylar::Fiber::ptr fiber(new sylar::Fiber(&empty_fiber, 0, false));
+            fiber->resume();
+        }
+        uint64_t used = sylar::GetCurrentUS() - begin;
+        SYLAR_LOG_INFO(g_logger) << "stack_allocator=" << name
+                                 << " fibers=" << N
+                                 << " used=" << used << "us"
+                                 << " fibers/sec=" << (uint64_t)(N * 1000000.0 / (used ? used : 1));
+    }
+    allocator->setValue("malloc");
+    SYLAR_LOG_NAME("system")->setLevel(level);
+}
+
+static bool s_pingpong_stop = false;
+
+void pingpong_fiber() {
+    while (!s_pingpong_stop) {
+        sylar::Fiber::GetThis()->yield();
+    }
+}
+
+/**
+ * @brief 协程与主协程之间来回切换，对比ucontext和汇编两种上下文切换方式每次切换的耗时
+ */
+void bench_fiber_switch() {
+    static const int N = 1000000;
+    sylar::Fiber::GetThis();
+
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    auto context = sylar::Config::Lookup<std::string>("fiber.context");
+    std::vector<std::string> names = {"ucontext"};
+    if (sylar::Fiber::HasAsmContext()) {
+        names.push_back("asm");
+    }
+    for (auto& name : names) {
+        context->setValue(name);
+        s_pingpong_stop = false;
+        sylar::Fiber::ptr fiber(new sylar::Fiber(&pingpong_fiber, 0, false));
+
+        uint64_t begin = sylar::GetCurrentUS();
+        for (int i = 0; i < N; ++i) {
+            fiber->resume();
+        }
+        uint64_t used = sylar::GetCurrentUS() - begin;
+
+        s_pingpong_stop = true;
+        fiber->resume();
+        // 每次resume包含切入和切出两次切换
+        SYLAR_LOG_INFO(g_logger) << "context=" << name
+                                 << " switches=" << 2 * N
+                                 << " used=" << used << "us"
+                                 << " ns/switch=" << used * 1000.0 / (2 * N);
+    }
+    context->setValue("ucontext");
+    SYLAR_LOG_NAME("system")->setLevel(level);
+}
+
+/**
+ * @brief 请求上下文，统计存活的实例数以检查协程局部变量是否都被销毁
+ */
+struct RequestCtx {
+    static std::atomic<int> s_live;
+    int id;
+
+    RequestCtx(int v = -1) : id(v) { ++s_live; }
+    RequestCtx(const RequestCtx& o) : id(o.id) { ++s_live; }
+    ~RequestCtx() { --s_live; }
+};
+
+std::atomic<int> RequestCtx::s_live = {0};
+
+static sylar::FiberLocal<RequestCtx> s_request_ctx;
+static sylar::FiberLocal<int> s_request_hops;
+
+/**
+ * @brief 协程局部变量跟随协程跨线程迁移，协程结束时销毁，复用的协程看不到上一个任务的值
+ */
+void test_fiber_local() {
+    static const int TASKS = 1000;
+    static const int HOPS  = 5;
+
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+
+    // 单独的协程：结束时销毁，reset之后是空的
+    {
+        sylar::Fiber::GetThis();
+        sylar::Fiber::ptr fiber(new sylar::Fiber([]{
+            SYLAR_ASSERT(!s_request_ctx.get());
+            s_request_ctx.set(RequestCtx(1));
+            sylar::Fiber::GetThis()->yield();
+            SYLAR_ASSERT(s_request_ctx->id == 1);
+        }, 0, false));
+        fiber->resume();
+        SYLAR_ASSERT(RequestCtx::s_live == 1);
+        // 协程外访问的是线程主协程的那份
+        SYLAR_ASSERT(!s_request_ctx.get());
+        fiber->resume();
+        SYLAR_ASSERT(fiber->getState() == sylar::Fiber::TERM);
+        SYLAR_ASSERT(RequestCtx::s_live == 0);
+        fiber->reset([]{ SYLAR_ASSERT(!s_request_ctx.get()); });
+        fiber->resume();
+    }
+
+    std::atomic<int> done = {0};
+    std::atomic<int> migrated = {0};
+    {
+        sylar::IOManager iom(2, false, "fiber_local");
+        for (int i = 0; i < TASKS; ++i) {
+            iom.schedule([i, &done, &migrated]{
+                // 调度器复用执行回调的协程，上一个任务的值必须已经销毁
+                SYLAR_ASSERT(!s_request_ctx.get());
+                SYLAR_ASSERT(!s_request_hops.get());
+                s_request_ctx.set(RequestCtx(i));
+                int thread = sylar::GetThreadId();
+                for (int h = 0; h < HOPS; ++h) {
+                    sylar::Scheduler::GetThis()->schedule(sylar::Fiber::GetThis());
+                    sylar::Fiber::GetThis()->yield();
+                    SYLAR_ASSERT(s_request_ctx->id == i);
+                    ++*s_request_hops;
+                    if (sylar::GetThreadId() != thread) {
+                        thread = sylar::GetThreadId();
+                        ++migrated;
+                    }
+                }
+                SYLAR_ASSERT(*s_request_hops == HOPS);
+                ++done;
+            });
+        }
+        while (done < TASKS) {
+            usleep(1000);
+        }
+    }
+    SYLAR_ASSERT(RequestCtx::s_live == 0);
+    SYLAR_LOG_NAME("system")->setLevel(level);
+    SYLAR_LOG_INFO(g_logger) << "fiber_local tasks=" << TASKS << " migrated=" << migrated;
+}
+
+/**
+ * @brief 递归到depth层后反复让出，每层栈上都有一块按id和层数填充的数据，返回时检查是否被别的协程踩坏
+ */
+static int shared_stack_deep(int id, int depth, int hops) {
+    volatile char buf[256];
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+        buf[i] = (char)(id * 31 + depth * 7 + i);
+    }
+    int sum = 0;
+    if (depth > 0) {
+        sum = shared_stack_deep(id, depth - 1, hops);
+    } else {
+        for (int h = 0; h < hops; ++h) {
+            sylar::Scheduler::GetThis()->schedule(sylar::Fiber::GetThis());
+            sylar::Fiber::GetThis()->yield();
+        }
+    }
+    for (size_t i = 0; i < sizeof(buf); ++i) {
+        SYLAR_ASSERT(buf[i] == (char)(id * 31 + depth * 7 + i));
+    }
+    return sum + 1;
+}
+
+/**
+ * @brief 共享栈模式：栈内容在协程间换入换出后保持不变，协程始终回到绑定的线程；
+ *        通道收发和parallel_for在共享栈协程之间正常工作
+ */
+void test_shared_stack() {
+    static const int TASKS = 200;
+    static const int HOPS  = 20;
+    static const int MSGS  = 1000;
+
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    if (!sylar::Fiber::HasSharedStack()) {
+        SYLAR_LOG_NAME("system")->setLevel(level);
+        return;
+    }
+    auto shared = sylar::Config::Lookup<bool>("fiber.shared_stack");
+    auto count = sylar::Config::Lookup<uint32_t>("fiber.shared_stack_count");
+    auto context = sylar::Config::Lookup<std::string>("fiber.context");
+    shared->setValue(true);
+    count->setValue(2);
+    std::vector<std::string> names = {"ucontext"};
+    if (sylar::Fiber::HasAsmContext()) {
+        names.push_back("asm");
+    }
+    for (auto& name : names) {
+        context->setValue(name);
+        std::atomic<int> done = {0};
+        {
+            sylar::IOManager iom(2, false, "shared_stack");
+            for (int i = 0; i < TASKS; ++i) {
+                iom.schedule([i, &done]{
+                    SYLAR_ASSERT(sylar::Fiber::GetThis()->isSharedStack());
+                    int thread = sylar::GetThreadId();
+                    SYLAR_ASSERT(sylar::Fiber::GetThis()->getBoundThread() == thread);
+                    // 不同协程用到的栈深度不同，保存区大小各不相同
+                    SYLAR_ASSERT(shared_stack_deep(i, i % 8, HOPS) == i % 8 + 1);
+                    SYLAR_ASSERT(sylar::GetThreadId() == thread);
+                    ++done;
+                });
+            }
+
+            // 无缓冲通道，值在两个共享栈协程之间直接交接
+            std::shared_ptr<sylar::Channel<std::string> > chan(new sylar::Channel<std::string>());
+            iom.schedule([chan, &done]{
+                for (int i = 0; i < MSGS; ++i) {
+                    std::string msg = "msg-" + std::to_string(i);
+                    SYLAR_ASSERT(chan->send(msg));
+                }
+                chan->close();
+                ++done;
+            });
+            iom.schedule([chan, &done]{
+                std::string msg;
+                int n = 0;
+                while (chan->recv(msg)) {
+                    SYLAR_ASSERT(msg == "msg-" + std::to_string(n));
+                    ++n;
+                }
+                SYLAR_ASSERT(n == MSGS);
+                ++done;
+            });
+
+            iom.schedule([&done]{
+                std::vector<std::function<int()> > fns;
+                for (int i = 0; i < 16; ++i) {
+                    fns.push_back([i]{ return shared_stack_deep(i, 2, 3) * i; });
+                }
+                std::vector<int> results = sylar::when_all(fns);
+                for (int i = 0; i < 16; ++i) {
+                    SYLAR_ASSERT(results[i] == 3 * i);
+                }
+                ++done;
+            });
+            while (done < TASKS + 3) {
+                usleep(1000);
+            }
+        }
+    }
+    context->setValue("ucontext");
+    count->setValue(4);
+    shared->setValue(false);
+    SYLAR_LOG_NAME("system")->setLevel(level);
+    SYLAR_LOG_INFO(g_logger) << "shared_stack tasks=" << TASKS << " ok";
+}
+
+/**
+ * @brief 当前进程的常驻内存
+ */
+static uint64_t resident_bytes() {
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (!fp) {
+        return 0;
+    }
+    unsigned long size = 0, resident = 0;
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fp);
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief 在一种栈模式下测量：每个空闲连接一个协程挂起在read上时每个连接的常驻内存，以及协程切换的耗时
+ */
+static void bench_stack_mode(bool shared_stack) {
+    static const int CONNS  = 4000;
+    static const int FIBERS = 64;
+    static const int ROUNDS = 5000;
+
+    sylar::Config::Lookup<bool>("fiber.shared_stack")->setValue(shared_stack);
+    sylar::IOManager iom(1, false, "bench_stack");
+
+    std::vector<int> fds(2 * CONNS, -1);
+    for (int i = 0; i < CONNS; ++i) {
+        SYLAR_ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[2 * i]) == 0);
+        // socketpair不经过hook，登记之后读端的read才会挂起协程而不是阻塞线程
+        sylar::FdMgr::GetInstance()->del(fds[2 * i]);
+        sylar::FdMgr::GetInstance()->get(fds[2 * i], true);
+    }
+    std::atomic<int> parked = {0};
+    std::atomic<int> done = {0};
+    // 先让调度线程跑起来，基线里包含线程栈、共享栈等固定开销
+    iom.schedule([&done]{ ++done; });
+    while (done < 1) {
+        usleep(1000);
+    }
+    usleep(50 * 1000);
+    uint64_t base = resident_bytes();
+    for (int i = 0; i < CONNS; ++i) {
+        int fd = fds[2 * i];
+        iom.schedule([fd, &parked, &done]{
+            sylar::set_hook_enable(true);
+            char c;
+            ++parked;
+            SYLAR_ASSERT(read(fd, &c, 1) == 1);
+            ++done;
+        });
+    }
+    while (parked < CONNS) {
+        usleep(1000);
+    }
+    usleep(100 * 1000);
+    uint64_t idle = resident_bytes();
+    for (int i = 0; i < CONNS; ++i) {
+        SYLAR_ASSERT(write(fds[2 * i + 1], "x", 1) == 1);
+    }
+    while (done < CONNS + 1) {
+        usleep(1000);
+    }
+
+    // 协程数多于共享栈个数，共享栈模式下几乎每次切入都要换出上一个协程的栈再拷回自己的
+    std::atomic<int> finished = {0};
+    uint64_t begin = sylar::GetCurrentUS();
+    for (int i = 0; i < FIBERS; ++i) {
+        iom.schedule([&finished]{
+            for (int r = 0; r < ROUNDS; ++r) {
+                sylar::Scheduler::GetThis()->schedule(sylar::Fiber::GetThis());
+                sylar::Fiber::GetThis()->yield();
+            }
+            ++finished;
+        });
+    }
+    while (finished < FIBERS) {
+        usleep(1000);
+    }
+    uint64_t used = sylar::GetCurrentUS() - begin;
+
+    for (auto fd : fds) {
+        sylar::FdMgr::GetInstance()->del(fd);
+        close(fd);
+    }
+    SYLAR_LOG_INFO(g_logger) << "stack=" << (shared_stack ? "shared" : "private")
+                             << " idle_conns=" << CONNS
+                             << " rss_per_conn=" << (idle > base ? (idle - base) / CONNS : 0) << "B"
+                             << " fibers=" << FIBERS
+                             << " ns/resume=" << used * 1000.0 / ((uint64_t)FIBERS * ROUNDS);
+}
+
+/**
+ * @brief 对比独立栈和共享栈两种模式下每个空闲连接的常驻内存和切换耗时
+ * @details 每种模式在单独的子进程中运行，前一种模式释放后留在分配器里的内存不影响后一种的测量
+ */
+void bench_shared_stack() {
+    if (!sylar::Fiber::HasSharedStack()) {
+        return;
+    }
+    for (int i = 0; i < 2; ++i) {
+        std::cout.flush();
+        pid_t pid = fork();
+        SYLAR_ASSERT(pid >= 0);
+        if (pid == 0) {
+            SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+            bench_stack_mode(i == 1);
+            std::cout.flush();
+            _exit(0);
+        }
+        int status = 0;
+        SYLAR_ASSERT(waitpid(pid, &status, 0) == pid);
+        SYLAR_ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+}
+
 int main(int argc, char *argv[]) {
     SYLAR_LOG_INFO(g_logger) << "main begin";
 
@@ -79,6 +469,18 @@ int main(int argc, char *argv[]) {
         i->join();
     }
 
+    sylar::Thread::ptr bench(new sylar::Thread(&bench_fiber_create, "bench_fiber"));
+    bench->join();
+
+    bench.reset(new sylar::Thread(&bench_fiber_switch, "bench_switch"));
+    bench->join();
+
+    test_fiber_local();
+
+    test_shared_stack();
+
+    bench_shared_stack();
+
     SYLAR_LOG_INFO(g_logger) << "main end";
     return 0;
 }
@@ -0,0 +1,423 @@
+/**
+  ********************************************************
+  * @file        : test_fiber_sync.cc
+  * @author      : zgys
+  * @brief       : 测试协程同步原语
+  * @attention   : None
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#include "sylar/sylar.h"
+#include "sylar/fiber_sync.h"
+#include "sylar/parallel.h"
+#include <atomic>
+#include <deque>
+#include <stdexcept>
+#include <string>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const int THREADS = 4;
+
+/**
+ * @brief 把当前协程重新加入调度后让出，模拟临界区里的IO等待
+ */
+static void yield_to_scheduler() {
+    sylar::Scheduler::GetThis()->schedule(sylar::Fiber::GetThis());
+    sylar::Fiber::GetThis()->yield();
+}
+
+/**
+ * @brief 持有锁期间让出协程，其他线程上等锁的协程只挂起自己，计数不会丢
+ */
+void test_mutex() {
+    static const int FIBERS = 64;
+    static const int LOOPS = 1000;
+    sylar::FiberMutex mutex;
+    int count = 0;
+    {
+        sylar::IOManager iom(THREADS, false, "fiber_mutex");
+        for (int i = 0; i < FIBERS; ++i) {
+            iom.schedule([&mutex, &count]{
+                for (int j = 0; j < LOOPS; ++j) {
+                    sylar::FiberMutex::Lock lock(mutex);
+                    int v = count;
+                    if (j % 100 == 0) {
+                        yield_to_scheduler();
+                    }
+                    count = v + 1;
+                }
+            });
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "fiber mutex count=" << count;
+    SYLAR_ASSERT(count == FIBERS * LOOPS);
+}
+
+/**
+ * @brief 写者在两次写之间让出，读者不能看到写了一半的状态
+ */
+void test_rwmutex() {
+    static const int READERS = 32;
+    static const int WRITERS = 4;
+    static const int LOOPS = 500;
+    sylar::FiberRWMutex mutex;
+    int a = 0;
+    int b = 0;
+    std::atomic<int> reads = {0};
+    {
+        sylar::IOManager iom(THREADS, false, "fiber_rwmutex");
+        for (int i = 0; i < WRITERS; ++i) {
+            iom.schedule([&]{
+                for (int j = 0; j < LOOPS; ++j) {
+                    sylar::FiberRWMutex::WriteLock lock(mutex);
+                    ++a;
+                    yield_to_scheduler();
+                    ++b;
+                }
+            });
+        }
+        for (int i = 0; i < READERS; ++i) {
+            iom.schedule([&]{
+                for (int j = 0; j < LOOPS; ++j) {
+                    sylar::FiberRWMutex::ReadLock lock(mutex);
+                    SYLAR_ASSERT(a == b);
+                    if (j % 50 == 0) {
+                        yield_to_scheduler();
+                    }
+                    ++reads;
+                }
+            });
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "fiber rwmutex a=" << a << " reads=" << reads;
+    SYLAR_ASSERT(a == WRITERS * LOOPS && b == a);
+    SYLAR_ASSERT(reads == READERS * LOOPS);
+}
+
+/**
+ * @brief 有界队列上的多生产者多消费者
+ */
+void test_condition() {
+    static const int PRODUCERS = 4;
+    static const int CONSUMERS = 4;
+    static const int ITEMS = 2000;
+    static const size_t CAPACITY = 8;
+    sylar::FiberMutex mutex;
+    sylar::FiberCondition not_full;
+    sylar::FiberCondition not_empty;
+    std::deque<int> queue;
+    int64_t sum = 0;
+    int consumed = 0;
+    {
+        sylar::IOManager iom(THREADS, false, "fiber_cond");
+        for (int i = 0; i < PRODUCERS; ++i) {
+            iom.schedule([&]{
+                for (int j = 1; j <= ITEMS; ++j) {
+                    sylar::FiberMutex::Lock lock(mutex);
+                    while (queue.size() >= CAPACITY) {
+                        not_full.wait(mutex);
+                    }
+                    queue.push_back(j);
+                    not_empty.notifyOne();
+                }
+            });
+        }
+        for (int i = 0; i < CONSUMERS; ++i) {
+            iom.schedule([&]{
+                while (true) {
+                    sylar::FiberMutex::Lock lock(mutex);
+                    while (queue.empty() && consumed < PRODUCERS * ITEMS) {
+                        not_empty.wait(mutex);
+                    }
+                    if (consumed == PRODUCERS * ITEMS) {
+                        // 唤醒其他还在等待的消费者退出
+                        not_empty.notifyAll();
+                        break;
+                    }
+                    sum += queue.front();
+                    queue.pop_front();
+                    ++consumed;
+                    not_full.notifyOne();
+                }
+            });
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "fiber condition consumed=" << consumed << " sum=" << sum;
+    SYLAR_ASSERT(sum == (int64_t)PRODUCERS * ITEMS * (ITEMS + 1) / 2);
+}
+
+/**
+ * @brief 信号量限制同时进入的协程数
+ */
+void test_semaphore() {
+    static const int FIBERS = 64;
+    static const uint32_t LIMIT = 3;
+    sylar::FiberSemaphore sem(LIMIT);
+    std::atomic<uint32_t> active = {0};
+    std::atomic<uint32_t> peak = {0};
+    {
+        sylar::IOManager iom(THREADS, false, "fiber_sem");
+        for (int i = 0; i < FIBERS; ++i) {
+            iom.schedule([&]{
+                for (int j = 0; j < 10; ++j) {
+                    sem.wait();
+                    uint32_t now = ++active;
+                    uint32_t old = peak;
+                    while (now > old && !peak.compare_exchange_weak(old, now));
+                    yield_to_scheduler();
+                    --active;
+                    sem.notify();
+                }
+            });
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "fiber semaphore peak=" << peak << " count=" << sem.getCount();
+    SYLAR_ASSERT(peak <= LIMIT);
+    SYLAR_ASSERT(sem.getCount() == LIMIT);
+}
+
+/**
+ * @brief 父协程等一批会让出的子协程全部done后才继续；批量schedule要把每个元素都投递出去
+ */
+void test_wait_group() {
+    static const int PARENTS = 8;
+    static const int CHILDREN = 32;
+    std::atomic<int> finished = {0};
+    {
+        sylar::IOManager iom(THREADS, false, "wait_group");
+        for (int i = 0; i < PARENTS; ++i) {
+            iom.schedule([&finished]{
+                sylar::WaitGroup wg;
+                std::atomic<int> count = {0};
+                std::vector<std::function<void()> > children;
+                for (int j = 0; j < CHILDREN; ++j) {
+                    wg.add();
+                    children.push_back([&wg, &count]{
+                        yield_to_scheduler();
+                        ++count;
+                        wg.done();
+                    });
+                }
+                sylar::Scheduler::GetThis()->schedule(children.begin(), children.end());
+                wg.wait();
+                SYLAR_ASSERT(count == CHILDREN);
+                SYLAR_ASSERT(wg.getCount() == 0);
+                // 计数为0时直接返回
+                wg.wait();
+                ++finished;
+            });
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "wait group finished=" << finished;
+    SYLAR_ASSERT(finished == PARENTS);
+}
+
+/**
+ * @brief parallel_for覆盖每个下标恰好一次，when_all按顺序返回结果(包括bool结果)，子协程的异常在父协程中抛出
+ */
+void test_parallel() {
+    bool done = false;
+    {
+        sylar::IOManager iom(THREADS, false, "parallel");
+        iom.schedule([&done]{
+            static const size_t N = 1000;
+            std::vector<int> hits(N, 0);
+            sylar::parallel_for(0, N, [&hits](size_t i){
+                if (i % 64 == 0) {
+                    yield_to_scheduler();
+                }
+                ++hits[i];
+            }, 16);
+            for (size_t i = 0; i < N; ++i) {
+                SYLAR_ASSERT(hits[i] == 1);
+            }
+
+            std::vector<std::function<std::string()> > fns;
+            for (int i = 0; i < 10; ++i) {
+                fns.push_back([i]{
+                    yield_to_scheduler();
+                    return std::to_string(i);
+                });
+            }
+            auto results = sylar::when_all(fns);
+            SYLAR_ASSERT(results.size() == fns.size());
+            for (size_t i = 0; i < results.size(); ++i) {
+                SYLAR_ASSERT(results[i] == std::to_string(i));
+            }
+
+            // bool结果：std::vector<bool>按位存放，多个线程上的子协程同时写回不能丢失结果
+            static const int BOOLS = 512;
+            for (int round = 0; round < 20; ++round) {
+                std::vector<std::function<bool()> > preds;
+                for (int i = 0; i < BOOLS; ++i) {
+                    preds.push_back([i, round]{
+                        if (i % 7 == round % 7) {
+                            yield_to_scheduler();
+                        }
+                        return (i + round) % 3 != 0;
+                    });
+                }
+                std::vector<bool> flags = sylar::when_all(preds);
+                SYLAR_ASSERT(flags.size() == (size_t)BOOLS);
+                for (int i = 0; i < BOOLS; ++i) {
+                    SYLAR_ASSERT(flags[i] == ((i + round) % 3 != 0));
+                }
+            }
+
+            std::atomic<int> ran = {0};
+            std::vector<std::function<void()> > throwers;
+            for (int i = 0; i < 8; ++i) {
+                throwers.push_back([i, &ran]{
+                    yield_to_scheduler();
+                    ++ran;
+                    if (i >= 3) {
+                        throw std::runtime_error("child " + std::to_string(i));
+                    }
+                });
+            }
+            std::string what;
+            try {
+                sylar::when_all(throwers);
+            } catch (std::exception& e) {
+                what = e.what();
+            }
+            // 抛出前已经等所有子协程结束，按顺序抛出第一个异常
+            SYLAR_ASSERT(ran == 8);
+            SYLAR_ASSERT(what == "child 3");
+            done = true;
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << "parallel done=" << done;
+    SYLAR_ASSERT(done);
+}
+
+/**
+ * @brief 多个协程争抢同一把锁做自增，对比协程锁和pthread锁
+ */
+template<class MutexType>
+uint64_t bench_lock(const char* name) {
+    static const int FIBERS = 64;
+    static const int LOOPS = 20000;
+    MutexType mutex;
+    int64_t count = 0;
+    uint64_t begin = sylar::GetCurrentUS();
+    {
+        sylar::IOManager iom(THREADS, false, "bench_lock");
+        for (int i = 0; i < FIBERS; ++i) {
+            iom.schedule([&mutex, &count]{
+                for (int j = 0; j < LOOPS; ++j) {
+                    typename MutexType::Lock lock(mutex);
+                    ++count;
+                }
+            });
+        }
+    }
+    uint64_t used = sylar::GetCurrentUS() - begin;
+    SYLAR_ASSERT(count == (int64_t)FIBERS * LOOPS);
+    SYLAR_LOG_INFO(g_logger) << "lock=" << name
+                             << " threads=" << THREADS
+                             << " fibers=" << FIBERS
+                             << " ops=" << count
+                             << " used=" << used << "us"
+                             << " ns/op=" << used * 1000.0 / count;
+    return used;
+}
+
+/**
+ * @brief 九成读一成写，对比协程读写锁和pthread读写锁
+ */
+template<class RWMutexType>
+uint64_t bench_rwlock(const char* name) {
+    static const int FIBERS = 64;
+    static const int LOOPS = 20000;
+    RWMutexType mutex;
+    int64_t value = 0;
+    std::atomic<int64_t> reads = {0};
+    uint64_t begin = sylar::GetCurrentUS();
+    {
+        sylar::IOManager iom(THREADS, false, "bench_rwlock");
+        for (int i = 0; i < FIBERS; ++i) {
+            iom.schedule([&mutex, &value, &reads]{
+                int64_t local = 0;
+                for (int j = 0; j < LOOPS; ++j) {
+                    if (j % 10 == 0) {
+                        typename RWMutexType::WriteLock lock(mutex);
+                        ++value;
+                    } else {
+                        typename RWMutexType::ReadLock lock(mutex);
+                        local += value;
+                    }
+                }
+                reads += local;
+            });
+        }
+    }
+    uint64_t used = sylar::GetCurrentUS() - begin;
+    SYLAR_LOG_INFO(g_logger) << "rwlock=" << name
+                             << " threads=" << THREADS
+                             << " fibers=" << FIBERS
+                             << " ops=" << (int64_t)FIBERS * LOOPS
+                             << " used=" << used << "us"
+                             << " ns/op=" << used * 1000.0 / ((int64_t)FIBERS * LOOPS);
+    return used;
+}
+
+/**
+ * @brief 两个协程通过一对信号量来回传递，对比协程信号量和pthread信号量
+ * @details pthread信号量等待时阻塞整个线程，线程上排队的其他协程都跟着停住
+ */
+template<class SemaphoreType>
+uint64_t bench_semaphore(const char* name) {
+    static const int ROUNDS = 50000;
+    SemaphoreType ping;
+    SemaphoreType pong;
+    uint64_t begin = sylar::GetCurrentUS();
+    {
+        sylar::IOManager iom(THREADS, false, "bench_sem");
+        iom.schedule([&ping, &pong]{
+            for (int i = 0; i < ROUNDS; ++i) {
+                ping.notify();
+                pong.wait();
+            }
+        });
+        iom.schedule([&ping, &pong]{
+            for (int i = 0; i < ROUNDS; ++i) {
+                ping.wait();
+                pong.notify();
+            }
+        });
+    }
+    uint64_t used = sylar::GetCurrentUS() - begin;
+    SYLAR_LOG_INFO(g_logger) << "semaphore=" << name
+                             << " rounds=" << ROUNDS
+                             << " used=" << used << "us"
+                             << " ns/round=" << used * 1000.0 / ROUNDS;
+    return used;
+}
+
+void bench_fiber_sync() {
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    bench_lock<sylar::Mutex>("pthread");
+    bench_lock<sylar::FiberMutex>("fiber");
+    bench_rwlock<sylar::RWMutex>("pthread");
+    bench_rwlock<sylar::FiberRWMutex>("fiber");
+    bench_semaphore<sylar::Semaphore>("pthread");
+    bench_semaphore<sylar::FiberSemaphore>("fiber");
+    SYLAR_LOG_NAME("system")->setLevel(level);
+}
+
+int main(int argc, char** argv) {
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    test_mutex();
+    test_rwmutex();
+    test_condition();
+    test_semaphore();
+    test_wait_group();
+    test_parallel();
+    SYLAR_LOG_NAME("system")->setLevel(level);
+    bench_fiber_sync();
+    return 0;
+}
@@ -15,11 +15,16 @@
  *          当服务器关闭连接时客户端也退出
  */
 #include "sylar/sylar.h"
+#include "sylar/fdmanager.h"
+#include "sylar/hook.h"
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <atomic>
+#include <algorithm>
+#include <vector>
 
 sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
@@ -100,11 +105,441 @@ void test_iomanager() {
     iom.schedule(test_io);
 }
 
+static std::atomic<int> s_rounds_done = {0};
+static std::atomic<int> s_migrations = {0};
+
+/**
+ * @brief 在fd[0]上等待读事件多轮，检查每次事件触发后协程是否回到注册事件的线程
+ */
+void reactor_reader(int fd, int rounds) {
+    for (int i = 0; i < rounds; ++i) {
+        int tid = sylar::GetThreadId();
+        sylar::IOManager::GetThis()->addEvent(fd, sylar::IOManager::READ);
+        sylar::Fiber::GetThis()->yield();
+        if (sylar::GetThreadId() != tid) {
+            ++s_migrations;
+        }
+        char buf[16];
+        while (read(fd, buf, sizeof(buf)) > 0);
+        ++s_rounds_done;
+    }
+    close(fd);
+}
+
+/**
+ * @brief 每线程epoll模式：多个线程各自等待自己注册的fd，由其他线程写对端唤醒
+ */
+void test_reactor_per_thread() {
+    static const int PAIRS = 16;
+    static const int ROUNDS = 200;
+    auto per_thread = sylar::Config::Lookup<bool>("iomanager.reactor_per_thread");
+    per_thread->setValue(true);
+    {
+        sylar::IOManager iom(4, false, "reactor");
+        SYLAR_ASSERT(iom.isReactorPerThread());
+        std::vector<int> writers;
+        for (int i = 0; i < PAIRS; ++i) {
+            int fds[2];
+            int rt = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+            SYLAR_ASSERT(!rt);
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
+            writers.push_back(fds[1]);
+            int fd = fds[0];
+            iom.schedule([fd]{ reactor_reader(fd, ROUNDS); });
+        }
+        // 非调度线程写对端，通过eventfd唤醒目标线程
+        for (int r = 0; r < ROUNDS; ++r) {
+            while (s_rounds_done < r * PAIRS) {
+                usleep(100);
+            }
+            for (int fd : writers) {
+                int rt = write(fd, "x", 1);
+                SYLAR_ASSERT(rt == 1);
+            }
+        }
+        while (s_rounds_done < ROUNDS * PAIRS) {
+            usleep(100);
+        }
+        for (int fd : writers) {
+            close(fd);
+        }
+    }
+    per_thread->setValue(false);
+    SYLAR_LOG_INFO(g_logger) << "reactor_per_thread rounds=" << s_rounds_done
+                             << " migrations=" << s_migrations;
+    SYLAR_ASSERT(s_migrations == 0);
+}
+
+/**
+ * @brief 每线程epoll模式：指定线程的任务投递时，目标线程刚执行完上一个任务、正在进入idle，
+ *        任务不能等到epoll_wait超时才执行
+ */
+void test_reactor_pinned_latency() {
+    static const int ROUNDS = 500;
+    auto per_thread = sylar::Config::Lookup<bool>("iomanager.reactor_per_thread");
+    per_thread->setValue(true);
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    uint64_t max_us = 0;
+    {
+        sylar::IOManager iom(2, false, "reactor_pinned");
+        std::atomic<int> target = {-1};
+        iom.schedule([&target]{ target = sylar::GetThreadId(); });
+        while (target == -1) {
+            usleep(100);
+        }
+        std::atomic<int> done = {0};
+        for (int i = 0; i < ROUNDS; ++i) {
+            // 上一个任务一结束就投递，正好落在目标线程从调度循环进入idle的过程中
+            uint64_t begin = sylar::GetCurrentUS();
+            iom.schedule([&done]{ ++done; }, target);
+            while (done <= i) {
+                SYLAR_ASSERT(sylar::GetCurrentUS() - begin < 1000 * 1000);
+            }
+            max_us = std::max(max_us, sylar::GetCurrentUS() - begin);
+        }
+    }
+    per_thread->setValue(false);
+    SYLAR_LOG_NAME("system")->setLevel(level);
+    SYLAR_LOG_INFO(g_logger) << "reactor pinned rounds=" << ROUNDS << " max_latency=" << max_us << "us";
+}
+
+/**
+ * @brief 非调度线程突发地投递大量小任务，统计实际写eventfd的次数和被合并掉的次数
+ */
+void bench_tickle() {
+    static const int N = 100000;
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    std::atomic<int> done = {0};
+    uint64_t used = 0;
+    uint64_t sent = 0;
+    uint64_t suppressed = 0;
+    {
+        sylar::IOManager iom(4, false, "tickle");
+        uint64_t begin = sylar::GetCurrentUS();
+        for (int i = 0; i < N; ++i) {
+            iom.schedule([&done]{ ++done; });
+            if (i % 1000 == 999) {
+                usleep(100);
+            }
+        }
+        while (done < N) {
+            usleep(100);
+        }
+        used = sylar::GetCurrentUS() - begin;
+        sent = iom.getTicklesSent();
+        suppressed = iom.getTicklesSuppressed();
+    }
+    SYLAR_LOG_NAME("system")->setLevel(level);
+    SYLAR_LOG_INFO(g_logger) << "tasks=" << N << " used=" << used << "us"
+                             << " tickles_sent=" << sent
+                             << " tickles_suppressed=" << suppressed;
+}
+
+/**
+ * @brief socketpair上两个协程通过hook的read/write来回传一个字节，对比每次注销重注册和持久注册两种模式
+ */
+void test_persistent_events(bool persistent) {
+    static const int ROUNDS = 20000;
+    auto persistent_events = sylar::Config::Lookup<bool>("iomanager.persistent_events");
+    persistent_events->setValue(persistent);
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    uint64_t used = 0;
+    std::atomic<int> done = {0};
+    {
+        sylar::IOManager iom(1, false, "persistent");
+        SYLAR_ASSERT(iom.isPersistentEvents() == persistent);
+        int fds[2];
+        int rt = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        SYLAR_ASSERT(!rt);
+        int a = fds[0];
+        int b = fds[1];
+        uint64_t begin = sylar::GetCurrentUS();
+        iom.schedule([a, &done]{
+            sylar::set_hook_enable(true);
+            sylar::FdMgr::GetInstance()->get(a, true);
+            char c = 0;
+            for (int i = 0; i < ROUNDS; ++i) {
+                SYLAR_ASSERT(write(a, &c, 1) == 1);
+                SYLAR_ASSERT(read(a, &c, 1) == 1);
+                SYLAR_ASSERT(c == (char)(i + 1));
+            }
+            close(a);
+            ++done;
+        });
+        iom.schedule([b, &done]{
+            sylar::set_hook_enable(true);
+            sylar::FdMgr::GetInstance()->get(b, true);
+            char c = 0;
+            for (int i = 0; i < ROUNDS; ++i) {
+                SYLAR_ASSERT(read(b, &c, 1) == 1);
+                ++c;
+                SYLAR_ASSERT(write(b, &c, 1) == 1);
+            }
+            close(b);
+            ++done;
+        });
+        while (done < 2) {
+            usleep(100);
+        }
+        used = sylar::GetCurrentUS() - begin;
+    }
+    persistent_events->setValue(false);
+    SYLAR_LOG_NAME("system")->setLevel(level);
+    SYLAR_LOG_INFO(g_logger) << "persistent_events=" << persistent
+                             << " rounds=" << ROUNDS
+                             << " used=" << used << "us"
+                             << " us/round=" << (double)used / ROUNDS;
+}
+
+/**
+ * @brief 大量fd同时就绪时一轮epoll_wait唤醒很多协程，对比逐个schedule和批量投递
+ * @details 每个fd上一个协程用hook的read等待；同一线程上的写协程每轮给所有fd各写1字节后让出，
+ *          下一次epoll_wait就一次返回全部fd，等全部读到后再写下一轮。
+ *          每线程epoll模式下唤醒的协程指定了线程，逐个schedule时每个都要加一次调度器的锁
+ */
+void bench_batch_schedule(bool batch, bool reactor) {
+    static const int FDS    = 128;
+    static const int ROUNDS = 2000;
+    auto batch_schedule = sylar::Config::Lookup<bool>("iomanager.batch_schedule");
+    batch_schedule->setValue(batch);
+    auto reactor_per_thread = sylar::Config::Lookup<bool>("iomanager.reactor_per_thread");
+    reactor_per_thread->setValue(reactor);
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    std::atomic<int> reads = {0};
+    std::atomic<bool> done = {false};
+    sylar::FiberSemaphore round_done(0);
+    uint64_t used = 0;
+    sylar::SchedulerStats stats;
+    {
+        sylar::IOManager iom(1, false, "batch");
+        SYLAR_ASSERT(iom.isBatchSchedule() == batch);
+        std::vector<int> writers;
+        for (int i = 0; i < FDS; ++i) {
+            int fds[2];
+            SYLAR_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+            writers.push_back(fds[1]);
+            int fd = fds[0];
+            // 前面的测试在未hook的线程里关闭过fd，清掉可能残留的上下文
+            sylar::FdMgr::GetInstance()->del(fd);
+            iom.schedule([fd, &reads, &round_done]{
+                sylar::set_hook_enable(true);
+                sylar::FdMgr::GetInstance()->get(fd, true);
+                char c;
+                for (int r = 0; r < ROUNDS; ++r) {
+                    SYLAR_ASSERT(read(fd, &c, 1) == 1);
+                    // 本轮最后一个读到的唤醒写协程
+                    if (++reads % FDS == 0) {
+                        round_done.notify();
+                    }
+                }
+                close(fd);
+            });
+        }
+        uint64_t begin = sylar::GetCurrentUS();
+        iom.schedule([&writers, &round_done, &done]{
+            for (int r = 0; r < ROUNDS; ++r) {
+                for (int fd : writers) {
+                    SYLAR_ASSERT(write(fd, "x", 1) == 1);
+                }
+                round_done.wait();
+            }
+            done = true;
+        });
+        while (!done) {
+            usleep(1000);
+        }
+        used = sylar::GetCurrentUS() - begin;
+        stats = iom.getStats();
+        for (int fd : writers) {
+            close(fd);
+        }
+    }
+    batch_schedule->setValue(true);
+    reactor_per_thread->setValue(false);
+    SYLAR_LOG_NAME("system")->setLevel(level);
+    SYLAR_LOG_INFO(g_logger) << "batch_schedule=" << batch
+                             << " reactor_per_thread=" << reactor
+                             << " wakeups=" << FDS * ROUNDS
+                             << " used=" << used << "us"
+                             << " ns/wakeup=" << used * 1000.0 / (FDS * ROUNDS)
+                             << " events_per_wait=" << stats.eventsPerWait()
+                             << " tickles=" << stats.ticklesSent;
+}
+
+/**
+ * @brief 跑一批任务、定时器和IO事件后采集运行统计，检查各项计数与实际发生的一致
+ */
+void test_stats() {
+    static const int TASKS  = 10000;
+    static const int TIMERS = 20;
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    std::atomic<int> done = {0};
+    {
+        sylar::IOManager iom(2, false, "stats");
+        for (int i = 0; i < TASKS; ++i) {
+            iom.schedule([&done]{ ++done; });
+        }
+        for (int i = 0; i < TIMERS; ++i) {
+            iom.addTimer(1 + i % 5, [&done]{ ++done; });
+        }
+        int fds[2];
+        SYLAR_ASSERT(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        iom.schedule([&iom, &done, fds]{
+            iom.addEvent(fds[0], sylar::IOManager::READ, [&done, fds]{
+                char c;
+                SYLAR_ASSERT(read(fds[0], &c, 1) == 1);
+                ++done;
+            });
+            SYLAR_ASSERT(write(fds[1], "x", 1) == 1);
+        });
+        while (done < TASKS + TIMERS + 1) {
+            usleep(1000);
+        }
+        // 让调度线程回到idle，空闲时间可见
+        usleep(10000);
+
+        sylar::SchedulerStats stats = iom.getStats();
+        SYLAR_LOG_INFO(g_logger) << stats.toString();
+        SYLAR_ASSERT(stats.name == "stats");
+        SYLAR_ASSERT(stats.threads == 2);
+        SYLAR_ASSERT(stats.perThread.size() == 2);
+        SYLAR_ASSERT(stats.queueDepth == 0);
+        // 任务、定时器回调、IO事件回调、投递addEvent的任务
+        SYLAR_ASSERT(stats.tasks >= (uint64_t)(TASKS + TIMERS + 2));
+        SYLAR_ASSERT(stats.switches >= stats.tasks);
+        SYLAR_ASSERT(stats.timerExpired == (uint64_t)TIMERS);
+        SYLAR_ASSERT(stats.epollWaits > 0 && stats.epollEvents > 0);
+        SYLAR_ASSERT(stats.idleUs > 0 && stats.busyUs > 0);
+        SYLAR_ASSERT(stats.pendingEvents == 0);
+        uint64_t tasks = 0;
+        for (auto& t : stats.perThread) {
+            tasks += t.tasks;
+        }
+        SYLAR_ASSERT(tasks == stats.tasks);
+        close(fds[0]);
+        close(fds[1]);
+    }
+    SYLAR_LOG_NAME("system")->setLevel(level);
+}
+
+/**
+ * @brief 轻负载下单个请求的往返延迟，对比idle忙轮询开关
+ * @details 客户端线程发1字节，等服务端协程回写后歇一会再发下一个。两次请求之间服务端线程无事可做，
+ *          关闭忙轮询时每个请求都要把它从epoll_wait中唤醒；开启后请求落在自旋窗口内直接被轮询到
+ */
+void bench_busy_poll(uint32_t busy_poll_us) {
+    static const int ROUNDS = 5000;
+    static const int THINK_US = 20;
+    auto busy_poll = sylar::Config::Lookup<uint32_t>("iomanager.busy_poll_us");
+    busy_poll->setValue(busy_poll_us);
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    std::vector<uint64_t> rtts;
+    rtts.reserve(ROUNDS);
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    {
+        sylar::IOManager iom(1, false, "busy_poll");
+        int fds[2];
+        int rt = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        SYLAR_ASSERT(!rt);
+        int server = fds[0];
+        int client = fds[1];
+        iom.schedule([server]{
+            sylar::set_hook_enable(true);
+            sylar::FdMgr::GetInstance()->get(server, true);
+            char c = 0;
+            while (read(server, &c, 1) == 1) {
+                SYLAR_ASSERT(write(server, &c, 1) == 1);
+            }
+            close(server);
+        });
+        char c = 0;
+        for (int i = 0; i < ROUNDS; ++i) {
+            usleep(THINK_US);
+            uint64_t begin = sylar::GetCurrentUS();
+            SYLAR_ASSERT(write(client, &c, 1) == 1);
+            SYLAR_ASSERT(read(client, &c, 1) == 1);
+            rtts.push_back(sylar::GetCurrentUS() - begin);
+        }
+        close(client);
+        hits = iom.getBusyPollHits();
+        misses = iom.getBusyPollMisses();
+    }
+    busy_poll->setValue(0);
+    SYLAR_LOG_NAME("system")->setLevel(level);
+    std::sort(rtts.begin(), rtts.end());
+    SYLAR_LOG_INFO(g_logger) << "busy_poll_us=" << busy_poll_us
+                             << " rounds=" << ROUNDS
+                             << " p50=" << rtts[ROUNDS / 2] << "us"
+                             << " p99=" << rtts[ROUNDS * 99 / 100] << "us"
+                             << " max=" << rtts.back() << "us"
+                             << " poll_hits=" << hits
+                             << " poll_misses=" << misses;
+}
+
+/**
+ * @brief 高位fd上的事件：fd所在的块此前从未分配过，addEvent时才发布新块，已有的上下文地址保持不变
+ */
+void test_fd_table() {
+    sylar::IOManager iom(2, false, "fd_table");
+    int fds[2];
+    int rt = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    SYLAR_ASSERT(!rt);
+    int high = dup2(fds[0], 3000);
+    SYLAR_ASSERT(high == 3000);
+    fcntl(high, F_SETFL, O_NONBLOCK);
+
+    sylar::FdCtx::ptr low_ctx = sylar::FdMgr::GetInstance()->get(fds[1], true);
+    sylar::FdCtx::ptr high_ctx = sylar::FdMgr::GetInstance()->get(high, true);
+    SYLAR_ASSERT(low_ctx && high_ctx);
+    SYLAR_ASSERT(sylar::FdMgr::GetInstance()->get(fds[1]) == low_ctx);
+
+    std::atomic<bool> fired = {false};
+    iom.schedule([high, &fired]{
+        sylar::IOManager::GetThis()->addEvent(high, sylar::IOManager::READ);
+        sylar::Fiber::GetThis()->yield();
+        fired = true;
+    });
+    usleep(10 * 1000);
+    SYLAR_ASSERT(write(fds[1], "x", 1) == 1);
+    while (!fired) {
+        usleep(100);
+    }
+    SYLAR_ASSERT(!iom.cancelAll(high));
+
+    sylar::FdMgr::GetInstance()->del(high);
+    sylar::FdMgr::GetInstance()->del(fds[1]);
+    SYLAR_ASSERT(!sylar::FdMgr::GetInstance()->get(high));
+    close(high);
+    close(fds[0]);
+    close(fds[1]);
+    SYLAR_LOG_INFO(g_logger) << "fd_table ok";
+}
+
 int main(int argc, char *argv[]) {
 //    sylar::EnvMgr::GetInstance()->init(argc, argv);
 //    sylar::Config::LoadFromConfDir(sylar::EnvMgr::GetInstance()->getConfigPath());
 
     test_iomanager();
+    test_reactor_per_thread();
+    test_reactor_pinned_latency();
+    bench_tickle();
+    test_persistent_events(false);
+    test_persistent_events(true);
+    test_fd_table();
+    test_stats();
+    for (int reactor = 0; reactor < 2; ++reactor) {
+        bench_batch_schedule(false, reactor);
+        bench_batch_schedule(true, reactor);
+    }
+    bench_busy_poll(0);
+    bench_busy_poll(200);
 
     return 0;
 }
@@ -0,0 +1,222 @@
+/**
+  ********************************************************
+  * @file        : test_offload.cc
+  * @author      : zgys
+  * @brief       : 测试阻塞调用的卸载线程池
+  * @attention   : None
+  * @date        : 26-10-16
+  ********************************************************
+  */
+#include "sylar/sylar.h"
+#include "sylar/address.h"
+#include "sylar/fdmanager.h"
+#include "sylar/hook.h"
+#include "sylar/offload.h"
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+/**
+ * @brief 阻塞调用卸载后调度线程继续运行其他协程；结果、异常都回到调用者协程，调用者留在原来的调度器上
+ */
+void test_run() {
+    sylar::OffloadPool pool(2, "test_offload");
+    // 不在调度器的协程中，直接在当前线程执行
+    int tid = sylar::GetThreadId();
+    SYLAR_ASSERT(pool.call([tid]{ return sylar::GetThreadId() == tid; }));
+    SYLAR_ASSERT(pool.getCompleted() == 0);
+
+    std::atomic<int> ticks = {0};
+    std::atomic<int> ticks_during = {-1};
+    std::atomic<bool> done = {false};
+    {
+        sylar::IOManager iom(1, false, "offload_run");
+        iom.schedule([&]{
+            sylar::set_hook_enable(true);
+            while (!done) {
+                usleep(5 * 1000);
+                ++ticks;
+            }
+        });
+        iom.schedule([&]{
+            sylar::Scheduler* sc = sylar::Scheduler::GetThis();
+            int before = ticks;
+            // 原始的usleep会阻塞线程，卸载之后唯一的调度线程还能继续跑计时的协程
+            int worker = pool.call([]{
+                usleep_f(200 * 1000);
+                return sylar::GetThreadId();
+            });
+            ticks_during = ticks - before;
+            SYLAR_ASSERT(worker != sylar::GetThreadId());
+            SYLAR_ASSERT(sylar::Scheduler::GetThis() == sc);
+
+            bool caught = false;
+            try {
+                pool.run([]{ throw std::runtime_error("offload error"); });
+            } catch (std::runtime_error& e) {
+                caught = std::string(e.what()) == "offload error";
+            }
+            SYLAR_ASSERT(caught);
+            done = true;
+        });
+    }
+    SYLAR_ASSERT(pool.getCompleted() == 2);
+    SYLAR_ASSERT(pool.getPending() == 0);
+    SYLAR_LOG_INFO(g_logger) << "offload run ticks_during_blocking_call=" << ticks_during;
+    SYLAR_ASSERT(ticks_during > 10);
+}
+
+/**
+ * @brief hook开启时普通文件的读写、pread/pwrite和fsync经过卸载线程池，结果与直接调用相同
+ */
+void test_file_io(bool shared_stack) {
+    static const int FIBERS = 16;
+    sylar::Config::Lookup<bool>("fiber.shared_stack")->setValue(shared_stack);
+    // 只有一个共享栈，卸载期间固定住的栈迫使其他协程使用新映射的栈
+    sylar::Config::Lookup<uint32_t>("fiber.shared_stack_count")->setValue(1);
+
+    uint64_t completed = sylar::OffloadMgr::GetInstance()->getCompleted();
+    std::atomic<int> done = {0};
+    {
+        sylar::IOManager iom(2, false, "offload_file");
+        for (int i = 0; i < FIBERS; ++i) {
+            iom.schedule([i, &done]{
+                sylar::set_hook_enable(true);
+                std::string path = "/tmp/sylar_test_offload_" + std::to_string(getpid())
+                                   + "_" + std::to_string(i);
+                int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+                SYLAR_ASSERT(fd >= 0);
+                // 清掉同号fd可能残留的socket上下文
+                sylar::FdMgr::GetInstance()->del(fd);
+                // 缓冲区在协程栈上，池中的线程直接读写它
+                char data[4096];
+                memset(data, 'a' + i, sizeof(data));
+                SYLAR_ASSERT(write(fd, data, sizeof(data)) == (ssize_t)sizeof(data));
+                sylar::set_hook_enable(true);
+                SYLAR_ASSERT(pwrite(fd, "xyz", 3, 100) == 3);
+                sylar::set_hook_enable(true);
+                SYLAR_ASSERT(fsync(fd) == 0);
+                sylar::set_hook_enable(true);
+
+                char buf[4096];
+                memset(buf, 0, sizeof(buf));
+                SYLAR_ASSERT(pread(fd, buf, sizeof(buf), 0) == (ssize_t)sizeof(buf));
+                sylar::set_hook_enable(true);
+                SYLAR_ASSERT(memcmp(buf, data, 100) == 0);
+                SYLAR_ASSERT(memcmp(buf + 100, "xyz", 3) == 0);
+                SYLAR_ASSERT(memcmp(buf + 103, data + 103, sizeof(buf) - 103) == 0);
+
+                SYLAR_ASSERT(lseek(fd, 0, SEEK_SET) == 0);
+                SYLAR_ASSERT(read(fd, buf, 10) == 10);
+                sylar::set_hook_enable(true);
+                SYLAR_ASSERT(memcmp(buf, data, 10) == 0);
+
+                // errno和原函数一致；协程可能已换了线程，挂起前不要访问errno，编译器会复用它的线程局部地址
+                SYLAR_ASSERT(pread(fd, buf, sizeof(buf), -1) == -1);
+                SYLAR_ASSERT(errno == EINVAL);
+                sylar::set_hook_enable(true);
+                close(fd);
+                unlink(path.c_str());
+                ++done;
+            });
+        }
+        while (done < FIBERS) {
+            usleep(1000);
+        }
+    }
+    uint64_t used = sylar::OffloadMgr::GetInstance()->getCompleted() - completed;
+    sylar::Config::Lookup<uint32_t>("fiber.shared_stack_count")->setValue(4);
+    sylar::Config::Lookup<bool>("fiber.shared_stack")->setValue(false);
+    SYLAR_LOG_INFO(g_logger) << "offload file_io shared_stack=" << shared_stack << " offloaded=" << used;
+    // 每个协程6次卸载：write、pwrite、fsync、pread、read、出错的pread
+    SYLAR_ASSERT(used == (uint64_t)FIBERS * 6);
+}
+
+/**
+ * @brief fclose不经过hook的close，读过的普通文件的FdCtx留了下来；同号fd被管道复用后，
+ *        管道上的读写不能交给卸载线程池，过期的FdCtx被删掉，管道也不会登记FdCtx
+ */
+void test_stale_fd() {
+    bool done = false;
+    {
+        sylar::IOManager iom(1, false, "offload_stale");
+        iom.schedule([&done]{
+            sylar::set_hook_enable(true);
+            std::string path = "/tmp/sylar_test_offload_stale_" + std::to_string(getpid());
+            FILE* fp = fopen(path.c_str(), "w+");
+            SYLAR_ASSERT(fp);
+            int fd = fileno(fp);
+            sylar::FdMgr::GetInstance()->del(fd);
+            SYLAR_ASSERT(write(fd, "abc", 3) == 3);
+            sylar::FdCtx::ptr ctx = sylar::FdMgr::GetInstance()->get(fd);
+            SYLAR_ASSERT(ctx && ctx->isRegular());
+            ctx.reset();
+            fclose(fp);
+            unlink(path.c_str());
+
+            int fds[2];
+            SYLAR_ASSERT(pipe(fds) == 0);
+            SYLAR_ASSERT(fds[0] == fd);
+            SYLAR_ASSERT(sylar::FdMgr::GetInstance()->get(fd));
+            sylar::Thread writer([&fds]{
+                usleep(50 * 1000);
+                SYLAR_ASSERT(::write(fds[1], "xy", 2) == 2);
+            }, "stale_writer");
+            uint64_t completed = sylar::OffloadMgr::GetInstance()->getCompleted();
+            char buf[4];
+            SYLAR_ASSERT(read(fds[0], buf, sizeof(buf)) == 2);
+            SYLAR_ASSERT(memcmp(buf, "xy", 2) == 0);
+            writer.join();
+            // 卸载线程只做了一次核对，读在调用者线程上直接执行，过期的FdCtx已经删掉
+            SYLAR_ASSERT(sylar::OffloadMgr::GetInstance()->getCompleted() == completed + 1);
+            SYLAR_ASSERT(!sylar::FdMgr::GetInstance()->get(fd));
+            // 之后管道上的读写不再卸载，也不创建FdCtx
+            SYLAR_ASSERT(write(fds[1], "z", 1) == 1);
+            SYLAR_ASSERT(read(fds[0], buf, sizeof(buf)) == 1);
+            SYLAR_ASSERT(sylar::OffloadMgr::GetInstance()->getCompleted() == completed + 1);
+            SYLAR_ASSERT(!sylar::FdMgr::GetInstance()->get(fds[0]));
+            SYLAR_ASSERT(!sylar::FdMgr::GetInstance()->get(fds[1]));
+            close(fds[0]);
+            close(fds[1]);
+            done = true;
+        });
+    }
+    SYLAR_ASSERT(done);
+    SYLAR_LOG_INFO(g_logger) << "offload stale fd ok";
+}
+
+/**
+ * @brief 服务名不是数字时Address::Lookup在调度器的协程中经过卸载线程池用getaddrinfo解析
+ */
+void test_lookup() {
+    uint64_t completed = sylar::OffloadMgr::GetInstance()->getCompleted();
+    bool ok = false;
+    {
+        sylar::IOManager iom(1, false, "offload_lookup");
+        iom.schedule([&ok]{
+            std::vector<sylar::Address::ptr> addrs;
+            ok = sylar::Address::Lookup(addrs, "localhost:http");
+        });
+    }
+    SYLAR_ASSERT(ok);
+    SYLAR_ASSERT(sylar::OffloadMgr::GetInstance()->getCompleted() == completed + 1);
+    SYLAR_LOG_INFO(g_logger) << "offload lookup ok";
+}
+
+int main(int argc, char** argv) {
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    test_run();
+    test_file_io(false);
+    if (sylar::Fiber::HasSharedStack()) {
+        test_file_io(true);
+    }
+    test_stale_fd();
+    test_lookup();
+    return 0;
+}
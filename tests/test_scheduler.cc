@@ -8,9 +8,34 @@
   ********************************************************
   */
 #include "sylar/sylar.h"
+#include "sylar/hook.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <new>
+#include <vector>
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
+/// 全局operator new计数，用来统计调度一个任务分配了几次内存
+static std::atomic<uint64_t> s_allocs{0};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t size) {
+    ++s_allocs;
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+#pragma GCC diagnostic pop
+
 /**
  * @brief 演示协程主动yield情况下应该如何操作
  */
@@ -73,6 +98,292 @@ void test_fiber4() {
     SYLAR_LOG_INFO(g_logger) << "test_fiber4 end";
 }
 
+static std::atomic<uint64_t> s_bench_done{0};
+
+void bench_child() {
+    ++s_bench_done;
+}
+
+// 根任务在调度线程内继续派生子任务，工作窃取模式下子任务进入本线程队列，由空闲线程窃取
+void bench_root(int children) {
+    for (int i = 0; i < children; ++i) {
+        sylar::Scheduler::GetThis()->schedule(&bench_child);
+    }
+}
+
+/**
+ * @brief 对比全局任务队列与工作窃取两种模式在不同线程数下的调度吞吐(tasks/sec)
+ */
+void bench_scheduler() {
+    static const int ROOTS    = 64;
+    static const int CHILDREN = 512;
+
+    // 调度器在debug级别下每次tickle都会打日志，压测时关掉
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    auto work_stealing = sylar::Config::Lookup<bool>("scheduler.work_stealing");
+
+    for (size_t threads = 1; threads <= 64; threads *= 2) {
+        for (int stealing = 0; stealing < 2; ++stealing) {
+            work_stealing->setValue(stealing);
+            s_bench_done = 0;
+
+            uint64_t begin = sylar::GetCurrentUS();
+            sylar::Scheduler sc(threads, false, "bench");
+            sc.start();
+            for (int i = 0; i < ROOTS; ++i) {
+                sc.schedule(std::bind(&bench_root, CHILDREN));
+            }
+            sc.stop();
+            uint64_t used = sylar::GetCurrentUS() - begin;
+
+            uint64_t tasks = s_bench_done + ROOTS;
+            SYLAR_LOG_INFO(g_logger) << (stealing ? "work_stealing" : "global_list  ")
+                                     << " threads=" << threads
+                                     << " tasks=" << tasks
+                                     << " used=" << used << "us"
+                                     << " tasks/sec=" << (uint64_t)(tasks * 1000000.0 / (used ? used : 1));
+        }
+    }
+    work_stealing->setValue(false);
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::DEBUG);
+}
+
+/**
+ * @brief 统计每调度一个任务的内存分配次数
+ * @details 任务分批投递，每批不超过注入队列容量，保证不走溢出链表；
+ *          捕获shared_ptr的lambda整个链路都在Task的内联存储里移动，应当不分配内存；
+ *          调用者自己先包成std::function的对照组只有std::function本身的一次分配
+ */
+void bench_schedule_alloc() {
+    static const int ROUNDS = 200;
+    static const int BATCH  = 256;
+
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    std::shared_ptr<std::atomic<int> > done = std::make_shared<std::atomic<int> >(0);
+    std::shared_ptr<std::atomic<int64_t> > sum = std::make_shared<std::atomic<int64_t> >(0);
+    {
+        sylar::IOManager iom(2, false, "bench_alloc");
+        auto wait_done = [&done](int n) {
+            while (*done < n) {
+                usleep(100);
+            }
+        };
+        // 预热：每个调度线程创建好执行回调的协程
+        for (int i = 0; i < BATCH; ++i) {
+            iom.schedule([done]{ ++*done; });
+        }
+        wait_done(BATCH);
+
+        for (int use_function = 0; use_function < 2; ++use_function) {
+            *done = 0;
+            uint64_t allocs = s_allocs;
+            uint64_t begin = sylar::GetCurrentUS();
+            for (int r = 0; r < ROUNDS; ++r) {
+                for (int i = 0; i < BATCH; ++i) {
+                    // 两个shared_ptr加一个int，超出std::function的内联大小，放得进Task
+                    auto cb = [done, sum, i]{
+                        *sum += i;
+                        ++*done;
+                    };
+                    if (use_function) {
+                        iom.schedule(std::function<void()>(cb));
+                    } else {
+                        iom.schedule(cb);
+                    }
+                }
+                wait_done((r + 1) * BATCH);
+            }
+            uint64_t used = sylar::GetCurrentUS() - begin;
+            uint64_t tasks = (uint64_t)ROUNDS * BATCH;
+            double per_task = (double)(s_allocs - allocs) / tasks;
+            SYLAR_LOG_INFO(g_logger) << "schedule " << (use_function ? "std::function" : "lambda       ")
+                                     << " tasks=" << tasks
+                                     << " allocs=" << s_allocs - allocs
+                                     << " allocs/task=" << per_task
+                                     << " ns/task=" << used * 1000.0 / tasks;
+            if (!use_function) {
+                SYLAR_ASSERT(per_task < 0.01);
+            }
+        }
+    }
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::DEBUG);
+}
+
+/**
+ * @brief 不做hook IO的忙循环
+ * @param[in] checkpoint 是否在循环中调用协作式检查点
+ */
+void hog_cpu(uint64_t ms, bool checkpoint) {
+    uint64_t end = sylar::GetCurrentMS() + ms;
+    volatile uint64_t n = 0;
+    while (sylar::GetCurrentMS() < end) {
+        ++n;
+        if (checkpoint) {
+            sylar::Scheduler::Checkpoint();
+        }
+    }
+}
+
+/**
+ * @brief 单个调度线程上一个协程忙循环：不调用检查点时看门狗报告一次，同一线程上排队的任务被饿住；
+ *        调用检查点时排队的任务在一个时间片左右就能执行，看门狗不报告
+ */
+void test_watchdog() {
+    static const uint64_t HOG_MS = 300;
+
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    auto threshold = sylar::Config::Lookup<uint32_t>("watchdog.threshold_ms");
+    auto watchdog = sylar::WatchdogMgr::GetInstance();
+
+    sylar::Mutex mutex;
+    std::vector<sylar::WatchdogEvent> events;
+    watchdog->setCallback([&mutex, &events](const sylar::WatchdogEvent& e) {
+        sylar::Mutex::Lock lock(mutex);
+        events.push_back(e);
+    });
+    threshold->setValue(50);
+
+    for (int checkpoint = 0; checkpoint < 2; ++checkpoint) {
+        {
+            sylar::Mutex::Lock lock(mutex);
+            events.clear();
+        }
+        std::atomic<uint64_t> hog_fiber = {0};
+        std::atomic<uint64_t> waited_ms = {0};
+        {
+            sylar::IOManager iom(1, false, "watchdog");
+            iom.schedule([checkpoint, &hog_fiber]{
+                hog_fiber = sylar::Fiber::GetFiberId();
+                hog_cpu(HOG_MS, checkpoint);
+            });
+            uint64_t begin = sylar::GetCurrentMS();
+            iom.schedule([begin, &waited_ms]{
+                waited_ms = sylar::GetCurrentMS() - begin;
+            });
+        }
+
+        sylar::Mutex::Lock lock(mutex);
+        SYLAR_LOG_INFO(g_logger) << "watchdog checkpoint=" << checkpoint
+                                 << " events=" << events.size()
+                                 << " queued_task_waited=" << waited_ms << "ms";
+        if (checkpoint) {
+            SYLAR_ASSERT(events.empty());
+            SYLAR_ASSERT(waited_ms < HOG_MS / 2);
+        } else {
+            SYLAR_ASSERT(events.size() == 1);
+            SYLAR_ASSERT(events[0].scheduler == "watchdog");
+            SYLAR_ASSERT(events[0].fiberId == hog_fiber);
+            SYLAR_ASSERT(events[0].stuckMs >= 50);
+            SYLAR_ASSERT(!events[0].backtrace.empty());
+            SYLAR_ASSERT(waited_ms >= HOG_MS / 2);
+            for (auto& i : events[0].backtrace) {
+                SYLAR_LOG_INFO(g_logger) << "    " << i;
+            }
+        }
+    }
+
+    threshold->setValue(0);
+    watchdog->setCallback(nullptr);
+    SYLAR_LOG_NAME("system")->setLevel(level);
+}
+
+/**
+ * @brief 弹性伸缩：持续投递占CPU的任务时线程数增长到上限，负载停止后逐个退出到下限；
+ *        伸缩期间一直在等定时器的协程和指定给各个线程(包括已经退出的)的任务都要执行完
+ */
+void test_elastic() {
+    static const int SLEEPERS = 16;
+
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    auto work_stealing  = sylar::Config::Lookup<bool>("scheduler.work_stealing");
+    auto elastic        = sylar::Config::Lookup<bool>("scheduler.elastic");
+    auto min_threads    = sylar::Config::Lookup<uint32_t>("scheduler.elastic_min_threads");
+    auto interval_ms    = sylar::Config::Lookup<uint32_t>("scheduler.elastic_interval_ms");
+    auto shrink_samples = sylar::Config::Lookup<uint32_t>("scheduler.elastic_shrink_samples");
+    elastic->setValue(true);
+    min_threads->setValue(1);
+    interval_ms->setValue(10);
+    shrink_samples->setValue(5);
+
+    for (int stealing = 0; stealing < 2; ++stealing) {
+        work_stealing->setValue(stealing);
+        std::atomic<int> sleepers_done = {0};
+        std::atomic<int> pinned_done = {0};
+        int pinned_sent = 0;
+        size_t peak = 0;
+        sylar::SchedulerStats stats;
+        {
+            sylar::IOManager iom(4, false, "elastic");
+            SYLAR_ASSERT(iom.isElastic());
+            SYLAR_ASSERT(iom.getThreadCount() == 1);
+            for (int i = 0; i < SLEEPERS; ++i) {
+                iom.schedule([&sleepers_done]{
+                    for (int j = 0; j < 50; ++j) {
+                        // 协程可能在另一个线程上醒来，hook开关是线程局部的
+                        sylar::set_hook_enable(true);
+                        usleep(10 * 1000);
+                    }
+                    ++sleepers_done;
+                });
+            }
+
+            std::atomic<int> queued = {0};
+            uint64_t begin = sylar::GetCurrentMS();
+            while (iom.getThreadCount() < 4 && sylar::GetCurrentMS() - begin < 5000) {
+                while (queued < 8) {
+                    ++queued;
+                    iom.schedule([&queued]{
+                        hog_cpu(3, false);
+                        --queued;
+                    });
+                }
+                usleep(1000);
+            }
+            peak = iom.getThreadCount();
+            while (queued > 0) {
+                usleep(1000);
+            }
+
+            begin = sylar::GetCurrentMS();
+            while (iom.getThreadCount() > 1 && sylar::GetCurrentMS() - begin < 10000) {
+                for (auto& t : iom.getStats().perThread) {
+                    ++pinned_sent;
+                    iom.schedule([&pinned_done]{
+                        ++pinned_done;
+                    }, t.id);
+                }
+                usleep(100 * 1000);
+            }
+            stats = iom.getStats();
+        }
+        SYLAR_LOG_INFO(g_logger) << "elastic stealing=" << stealing
+                                 << " peak=" << peak
+                                 << " threads=" << stats.threads
+                                 << " added=" << stats.threadsAdded
+                                 << " retired=" << stats.threadsRetired
+                                 << " pinned=" << pinned_done << "/" << pinned_sent
+                                 << " sleepers=" << sleepers_done;
+        SYLAR_ASSERT(peak == 4);
+        SYLAR_ASSERT(stats.threads == 1);
+        // 增长途中可能先缩掉一个再补回来，增减的次数只要相抵
+        SYLAR_ASSERT(stats.threadsAdded >= 3);
+        SYLAR_ASSERT(stats.threadsRetired == stats.threadsAdded);
+        SYLAR_ASSERT(pinned_done == pinned_sent);
+        SYLAR_ASSERT(sleepers_done == SLEEPERS);
+        // 退出的线程不再有单独的一行，它们执行过的任务仍然计入总数
+        SYLAR_ASSERT(stats.perThread.size() == stats.threads);
+        SYLAR_ASSERT(stats.tasks >= (uint64_t)(pinned_sent + SLEEPERS));
+    }
+
+    work_stealing->setValue(false);
+    elastic->setValue(false);
+    interval_ms->setValue(100);
+    shrink_samples->setValue(50);
+    SYLAR_LOG_NAME("system")->setLevel(level);
+}
+
 int main() {
     SYLAR_LOG_INFO(g_logger) << "main begin";
 
@@ -108,6 +419,11 @@ int main() {
      */
     sc.stop();
 
+    bench_scheduler();
+    bench_schedule_alloc();
+    test_watchdog();
+    test_elastic();
+
     SYLAR_LOG_INFO(g_logger) << "main end";
     return 0;
 }
\ No newline at end of file
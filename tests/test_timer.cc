@@ -8,6 +8,9 @@
   ********************************************************
   */
 #include "sylar/sylar.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
 
@@ -39,11 +42,75 @@ void test_timer() {
     });
 }
 
+/**
+ * @brief 只用于压测的定时器管理器，不需要唤醒idle协程
+ */
+class BenchTimerManager : public sylar::TimerManager {
+public:
+    void onTimerInsertedAtFront() override {}
+};
+
+/**
+ * @brief 在100万个未到期定时器的背景下，对比有序集合和分层时间轮两种实现的添加/取消/到期处理耗时
+ */
+void bench_timer() {
+    static const int N = 1000000;
+    static const int SHORT_N = 100000;
+    auto level = SYLAR_LOG_NAME("system")->getLevel();
+    SYLAR_LOG_NAME("system")->setLevel(sylar::LogLevel::ERROR);
+    auto wheel = sylar::Config::Lookup<bool>("timer.wheel");
+    for (int use_wheel = 0; use_wheel < 2; ++use_wheel) {
+        wheel->setValue(use_wheel);
+        BenchTimerManager mgr;
+        std::vector<sylar::Timer::ptr> timers;
+        timers.reserve(N);
+        srand(0);
+
+        uint64_t begin = sylar::GetCurrentUS();
+        for (int i = 0; i < N; ++i) {
+            timers.push_back(mgr.addTimer(1 + rand() % 60000, []{}));
+        }
+        uint64_t add_used = sylar::GetCurrentUS() - begin;
+
+        // 模拟hook中的IO超时：加一个定时器，很快又取消
+        begin = sylar::GetCurrentUS();
+        for (int i = 0; i < N; ++i) {
+            mgr.addTimer(1000 + rand() % 5000, []{})->cancel();
+        }
+        uint64_t churn_used = sylar::GetCurrentUS() - begin;
+
+        int fired = 0;
+        for (int i = 0; i < SHORT_N; ++i) {
+            mgr.addTimer(1 + i % 10, [&fired]{ ++fired; });
+        }
+        usleep(20 * 1000);
+        std::vector<sylar::Task> cbs;
+        begin = sylar::GetCurrentUS();
+        mgr.listExpiredCb(cbs);
+        uint64_t expire_used = sylar::GetCurrentUS() - begin;
+        for (auto& cb : cbs) {
+            cb();
+        }
+
+        SYLAR_LOG_INFO(g_logger) << "timer.wheel=" << (use_wheel ? "true" : "false")
+                                 << " outstanding=" << N
+                                 << " add=" << add_used * 1000.0 / N << "ns/op"
+                                 << " add+cancel=" << churn_used * 1000.0 / N << "ns/op"
+                                 << " expire(" << fired << ")=" << expire_used << "us";
+        for (auto& timer : timers) {
+            timer->cancel();
+        }
+    }
+    wheel->setValue(false);
+    SYLAR_LOG_NAME("system")->setLevel(level);
+}
+
 int main(int argc, char *argv[]) {
 //    sylar::EnvMgr::GetInstance()->init(argc, argv);
 //    sylar::Config::LoadFromConfDir(sylar::EnvMgr::GetInstance()->getConfigPath());
 
     test_timer();
+    bench_timer();
 
     SYLAR_LOG_INFO(g_logger) << "end";
 